@@ -20,6 +20,8 @@ typedef struct Arena {
 void arena_init(Arena *a, size_t chunk_size);
 void arena_free(Arena *a);
 void *arena_alloc(Arena *a, size_t size, size_t align);
+// Drop everything allocated, keeping only the first chunk for reuse
+void arena_reset(Arena *a);
 
 #endif // ARENA_H
 
@@ -7,6 +7,8 @@
 #include "arena.h"
 
 typedef struct Type Type; // forward
+struct BcProto;
+struct TierFn;
 
 typedef enum {
   N_LIST,
@@ -17,6 +19,30 @@ typedef enum {
   N_BOOL,
 } NodeKind;
 
+// Special-form opcode of a list, derived from its interned head symbol when
+// the head is pushed. FORM_CALL means an ordinary function call.
+typedef enum {
+  FORM_CALL = 0,
+  FORM_DEF,
+  FORM_DEFMACRO,
+  FORM_QUOTE,
+  FORM_QUASIQUOTE,
+  FORM_LET,
+  FORM_IF,
+  FORM_DO,
+  FORM_WHILE,
+  FORM_SET,
+  FORM_IMPORT,
+  FORM_DEFSTRUCT,
+  FORM_DEFENUM,
+  FORM_FN,
+  FORM_SELECT,
+  FORM_WITH_TASKS,
+  // Builtins with bespoke typing rules; evaluated as calls
+  FORM_VEC,
+  FORM_STRUCT_NEW,
+} FormOp;
+
 typedef struct Node Node;
 
 struct Node {
@@ -24,8 +50,16 @@ struct Node {
   size_t line, col;
   Type *ty; // inferred/checked type, set by type checker
   union {
-    struct { Node **items; size_t count; } list;
-    struct { const char *ptr; size_t len; } sym;
+    // nslots: frame size of a [fn ...] or [let ...] scope, set by the resolver.
+    // captured: the scope encloses a [fn ...] literal, so closures may outlive
+    // its frame and it must be heap-allocated; other frames live on the C stack.
+    // bc: bytecode of a [fn ...] body, compiled on first call by the bc engine.
+    // tier: call/back-edge counters and native code of a [fn ...], see tier.h.
+    struct { Node **items; size_t count; int32_t nslots; bool captured; FormOp form; struct BcProto *bc; struct TierFn *tier; } list;
+    // ptr is interned (see sym_intern), so equal names share one pointer.
+    // Resolver annotation: a local (depth, slot) in the frame chain, or a
+    // direct pointer to a global's value cell. Unresolved: slot < 0, cell NULL.
+    struct { const char *ptr; size_t len; int32_t depth; int32_t slot; struct Value *cell; FormOp form; } sym;
     int64_t ival;
     double fval;
     struct { const char *ptr; size_t len; } str;
@@ -35,6 +69,17 @@ struct Node {
 
 typedef struct Parser Parser;
 
+// Global symbol table: returns the canonical NUL-terminated copy of a name,
+// optionally reporting its special-form opcode. Names live for the whole
+// process. Not thread-safe; symbols are created by the parser and macro
+// expander on the main thread.
+const char *sym_intern(const char *ptr, size_t len, FormOp *form_out);
+
+// Arms of [select ...]: [[recv ch] name body...], [[send ch v] body...],
+// [[timeout ms] body...] and [default body...]
+typedef enum { SELECT_BAD, SELECT_RECV, SELECT_SEND, SELECT_TIMEOUT, SELECT_DEFAULT } SelectArm;
+SelectArm select_arm(const Node *arm);
+
 // Construction helpers
 Node *node_new_list(Arena *arena, size_t cap_hint);
 void node_list_push(Arena *arena, Node *list, Node *item);
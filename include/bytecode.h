@@ -0,0 +1,74 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stdint.h>
+#include "ast.h"
+#include "value.h"
+#include "runtime.h"
+
+// Register bytecode for [fn ...] bodies, selected with `sqale run --engine=bc`.
+// A function is compiled on its first call from the typechecked, resolved AST:
+// fn and let slots are flattened into one register file, globals are reached
+// through their value cells and if/while become direct jumps. Toplevel forms
+// and functions using forms the compiler does not lower still run on the tree
+// walker.
+//
+// Operands: a is the destination register unless noted; jump targets are
+// instruction indices. Ops carrying a cell index in d are fast paths for the
+// builtin named by that global and fall back to a call when it was redefined
+// or the operands are not both Int.
+#define BC_OP_LIST(X) \
+  X(BC_MOV)    /* r[a] = r[b] */ \
+  X(BC_LOADK)  /* r[a] = k[b] */ \
+  X(BC_LOADS)  /* r[a] = new String of strs[b] */ \
+  X(BC_GETG)   /* r[a] = *cells[b] */ \
+  X(BC_SETG)   /* *cells[b] = r[a] */ \
+  X(BC_GETUP)  /* r[a] = slot b of the closure env c frames up */ \
+  X(BC_SETUP)  /* slot b of the closure env c frames up = r[a] */ \
+  X(BC_JMP)    /* goto b */ \
+  X(BC_JMPF)   /* if r[a] is not true goto b */ \
+  X(BC_LOOP)   /* goto b; while back-edge and GC safepoint */ \
+  X(BC_CALL)   /* r[a] = r[b](r[b+1] .. r[b+c]) */ \
+  X(BC_CALLG)  /* r[a] = (*cells[d])(r[b] .. r[b+c-1]) */ \
+  X(BC_ADD)    /* r[a] = r[b] + r[c] */ \
+  X(BC_SUB) \
+  X(BC_MUL) \
+  X(BC_LT) \
+  X(BC_LE) \
+  X(BC_GT) \
+  X(BC_GE) \
+  X(BC_EQ) \
+  X(BC_JNLT)   /* if !(r[a] < r[b]) goto c */ \
+  X(BC_JNLE) \
+  X(BC_JNGT) \
+  X(BC_JNGE) \
+  X(BC_JNEQ) \
+  X(BC_RET)    /* return r[a] */
+
+#define BC_ENUM_ENTRY(op) op,
+typedef enum { BC_OP_LIST(BC_ENUM_ENTRY) BC_NOPS } BcOp;
+#undef BC_ENUM_ENTRY
+
+typedef struct BcInstr { uint16_t op, a, b, c, d; } BcInstr;
+
+typedef struct BcProto {
+  BcInstr *code;        // NULL when the body is left to the tree walker
+  int32_t ncode;
+  Value *k;             // Int/Float/Bool/Unit constants
+  int32_t nk;
+  Node **strs;          // string literals; a fresh String per evaluation, as in eval_node
+  int32_t nstrs;
+  Value **cells;        // global value cells referenced by the body
+  int32_t ncells;
+  int32_t nregs;        // fn slots, then flattened let slots and temporaries
+  int32_t nslots;       // fn frame slots, Unit-initialised on entry
+  int32_t *param_slots; // register of each parameter, -1 if unbound
+  int32_t nparams;
+} BcProto;
+
+// Run closure c on the bytecode engine, compiling its body on first use.
+// Returns 0 without running anything when the body cannot be compiled; the
+// caller then evaluates it with the tree walker.
+int bc_call(VM *vm, struct Closure *c, Value *args, int nargs, Value *out);
+
+#endif // BYTECODE_H
@@ -2,6 +2,7 @@
 #define CODEGEN_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include "ast.h"
 #include "type.h"
@@ -11,7 +12,7 @@ typedef struct CodegenOpts {
   const char *module_name;
   int use_llvm;       // 1 if compiled with LLVM C API
   int for_exe;        // emit main entrypoint
-  int opt_level;      // 0-3, optimization level
+  int opt_level;      // 0-3: LLVM's default<On> pipeline, C API path only
   int emit_debug;     // emit debug info
 } CodegenOpts;
 
@@ -19,9 +20,31 @@ typedef struct CodegenOpts {
 // Returns a malloc'd buffer that the caller must free; size is stored in out_len.
 char *codegen_emit_ir(Node *program, const CodegenOpts *opts, size_t *out_len);
 
-// Compile to object file (requires USE_LLVM=1)
+// Compile to a native object file for the host (requires USE_LLVM=1). With
+// for_exe it defines C main; link it with libsqale_rt.a. Returns nonzero,
+// having said why on stderr, on failure.
 int codegen_emit_object(Node *program, const CodegenOpts *opts, const char *out_path);
 
+// Compile main and the functions it calls with ORC LLJIT and run it, storing
+// main's Int result in *exit_code. Returns nonzero, having said why on
+// stderr, when the program uses something the LLVM backend does not lower or
+// the build has no LLVM; the program has not started running then.
+int codegen_jit_run(Node *program, const CodegenOpts *opts, int *exit_code);
+
+// Tiered execution: one JIT holding the functions of program that got hot.
+// Compiling fn_node, the [fn ...] of a toplevel def, also compiles the
+// functions it calls that the JIT does not hold yet. The entry point takes
+// the arguments in 64-bit slots and returns the result in one: Int as is,
+// Float as its bits, Bool as 0 or 1, Str as a char*, Unit as 0. Returns NULL
+// with the reason in error when the backend does not lower something the
+// function reaches. Modules are optimized at opt_level (0-3). Not
+// thread-safe; callers serialize compiles.
+typedef struct CgJit CgJit;
+typedef int64_t (*CgEntry)(int64_t *args);
+CgJit *codegen_jit_new(Node *program, int opt_level);
+void codegen_jit_free(CgJit *jit);
+CgEntry codegen_jit_compile(CgJit *jit, Node *fn_node, char *error, size_t error_len);
+
 // ============================================================================
 // Internal codegen context (used by codegen_llvm.c)
 // ============================================================================
@@ -32,6 +55,7 @@ typedef struct CgSymbol {
   size_t name_len;
   void *value;        // LLVMValueRef or text IR temp name
   Type *type;
+  int is_slot;        // value is the alloca of a local that set! assigns; load it
   struct CgSymbol *next;
 } CgSymbol;
 
@@ -60,6 +84,10 @@ typedef struct CgContext {
   int tmp_id;
   int str_id;
   int label_id;
+  char block[32];     // label of the block being emitted, for phis
+  char *entry_buf;    // allocas for the current function's entry block
+  size_t entry_len;
+  size_t entry_cap;
 
   // Function table for forward references
   struct {
@@ -91,7 +119,7 @@ void cg_program(CgContext *ctx, Node *program);
 // Runtime function declarations for LLVM linking
 // ============================================================================
 
-// These are implemented in runtime.c and declared for LLVM linking
+// These are implemented in runtime_llvm.c and declared for LLVM linking
 void sq_print_i64(long long v);
 void sq_print_f64(double v);
 void sq_print_bool(int v);
@@ -104,4 +132,12 @@ void *sq_alloc_closure(void *fn, void *env, int arity);
 void *sq_closure_get_fn(void *closure);
 void *sq_closure_get_env(void *closure);
 
+// NUL-terminated strings
+typedef struct SqStrings { char **items; size_t len, cap; } SqStrings;
+extern _Thread_local SqStrings *sq_strings; // when set, records every string made on the thread
+void sq_strings_free(SqStrings *l);         // free the strings recorded in l, and reset it
+char *sq_string_concat(const char *a, const char *b);
+size_t sq_string_len(const char *s);
+int sq_string_eq(const char *a, const char *b);
+
 #endif // CODEGEN_H
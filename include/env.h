@@ -2,8 +2,12 @@
 #define ENV_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include "type.h"
+#include "gc.h"
+
+struct Value;
 
 typedef struct EnvEntry {
   const char *name;
@@ -16,10 +20,27 @@ typedef struct Env {
   EnvEntry *head;
   struct Env *parent;
   void *aux; // VM* or other context propagated to children
+  struct Value *slots; // resolved locals of a fn/let frame; NULL for global/type envs
+  int32_t nslots;
+  bool heap; // embedded in a HeapFrame
 } Env;
 
+// Captured frame: a GC object holding the Env, with its slots following
+typedef struct HeapFrame {
+  Obj hdr;
+  Env env;
+} HeapFrame;
+
+static inline HeapFrame *env_heap_frame(Env *e) {
+  return (HeapFrame*)((char*)e - offsetof(HeapFrame, env));
+}
+
 Env *env_new(Env *parent);
+// Runtime frame with nslots Unit-initialised slots in caller-provided storage
+// (the C stack, or a HeapFrame); release entries with env_free_entries.
+void env_init_frame(Env *e, Env *parent, struct Value *slots, int32_t nslots);
 void env_free(Env *e); // frees only entries, not names or values
+void env_free_entries(Env *e);
 bool env_set(Env *e, const char *name, Type *type, void *value);
 EnvEntry *env_lookup(Env *e, const char *name);
 
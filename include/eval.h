@@ -15,6 +15,9 @@ void vm_free(VM *vm);
 // Evaluate a fully parsed and typechecked program at top-level
 // Returns 0 on success, non-zero on error.
 int eval_program(VM *vm, Node *program);
+// Typecheck only, annotating the AST for codegen; nothing is evaluated but
+// the modules the program imports
+int typecheck_program(VM *vm, Node *program);
 
 // Evaluate a single form (used by REPL)
 int eval_form(VM *vm, Node *form, Value *out);
@@ -2,28 +2,200 @@
 #define GC_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include "arena.h"
+#include "thread.h"
 
+struct Value;
+struct Env;
+
+// Heap object kinds; Obj.type selects the size/trace/release functions in gc.c
+typedef enum {
+  OBJ_STRING = 1,
+  OBJ_CLOSURE,
+  OBJ_LIST,
+  OBJ_VECTOR,
+  OBJ_MAP,
+  OBJ_OPTION,
+  OBJ_RESULT,
+  OBJ_STRUCT,
+  OBJ_FRAME, // captured call/let frame, see HeapFrame in env.h
+  OBJ_INT,   // Int too wide for an 8-byte Value (SQALE_NANBOX), see IntBox in value.h
+  OBJ_TASK,  // spawn's handle, see TaskVal in value.h
+  OBJ_CHANNEL, // see ChanVal in value.h
+  OBJ_NTYPES
+} ObjType;
+
+// Object header. Mark bits live in the slab page (or large object) holding
+// the object, not here. A copied young object keeps its forwarding address
+// in the word after the header.
 typedef struct Obj {
-  struct Obj *next;
-  unsigned marked : 1;
-  unsigned type : 7; // for debugging
+  unsigned type : 8;       // ObjType; 0 for a free slab slot
+  unsigned young : 1;      // lives in the nursery
+  unsigned forwarded : 1;
+  unsigned remembered : 1; // old object in the remembered set
+  unsigned large : 1;      // allocated outside the slab pages, see GcLarge in gc.c
 } Obj;
 
+// Old space: objects up to GC_MAX_SMALL bytes live in GC_PAGE_SIZE pages of
+// one size class each; larger ones are allocated individually.
+#define GC_PAGE_SIZE (64*1024)
+#define GC_MAX_SMALL 2048
+#define GC_NCLASSES 28
+
+typedef struct GcSizeClass {
+  void *free;            // free slots, linked through the word after the header
+  struct GcPage *pages;
+  struct GcPage *unswept; // pages marked by the last major collection, swept as allocation needs room
+} GcSizeClass;
+
+// Collection pauses, as the mutators see them
+typedef struct GcPauses { size_t count; int64_t total_us, max_us; } GcPauses;
+
+// A thread of evaluation on a heap: the thread that runs the VM's toplevel,
+// or a spawned task. Collections stop the world: the collecting mutator waits
+// until no other one is running, then scans the roots each left behind.
+// Mutators stop at safepoints and while blocked, so heap state is never
+// half-updated when a collection looks at it.
+typedef struct GcMutator {
+  struct GC *gc;
+  struct GcMutator *prev, *next;
+  struct GcRoot *roots; // its shadow stack while stopped
+  int running;
+  int depth;             // entries in progress; a task is always in one
+  struct GcMutator *saved; // what gc_enter took the thread over from
+} GcMutator;
+
 typedef struct GC {
-  Obj *objects;
-  size_t bytes_allocated;
-  size_t next_threshold;
+  GcSizeClass size_classes[GC_NCLASSES];
+  struct GcLarge *large;
+  size_t bytes_allocated; // old space: live bytes after the last major collection plus promotions and
+                          // direct allocations since, including payloads reported through gc_account
+  size_t next_threshold;  // bytes_allocated that requests a collection: a major one, or while marking
+                          // incrementally, the next mark step
+  size_t marked_bytes;    // live bytes found by the current major collection
+  RtSpin heap_lock;       // guards the old space, the remembered set and nursery refills while tasks run
+  Arena nursery;          // young objects, bump allocated; emptied by every minor collection
+  size_t epoch;           // changes with every minor collection, retiring the threads' TLABs
+  Obj **remembered;       // old objects that may point into the nursery
+  size_t nremembered, capremembered;
+  bool minor;             // a minor collection is running
   void (*mark_root_cb)(void *user);
   void *user;
+  Obj **gray;             // minor collections' copy queue
+  size_t ngray, capgray;
+  struct GcMarker *markers; // per-thread mark stacks, kept between major collections
+  int nmarkers;
+  int mark_threads;       // most threads marking and sweeping in a major collection
+  bool incremental;       // mark the old space a slice per collection instead of in one pause
+  bool marking;           // an incremental major collection is under way
+  size_t mark_limit;      // bytes_allocated at which marking finishes in the next pause, however far along
+  size_t step_base;       // bytes_allocated at the last mark step
+  Obj **greyed;           // objects shaded by the barrier or allocated while marking, yet to be traced
+  size_t ngreyed, capgreyed;
+  GcPauses minor_pauses, step_pauses, major_pauses;
+  bool stats;             // SQALE_GC_STATS: print collection counts and pauses when the heap is freed
+  bool collect_requested;
+  bool stress;            // SQALE_GC_STRESS: collect at every safepoint
+  int paused;             // >0 defers collections (macro-time VMs)
+  int threads;            // live spawned tasks; while there are any, allocation goes through locks and TLABs
+  GcMutator *mutators;    // every mutator of this heap
+  RtSpin mutators_lock;
+  int stopping;           // a collection is stopping the mutators, or running
+  GcMutator main;         // the toplevel, entered through gc_enter
+  size_t collections;      // major
+  size_t minor_collections;
 } GC;
 
+// Shadow stack of roots held in C locals by the evaluators: live frames and
+// temporary Value arrays. One per thread, pushed and popped in LIFO order.
+typedef struct GcRoot {
+  struct GcRoot *prev;
+  struct Value *vals;
+  int32_t n;
+  struct Env *env; // frame chain to trace, or NULL
+} GcRoot;
+
+extern _Thread_local GcRoot *gc_roots;
+
+static inline void gc_push_root(GcRoot *r, struct Value *vals, int32_t n, struct Env *env) {
+  r->prev = gc_roots; r->vals = vals; r->n = n; r->env = env; gc_roots = r;
+}
+static inline void gc_pop_root(GcRoot *r) { gc_roots = r->prev; }
+
+extern _Thread_local GcMutator *gc_self; // the mutator running on this thread, if any
+
+// Register m stopped, with roots to scan until it first runs
+void gc_mutator_add(GC *gc, GcMutator *m, GcRoot *roots);
+// Unregister the calling thread's mutator; it must not touch the heap after
+void gc_mutator_remove(GcMutator *m);
+// Run m on this thread, once any collection in progress is over
+void gc_resume(GcMutator *m);
+// Stop m, leaving the current shadow stack as its roots; call before blocking
+void gc_park(GcMutator *m);
+// Entry points into a heap bracket their work with gc_enter and gc_exit. The
+// calling thread becomes gc's main mutator unless one of gc's mutators
+// already runs here, and stays it after the outermost exit, until gc_leave,
+// so values an entry point returns remain safe to use. Entered from inside
+// another heap's entry point, the outermost exit hands the thread back.
+void gc_enter_slow(GC *gc);
+void gc_exit_slow(GcMutator *m);
+static inline void gc_enter(GC *gc) {
+  if (gc_self && gc_self->gc==gc) gc_self->depth++;
+  else gc_enter_slow(gc);
+}
+static inline void gc_exit(void) {
+  GcMutator *m = gc_self;
+  if (--m->depth==0 && m->saved) gc_exit_slow(m);
+}
+// Stop being gc's main mutator, e.g. before waiting for input
+void gc_leave(GC *gc);
+
+// Threads for major collections; 0 (the default) uses SQALE_GC_THREADS or
+// else one per online CPU. Takes effect for heaps created afterwards.
+void gc_set_threads(int n);
+// Mark incrementally (1) or stop the world for whole major collections (0);
+// -1 (the default) reads SQALE_GC_MODE, "incremental" or "stw". Takes effect
+// for heaps created afterwards.
+void gc_set_incremental(int on);
 void gc_init(GC *gc);
 void gc_set_root_callback(GC *gc, void (*cb)(void *), void *user);
+// Allocation never collects; it requests a collection once the nursery fills
+// or the old space crosses its threshold, and the evaluator runs it at its
+// next safepoint, where every live Value is reachable from the roots. Young
+// objects move, so C code must not hold them across a safepoint, or a
+// blocking call, except through a root. While tasks run, each thread bump
+// allocates young objects from its own TLAB carved out of the nursery.
 void *gc_alloc(GC *gc, size_t sz, unsigned type_tag);
+// Report growth (or shrinkage) of an object's malloc'd payload. Young
+// objects are counted when they are promoted.
+void gc_account(GC *gc, ptrdiff_t bytes);
+static inline void gc_account_obj(GC *gc, Obj *o, ptrdiff_t bytes) { if (!o->young) gc_account(gc, bytes); }
+// Stop the other mutators, then a minor collection, followed by a major one
+// when the old space is over its threshold. If another mutator is already
+// collecting, wait for it instead. In incremental mode the major collection
+// is spread out: it marks the roots, then each later collection marks a
+// slice paced by allocation, and the one that runs out of gray objects
+// rescans the roots, finishes marking and sweeps.
 void gc_collect(GC *gc);
-void gc_mark(Obj *o);
+void gc_remember(GC *gc, Obj *o);
+void gc_shade(GC *gc, Obj *o);
+// Call after storing a reference to stored (may be NULL) into owner. While
+// marking incrementally, an old stored object is shaded, so one the marker
+// has passed over cannot be hidden in an object it already traced.
+static inline void gc_write_barrier(GC *gc, Obj *owner, Obj *stored) {
+  if (!stored) return;
+  if (stored->young) { if (!owner->young && !owner->remembered) gc_remember(gc, owner); }
+  else if (gc->marking) gc_shade(gc, stored);
+}
+static inline void gc_safepoint(GC *gc) { if (__atomic_load_n(&gc->collect_requested, __ATOMIC_RELAXED)) gc_collect(gc); }
+void gc_mark(GC *gc, Obj *o);
+// Visit a reference: marks it in a major collection, copies a young object
+// out of the nursery and updates the reference in a minor one
+void gc_mark_value(GC *gc, struct Value *v);
+void gc_mark_values(GC *gc, struct Value *vals, int32_t n);
+void gc_mark_env(GC *gc, struct Env *e);
 void gc_free_all(GC *gc);
 
 #endif // GC_H
-
@@ -0,0 +1,14 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include "ast.h"
+
+struct VM;
+
+// Resolve every symbol in a typechecked toplevel form to either a local
+// (depth, slot) pair in the runtime frame chain or a direct pointer to the
+// global's value cell, and record frame sizes on [fn ...] and [let ...] nodes.
+// Must run after typechecking (global names are registered by the checker).
+void resolve_form(struct VM *vm, Node *form);
+
+#endif // RESOLVE_H
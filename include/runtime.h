@@ -10,12 +10,20 @@
 
 typedef struct VM VM;
 
+// How closure bodies are executed (`sqale run --engine=...`)
+typedef enum {
+  ENGINE_TREE, // walk the AST (default)
+  ENGINE_BC,   // register bytecode, see bytecode.h
+} Engine;
+
 // VM holds global GC and root sets; definition is shared here
 struct VM {
   struct GC gc;
   struct Env *global_env;
   struct ModNode *imported; // import cache
   struct ModArena *mod_arenas; // keep module arenas alive
+  Engine engine;
+  struct Tier *tier; // `run --tier`: hot functions compiled by LLVM, or NULL
 };
 
 typedef struct ModNode {
@@ -32,6 +40,12 @@ typedef struct ModArena {
 String *rt_string_new(VM *vm, const char *bytes, size_t len);
 String *rt_string_from_cstr(VM *vm, const char *cstr);
 
+// Collection constructors. rt_list_new leaves the items uninitialised: fill
+// them before the next safepoint; no write barrier is needed.
+ValList *rt_list_new(VM *vm, int32_t len);
+Vector *rt_vec_alloc(VM *vm, int32_t cap);
+void rt_vec_grow(VM *vm, Vector *v); // doubles cap, moving items out of line
+
 // I/O (runtime stdlib abstractions)
 Value rt_print(Env *env, Value *args, int nargs);
 Value rt_read_file(Env *env, Value *args, int nargs);
@@ -92,15 +106,28 @@ Value rt_float_to_str(Env *env, Value *args, int nargs);
 // Concurrency
 typedef struct Channel Channel;
 Value rt_chan(Env *env, Value *args, int nargs);
+Value rt_chan_with_cap(Env *env, Value *args, int nargs);
 Value rt_send(Env *env, Value *args, int nargs);
 Value rt_recv(Env *env, Value *args, int nargs);
+Value rt_send_many(Env *env, Value *args, int nargs);
+Value rt_recv_many(Env *env, Value *args, int nargs);
+Value rt_chan_drain(Env *env, Value *args, int nargs);
+void rt_chan_barrier(VM *vm, Value ch, Value msg); // before and after msg is sent on ch
 Value rt_spawn(Env *env, Value *args, int nargs);
+Value rt_join(Env *env, Value *args, int nargs);
+Value rt_join_timeout(Env *env, Value *args, int nargs);
+Value rt_task_done(Env *env, Value *args, int nargs);
 
 // Collections
 Value rt_vec_new(Env *env, Value *args, int nargs);
 Value rt_vec_push(Env *env, Value *args, int nargs);
 Value rt_vec_get(Env *env, Value *args, int nargs);
 Value rt_vec_len(Env *env, Value *args, int nargs);
+// Parallel ops over a vector, run on the calling thread and the task workers
+Value rt_pmap(Env *env, Value *args, int nargs);
+Value rt_pfilter(Env *env, Value *args, int nargs);
+Value rt_preduce(Env *env, Value *args, int nargs);
+Value rt_pfor(Env *env, Value *args, int nargs);
 
 // Code-as-data list/symbol helpers for macros
 Value rt_is_list(Env *env, Value *args, int nargs);
@@ -117,6 +144,14 @@ Value rt_map_new(Env *env, Value *args, int nargs);
 Value rt_map_set(Env *env, Value *args, int nargs);
 Value rt_map_get(Env *env, Value *args, int nargs);
 Value rt_map_len(Env *env, Value *args, int nargs);
+Value rt_map_get_or(Env *env, Value *args, int nargs);
+Value rt_map_has(Env *env, Value *args, int nargs);
+Value rt_map_del(Env *env, Value *args, int nargs);
+Value rt_map_keys(Env *env, Value *args, int nargs);
+Value rt_map_vals(Env *env, Value *args, int nargs);
+// Key hashing and equality used by maps
+uint64_t rt_value_hash(Value v);
+bool rt_value_equal(Value a, Value b);
 
 // Option type operations
 Value rt_some(Env *env, Value *args, int nargs);
@@ -13,13 +13,104 @@ typedef void *(*RtThreadFn)(void *arg);
 
 RtThread *rt_thread_spawn(RtThreadFn fn, void *arg);
 void rt_thread_join(RtThread *t);
+void rt_thread_yield(void);
+
+// Spin lock for short critical sections that may be entered from tasks.
+// Yields the CPU after a while, in case the holder was preempted.
+typedef bool RtSpin;
+static inline void rt_spin_lock(RtSpin *l) {
+  for (int i=0; __atomic_test_and_set(l, __ATOMIC_ACQUIRE); i++) if (i>=64) { rt_thread_yield(); i = 0; }
+}
+static inline void rt_spin_unlock(RtSpin *l) { __atomic_clear(l, __ATOMIC_RELEASE); }
+
+// M:N task scheduler (sched.c). Tasks run on a fixed pool of worker threads,
+// each on its own stack. A worker pushes the tasks it spawns onto its
+// own deque and pops them LIFO; an idle worker steals the oldest task from a
+// peer. A task that blocks parks, and its worker runs other tasks meanwhile.
+// Once started a task stays on its worker: compiled code may cache the
+// address of a thread-local across the call that parks it.
+typedef struct RtTask RtTask;
+typedef void (*RtTaskFn)(void *arg);
+
+// Number of workers; 0 (the default) uses SQALE_WORKERS or else one per
+// online CPU. Only takes effect before the first spawn.
+void rt_sched_set_workers(int n);
+// Stack reserved per task, in MB; 0 (the default) uses SQALE_TASK_STACK or
+// else 8MB. Only takes effect before the first spawn.
+void rt_sched_set_task_stack(int mb);
+int rt_sched_workers(void); // starts the workers if they are not yet running
+void rt_task_spawn(RtTaskFn fn, void *arg);
+RtTask *rt_task_current(void); // NULL outside a task
+
+// A blocked channel operation: parks the current task, or blocks the thread
+// when called outside one. Lives on the blocked side's stack.
+enum { RT_WAIT_PENDING, RT_WAIT_DONE, RT_WAIT_TIMEOUT };
+typedef struct RtWaiter {
+  int state;               // RT_WAIT_*; a blocked thread waits on it with a futex on Linux
+  RtTask *task;
+  struct RtParker *parker; // the blocked thread elsewhere, when task is NULL
+} RtWaiter;
+
+void rt_waiter_init(RtWaiter *w);
+// Wait until w is claimed or the timeout (<0: none) passes; true when
+// claimed. w may be claimed before this is called. After a timeout, w may
+// still be queued: unlink it under the queue's lock, since a waker holding
+// the lock may be looking at it.
+bool rt_waiter_block(RtWaiter *w, int64_t timeout_ms);
+// Waking takes two steps, so that the waiter can be signalled after the lock
+// guarding its queue is released: rt_waiter_claim completes w's wait (false
+// if it timed out or was claimed first), then rt_waiter_notify(&k) makes the
+// waiter run. A waiter that is claimed must still call rt_waiter_block, to
+// take the notification.
+typedef struct RtWake { RtTask *task; struct RtParker *parker; int *state; } RtWake;
+bool rt_waiter_claim(RtWaiter *w, RtWake *k);
+void rt_waiter_notify(RtWake *k);
+
+// Structured concurrency: a task spawned while a group is current is counted
+// in it until it returns, and so are the tasks it spawns in turn. The current
+// group belongs to the running task, or to the thread outside one.
+typedef struct RtGroup { int live; RtSpin lock; RtWaiter *waiter; } RtGroup;
+void rt_group_init(RtGroup *g);
+RtGroup *rt_group_enter(RtGroup *g); // make g current; returns the group it replaces
+// Restore prev as current, then wait until every task counted in g returned
+void rt_group_leave(RtGroup *g, RtGroup *prev);
+// Wait until no task can make progress: every one has returned, or is parked
+// with no deadline where only another task could wake it. Call at exit.
+void rt_sched_quiesce(void);
+int64_t rt_now_ms(void); // monotonic
+int64_t rt_now_us(void);
+int rt_cpu_count(void);   // online CPUs
+
+// Run fn(arg, 0) on the calling thread and fn(arg, 1..n-1) on helper
+// threads, and return once every call has. Helpers are a pool apart from the
+// task workers, started when first needed; one job runs at a time.
+void rt_parallel(int n, void (*fn)(void *arg, int id), void *arg);
 
 typedef struct Channel Channel;
 
-Channel *rt_channel_new(size_t capacity);
+// Bounded MPMC queue of elem_size-byte messages, copied in and out. With
+// capacity 0 it is a rendezvous: send returns once a receiver has the message.
+Channel *rt_channel_new(size_t capacity, size_t elem_size);
 void rt_channel_free(Channel *c);
-bool rt_channel_send(Channel *c, void *msg, int64_t timeout_ms);
-void *rt_channel_recv(Channel *c, int64_t timeout_ms);
+bool rt_channel_send(Channel *c, const void *elem, int64_t timeout_ms);
+bool rt_channel_recv(Channel *c, void *out, int64_t timeout_ms);
+// Batched forms, taking up to n consecutive slots per claim on the ring.
+// send_many returns how many of the n messages went before the timeout;
+// recv_many waits for at least one and returns how many it took, up to max
+// (0 on timeout).
+size_t rt_channel_send_many(Channel *c, const void *elems, size_t n, int64_t timeout_ms);
+size_t rt_channel_recv_many(Channel *c, void *out, size_t max, int64_t timeout_ms);
+size_t rt_channel_len(Channel *c);   // messages buffered at some recent instant
+size_t rt_channel_slots(Channel *c); // size of the ring: the capacity, or 1 for a rendezvous
+// Visit each buffered message in place. Not synchronised with senders or
+// receivers: only call it while no other thread uses the channel.
+void rt_channel_each(Channel *c, void (*fn)(void *elem, void *ud), void *ud);
 
-#endif // THREAD_H
+// One case of rt_channel_select: send *elem on chan, or receive into elem
+typedef struct RtSelectCase { Channel *chan; void *elem; bool send; } RtSelectCase;
+// Perform whichever case can proceed first and return its index, or -1 if
+// none could before timeout_ms passed (0: just try each; <0: no timeout). A
+// send to a rendezvous channel is only tried while a receiver is waiting.
+int rt_channel_select(RtSelectCase *cs, int n, int64_t timeout_ms);
 
+#endif // THREAD_H
@@ -0,0 +1,66 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ast.h"
+#include "value.h"
+#include "runtime.h"
+#include "codegen.h"
+#include "thread.h"
+
+// Tiered execution, selected with `sqale run --tier`. Closures start on the
+// tree walker (or the bytecode engine). Each [fn ...] counts its calls and
+// the loop back-edges taken in its body; at the first call after the sum
+// crosses the threshold, the LLVM backend compiles the function, and later
+// calls run the native code. The counters live with the fn node, not the
+// closure: young closures move during collections, and every closure of a
+// toplevel function shares the code. A function the backend does not lower
+// stays interpreted. There is no on-stack replacement: a loop already
+// running keeps interpreting.
+enum { TIER_COUNTING, TIER_COMPILING, TIER_NATIVE, TIER_FAILED };
+
+typedef struct TierFn {
+  int state;               // TIER_*
+  uint32_t calls, backedges;
+  CgEntry entry;           // once TIER_NATIVE
+  Node *fn;
+  int64_t compile_us;
+  char error[96];          // why it stayed interpreted
+  struct TierFn *next;     // every TierFn of the VM
+} TierFn;
+
+typedef struct Tier {
+  CgJit *jit;
+  Node *program;
+  uint32_t threshold;
+  bool stats;              // print the functions that tiered up when the VM is freed
+  RtSpin lock;             // held while compiling; a thread finding it taken keeps interpreting
+  TierFn *fns;
+  TierFn **tried;          // in the order they crossed the threshold
+  size_t ntried, captried;
+} Tier;
+
+// NULL (having said why) when the build has no LLVM; opt_level as in CodegenOpts
+Tier *tier_new(Node *program, uint32_t threshold, int opt_level, bool stats);
+void tier_free(Tier *t);
+
+// Run closure c natively if its function has tiered up, compiling it first
+// if it just got hot. Returns 0 without running anything otherwise, after
+// counting the call; the caller then interprets it, between tier_enter and
+// tier_leave so that its loops count back-edges.
+int tier_call(VM *vm, struct Closure *c, Value *args, int nargs, Value *out);
+
+extern _Thread_local TierFn *tier_running; // function whose body this thread interprets
+static inline TierFn *tier_enter(Node *fn) {
+  TierFn *outer = tier_running;
+  tier_running = __atomic_load_n(&fn->as.list.tier, __ATOMIC_ACQUIRE);
+  return outer;
+}
+static inline void tier_leave(TierFn *outer) { tier_running = outer; }
+static inline void tier_backedge(void) {
+  TierFn *t = tier_running;
+  if (t) __atomic_add_fetch(&t->backedges, 1, __ATOMIC_RELAXED);
+}
+
+#endif // TIER_H
@@ -20,11 +20,15 @@ typedef enum {
   TY_RESULT, // Result[T,E] - Ok(T) or Err(E)
   TY_STRUCT, // Named struct type
   TY_ENUM,   // Enum type
+  TY_VAR,    // Type variable in a builtin's signature, bound per call
+  TY_TASK,   // Task[T] - handle of a spawned task returning T
   TY_ERROR,
 } TypeKind;
 
 typedef struct Type Type;
 
+#define TY_MAX_VARS 4
+
 struct Type {
   TypeKind kind;
   union {
@@ -33,6 +37,7 @@ struct Type {
     struct { Type *ok_type; Type *err_type; } result; // For TY_RESULT
     struct { const char *name; Type **fields; const char **field_names; size_t nfields; } struc; // For TY_STRUCT
     struct { const char *name; const char **variants; size_t nvariants; } enu; // For TY_ENUM
+    struct { int id; } var; // For TY_VAR, 0 <= id < TY_MAX_VARS
   } as;
 };
 
@@ -56,9 +61,16 @@ Type *ty_option(void *arena, Type *elem);
 Type *ty_result(void *arena, Type *ok_type, Type *err_type);
 Type *ty_struct(void *arena, const char *name, Type **fields, const char **field_names, size_t nfields);
 Type *ty_enum(void *arena, const char *name, const char **variants, size_t nvariants);
+Type *ty_var(void *arena, int id);
+Type *ty_task(void *arena, Type *result);
 
 // Utilities
 bool ty_eq(const Type *a, const Type *b);
+// Generic builtins: match a parameter type against an argument type, binding
+// each type variable in bind[TY_MAX_VARS] to the first type it meets, then
+// substitute the bindings into the result type (unbound variables become Any)
+bool ty_match(const Type *param, Type *arg, Type **bind);
+Type *ty_subst(Type *t, Type **bind);
 const char *ty_kind_name(TypeKind k);
 void ty_to_string(const Type *t, char *buf, size_t bufsize);
 
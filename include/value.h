@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include "type.h"
 #include "gc.h"
 
@@ -24,6 +25,7 @@ typedef enum {
   VAL_OPTION,  // Some(value) or None
   VAL_RESULT,  // Ok(value) or Err(error)
   VAL_STRUCT,  // User-defined struct
+  VAL_TASK,    // Handle of a spawned task
 } ValueKind;
 
 typedef struct Value Value;
@@ -32,104 +34,273 @@ typedef struct Env Env;
 
 typedef Value (*NativeFn)(Env *env, Value *args, int nargs);
 
-typedef struct String {
+typedef struct String String;
+typedef struct Channel Channel;
+typedef struct Closure Closure;
+typedef struct ValList ValList;
+typedef struct Vector Vector;
+typedef struct Map Map;
+typedef struct OptionVal OptionVal;
+typedef struct ResultVal ResultVal;
+typedef struct StructVal StructVal;
+typedef struct TaskVal TaskVal;
+typedef struct ChanVal ChanVal;
+
+// A Value is 16 bytes by default: a kind tag and a union. Building with
+// SQALE_NANBOX=1 (`make NANBOX=1`) packs it into 8 bytes instead. Code outside
+// this header reads values only through v_kind and the v_as_* accessors
+// below, so both layouts build from the same sources. Object constructors
+// take non-NULL pointers: the 8-byte layout finds an object's kind in its
+// header.
+#ifndef SQALE_NANBOX
+#define SQALE_NANBOX 0
+#endif
+
+#if SQALE_NANBOX
+// NaN-boxing: a Float is stored as its own bits, with NaNs canonicalised to
+// 0x7ff8...; anything else is a negative quiet NaN carrying a tag in bits
+// 48-50 and a 48-bit payload: an Int in [-2^47, 2^47), a pointer or a
+// constant. Wider Ints are boxed on the GC heap, natives and symbols in
+// immortal malloc'd records.
+struct Value { uint64_t bits; };
+#else
+struct Value {
+  ValueKind kind;
+  union {
+    int64_t i;
+    double f;
+    bool b;
+    String *str;
+    struct { NativeFn fn; Type *type; } native;
+    Closure *clos;
+    ChanVal *chan;
+    struct { const char *name; int32_t len; } sym;
+    ValList *list;
+    Vector *vec;
+    Map *map;
+    OptionVal *opt;
+    ResultVal *res;
+    StructVal *struc;
+    TaskVal *task;
+  } as;
+};
+#endif
+
+// Heap objects keep their payload inline after the header where the size is
+// fixed at allocation, so most values are a single allocation.
+
+struct String {
   Obj hdr;
-  char *data;
   int64_t len;
-} String;
-
-typedef struct Channel Channel;
+  char data[]; // len bytes plus a NUL
+};
 
-typedef struct Closure {
+struct Closure {
   Obj hdr;
   // function AST pointer and environment
   void *fn_node; // opaque pointer to AST node for [fn ...]
   Env *env;      // captured environment
   Type *type;    // function type
-} Closure;
+};
 
-typedef struct ValList {
+struct ValList {
   Obj hdr;
-  struct Value *items;
   int32_t len;
-  int32_t cap;
-} ValList;
+  Value items[];
+};
 
-typedef struct Vector {
+// Starts with its items inline; once pushes outgrow them they move to a
+// malloc'd buffer
+struct Vector {
   Obj hdr;
-  struct Value *items;
   int32_t len;
   int32_t cap;
-} Vector;
+  int32_t ninline;
+  Value *items; // inline_items or the out-of-line buffer
+  Value inline_items[];
+};
 
-struct Value; // forward for MapEntry
-typedef struct MapEntry { struct Value *key; struct Value *val; int used; } MapEntry;
-typedef struct Map {
+// Open addressing with Robin Hood probing, see the map section of runtime.c.
+// Each entry caches its key's hash; 0 marks an empty slot.
+typedef struct MapEntry { uint64_t hash; Value key; Value val; } MapEntry;
+struct Map {
   Obj hdr;
   MapEntry *slots;
-  int32_t cap;
+  int32_t cap; // power of two
   int32_t len;
-} Map;
+};
 
 // Option: has_value indicates Some vs None
-typedef struct OptionVal {
+struct OptionVal {
   Obj hdr;
-  struct Value *value; // NULL for None
   bool has_value;
-} OptionVal;
+  Value value; // Unit for None
+};
 
 // Result: is_ok indicates Ok vs Err
-typedef struct ResultVal {
+struct ResultVal {
   Obj hdr;
-  struct Value *value; // Ok or Err value
   bool is_ok;
-} ResultVal;
+  Value value; // Ok or Err value
+};
 
-// Struct instance
-typedef struct StructVal {
+// Struct instance; the type name is stored after the fields
+struct StructVal {
   Obj hdr;
   const char *type_name;
-  struct Value *fields;
   int32_t nfields;
-} StructVal;
+  Value fields[];
+};
 
-struct Value {
-  ValueKind kind;
-  union {
-    int64_t i;
-    double f;
-    bool b;
-    String *str;
-    struct { NativeFn fn; Type *type; } native;
-    Closure *clos;
-    Channel *chan;
-    struct { const char *name; int32_t len; } sym;
-    ValList *list;
-    Vector *vec;
-    Map *map;
-    OptionVal *opt;
-    ResultVal *res;
-    StructVal *struc;
-  } as;
+// Handle returned by spawn. Allocated old, so the task can hold it while it
+// runs; result is set once done is, and joiners wait on the list in runtime.c.
+struct TaskVal {
+  Obj hdr;
+  int done;
+  bool lock;                 // RtSpin guarding done and joiners
+  struct JoinNode *joiners;
+  Value result;
+};
+
+// A channel on the heap, so that it lives as long as something references
+// it and its buffered messages are traced through it. Allocated old: the
+// Channel itself is malloc'd and never moves, and sends barrier against hdr.
+struct ChanVal {
+  Obj hdr;
+  Channel *chan;
 };
 
-// Constructors
-Value v_int(int64_t x);
-Value v_float(double x);
-Value v_bool(bool x);
-Value v_unit(void);
-Value v_str(String *s);
+// Int that does not fit an 8-byte Value; only allocated with SQALE_NANBOX
+typedef struct IntBox { Obj hdr; int64_t i; } IntBox;
+
+#if SQALE_NANBOX
+
+#if UINTPTR_MAX != UINT64_MAX
+#error "SQALE_NANBOX needs 64-bit pointers"
+#endif
+
+typedef struct NativeBox { NativeFn fn; Type *type; } NativeBox;
+typedef struct SymbolName { int32_t len; char name[]; } SymbolName; // interned
+
+enum { VT_FLOAT, VT_INT, VT_CONST, VT_OBJ, VT_NATIVE, VT_SYM };
+enum { VC_UNIT, VC_FALSE, VC_TRUE, VC_NONE };
+#define VB_BASE 0xfff8000000000000ull
+#define VB_PAYLOAD 0x0000ffffffffffffull
+#define VB_INT_MIN (-(INT64_C(1)<<47))
+#define VB_INT_MAX ((INT64_C(1)<<47)-1)
+
+extern const uint8_t v_obj_kinds[OBJ_NTYPES]; // ValueKind of each ObjType
+
+static inline Value vb_make(unsigned tag, uint64_t payload) { Value v; v.bits = VB_BASE | (uint64_t)tag<<48 | payload; return v; }
+static inline unsigned vb_tag(Value v) { return v.bits > (VB_BASE|VB_PAYLOAD) ? (unsigned)(v.bits>>48 & 7) : VT_FLOAT; }
+static inline void *vb_ptr(Value v) { return (void*)(uintptr_t)(v.bits & VB_PAYLOAD); }
+static inline Value vb_obj(void *o) { return vb_make(VT_OBJ, (uint64_t)(uintptr_t)o); }
+
+Value v_int_boxed(int64_t x);
+static inline Value v_int(int64_t x) { return x>=VB_INT_MIN && x<=VB_INT_MAX ? vb_make(VT_INT, (uint64_t)x & VB_PAYLOAD) : v_int_boxed(x); }
+static inline Value v_float(double x) { Value v; if (x!=x) v.bits = 0x7ff8000000000000ull; else memcpy(&v.bits, &x, 8); return v; }
+static inline Value v_bool(bool x) { return vb_make(VT_CONST, x ? VC_TRUE : VC_FALSE); }
+static inline Value v_unit(void) { return vb_make(VT_CONST, VC_UNIT); }
+static inline Value v_str(String *s) { return vb_obj(s); }
 Value v_native(NativeFn f, Type *type);
-Value v_closure(Closure *c);
-Value v_chan(Channel *c);
+static inline Value v_closure(Closure *c) { return vb_obj(c); }
+static inline Value v_chan(ChanVal *c) { return vb_obj(c); }
 Value v_symbol(const char *name, int32_t len);
-Value v_list(ValList *l);
-Value v_vec(Vector *v);
-Value v_map(Map *m);
-Value v_some(OptionVal *o);
-Value v_none(void);
-Value v_ok(ResultVal *r);
-Value v_err(ResultVal *r);
-Value v_struct(StructVal *s);
+static inline Value v_list(ValList *l) { return vb_obj(l); }
+static inline Value v_vec(Vector *v) { return vb_obj(v); }
+static inline Value v_map(Map *m) { return vb_obj(m); }
+static inline Value v_some(OptionVal *o) { return vb_obj(o); }
+static inline Value v_none(void) { return vb_make(VT_CONST, VC_NONE); }
+static inline Value v_ok(ResultVal *r) { return vb_obj(r); }
+static inline Value v_err(ResultVal *r) { return vb_obj(r); }
+static inline Value v_struct(StructVal *s) { return vb_obj(s); }
+static inline Value v_task(TaskVal *t) { return vb_obj(t); }
+
+static inline ValueKind v_kind(Value v) {
+  switch (vb_tag(v)) {
+    case VT_FLOAT: return VAL_FLOAT;
+    case VT_INT: return VAL_INT;
+    case VT_CONST: { uint64_t c = v.bits & VB_PAYLOAD; return c==VC_UNIT ? VAL_UNIT : c==VC_NONE ? VAL_OPTION : VAL_BOOL; }
+    case VT_OBJ: return (ValueKind)v_obj_kinds[((Obj*)vb_ptr(v))->type];
+    case VT_NATIVE: return VAL_FUNC;
+    default: return VAL_SYMBOL;
+  }
+}
+static inline int64_t v_as_int(Value v) { return vb_tag(v)==VT_INT ? (int64_t)(v.bits<<16)>>16 : ((IntBox*)vb_ptr(v))->i; }
+static inline double v_as_float(Value v) { double f; memcpy(&f, &v.bits, 8); return f; }
+static inline bool v_as_bool(Value v) { return (v.bits & VB_PAYLOAD)==VC_TRUE; }
+static inline String *v_as_str(Value v) { return (String*)vb_ptr(v); }
+static inline NativeFn v_as_native(Value v) { return ((NativeBox*)vb_ptr(v))->fn; }
+static inline Type *v_native_type(Value v) { return ((NativeBox*)vb_ptr(v))->type; }
+static inline Closure *v_as_clos(Value v) { return (Closure*)vb_ptr(v); }
+static inline Channel *v_as_chan(Value v) { return ((ChanVal*)vb_ptr(v))->chan; }
+static inline const char *v_sym_name(Value v) { return ((SymbolName*)vb_ptr(v))->name; }
+static inline int32_t v_sym_len(Value v) { return ((SymbolName*)vb_ptr(v))->len; }
+static inline ValList *v_as_list(Value v) { return (ValList*)vb_ptr(v); }
+static inline Vector *v_as_vec(Value v) { return (Vector*)vb_ptr(v); }
+static inline Map *v_as_map(Value v) { return (Map*)vb_ptr(v); }
+static inline OptionVal *v_as_opt(Value v) { return vb_tag(v)==VT_OBJ ? (OptionVal*)vb_ptr(v) : NULL; }
+static inline ResultVal *v_as_res(Value v) { return (ResultVal*)vb_ptr(v); }
+static inline StructVal *v_as_struct(Value v) { return (StructVal*)vb_ptr(v); }
+static inline TaskVal *v_as_task(Value v) { return (TaskVal*)vb_ptr(v); }
+// Heap object referenced by v, or NULL for immediates and natives
+static inline Obj *v_obj(Value v) { return vb_tag(v)==VT_OBJ ? (Obj*)vb_ptr(v) : NULL; }
+// Point v at o, the new address of the object it referenced
+static inline void v_set_obj(Value *v, Obj *o) { *v = vb_obj(o); }
+// Heap that v_int boxes wide Ints into on the calling thread
+extern _Thread_local GC *v_heap;
+static inline void v_set_heap(GC *gc) { v_heap = gc; }
+
+#else
+
+static inline Value v_int(int64_t x) { Value v; v.kind=VAL_INT; v.as.i=x; return v; }
+static inline Value v_float(double x) { Value v; v.kind=VAL_FLOAT; v.as.f=x; return v; }
+static inline Value v_bool(bool x) { Value v; v.kind=VAL_BOOL; v.as.b=x; return v; }
+static inline Value v_unit(void) { Value v; v.kind=VAL_UNIT; v.as.i=0; return v; }
+static inline Value v_str(String *s) { Value v; v.kind=VAL_STR; v.as.str=s; return v; }
+static inline Value v_native(NativeFn f, Type *type) { Value v; v.kind=VAL_FUNC; v.as.native.fn=f; v.as.native.type=type; return v; }
+static inline Value v_closure(Closure *c) { Value v; v.kind=VAL_CLOSURE; v.as.clos=c; return v; }
+static inline Value v_chan(ChanVal *c) { Value v; v.kind=VAL_CHAN; v.as.chan=c; return v; }
+static inline Value v_symbol(const char *name, int32_t len) { Value v; v.kind=VAL_SYMBOL; v.as.sym.name=name; v.as.sym.len=len; return v; }
+static inline Value v_list(ValList *l) { Value v; v.kind=VAL_LIST; v.as.list=l; return v; }
+static inline Value v_vec(Vector *vec) { Value v; v.kind=VAL_VEC; v.as.vec=vec; return v; }
+static inline Value v_map(Map *m) { Value v; v.kind=VAL_MAP; v.as.map=m; return v; }
+static inline Value v_some(OptionVal *o) { Value v; v.kind=VAL_OPTION; v.as.opt=o; return v; }
+static inline Value v_none(void) { Value v; v.kind=VAL_OPTION; v.as.opt=NULL; return v; }
+static inline Value v_ok(ResultVal *r) { Value v; v.kind=VAL_RESULT; v.as.res=r; return v; }
+static inline Value v_err(ResultVal *r) { Value v; v.kind=VAL_RESULT; v.as.res=r; return v; }
+static inline Value v_struct(StructVal *s) { Value v; v.kind=VAL_STRUCT; v.as.struc=s; return v; }
+static inline Value v_task(TaskVal *t) { Value v; v.kind=VAL_TASK; v.as.task=t; return v; }
+
+static inline ValueKind v_kind(Value v) { return v.kind; }
+static inline int64_t v_as_int(Value v) { return v.as.i; }
+static inline double v_as_float(Value v) { return v.as.f; }
+static inline bool v_as_bool(Value v) { return v.as.b; }
+static inline String *v_as_str(Value v) { return v.as.str; }
+static inline NativeFn v_as_native(Value v) { return v.as.native.fn; }
+static inline Type *v_native_type(Value v) { return v.as.native.type; }
+static inline Closure *v_as_clos(Value v) { return v.as.clos; }
+static inline Channel *v_as_chan(Value v) { return v.as.chan->chan; }
+static inline const char *v_sym_name(Value v) { return v.as.sym.name; }
+static inline int32_t v_sym_len(Value v) { return v.as.sym.len; }
+static inline ValList *v_as_list(Value v) { return v.as.list; }
+static inline Vector *v_as_vec(Value v) { return v.as.vec; }
+static inline Map *v_as_map(Value v) { return v.as.map; }
+static inline OptionVal *v_as_opt(Value v) { return v.as.opt; }
+static inline ResultVal *v_as_res(Value v) { return v.as.res; }
+static inline StructVal *v_as_struct(Value v) { return v.as.struc; }
+static inline TaskVal *v_as_task(Value v) { return v.as.task; }
+// Heap object referenced by v, or NULL for immediates and natives
+static inline Obj *v_obj(Value v) {
+  switch (v.kind) {
+    case VAL_STR: case VAL_CLOSURE: case VAL_LIST: case VAL_VEC: case VAL_MAP:
+    case VAL_OPTION: case VAL_RESULT: case VAL_STRUCT: case VAL_TASK: case VAL_CHAN: return (Obj*)v.as.str; // one pointer slot for every heap kind
+    default: return NULL;
+  }
+}
+static inline void v_set_obj(Value *v, Obj *o) { v->as.str = (String*)o; }
+static inline void v_set_heap(GC *gc) { (void)gc; }
+
+#endif
 
 #endif // VALUE_H
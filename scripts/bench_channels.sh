@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+# Time channel throughput as the worker pool grows, on both engines, one
+# message per send and batched. Usage: scripts/bench_channels.sh [max-workers]
+set -euo pipefail
+cd "$(dirname "$0")/.."
+max=${1:-$(getconf _NPROCESSORS_ONLN)}
+make -s
+TIMEFORMAT=%R
+for prog in examples/chanbench.sq examples/chanbatch.sq; do
+  for ((w = 1; w <= max; w *= 2)); do
+    for engine in tree bc; do
+      printf '%-22s workers=%-3s %-5s ' "$prog" "$w" "$engine"
+      { time ./build/sqale run --engine=$engine --workers=$w "$prog" >/dev/null; } 2>&1
+    done
+  done
+done
@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+# Compare the 16-byte and NaN-boxed 8-byte Value layouts on a vector-heavy
+# workload, on both engines. Usage: scripts/bench_value_layout.sh [file.sq]
+set -euo pipefail
+cd "$(dirname "$0")/.."
+prog=${1:-examples/vecbench.sq}
+make -s
+make -s NANBOX=1 BUILD_DIR=build/nanbox
+TIMEFORMAT=%R
+for layout in build build/nanbox; do
+  for engine in tree bc; do
+    printf '%-13s %-5s ' "$layout" "$engine"
+    { time "$layout/sqale" run --engine=$engine "$prog" >/dev/null; } 2>&1
+  done
+done
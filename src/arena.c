@@ -48,3 +48,11 @@ void *arena_alloc(Arena *a, size_t size, size_t align) {
   return p;
 }
 
+void arena_reset(Arena *a) {
+  ArenaChunk *c = a->head;
+  if (!c) return;
+  while (c->next) { ArenaChunk *n = c->next; free(c); c = n; }
+  c->used = 0;
+  a->head = c;
+}
+
@@ -3,12 +3,89 @@
 #include <stdalign.h>
 #include <string.h>
 
+typedef struct Symbol {
+  struct Symbol *next;
+  uint64_t hash;
+  size_t len;
+  FormOp form;
+  char name[];
+} Symbol;
+
+static Symbol **sym_buckets;
+static size_t sym_nbuckets, sym_count;
+
+static const struct { const char *name; FormOp form; } form_names[] = {
+  {"def", FORM_DEF}, {"defmacro", FORM_DEFMACRO}, {"quote", FORM_QUOTE},
+  {"quasiquote", FORM_QUASIQUOTE}, {"let", FORM_LET}, {"if", FORM_IF},
+  {"do", FORM_DO}, {"while", FORM_WHILE}, {"set!", FORM_SET},
+  {"import", FORM_IMPORT}, {"defstruct", FORM_DEFSTRUCT}, {"defenum", FORM_DEFENUM},
+  {"fn", FORM_FN}, {"select", FORM_SELECT}, {"with-tasks", FORM_WITH_TASKS},
+  {"vec", FORM_VEC}, {"struct-new", FORM_STRUCT_NEW},
+};
+
+static uint64_t sym_hash(const char *s, size_t len) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i=0;i<len;i++) { h ^= (unsigned char)s[i]; h *= 1099511628211ull; }
+  return h;
+}
+
+static void sym_grow(void) {
+  size_t nb = sym_nbuckets ? sym_nbuckets*2 : 256;
+  Symbol **b = (Symbol**)calloc(nb, sizeof(Symbol*));
+  for (size_t i=0;i<sym_nbuckets;i++) {
+    Symbol *s = sym_buckets[i];
+    while (s) { Symbol *n = s->next; size_t j = s->hash & (nb-1); s->next = b[j]; b[j] = s; s = n; }
+  }
+  free(sym_buckets); sym_buckets = b; sym_nbuckets = nb;
+}
+
+const char *sym_intern(const char *ptr, size_t len, FormOp *form_out) {
+  uint64_t h = sym_hash(ptr, len);
+  if (sym_nbuckets) {
+    for (Symbol *s = sym_buckets[h & (sym_nbuckets-1)]; s; s = s->next) {
+      if (s->hash==h && s->len==len && memcmp(s->name, ptr, len)==0) {
+        if (form_out) *form_out = s->form;
+        return s->name;
+      }
+    }
+  }
+  if (sym_count+1 > sym_nbuckets) sym_grow();
+  Symbol *s = (Symbol*)malloc(sizeof(Symbol) + len + 1);
+  memcpy(s->name, ptr, len); s->name[len] = '\0';
+  s->hash = h; s->len = len; s->form = FORM_CALL;
+  for (size_t i=0;i<sizeof(form_names)/sizeof(form_names[0]);i++) {
+    if (strcmp(form_names[i].name, s->name)==0) { s->form = form_names[i].form; break; }
+  }
+  size_t j = h & (sym_nbuckets-1);
+  s->next = sym_buckets[j]; sym_buckets[j] = s; sym_count++;
+  if (form_out) *form_out = s->form;
+  return s->name;
+}
+
+static bool is_name(const Node *n, const char *s) {
+  return n->kind==N_SYMBOL && strlen(s)==n->as.sym.len && memcmp(n->as.sym.ptr, s, n->as.sym.len)==0;
+}
+
+SelectArm select_arm(const Node *arm) {
+  if (arm->kind!=N_LIST || arm->as.list.count==0) return SELECT_BAD;
+  const Node *op = arm->as.list.items[0];
+  if (is_name(op, "default")) return SELECT_DEFAULT;
+  if (op->kind!=N_LIST || op->as.list.count<2) return SELECT_BAD;
+  const Node *head = op->as.list.items[0]; size_t n = op->as.list.count;
+  if (is_name(head, "recv") && n==2 && arm->as.list.count>=2 && arm->as.list.items[1]->kind==N_SYMBOL) return SELECT_RECV;
+  if (is_name(head, "send") && n==3) return SELECT_SEND;
+  if (is_name(head, "timeout") && n==2) return SELECT_TIMEOUT;
+  return SELECT_BAD;
+}
+
 Node *node_new_list(Arena *arena, size_t cap_hint) {
   Node *n = (Node *)arena_alloc(arena, sizeof(Node), alignof(Node));
   n->kind = N_LIST; n->line=0; n->col=0; n->ty=NULL;
   size_t cap = cap_hint ? cap_hint : 4;
   n->as.list.items = (Node **)arena_alloc(arena, sizeof(Node*)*cap, alignof(Node*));
   n->as.list.count = 0;
+  n->as.list.nslots = 0;
+  n->as.list.captured = false; n->as.list.form = FORM_CALL; n->as.list.bc = NULL; n->as.list.tier = NULL;
   return n;
 }
 
@@ -26,14 +103,14 @@ void node_list_push(Arena *arena, Node *list, Node *item) {
   }
   list->as.list.items[cnt] = item;
   list->as.list.count++;
+  if (cnt==0) list->as.list.form = item->kind==N_SYMBOL ? item->as.sym.form : FORM_CALL;
 }
 
 Node *node_new_symbol(Arena *arena, const char *ptr, size_t len, size_t line, size_t col) {
   Node *n = (Node *)arena_alloc(arena, sizeof(Node), alignof(Node));
   n->kind=N_SYMBOL; n->line=line; n->col=col; n->ty=NULL;
-  char *p = (char *)arena_alloc(arena, len+1, 1);
-  memcpy(p, ptr, len); p[len]='\0';
-  n->as.sym.ptr = p; n->as.sym.len=len;
+  n->as.sym.ptr = sym_intern(ptr, len, &n->as.sym.form); n->as.sym.len=len;
+  n->as.sym.depth = -1; n->as.sym.slot = -1; n->as.sym.cell = NULL;
   return n;
 }
 
@@ -0,0 +1,469 @@
+#include "bytecode.h"
+#include "eval.h"
+#include "tier.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Cross-platform alloca
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <alloca.h>
+#endif
+
+// Labels-as-values dispatch where the compiler has it, a plain switch otherwise
+#if defined(__GNUC__) || defined(__clang__)
+#define BC_COMPUTED_GOTO 1
+#endif
+
+#define BC_MAX_OPERAND 0xFFFF
+
+typedef struct Compiler {
+  BcProto *p;
+  int32_t cap_code, cap_k, cap_strs, cap_cells;
+  int32_t *scopes; // base register of each fn/let frame, innermost last
+  int32_t nscopes, cap_scopes;
+  int32_t top;     // first free register
+  int ok;          // cleared when the body uses a form we do not lower
+} Compiler;
+
+static void compile_into(Compiler *c, Node *n, int32_t dst);
+
+static int is_colon(Node *n) {
+  return n->kind==N_SYMBOL && n->as.sym.len==1 && n->as.sym.ptr[0]==':';
+}
+
+static int32_t emit(Compiler *c, int op, int32_t a, int32_t b, int32_t cc, int32_t d) {
+  if (a<0 || b<0 || cc<0 || d<0 || a>BC_MAX_OPERAND || b>BC_MAX_OPERAND || cc>BC_MAX_OPERAND || d>BC_MAX_OPERAND) {
+    c->ok = 0; a = b = cc = d = 0;
+  }
+  BcProto *p = c->p;
+  if (p->ncode==c->cap_code) {
+    c->cap_code = c->cap_code ? c->cap_code*2 : 32;
+    p->code = (BcInstr*)realloc(p->code, sizeof(BcInstr)*c->cap_code);
+  }
+  p->code[p->ncode] = (BcInstr){ (uint16_t)op, (uint16_t)a, (uint16_t)b, (uint16_t)cc, (uint16_t)d };
+  return p->ncode++;
+}
+
+// Point the jump emitted at `at` to the next instruction
+static void patch(Compiler *c, int32_t at) {
+  int32_t here = c->p->ncode;
+  if (here>BC_MAX_OPERAND) { c->ok = 0; return; }
+  BcInstr *in = &c->p->code[at];
+  if (in->op==BC_JMP || in->op==BC_JMPF) in->b = (uint16_t)here; else in->c = (uint16_t)here;
+}
+
+static int32_t alloc_reg(Compiler *c) {
+  int32_t r = c->top++;
+  if (c->top>c->p->nregs) c->p->nregs = c->top;
+  return r;
+}
+
+// Constants are not traced by the GC, so they must be immediates; an Int
+// boxed by the NaN-boxed layout leaves the body to the tree walker
+static int32_t add_k(Compiler *c, Value v) {
+  BcProto *p = c->p;
+  if (v_obj(v)) { c->ok = 0; return 0; }
+  if (p->nk==c->cap_k) { c->cap_k = c->cap_k ? c->cap_k*2 : 8; p->k = (Value*)realloc(p->k, sizeof(Value)*c->cap_k); }
+  p->k[p->nk] = v; return p->nk++;
+}
+
+static int32_t add_str(Compiler *c, Node *n) {
+  BcProto *p = c->p;
+  if (p->nstrs==c->cap_strs) { c->cap_strs = c->cap_strs ? c->cap_strs*2 : 8; p->strs = (Node**)realloc(p->strs, sizeof(Node*)*c->cap_strs); }
+  p->strs[p->nstrs] = n; return p->nstrs++;
+}
+
+static int32_t add_cell(Compiler *c, Value *cell) {
+  BcProto *p = c->p;
+  for (int32_t i=0;i<p->ncells;i++) if (p->cells[i]==cell) return i;
+  if (p->ncells==c->cap_cells) { c->cap_cells = c->cap_cells ? c->cap_cells*2 : 8; p->cells = (Value**)realloc(p->cells, sizeof(Value*)*c->cap_cells); }
+  p->cells[p->ncells] = cell; return p->ncells++;
+}
+
+static void scope_push(Compiler *c, int32_t base) {
+  if (c->nscopes==c->cap_scopes) { c->cap_scopes = c->cap_scopes ? c->cap_scopes*2 : 8; c->scopes = (int32_t*)realloc(c->scopes, sizeof(int32_t)*c->cap_scopes); }
+  c->scopes[c->nscopes++] = base;
+}
+
+static void load_unit(Compiler *c, int32_t dst) {
+  if (dst>=0) emit(c, BC_LOADK, dst, add_k(c, v_unit()), 0, 0);
+}
+
+// Register of a resolved local, or -1 when it lives in the closure's captured
+// environment, *up frames above it.
+static int32_t local_reg(Compiler *c, Node *sym, int32_t *up) {
+  int32_t d = sym->as.sym.depth;
+  if (d<c->nscopes) return c->scopes[c->nscopes-1-d] + sym->as.sym.slot;
+  *up = d - c->nscopes; return -1;
+}
+
+// Locals of a compiled frame can only change through set! in the same body:
+// the frame is never captured because bodies with nested fns are not compiled.
+static int has_set(Node *n) {
+  if (n->kind!=N_LIST) return 0;
+  if (n->as.list.form==FORM_SET) return 1;
+  for (size_t i=0;i<n->as.list.count;i++) if (has_set(n->as.list.items[i])) return 1;
+  return 0;
+}
+
+// Expressions that write their destination only as their final instruction and
+// may therefore target a live local register directly
+static int writes_last(Node *n) {
+  if (n->kind!=N_LIST) return 1;
+  FormOp f = n->as.list.form;
+  return n->as.list.count==0 || f==FORM_CALL || f==FORM_VEC || f==FORM_STRUCT_NEW;
+}
+
+// Register holding n's value: the local's own register when aliasing is safe,
+// otherwise a fresh temporary
+static int32_t compile_operand(Compiler *c, Node *n, int alias_ok) {
+  if (alias_ok && n->kind==N_SYMBOL && !n->as.sym.cell && n->as.sym.slot>=0) {
+    int32_t up = 0; int32_t r = local_reg(c, n, &up);
+    if (r>=0) return r;
+  }
+  int32_t t = alloc_reg(c);
+  compile_into(c, n, t);
+  return t;
+}
+
+static void store_local(Compiler *c, Node *ex, int32_t reg) {
+  if (writes_last(ex)) { compile_into(c, ex, reg); return; }
+  int32_t save = c->top, t = alloc_reg(c);
+  compile_into(c, ex, t);
+  emit(c, BC_MOV, reg, t, 0, 0);
+  c->top = save;
+}
+
+// Builtin behind a global cell that has an Int fast path, as a bytecode op
+static int fast_binary(Value *cell) {
+  if (!cell || v_kind(*cell)!=VAL_FUNC) return -1;
+  NativeFn f = v_as_native(*cell);
+  if (f==rt_add) return BC_ADD;
+  if (f==rt_sub) return BC_SUB;
+  if (f==rt_mul) return BC_MUL;
+  if (f==rt_lt) return BC_LT;
+  if (f==rt_le) return BC_LE;
+  if (f==rt_gt) return BC_GT;
+  if (f==rt_ge) return BC_GE;
+  if (f==rt_eq) return BC_EQ;
+  return -1;
+}
+
+static Value *call_cell(Node *list) {
+  if (list->kind!=N_LIST || list->as.list.form!=FORM_CALL || list->as.list.count==0) return NULL;
+  Node *head = list->as.list.items[0];
+  return head->kind==N_SYMBOL ? head->as.sym.cell : NULL;
+}
+
+// Emit a branch taken when cond is not true; returns the jump to patch.
+// Int comparisons fuse the test into the branch.
+static int32_t compile_branch_false(Compiler *c, Node *cond) {
+  int32_t save = c->top, at;
+  Value *cell = call_cell(cond);
+  int op = cond->kind==N_LIST && cond->as.list.count==3 ? fast_binary(cell) : -1;
+  int jop = op==BC_LT ? BC_JNLT : op==BC_LE ? BC_JNLE : op==BC_GT ? BC_JNGT : op==BC_GE ? BC_JNGE : op==BC_EQ ? BC_JNEQ : -1;
+  if (jop>=0) {
+    int32_t a = compile_operand(c, cond->as.list.items[1], !has_set(cond->as.list.items[2]));
+    int32_t b = compile_operand(c, cond->as.list.items[2], 1);
+    at = emit(c, jop, a, b, 0, add_cell(c, cell));
+  } else {
+    int32_t r = compile_operand(c, cond, 1);
+    at = emit(c, BC_JMPF, r, 0, 0, 0);
+  }
+  c->top = save;
+  return at;
+}
+
+static void compile_symbol(Compiler *c, Node *n, int32_t dst) {
+  if (dst<0) return;
+  if (n->as.sym.cell) { emit(c, BC_GETG, dst, add_cell(c, n->as.sym.cell), 0, 0); return; }
+  if (n->as.sym.slot<0) { load_unit(c, dst); return; }
+  int32_t up = 0; int32_t r = local_reg(c, n, &up);
+  if (r<0) emit(c, BC_GETUP, dst, n->as.sym.slot, up, 0);
+  else if (r!=dst) emit(c, BC_MOV, dst, r, 0, 0);
+}
+
+static void compile_call(Compiler *c, Node *list, int32_t dst) {
+  size_t n = list->as.list.count;
+  int32_t argc = (int32_t)(n-1);
+  int32_t save = c->top;
+  int32_t out = dst>=0 ? dst : alloc_reg(c);
+  // A global callee is read when the call executes, after its arguments
+  Value *cell = call_cell(list);
+  if (cell) {
+    int op = argc==2 ? fast_binary(cell) : -1;
+    if (op>=0) {
+      int32_t a = compile_operand(c, list->as.list.items[1], !has_set(list->as.list.items[2]));
+      int32_t b = compile_operand(c, list->as.list.items[2], 1);
+      emit(c, op, out, a, b, add_cell(c, cell));
+    } else {
+      int32_t base = c->top;
+      for (int32_t i=0;i<argc;i++) alloc_reg(c);
+      for (int32_t i=0;i<argc;i++) compile_into(c, list->as.list.items[i+1], base+i);
+      emit(c, BC_CALLG, out, base, argc, add_cell(c, cell));
+    }
+  } else {
+    int32_t base = c->top;
+    for (int32_t i=0;i<=argc;i++) alloc_reg(c);
+    for (int32_t i=0;i<=argc;i++) compile_into(c, list->as.list.items[i], base+i);
+    emit(c, BC_CALL, out, base, argc, 0);
+  }
+  c->top = save;
+}
+
+static void compile_let(Compiler *c, Node *list, int32_t dst) {
+  size_t n = list->as.list.count;
+  if (n<3) { load_unit(c, dst); return; }
+  Node *binds = list->as.list.items[1];
+  int32_t save = c->top, base = c->top;
+  for (int32_t i=0;i<list->as.list.nslots;i++) alloc_reg(c);
+  scope_push(c, base);
+  // Same binding shapes as eval_list
+  for (size_t i=0;i<binds->as.list.count;i++) {
+    Node *pair = binds->as.list.items[i];
+    if (pair->kind!=N_LIST || pair->as.list.count<2) continue;
+    Node *nm = pair->as.list.items[0];
+    Node *ex = NULL;
+    if (pair->as.list.count>=4 && is_colon(pair->as.list.items[1])) {
+      ex = pair->as.list.items[3];
+    } else if (pair->as.list.count==3 && is_colon(pair->as.list.items[1])) {
+      if (i+1<binds->as.list.count) ex = binds->as.list.items[++i];
+    } else {
+      ex = pair->as.list.items[1];
+    }
+    if (!ex) { c->ok = 0; break; }
+    if (nm->kind==N_SYMBOL && nm->as.sym.slot>=0) store_local(c, ex, base + nm->as.sym.slot);
+    else compile_into(c, ex, -1);
+  }
+  for (size_t i=2;i<n;i++) compile_into(c, list->as.list.items[i], i==n-1 ? dst : -1);
+  c->nscopes--;
+  c->top = save;
+}
+
+static void compile_list(Compiler *c, Node *list, int32_t dst) {
+  size_t n = list->as.list.count;
+  if (n==0) { load_unit(c, dst); return; }
+  switch (list->as.list.form) {
+    case FORM_IF: {
+      if (n!=4) { load_unit(c, dst); return; }
+      int32_t jf = compile_branch_false(c, list->as.list.items[1]);
+      compile_into(c, list->as.list.items[2], dst);
+      int32_t je = emit(c, BC_JMP, 0, 0, 0, 0);
+      patch(c, jf);
+      compile_into(c, list->as.list.items[3], dst);
+      patch(c, je);
+      return;
+    }
+    case FORM_DO: {
+      if (n==1) { load_unit(c, dst); return; }
+      for (size_t i=1;i<n;i++) compile_into(c, list->as.list.items[i], i==n-1 ? dst : -1);
+      return;
+    }
+    case FORM_WHILE: {
+      if (n<2) { load_unit(c, dst); return; }
+      int32_t top = c->p->ncode;
+      int32_t jf = compile_branch_false(c, list->as.list.items[1]);
+      for (size_t i=2;i<n;i++) compile_into(c, list->as.list.items[i], -1);
+      emit(c, BC_LOOP, 0, top, 0, 0);
+      patch(c, jf);
+      load_unit(c, dst);
+      return;
+    }
+    case FORM_SET: {
+      if (n!=3 || list->as.list.items[1]->kind!=N_SYMBOL) { load_unit(c, dst); return; }
+      Node *target = list->as.list.items[1];
+      int32_t save = c->top;
+      if (target->as.sym.cell) {
+        int32_t r = compile_operand(c, list->as.list.items[2], 1);
+        emit(c, BC_SETG, r, add_cell(c, target->as.sym.cell), 0, 0);
+      } else if (target->as.sym.slot<0) {
+        c->ok = 0; // undefined variable: leave the diagnostic to the tree walker
+      } else {
+        int32_t up = 0; int32_t reg = local_reg(c, target, &up);
+        if (reg>=0) {
+          store_local(c, list->as.list.items[2], reg);
+        } else {
+          int32_t r = compile_operand(c, list->as.list.items[2], 1);
+          emit(c, BC_SETUP, r, target->as.sym.slot, up, 0);
+        }
+      }
+      c->top = save;
+      load_unit(c, dst);
+      return;
+    }
+    case FORM_LET: compile_let(c, list, dst); return;
+    case FORM_CALL:
+    case FORM_VEC:
+    case FORM_STRUCT_NEW:
+      compile_call(c, list, dst);
+      return;
+    default:
+      // fn, quote, quasiquote, def, select, with-tasks and the declaration forms
+      c->ok = 0;
+      return;
+  }
+}
+
+// Compile n with its value left in dst; dst < 0 evaluates n for effect only
+static void compile_into(Compiler *c, Node *n, int32_t dst) {
+  if (!c->ok) return;
+  switch (n->kind) {
+    case N_INT: if (dst>=0) emit(c, BC_LOADK, dst, add_k(c, v_int(n->as.ival)), 0, 0); return;
+    case N_FLOAT: if (dst>=0) emit(c, BC_LOADK, dst, add_k(c, v_float(n->as.fval)), 0, 0); return;
+    case N_BOOL: if (dst>=0) emit(c, BC_LOADK, dst, add_k(c, v_bool(n->as.bval)), 0, 0); return;
+    case N_STRING: if (dst>=0) emit(c, BC_LOADS, dst, add_str(c, n), 0, 0); return;
+    case N_SYMBOL: compile_symbol(c, n, dst); return;
+    case N_LIST: compile_list(c, n, dst); return;
+  }
+}
+
+static void proto_free(BcProto *p) {
+  free(p->code); free(p->k); free(p->strs); free(p->cells); free(p->param_slots); free(p);
+}
+
+static BcProto *bc_compile(Node *fn) {
+  BcProto *p = (BcProto*)calloc(1, sizeof(BcProto));
+  Compiler c; memset(&c, 0, sizeof(c));
+  c.p = p; c.ok = 1;
+  Node *params = fn->as.list.items[1];
+  p->nslots = fn->as.list.nslots;
+  p->nparams = (int32_t)params->as.list.count;
+  p->param_slots = (int32_t*)malloc(sizeof(int32_t)*(p->nparams ? p->nparams : 1));
+  for (int32_t i=0;i<p->nparams;i++) {
+    Node *pm = params->as.list.items[i];
+    Node *nm = pm->kind==N_LIST && pm->as.list.count>0 ? pm->as.list.items[0] : NULL;
+    p->param_slots[i] = nm && nm->kind==N_SYMBOL ? nm->as.sym.slot : -1;
+  }
+  scope_push(&c, 0);
+  for (int32_t i=0;i<p->nslots;i++) alloc_reg(&c);
+  size_t i0 = 2;
+  if (fn->as.list.count>i0 && is_colon(fn->as.list.items[i0])) i0 += 2;
+  size_t n = fn->as.list.count;
+  if (i0>=n) {
+    int32_t r = alloc_reg(&c); load_unit(&c, r); emit(&c, BC_RET, r, 0, 0, 0);
+  } else {
+    for (size_t i=i0;i<n-1;i++) compile_into(&c, fn->as.list.items[i], -1);
+    int32_t r = compile_operand(&c, fn->as.list.items[n-1], 1);
+    emit(&c, BC_RET, r, 0, 0, 0);
+  }
+  free(c.scopes);
+  if (!c.ok) { free(p->code); p->code = NULL; p->ncode = 0; }
+  return p;
+}
+
+static inline int is_native(const Value *v, NativeFn f) {
+  return v_kind(*v)==VAL_FUNC && v_as_native(*v)==f;
+}
+
+static Value invoke(VM *vm, Env *env, Value f, Value *argv, int argc) {
+  if (v_kind(f)==VAL_FUNC) return v_as_native(f)(env, argv, argc);
+  if (v_kind(f)==VAL_CLOSURE) return vm_call_closure(vm, v_as_clos(f), argv, argc);
+  return v_unit();
+}
+
+static Value invoke2(VM *vm, Env *env, Value f, Value x, Value y) {
+  Value argv[2] = { x, y };
+  return invoke(vm, env, f, argv, 2);
+}
+
+static Value run(VM *vm, Env *env, BcProto *p, Value *r) {
+  const BcInstr *code = p->code, *ip = code;
+  Value *k = p->k, **cells = p->cells;
+#ifdef BC_COMPUTED_GOTO
+#define BC_LABEL_ENTRY(op) &&L_##op,
+  static void *const labels[BC_NOPS] = { BC_OP_LIST(BC_LABEL_ENTRY) };
+#undef BC_LABEL_ENTRY
+#define OP(x) L_##x
+#define DISPATCH() goto *labels[ip->op]
+  DISPATCH();
+#else
+#define OP(x) case x
+#define DISPATCH() goto dispatch
+dispatch:
+  switch (ip->op) {
+#endif
+  OP(BC_MOV): r[ip->a] = r[ip->b]; ip++; DISPATCH();
+  OP(BC_LOADK): r[ip->a] = k[ip->b]; ip++; DISPATCH();
+  OP(BC_LOADS): {
+    Node *s = p->strs[ip->b];
+    r[ip->a] = v_str(rt_string_new(vm, s->as.str.ptr, s->as.str.len)); ip++; DISPATCH();
+  }
+  OP(BC_GETG): r[ip->a] = *cells[ip->b]; ip++; DISPATCH();
+  OP(BC_SETG): *cells[ip->b] = r[ip->a]; ip++; DISPATCH();
+  OP(BC_GETUP): {
+    Env *e = env; for (int d=ip->c; d>0; d--) e = e->parent;
+    r[ip->a] = e->slots[ip->b]; ip++; DISPATCH();
+  }
+  OP(BC_SETUP): {
+    Env *e = env; for (int d=ip->c; d>0; d--) e = e->parent;
+    e->slots[ip->b] = r[ip->a];
+    if (e->heap) gc_write_barrier(&vm->gc, &env_heap_frame(e)->hdr, v_obj(r[ip->a]));
+    ip++; DISPATCH();
+  }
+  OP(BC_JMP): ip = code + ip->b; DISPATCH();
+  OP(BC_LOOP): tier_backedge(); gc_safepoint(&vm->gc); ip = code + ip->b; DISPATCH();
+  OP(BC_JMPF): ip = (v_kind(r[ip->a])==VAL_BOOL && v_as_bool(r[ip->a])) ? ip+1 : code + ip->b; DISPATCH();
+  OP(BC_CALL): r[ip->a] = invoke(vm, env, r[ip->b], &r[ip->b+1], ip->c); ip++; DISPATCH();
+  OP(BC_CALLG): r[ip->a] = invoke(vm, env, *cells[ip->d], &r[ip->b], ip->c); ip++; DISPATCH();
+#define BC_BINARY(opc, fn, expr) \
+  OP(opc): { \
+    Value x = r[ip->b], y = r[ip->c]; \
+    if (v_kind(x)==VAL_INT && v_kind(y)==VAL_INT && is_native(cells[ip->d], fn)) r[ip->a] = expr; \
+    else r[ip->a] = invoke2(vm, env, *cells[ip->d], x, y); \
+    ip++; DISPATCH(); \
+  }
+  BC_BINARY(BC_ADD, rt_add, v_int(v_as_int(x) + v_as_int(y)))
+  BC_BINARY(BC_SUB, rt_sub, v_int(v_as_int(x) - v_as_int(y)))
+  BC_BINARY(BC_MUL, rt_mul, v_int(v_as_int(x) * v_as_int(y)))
+  BC_BINARY(BC_LT, rt_lt, v_bool(v_as_int(x) < v_as_int(y)))
+  BC_BINARY(BC_LE, rt_le, v_bool(v_as_int(x) <= v_as_int(y)))
+  BC_BINARY(BC_GT, rt_gt, v_bool(v_as_int(x) > v_as_int(y)))
+  BC_BINARY(BC_GE, rt_ge, v_bool(v_as_int(x) >= v_as_int(y)))
+  BC_BINARY(BC_EQ, rt_eq, v_bool(v_as_int(x) == v_as_int(y)))
+#undef BC_BINARY
+#define BC_BRANCH(opc, fn, cmp) \
+  OP(opc): { \
+    Value x = r[ip->a], y = r[ip->b]; int t; \
+    if (v_kind(x)==VAL_INT && v_kind(y)==VAL_INT && is_native(cells[ip->d], fn)) t = v_as_int(x) cmp v_as_int(y); \
+    else { Value v = invoke2(vm, env, *cells[ip->d], x, y); t = v_kind(v)==VAL_BOOL && v_as_bool(v); } \
+    ip = t ? ip+1 : code + ip->c; DISPATCH(); \
+  }
+  BC_BRANCH(BC_JNLT, rt_lt, <)
+  BC_BRANCH(BC_JNLE, rt_le, <=)
+  BC_BRANCH(BC_JNGT, rt_gt, >)
+  BC_BRANCH(BC_JNGE, rt_ge, >=)
+  BC_BRANCH(BC_JNEQ, rt_eq, ==)
+#undef BC_BRANCH
+  OP(BC_RET): return r[ip->a];
+#ifndef BC_COMPUTED_GOTO
+  default: return v_unit();
+  }
+#endif
+#undef OP
+#undef DISPATCH
+}
+
+int bc_call(VM *vm, Closure *cl, Value *args, int nargs, Value *out) {
+  Node *fn = (Node*)cl->fn_node;
+  BcProto *p = __atomic_load_n(&fn->as.list.bc, __ATOMIC_ACQUIRE);
+  if (!p) {
+    // Spawned threads may race to compile the same fn; the loser discards its copy
+    BcProto *fresh = bc_compile(fn), *expected = NULL;
+    if (__atomic_compare_exchange_n(&fn->as.list.bc, &expected, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) p = fresh;
+    else { proto_free(fresh); p = expected; }
+  }
+  if (!p->code) return 0;
+  Value *regs = (Value*)alloca(sizeof(Value)*(size_t)p->nregs);
+  for (int32_t i=0;i<p->nregs;i++) regs[i] = v_unit();
+  int nbind = nargs<p->nparams ? nargs : p->nparams;
+  for (int i=0;i<nbind;i++) if (p->param_slots[i]>=0) regs[p->param_slots[i]] = args[i];
+  // cl may move at the safepoint; its env is a captured frame or the globals, which do not
+  Env *env = cl->env;
+  GcRoot root; gc_push_root(&root, regs, p->nregs, env);
+  gc_safepoint(&vm->gc);
+  *out = run(vm, env, p, regs);
+  gc_pop_root(&root);
+  return 1;
+}
@@ -1,101 +1,426 @@
-#ifndef _POSIX_C_SOURCE
-#define _POSIX_C_SOURCE 200809L
-#endif
 #include "thread.h"
 #include <stdlib.h>
+#include <string.h>
+
+// Bounded MPMC channel: a ring of sequence-numbered slots holding messages
+// inline (Vyukov's queue). A slot's sequence is twice the position it is
+// next free for, plus one while it holds that position's message; the
+// doubling keeps "full" and "free" apart when there is a single slot. A
+// sender claims the slot at tail when it is free for that position and
+// publishes the message by setting the low bit; a receiver takes the slot
+// at head once the bit is set and frees it for the position a lap later.
+// Neither takes a lock.
+//
+// A sender finding the ring full, or a receiver finding it empty, spins a
+// little when there is another CPU to make progress meanwhile, then parks as
+// an RtWaiter. The other side only takes the wait queue lock when the parked
+// count says someone is there, and wakes one waiter to retry.
+//
+// A waiter is queued through a WaitNode, so select can queue one waiter on
+// every channel it waits for; the first channel to claim it wins. Receivers
+// parking on a rendezvous channel wake a parked sender, since a select only
+// sends there once a receiver is waiting.
+//
+// A rendezvous channel (capacity 0) is a one-slot ring whose sender also
+// waits until its message is taken. If it times out first, it takes the
+// message back by receiving it itself, which only succeeds if no receiver
+// got there first.
 
-#if defined(_WIN32)
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#define CHAN_SPIN 32
+#define CACHE_LINE 64
+
+typedef struct WaitNode { struct WaitNode *next; RtWaiter *w; } WaitNode;
+typedef struct WaitQueue { WaitNode *head, *tail; } WaitQueue;
 
 typedef struct Channel {
-  CRITICAL_SECTION mu;
-  CONDITION_VARIABLE cv_send;
-  CONDITION_VARIABLE cv_recv;
-  void **buf;
-  size_t cap, head, tail, count;
+  _Alignas(CACHE_LINE) size_t tail; // next position to send to
+  _Alignas(CACHE_LINE) size_t head; // next position to receive from
+  _Alignas(CACHE_LINE) int nsendq;  // parked senders, receivers and rendezvous senders
+  int nrecvq, nackq;
+  RtSpin lock;                      // guards the wait queues
+  WaitQueue sendq, recvq, ackq;
+  size_t cap, elem_size, stride;
+  bool pow2, rendezvous;
+  int spin;                         // tries before parking
+  char *slots;                      // cap slots of stride bytes: a size_t sequence, then the message
 } Channel;
 
-Channel *rt_channel_new(size_t capacity) {
-  Channel *c = (Channel*)malloc(sizeof(Channel));
-  InitializeCriticalSection(&c->mu);
-  InitializeConditionVariable(&c->cv_send);
-  InitializeConditionVariable(&c->cv_recv);
-  c->buf = (void**)malloc(sizeof(void*)*capacity);
-  c->cap=capacity; c->head=c->tail=c->count=0; return c;
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
 }
-void rt_channel_free(Channel *c) {
-  DeleteCriticalSection(&c->mu);
-  free(c->buf); free(c);
+
+static inline char *slot_at(Channel *c, size_t pos) {
+  return c->slots + (c->pow2 ? pos & (c->cap-1) : pos % c->cap) * c->stride;
 }
-static BOOL wait_ms(CONDITION_VARIABLE *cv, CRITICAL_SECTION *mu, int64_t ms) {
-  if (ms<0) { SleepConditionVariableCS(cv, mu, INFINITE); return TRUE; }
-  return SleepConditionVariableCS(cv, mu, (DWORD)ms);
+static inline size_t *slot_seq(char *s) { return (size_t*)s; }
+static inline void *slot_data(char *s) { return s + sizeof(size_t); }
+
+Channel *rt_channel_new(size_t capacity, size_t elem_size) {
+  bool rendezvous = capacity==0;
+  if (rendezvous) capacity = 1;
+  size_t sz = (sizeof(Channel) + CACHE_LINE-1) / CACHE_LINE * CACHE_LINE;
+  Channel *c = (Channel*)aligned_alloc(CACHE_LINE, sz);
+  memset(c, 0, sizeof(Channel));
+  c->cap = capacity; c->elem_size = elem_size;
+  c->stride = (sizeof(size_t) + elem_size + 7) & ~(size_t)7;
+  c->pow2 = (capacity & (capacity-1))==0; c->rendezvous = rendezvous;
+  c->spin = rt_cpu_count()>1 ? CHAN_SPIN : 0;
+  c->slots = (char*)malloc(c->stride * capacity);
+  for (size_t i=0;i<capacity;i++) *slot_seq(c->slots + i*c->stride) = 2*i;
+  return c;
 }
-bool rt_channel_send(Channel *c, void *msg, int64_t timeout_ms) {
-  EnterCriticalSection(&c->mu);
-  while (c->count==c->cap) { if (!wait_ms(&c->cv_send, &c->mu, timeout_ms)) { LeaveCriticalSection(&c->mu); return false; } }
-  c->buf[c->tail] = msg; c->tail = (c->tail+1)%c->cap; c->count++;
-  WakeConditionVariable(&c->cv_recv);
-  LeaveCriticalSection(&c->mu); return true;
+void rt_channel_free(Channel *c) { free(c->slots); free(c); }
+
+static bool try_send(Channel *c, const void *elem, size_t *sent) {
+  size_t pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    char *s = slot_at(c, pos);
+    intptr_t dif = (intptr_t)__atomic_load_n(slot_seq(s), __ATOMIC_ACQUIRE) - (intptr_t)(2*pos);
+    if (dif==0) {
+      if (__atomic_compare_exchange_n(&c->tail, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        memcpy(slot_data(s), elem, c->elem_size);
+        __atomic_store_n(slot_seq(s), 2*pos+1, __ATOMIC_RELEASE);
+        *sent = pos; return true;
+      }
+    } else if (dif<0) return false; // full: the slot still holds the message from a lap ago
+    else pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+  }
 }
-void *rt_channel_recv(Channel *c, int64_t timeout_ms) {
-  EnterCriticalSection(&c->mu);
-  while (c->count==0) { if (!wait_ms(&c->cv_recv, &c->mu, timeout_ms)) { LeaveCriticalSection(&c->mu); return NULL; } }
-  void *msg = c->buf[c->head]; c->head=(c->head+1)%c->cap; c->count--; 
-  WakeConditionVariable(&c->cv_send);
-  LeaveCriticalSection(&c->mu); return msg;
+
+static bool try_recv(Channel *c, void *out) {
+  size_t pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+  for (;;) {
+    char *s = slot_at(c, pos);
+    intptr_t dif = (intptr_t)__atomic_load_n(slot_seq(s), __ATOMIC_ACQUIRE) - (intptr_t)(2*pos+1);
+    if (dif==0) {
+      if (__atomic_compare_exchange_n(&c->head, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        memcpy(out, slot_data(s), c->elem_size);
+        __atomic_store_n(slot_seq(s), 2*(pos + c->cap), __ATOMIC_RELEASE);
+        return true;
+      }
+    } else if (dif<0) return false; // empty
+    else pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+  }
 }
 
-#else
+// Take back the message sent at pos, unless a receiver already has it
+static bool retract(Channel *c, size_t pos) {
+  size_t expect = pos;
+  if (!__atomic_compare_exchange_n(&c->head, &expect, pos+1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return false;
+  __atomic_store_n(slot_seq(slot_at(c, pos)), 2*(pos + c->cap), __ATOMIC_RELEASE);
+  return true;
+}
 
-#include <pthread.h>
-#include <time.h>
+// Batched forms: claim up to n consecutive positions with a single CAS
+static size_t try_send_n(Channel *c, const char *elems, size_t n) {
+  size_t pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    size_t k = 0;
+    while (k<n && k<c->cap && __atomic_load_n(slot_seq(slot_at(c, pos+k)), __ATOMIC_ACQUIRE)==2*(pos+k)) k++;
+    if (k==0) {
+      intptr_t dif = (intptr_t)__atomic_load_n(slot_seq(slot_at(c, pos)), __ATOMIC_ACQUIRE) - (intptr_t)(2*pos);
+      if (dif<0) return 0;
+      pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (!__atomic_compare_exchange_n(&c->tail, &pos, pos+k, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) continue;
+    for (size_t i=0;i<k;i++) {
+      char *s = slot_at(c, pos+i);
+      memcpy(slot_data(s), elems + i*c->elem_size, c->elem_size);
+      __atomic_store_n(slot_seq(s), 2*(pos+i)+1, __ATOMIC_RELEASE);
+    }
+    return k;
+  }
+}
 
-typedef struct Channel {
-  pthread_mutex_t mu;
-  pthread_cond_t cv_send;
-  pthread_cond_t cv_recv;
-  void **buf;
-  size_t cap, head, tail, count;
-} Channel;
+static size_t try_recv_n(Channel *c, char *out, size_t n) {
+  size_t pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+  for (;;) {
+    size_t k = 0;
+    while (k<n && k<c->cap && __atomic_load_n(slot_seq(slot_at(c, pos+k)), __ATOMIC_ACQUIRE)==2*(pos+k)+1) k++;
+    if (k==0) {
+      intptr_t dif = (intptr_t)__atomic_load_n(slot_seq(slot_at(c, pos)), __ATOMIC_ACQUIRE) - (intptr_t)(2*pos+1);
+      if (dif<0) return 0;
+      pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (!__atomic_compare_exchange_n(&c->head, &pos, pos+k, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) continue;
+    for (size_t i=0;i<k;i++) {
+      char *s = slot_at(c, pos+i);
+      memcpy(out + i*c->elem_size, slot_data(s), c->elem_size);
+      __atomic_store_n(slot_seq(s), 2*(pos+i + c->cap), __ATOMIC_RELEASE);
+    }
+    return k;
+  }
+}
 
-Channel *rt_channel_new(size_t capacity) {
-  Channel *c = (Channel*)malloc(sizeof(Channel));
-  pthread_mutex_init(&c->mu, NULL);
-  pthread_cond_init(&c->cv_send, NULL);
-  pthread_cond_init(&c->cv_recv, NULL);
-  c->buf = (void**)malloc(sizeof(void*)*capacity);
-  c->cap=capacity; c->head=c->tail=c->count=0; return c;
+// Park conditions; the position only matters to taken
+static bool can_send(Channel *c, size_t unused) {
+  (void)unused; size_t pos = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(slot_seq(slot_at(c, pos)), __ATOMIC_ACQUIRE)==2*pos;
 }
-void rt_channel_free(Channel *c) {
-  pthread_mutex_destroy(&c->mu);
-  pthread_cond_destroy(&c->cv_send);
-  pthread_cond_destroy(&c->cv_recv);
-  free(c->buf); free(c);
+static bool can_recv(Channel *c, size_t unused) {
+  (void)unused; size_t pos = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(slot_seq(slot_at(c, pos)), __ATOMIC_ACQUIRE)==2*pos+1;
 }
+static bool taken(Channel *c, size_t pos) { return __atomic_load_n(&c->head, __ATOMIC_ACQUIRE) > pos; }
 
-static int wait_ms(pthread_cond_t *cv, pthread_mutex_t *mu, int64_t ms) {
-  if (ms<0) return pthread_cond_wait(cv, mu);
-  struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
-  ts.tv_sec += ms/1000; ts.tv_nsec += (ms%1000)*1000000;
-  if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
-  return pthread_cond_timedwait(cv, mu, &ts);
+static void wq_push(WaitQueue *q, WaitNode *e) {
+  e->next = NULL;
+  if (q->tail) q->tail->next = e; else q->head = e;
+  q->tail = e;
+}
+static WaitNode *wq_pop(WaitQueue *q) {
+  WaitNode *e = q->head;
+  if (e) { q->head = e->next; if (!q->head) q->tail = NULL; }
+  return e;
+}
+static bool wq_remove(WaitQueue *q, WaitNode *e) {
+  WaitNode *prev = NULL;
+  for (WaitNode *it=q->head; it; prev=it, it=it->next) {
+    if (it!=e) continue;
+    if (prev) prev->next = e->next; else q->head = e->next;
+    if (q->tail==e) q->tail = prev;
+    return true;
+  }
+  return false;
 }
 
-bool rt_channel_send(Channel *c, void *msg, int64_t timeout_ms) {
-  pthread_mutex_lock(&c->mu);
-  while (c->count==c->cap) { if (wait_ms(&c->cv_send, &c->mu, timeout_ms)!=0) { pthread_mutex_unlock(&c->mu); return false; } }
-  c->buf[c->tail] = msg; c->tail = (c->tail+1)%c->cap; c->count++;
-  pthread_cond_signal(&c->cv_recv);
-  pthread_mutex_unlock(&c->mu); return true;
+// Wake one parked waiter on q, if there is one; false if none was parked.
+// The fence pairs with the one in enqueue: either the waiter sees the slot
+// just published or this sees its count.
+static bool wake_one(Channel *c, WaitQueue *q, int *n) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(n, __ATOMIC_RELAXED)) return false;
+  RtWake k; bool woke = false;
+  rt_spin_lock(&c->lock);
+  for (WaitNode *e; !woke && (e = wq_pop(q)); ) {
+    __atomic_sub_fetch(n, 1, __ATOMIC_RELAXED);
+    woke = rt_waiter_claim(e->w, &k);
+  }
+  rt_spin_unlock(&c->lock);
+  if (woke) rt_waiter_notify(&k);
+  return woke;
 }
-void *rt_channel_recv(Channel *c, int64_t timeout_ms) {
-  pthread_mutex_lock(&c->mu);
-  while (c->count==0) { if (wait_ms(&c->cv_recv, &c->mu, timeout_ms)!=0) { pthread_mutex_unlock(&c->mu); return NULL; } }
-  void *msg = c->buf[c->head]; c->head=(c->head+1)%c->cap; c->count--; 
-  pthread_cond_signal(&c->cv_send);
-  pthread_mutex_unlock(&c->mu); return msg;
+static void wake_n(Channel *c, WaitQueue *q, int *n, size_t count) {
+  for (size_t i=0; i<count && wake_one(c, q, n); i++) {}
 }
 
-#endif
+// Queue e on q; false (and not queued) if ready(c, pos) already holds
+static bool enqueue(Channel *c, WaitQueue *q, int *n, WaitNode *e, bool (*ready)(Channel*, size_t), size_t pos) {
+  rt_spin_lock(&c->lock);
+  wq_push(q, e);
+  __atomic_add_fetch(n, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (ready(c, pos)) {
+    wq_remove(q, e); __atomic_sub_fetch(n, 1, __ATOMIC_RELAXED);
+    rt_spin_unlock(&c->lock); return false;
+  }
+  rt_spin_unlock(&c->lock);
+  return true;
+}
+
+// Unlink e unless a waker already popped it
+static void dequeue(Channel *c, WaitQueue *q, int *n, WaitNode *e) {
+  rt_spin_lock(&c->lock);
+  if (wq_remove(q, e)) __atomic_sub_fetch(n, 1, __ATOMIC_RELAXED);
+  rt_spin_unlock(&c->lock);
+}
+
+// Park on q until woken, ready(c, pos) holds or the timeout passes
+static void park(Channel *c, WaitQueue *q, int *n, bool (*ready)(Channel*, size_t), size_t pos, int64_t timeout_ms) {
+  RtWaiter w; rt_waiter_init(&w);
+  WaitNode e = { NULL, &w };
+  if (!enqueue(c, q, n, &e, ready, pos)) return;
+  if (c->rendezvous && q==&c->recvq) wake_one(c, &c->sendq, &c->nsendq);
+  if (!rt_waiter_block(&w, timeout_ms)) dequeue(c, q, n, &e);
+}
+
+// Wait for the receiver of a rendezvous message sent at pos
+static bool await_taken(Channel *c, size_t pos, int64_t deadline) {
+  for (int spin=0; !taken(c, pos); spin++) {
+    if (spin < c->spin) { cpu_relax(); continue; }
+    int64_t left = deadline<0 ? -1 : deadline - rt_now_ms();
+    if (deadline>=0 && left<=0) {
+      if (!retract(c, pos)) return true;
+      wake_one(c, &c->sendq, &c->nsendq);
+      return false;
+    }
+    park(c, &c->ackq, &c->nackq, taken, pos, left);
+  }
+  return true;
+}
+
+// Wake the other side after a message went in or out
+static bool sent(Channel *c, size_t pos, int64_t deadline) {
+  wake_one(c, &c->recvq, &c->nrecvq);
+  return !c->rendezvous || await_taken(c, pos, deadline);
+}
+static void received(Channel *c, size_t count) {
+  if (c->rendezvous) wake_n(c, &c->ackq, &c->nackq, count);
+  wake_n(c, &c->sendq, &c->nsendq, count);
+}
+
+bool rt_channel_send(Channel *c, const void *elem, int64_t timeout_ms) {
+  int64_t deadline = timeout_ms<0 ? -1 : rt_now_ms() + timeout_ms;
+  for (int spin=0;; spin++) {
+    size_t pos;
+    if (try_send(c, elem, &pos)) return sent(c, pos, deadline);
+    if (timeout_ms==0) return false;
+    if (spin < c->spin) { cpu_relax(); continue; }
+    int64_t left = deadline<0 ? -1 : deadline - rt_now_ms();
+    if (deadline>=0 && left<=0) return false;
+    park(c, &c->sendq, &c->nsendq, can_send, 0, left);
+  }
+}
+
+bool rt_channel_recv(Channel *c, void *out, int64_t timeout_ms) {
+  int64_t deadline = timeout_ms<0 ? -1 : rt_now_ms() + timeout_ms;
+  for (int spin=0;; spin++) {
+    if (try_recv(c, out)) { received(c, 1); return true; }
+    if (timeout_ms==0) return false;
+    if (spin < c->spin) { cpu_relax(); continue; }
+    int64_t left = deadline<0 ? -1 : deadline - rt_now_ms();
+    if (deadline>=0 && left<=0) return false;
+    park(c, &c->recvq, &c->nrecvq, can_recv, 0, left);
+  }
+}
+
+size_t rt_channel_send_many(Channel *c, const void *elems, size_t n, int64_t timeout_ms) {
+  const char *p = (const char*)elems;
+  int64_t deadline = timeout_ms<0 ? -1 : rt_now_ms() + timeout_ms;
+  size_t done = 0;
+  // Every rendezvous message waits for its own receiver
+  if (c->rendezvous) {
+    for (; done<n; done++) {
+      int64_t left = deadline<0 ? -1 : deadline - rt_now_ms();
+      if (deadline>=0 && left<0) left = 0;
+      if (!rt_channel_send(c, p + done*c->elem_size, left)) break;
+    }
+    return done;
+  }
+  for (int spin=0; done<n; spin++) {
+    size_t k = try_send_n(c, p + done*c->elem_size, n-done);
+    if (k) { done += k; wake_n(c, &c->recvq, &c->nrecvq, k); spin = 0; continue; }
+    if (timeout_ms==0) break;
+    if (spin < c->spin) { cpu_relax(); continue; }
+    int64_t left = deadline<0 ? -1 : deadline - rt_now_ms();
+    if (deadline>=0 && left<=0) break;
+    park(c, &c->sendq, &c->nsendq, can_send, 0, left);
+  }
+  return done;
+}
+
+size_t rt_channel_recv_many(Channel *c, void *out, size_t max, int64_t timeout_ms) {
+  int64_t deadline = timeout_ms<0 ? -1 : rt_now_ms() + timeout_ms;
+  if (max==0) return 0;
+  for (int spin=0;; spin++) {
+    size_t k = try_recv_n(c, (char*)out, max);
+    if (k) { received(c, k); return k; }
+    if (timeout_ms==0) return 0;
+    if (spin < c->spin) { cpu_relax(); continue; }
+    int64_t left = deadline<0 ? -1 : deadline - rt_now_ms();
+    if (deadline>=0 && left<=0) return 0;
+    park(c, &c->recvq, &c->nrecvq, can_recv, 0, left);
+  }
+}
+
+size_t rt_channel_slots(Channel *c) { return c->cap; }
+size_t rt_channel_len(Channel *c) {
+  size_t head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE), tail = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+  return tail>head ? tail-head : 0;
+}
+
+// ---- select ----
+
+// A rendezvous send from select waits for a parked receiver: it commits to
+// the case once the message is out, so it should not sit there unclaimed
+static bool can_handoff(Channel *c, size_t pos) {
+  return can_send(c, pos) && __atomic_load_n(&c->nrecvq, __ATOMIC_RELAXED)>0;
+}
+
+static bool select_try(RtSelectCase *sc, int64_t deadline) {
+  Channel *c = sc->chan;
+  if (!sc->send) {
+    if (!try_recv(c, sc->elem)) return false;
+    received(c, 1); return true;
+  }
+  size_t pos;
+  if (c->rendezvous && !can_handoff(c, 0)) return false;
+  return try_send(c, sc->elem, &pos) && sent(c, pos, deadline);
+}
+
+static WaitQueue *select_queue(RtSelectCase *sc, int **n) {
+  Channel *c = sc->chan;
+  if (sc->send) { *n = &c->nsendq; return &c->sendq; }
+  *n = &c->nrecvq; return &c->recvq;
+}
+
+// Queue one waiter on every case and block until a channel claims it. Stops
+// early if a case turns out ready while queueing.
+static void select_park(RtSelectCase *cs, int n, WaitNode *nodes, int64_t timeout_ms) {
+  RtWaiter w; rt_waiter_init(&w);
+  int queued = 0; bool ready = false;
+  for (; queued<n && !ready; queued++) {
+    RtSelectCase *sc = &cs[queued]; Channel *c = sc->chan; int *cnt;
+    WaitQueue *q = select_queue(sc, &cnt);
+    nodes[queued].w = &w;
+    bool (*pred)(Channel*, size_t) = !sc->send ? can_recv : c->rendezvous ? can_handoff : can_send;
+    if (!enqueue(c, q, cnt, &nodes[queued], pred, 0)) { ready = true; queued--; continue; }
+    if (c->rendezvous && !sc->send) wake_one(c, &c->sendq, &c->nsendq);
+  }
+  // Once a case was found ready, claim w ourselves so wakers popping our
+  // other nodes move on to the next waiter. If one claimed it first, its
+  // notification is still on the way and has to be taken.
+  RtWake k;
+  if (!ready || !rt_waiter_claim(&w, &k)) rt_waiter_block(&w, timeout_ms);
+  for (int i=0;i<queued;i++) {
+    int *cnt; WaitQueue *q = select_queue(&cs[i], &cnt);
+    dequeue(cs[i].chan, q, cnt, &nodes[i]);
+  }
+}
+
+// A waker claims one waiter per message. If select took another case, pass
+// the wakeup on so a message is not left behind with its waiters parked.
+static void select_pass_on(RtSelectCase *cs, int n, int taken_case) {
+  for (int i=0;i<n;i++) {
+    if (i==taken_case) continue;
+    Channel *c = cs[i].chan;
+    if (cs[i].send) { if (can_send(c, 0)) wake_one(c, &c->sendq, &c->nsendq); }
+    else if (can_recv(c, 0)) wake_one(c, &c->recvq, &c->nrecvq);
+  }
+}
+
+int rt_channel_select(RtSelectCase *cs, int n, int64_t timeout_ms) {
+  static _Thread_local unsigned rotor;
+  if (n<=0) { if (timeout_ms>0) { RtWaiter w; rt_waiter_init(&w); rt_waiter_block(&w, timeout_ms); } return -1; }
+  int64_t deadline = timeout_ms<0 ? -1 : rt_now_ms() + timeout_ms;
+  WaitNode stack[8], *nodes = n<=8 ? stack : (WaitNode*)malloc(sizeof(WaitNode)*(size_t)n);
+  int spins = rt_cpu_count()>1 ? CHAN_SPIN : 0, got = -1;
+  bool parked = false;
+  // Start at a different case each time so a busy channel does not starve the rest
+  unsigned start = rotor++;
+  for (int spin=0; got<0; spin++) {
+    for (int k=0;k<n && got<0;k++) {
+      int i = (int)((start + (unsigned)k) % (unsigned)n);
+      if (select_try(&cs[i], deadline)) got = i;
+    }
+    if (got>=0 || timeout_ms==0) break;
+    if (spin < spins) { cpu_relax(); continue; }
+    int64_t left = deadline<0 ? -1 : deadline - rt_now_ms();
+    if (deadline>=0 && left<=0) break;
+    select_park(cs, n, nodes, left);
+    parked = true;
+  }
+  if (parked) select_pass_on(cs, n, got);
+  if (nodes!=stack) free(nodes);
+  return got;
+}
+
+void rt_channel_each(Channel *c, void (*fn)(void *elem, void *ud), void *ud) {
+  for (size_t pos=c->head; pos!=c->tail; pos++) fn(slot_data(slot_at(c, pos)), ud);
+}
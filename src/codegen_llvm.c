@@ -29,6 +29,8 @@
 #include <llvm-c/Target.h>
 #include <llvm-c/TargetMachine.h>
 #include <llvm-c/Transforms/PassBuilder.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
 #endif
 
 // ============================================================================
@@ -45,6 +47,20 @@ static int sym_eq(const char *a, size_t alen, const char *b, size_t blen) {
   return alen == blen && strncmp(a, b, alen) == 0;
 }
 
+// Whether n contains [set! name ...]. Locals it finds get a stack slot
+// instead of an SSA value; shadowing is ignored, which only costs a slot.
+static int assigns_local(Node *n, const char *name, size_t len) {
+  if (n->kind != N_LIST) return 0;
+  if (n->as.list.count == 3 && is_sym(n->as.list.items[0], "set!")) {
+    Node *target = n->as.list.items[1];
+    if (target->kind == N_SYMBOL && sym_eq(target->as.sym.ptr, target->as.sym.len, name, len)) return 1;
+  }
+  for (size_t i = 0; i < n->as.list.count; i++) {
+    if (assigns_local(n->as.list.items[i], name, len)) return 1;
+  }
+  return 0;
+}
+
 // ============================================================================
 // Text IR emission helpers (for USE_LLVM=0)
 // ============================================================================
@@ -105,6 +121,27 @@ static int new_label(CgContext *ctx) {
   return ctx->label_id++;
 }
 
+// Start block prefix<id>, remembering it as the predecessor for phis
+static void ir_label(CgContext *ctx, const char *prefix, int id) {
+  snprintf(ctx->block, sizeof(ctx->block), "%s%d", prefix, id);
+  ir_appendf(ctx, "%s:\n", ctx->block);
+}
+
+// Stack slot for a mutable local in the entry block, where mem2reg promotes
+// it; cg_function_text splices the block's allocas in at the end
+static int ir_slot(CgContext *ctx, const char *llvm_ty) {
+  int t = new_tmp(ctx);
+  char line[96];
+  int n = snprintf(line, sizeof(line), "  %%t%d = alloca %s\n", t, llvm_ty);
+  if (ctx->entry_len + (size_t)n + 1 > ctx->entry_cap) {
+    ctx->entry_cap = (ctx->entry_cap + (size_t)n + 1) * 2;
+    ctx->entry_buf = (char*)realloc(ctx->entry_buf, ctx->entry_cap);
+  }
+  memcpy(ctx->entry_buf + ctx->entry_len, line, (size_t)n + 1);
+  ctx->entry_len += (size_t)n;
+  return t;
+}
+
 // ============================================================================
 // Context and scope management
 // ============================================================================
@@ -148,6 +185,7 @@ void cg_context_free(CgContext *ctx) {
 
   free(ctx->ir_buf);
   free(ctx->globals_buf);
+  free(ctx->entry_buf);
   free(ctx->functions);
   free(ctx);
 }
@@ -300,9 +338,32 @@ static int cg_symbol_text(CgContext *ctx, Node *node) {
             (int)node->as.sym.len, node->as.sym.ptr);
     return -1;
   }
+  if (sym->is_slot) {
+    int t = new_tmp(ctx);
+    const char *llvm_ty = type_to_llvm(sym->type);
+    ir_appendf(ctx, "  %%t%d = load %s, %s* %%t%d\n", t, llvm_ty, llvm_ty, (int)(intptr_t)sym->value);
+    return t;
+  }
   return (int)(intptr_t)sym->value;
 }
 
+// Integer / and mod never trap, like rt_div and rt_mod: a zero divisor gives
+// 0 and INT64_MIN / -1 wraps. Both divide by 1 instead, so sdiv and srem never
+// see such a divisor; x mod 1 is already the 0 wanted for -1.
+static void cg_idiv_text(CgContext *ctx, int t, int l, int r, int rem) {
+  int is0 = new_tmp(ctx), neg1 = new_tmp(ctx), odd = new_tmp(ctx), d = new_tmp(ctx);
+  ir_appendf(ctx, "  %%t%d = icmp eq i64 %%t%d, 0\n", is0, r);
+  ir_appendf(ctx, "  %%t%d = icmp eq i64 %%t%d, -1\n", neg1, r);
+  ir_appendf(ctx, "  %%t%d = or i1 %%t%d, %%t%d\n", odd, is0, neg1);
+  ir_appendf(ctx, "  %%t%d = select i1 %%t%d, i64 1, i64 %%t%d\n", d, odd, r);
+  if (rem) { ir_appendf(ctx, "  %%t%d = srem i64 %%t%d, %%t%d\n", t, l, d); return; }
+  int q = new_tmp(ctx), neg = new_tmp(ctx), w = new_tmp(ctx);
+  ir_appendf(ctx, "  %%t%d = sdiv i64 %%t%d, %%t%d\n", q, l, d);
+  ir_appendf(ctx, "  %%t%d = sub i64 0, %%t%d\n", neg, l);
+  ir_appendf(ctx, "  %%t%d = select i1 %%t%d, i64 %%t%d, i64 %%t%d\n", w, neg1, neg, q);
+  ir_appendf(ctx, "  %%t%d = select i1 %%t%d, i64 0, i64 %%t%d\n", t, is0, w);
+}
+
 // Generate code for binary operations
 static int cg_binop_text(CgContext *ctx, const char *op, Node *left, Node *right, Type *ty) {
   int l = cg_expr_text(ctx, left);
@@ -331,9 +392,9 @@ static int cg_binop_text(CgContext *ctx, const char *op, Node *left, Node *right
     if (ty && ty->kind == TY_FLOAT)
       ir_appendf(ctx, "  %%t%d = fdiv %s %%t%d, %%t%d\n", t, llvm_ty, l, r);
     else
-      ir_appendf(ctx, "  %%t%d = sdiv %s %%t%d, %%t%d\n", t, llvm_ty, l, r);
+      cg_idiv_text(ctx, t, l, r, 0);
   } else if (strcmp(op, "%") == 0) {
-    ir_appendf(ctx, "  %%t%d = srem %s %%t%d, %%t%d\n", t, llvm_ty, l, r);
+    cg_idiv_text(ctx, t, l, r, 1);
   } else if (strcmp(op, "=") == 0) {
     if (left->ty && left->ty->kind == TY_FLOAT)
       ir_appendf(ctx, "  %%t%d = fcmp oeq double %%t%d, %%t%d\n", t, l, r);
@@ -365,7 +426,7 @@ static int cg_binop_text(CgContext *ctx, const char *op, Node *left, Node *right
     else
       ir_appendf(ctx, "  %%t%d = icmp ne i64 %%t%d, %%t%d\n", t, l, r);
   } else if (strcmp(op, "mod") == 0) {
-    ir_appendf(ctx, "  %%t%d = srem i64 %%t%d, %%t%d\n", t, l, r);
+    cg_idiv_text(ctx, t, l, r, 1);
   } else if (strcmp(op, "and") == 0) {
     ir_appendf(ctx, "  %%t%d = and i1 %%t%d, %%t%d\n", t, l, r);
   } else if (strcmp(op, "or") == 0) {
@@ -463,8 +524,8 @@ static int cg_if_text(CgContext *ctx, Node *list) {
   ir_appendf(ctx, "  br i1 %%t%d, label %%then%d, label %%else%d\n",
              cond, then_label, else_label);
 
-  // Then block
-  ir_appendf(ctx, "then%d:\n", then_label);
+  // Then block; nested control flow may leave it in another block
+  ir_label(ctx, "then", then_label);
   int then_val = cg_expr_text(ctx, then_node);
   int then_end_tmp = -1;
   if (!is_void) {
@@ -473,10 +534,12 @@ static int cg_if_text(CgContext *ctx, Node *list) {
       ir_appendf(ctx, "  %%t%d = add i64 0, 0\n", then_end_tmp);
     }
   }
+  char then_end[sizeof(ctx->block)];
+  memcpy(then_end, ctx->block, sizeof(then_end));
   ir_appendf(ctx, "  br label %%merge%d\n", merge_label);
 
   // Else block
-  ir_appendf(ctx, "else%d:\n", else_label);
+  ir_label(ctx, "else", else_label);
   int else_val = cg_expr_text(ctx, else_node);
   int else_end_tmp = -1;
   if (!is_void) {
@@ -485,10 +548,12 @@ static int cg_if_text(CgContext *ctx, Node *list) {
       ir_appendf(ctx, "  %%t%d = add i64 0, 0\n", else_end_tmp);
     }
   }
+  char else_end[sizeof(ctx->block)];
+  memcpy(else_end, ctx->block, sizeof(else_end));
   ir_appendf(ctx, "  br label %%merge%d\n", merge_label);
 
   // Merge block
-  ir_appendf(ctx, "merge%d:\n", merge_label);
+  ir_label(ctx, "merge", merge_label);
 
   // Only emit phi if result is not void
   if (is_void) {
@@ -497,8 +562,8 @@ static int cg_if_text(CgContext *ctx, Node *list) {
 
   int result = new_tmp(ctx);
   const char *llvm_ty = type_to_llvm(result_ty);
-  ir_appendf(ctx, "  %%t%d = phi %s [ %%t%d, %%then%d ], [ %%t%d, %%else%d ]\n",
-             result, llvm_ty, then_end_tmp, then_label, else_end_tmp, else_label);
+  ir_appendf(ctx, "  %%t%d = phi %s [ %%t%d, %%%s ], [ %%t%d, %%%s ]\n",
+             result, llvm_ty, then_end_tmp, then_end, else_end_tmp, else_end);
 
   return result;
 }
@@ -534,8 +599,17 @@ static int cg_let_text(CgContext *ctx, Node *list) {
 
     if (expr_node) {
       int val = cg_expr_text(ctx, expr_node);
-      cg_scope_define(ctx, name_node->as.sym.ptr, name_node->as.sym.len,
-                      (void*)(intptr_t)val, bind_ty);
+      if (assigns_local(list, name_node->as.sym.ptr, name_node->as.sym.len)) {
+        const char *llvm_ty = type_to_llvm(bind_ty);
+        int slot = ir_slot(ctx, llvm_ty);
+        ir_appendf(ctx, "  store %s %%t%d, %s* %%t%d\n", llvm_ty, val, llvm_ty, slot);
+        cg_scope_define(ctx, name_node->as.sym.ptr, name_node->as.sym.len,
+                        (void*)(intptr_t)slot, bind_ty);
+        ctx->scope->symbols->is_slot = 1;
+      } else {
+        cg_scope_define(ctx, name_node->as.sym.ptr, name_node->as.sym.len,
+                        (void*)(intptr_t)val, bind_ty);
+      }
     }
   }
 
@@ -549,6 +623,42 @@ static int cg_let_text(CgContext *ctx, Node *list) {
   return result;
 }
 
+// Generate code for while loop: [while cond body...], Unit
+static int cg_while_text(CgContext *ctx, Node *list) {
+  if (list->as.list.count < 2) {
+    fprintf(stderr, "codegen: while requires a condition\n");
+    return -1;
+  }
+  int label = new_label(ctx);
+  ir_appendf(ctx, "  br label %%while.cond%d\n", label);
+  ir_label(ctx, "while.cond", label);
+  int cond = cg_expr_text(ctx, list->as.list.items[1]);
+  if (cond < 0) return -1;
+  ir_appendf(ctx, "  br i1 %%t%d, label %%while.body%d, label %%while.end%d\n", cond, label, label);
+  ir_label(ctx, "while.body", label);
+  for (size_t i = 2; i < list->as.list.count; i++) {
+    cg_expr_text(ctx, list->as.list.items[i]);
+  }
+  ir_appendf(ctx, "  br label %%while.cond%d\n", label);
+  ir_label(ctx, "while.end", label);
+  return -1;
+}
+
+// Generate code for assignment: [set! name expr], Unit
+static int cg_set_text(CgContext *ctx, Node *list) {
+  Node *target = list->as.list.items[1];
+  CgSymbol *sym = target->kind == N_SYMBOL ? cg_scope_lookup(ctx, target->as.sym.ptr, target->as.sym.len) : NULL;
+  if (!sym || !sym->is_slot) {
+    fprintf(stderr, "codegen: set! needs a local variable\n");
+    return -1;
+  }
+  int val = cg_expr_text(ctx, list->as.list.items[2]);
+  if (val < 0) return -1;
+  const char *llvm_ty = type_to_llvm(sym->type);
+  ir_appendf(ctx, "  store %s %%t%d, %s* %%t%d\n", llvm_ty, val, llvm_ty, (int)(intptr_t)sym->value);
+  return -1;
+}
+
 // Generate code for do block
 static int cg_do_text(CgContext *ctx, Node *list) {
   int result = -1;
@@ -661,6 +771,8 @@ static int cg_list_text(CgContext *ctx, Node *list) {
     if (is_sym(head, "if")) return cg_if_text(ctx, list);
     if (is_sym(head, "let")) return cg_let_text(ctx, list);
     if (is_sym(head, "do")) return cg_do_text(ctx, list);
+    if (is_sym(head, "while")) return cg_while_text(ctx, list);
+    if (is_sym(head, "set!") && list->as.list.count == 3) return cg_set_text(ctx, list);
     if (is_sym(head, "def")) return -1;  // Handled at top level
     if (is_sym(head, "fn")) return -1;   // Closure creation (TODO)
     if (is_sym(head, "quote")) return -1;
@@ -726,6 +838,19 @@ static void cg_function_text(CgContext *ctx, Node *def) {
   }
   ir_append(ctx, ") {\n");
   ir_append(ctx, "entry:\n");
+  snprintf(ctx->block, sizeof(ctx->block), "entry");
+  ctx->entry_len = 0;
+  size_t entry_at = ctx->ir_len;
+
+  // Parameters that set! assigns live in slots
+  for (CgSymbol *sym = ctx->scope->symbols; sym; sym = sym->next) {
+    if (!assigns_local(fn_node, sym->name, sym->name_len)) continue;
+    const char *llvm_ty = type_to_llvm(sym->type);
+    int slot = ir_slot(ctx, llvm_ty);
+    ir_appendf(ctx, "  store %s %%t%d, %s* %%t%d\n", llvm_ty, (int)(intptr_t)sym->value, llvm_ty, slot);
+    sym->value = (void*)(intptr_t)slot;
+    sym->is_slot = 1;
+  }
 
   // Register function in scope for recursion
   cg_scope_define(ctx, name_node->as.sym.ptr, name_node->as.sym.len, NULL, fn_type);
@@ -752,6 +877,15 @@ static void cg_function_text(CgContext *ctx, Node *def) {
 
   ir_append(ctx, "}\n\n");
   cg_scope_pop(ctx);
+
+  // Allocas go first in the entry block
+  if (ctx->entry_len) {
+    ir_ensure_cap(ctx, ctx->entry_len + 1);
+    memmove(ctx->ir_buf + entry_at + ctx->entry_len, ctx->ir_buf + entry_at, ctx->ir_len - entry_at + 1);
+    memcpy(ctx->ir_buf + entry_at, ctx->entry_buf, ctx->entry_len);
+    ctx->ir_len += ctx->entry_len;
+    ctx->entry_len = 0;
+  }
 }
 
 // Find main function in program
@@ -781,13 +915,37 @@ static void register_functions(CgContext *ctx, Node *program) {
   }
 }
 
+// Triple of the machine sqale was compiled for; the LLVM path asks LLVM
+// instead (LLVMGetDefaultTargetTriple)
+static const char *cg_host_triple_text(void) {
+#if defined(__x86_64__) || defined(_M_X64)
+#define CG_ARCH "x86_64"
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define CG_ARCH "aarch64"
+#elif defined(__i386__) || defined(_M_IX86)
+#define CG_ARCH "i686"
+#else
+#define CG_ARCH "unknown"
+#endif
+#if defined(__APPLE__)
+  return CG_ARCH "-apple-macosx";
+#elif defined(_WIN32)
+  return CG_ARCH "-pc-windows-msvc";
+#elif defined(__linux__)
+  return CG_ARCH "-unknown-linux-gnu";
+#else
+  return CG_ARCH "-unknown-unknown";
+#endif
+#undef CG_ARCH
+}
+
 // Generate IR for entire program
 static void cg_program_text(CgContext *ctx, Node *program) {
   // Module header
   ir_append(ctx, "; ModuleID = 'sqale'\n");
   ir_appendf(ctx, "source_filename = \"%s\"\n",
              ctx->opts.module_name ? ctx->opts.module_name : "sqale");
-  ir_append(ctx, "target triple = \"x86_64-unknown-linux-gnu\"\n\n");
+  ir_appendf(ctx, "target triple = \"%s\"\n\n", cg_host_triple_text());
 
   // Runtime declarations
   emit_runtime_decls(ctx);
@@ -823,24 +981,168 @@ static void cg_program_text(CgContext *ctx, Node *program) {
 
 #if USE_LLVM
 
-// LLVM codegen context extension
+// LLVM codegen context extension. Unit values are NULL; the first construct
+// the backend does not lower is recorded in error, and lowering stops there.
 typedef struct {
   LLVMContextRef ctx;
   LLVMModuleRef module;
   LLVMBuilderRef builder;
   LLVMValueRef current_fn;
+  Node *program;
+  const CgJit *jit;   // tiering: functions it already holds are only declared
+  struct { const char *name; size_t len; Node *fn_node; LLVMValueRef fn; } *pending; // bodies to emit
+  size_t npending, cappending;
+  char error[256];
 } LLVMCg;
 
+static LLVMValueRef cg_fail(LLVMCg *llvm, Node *at, const char *fmt, ...) {
+  if (llvm->error[0]) return NULL;
+  char msg[200];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, args);
+  va_end(args);
+  if (at) snprintf(llvm->error, sizeof(llvm->error), "%zu:%zu: %s", at->line, at->col, msg);
+  else snprintf(llvm->error, sizeof(llvm->error), "%s", msg);
+  return NULL;
+}
+
+// NULL for types the backend has no representation for
 static LLVMTypeRef type_to_llvm_type(LLVMContextRef ctx, Type *ty) {
-  if (!ty) return LLVMInt64TypeInContext(ctx);
+  if (!ty) return NULL;
   switch (ty->kind) {
     case TY_INT: return LLVMInt64TypeInContext(ctx);
     case TY_FLOAT: return LLVMDoubleTypeInContext(ctx);
     case TY_BOOL: return LLVMInt1TypeInContext(ctx);
     case TY_STR: return LLVMPointerType(LLVMInt8TypeInContext(ctx), 0);
     case TY_UNIT: return LLVMVoidTypeInContext(ctx);
-    default: return LLVMInt64TypeInContext(ctx);
+    default: return NULL;
+  }
+}
+
+// Runtime shims called by generated code (src/runtime_llvm.c). The JIT binds
+// these names to the copies linked into this binary.
+// attrs: function attributes of the declaration. None of the shims unwind;
+// the string queries only read their arguments, so the optimizer may hoist,
+// merge or drop their calls.
+static const struct { const char *name; void *addr; const char *attrs; } cg_shims[] = {
+  { "sq_print_i64", (void*)sq_print_i64, "nounwind" },
+  { "sq_print_f64", (void*)sq_print_f64, "nounwind" },
+  { "sq_print_bool", (void*)sq_print_bool, "nounwind" },
+  { "sq_print_cstr", (void*)sq_print_cstr, "nounwind" },
+  { "sq_print_newline", (void*)sq_print_newline, "nounwind" },
+  { "sq_string_concat", (void*)sq_string_concat, "nounwind willreturn" },
+  { "sq_string_len", (void*)sq_string_len, "nounwind readonly argmemonly willreturn" },
+  { "sq_string_eq", (void*)sq_string_eq, "nounwind readonly argmemonly willreturn" },
+};
+
+// Add the space-separated enum attributes in attrs to f at idx
+static void cg_add_attrs(LLVMContextRef ctx, LLVMValueRef f, LLVMAttributeIndex idx, const char *attrs) {
+  while (*attrs) {
+    size_t len = strcspn(attrs, " ");
+    unsigned kind = LLVMGetEnumAttributeKindForName(attrs, len);
+    if (kind) LLVMAddAttributeAtIndex(f, idx, LLVMCreateEnumAttribute(ctx, kind, 0));
+    attrs += len;
+    while (*attrs == ' ') attrs++;
+  }
+}
+
+static LLVMValueRef cg_shim_call(LLVMCg *llvm, const char *name, LLVMTypeRef ret,
+                                 LLVMTypeRef *params, LLVMValueRef *args, unsigned n) {
+  LLVMValueRef f = LLVMGetNamedFunction(llvm->module, name);
+  if (!f) {
+    f = LLVMAddFunction(llvm->module, name, LLVMFunctionType(ret, params, n, 0));
+    for (size_t i = 0; i < sizeof(cg_shims) / sizeof(cg_shims[0]); i++) {
+      if (strcmp(cg_shims[i].name, name) == 0) cg_add_attrs(llvm->ctx, f, LLVMAttributeFunctionIndex, cg_shims[i].attrs);
+    }
+    // A fresh string nothing else points to
+    if (strcmp(name, "sq_string_concat") == 0) cg_add_attrs(llvm->ctx, f, LLVMAttributeReturnIndex, "noalias");
+  }
+  int is_void = LLVMGetTypeKind(ret) == LLVMVoidTypeKind;
+  return LLVMBuildCall2(llvm->builder, LLVMGlobalGetValueType(f), f, args, n, is_void ? "" : "calltmp");
+}
+
+static LLVMValueRef cg_print_cstr_llvm(LLVMCg *llvm, const char *s) {
+  LLVMTypeRef str_ty = LLVMPointerType(LLVMInt8TypeInContext(llvm->ctx), 0);
+  LLVMValueRef arg = LLVMBuildGlobalStringPtr(llvm->builder, s, ".str");
+  return cg_shim_call(llvm, "sq_print_cstr", LLVMVoidTypeInContext(llvm->ctx), &str_ty, &arg, 1);
+}
+
+// [fn ...] of the last toplevel [def name : T ...], if that is a function
+static Node *find_fn_def(Node *program, const char *name, size_t len) {
+  Node *found = NULL;
+  for (size_t i = 0; i < program->as.list.count; i++) {
+    Node *form = program->as.list.items[i];
+    if (form->kind != N_LIST || form->as.list.count < 5) continue;
+    if (!is_sym(form->as.list.items[0], "def")) continue;
+    Node *nm = form->as.list.items[1];
+    Node *fn_node = form->as.list.items[4];
+    if (nm->kind != N_SYMBOL || !sym_eq(nm->as.sym.ptr, nm->as.sym.len, name, len)) continue;
+    found = fn_node->kind == N_LIST && fn_node->as.list.count >= 3 &&
+            is_sym(fn_node->as.list.items[0], "fn") ? fn_node : NULL;
+  }
+  return found;
+}
+
+static bool cg_jit_has(const CgJit *jit, const char *name, size_t len);
+
+// LLVM function for a toplevel function, declared on first use and queued
+// for its body. SQALE's main becomes sqale_main, leaving main to the C entry
+// point. NULL if name is not a toplevel function. A direct call would
+// bypass a [set! name ...] anywhere in the program, so such names are refused.
+static LLVMValueRef cg_fn_ref_llvm(CgContext *ctx, LLVMCg *llvm, Node *at, const char *name, size_t len) {
+  for (int i = 0; i < ctx->fn_count; i++) {
+    if (sym_eq(ctx->functions[i].name, ctx->functions[i].name_len, name, len))
+      return (LLVMValueRef)ctx->functions[i].fn;
+  }
+  Node *fn_node = find_fn_def(llvm->program, name, len);
+  if (!fn_node) return NULL;
+  if (assigns_local(llvm->program, name, len))
+    return cg_fail(llvm, at, "%.*s is reassigned with set!", (int)len, name);
+
+  Type *fn_type = fn_node->ty;
+  if (!fn_type || fn_type->kind != TY_FUNC)
+    return cg_fail(llvm, at, "%.*s has no function type", (int)len, name);
+  LLVMTypeRef ret = type_to_llvm_type(llvm->ctx, fn_type->as.fn.ret);
+  if (!ret) return cg_fail(llvm, at, "%.*s returns %s", (int)len, name, ty_kind_name(fn_type->as.fn.ret->kind));
+  size_t arity = fn_type->as.fn.arity;
+  LLVMTypeRef *params = (LLVMTypeRef*)malloc(sizeof(LLVMTypeRef) * (arity ? arity : 1));
+  for (size_t i = 0; i < arity; i++) {
+    params[i] = type_to_llvm_type(llvm->ctx, fn_type->as.fn.params[i]);
+    if (!params[i] || LLVMGetTypeKind(params[i]) == LLVMVoidTypeKind) {
+      free(params);
+      return cg_fail(llvm, at, "%.*s takes a %s", (int)len, name, ty_kind_name(fn_type->as.fn.params[i]->kind));
+    }
+  }
+
+  char fname[256];
+  if (sym_eq(name, len, "main", 4)) snprintf(fname, sizeof(fname), "sqale_main");
+  else snprintf(fname, sizeof(fname), "%.*s", (int)len, name);
+  LLVMValueRef fn = LLVMAddFunction(llvm->module, fname, LLVMFunctionType(ret, params, (unsigned)arity, 0));
+  cg_add_attrs(llvm->ctx, fn, LLVMAttributeFunctionIndex, "nounwind");
+  free(params);
+
+  if (ctx->fn_count == ctx->fn_cap) {
+    ctx->fn_cap *= 2;
+    ctx->functions = realloc(ctx->functions, sizeof(*ctx->functions) * ctx->fn_cap);
+  }
+  ctx->functions[ctx->fn_count].name = name;
+  ctx->functions[ctx->fn_count].name_len = len;
+  ctx->functions[ctx->fn_count].fn = fn;
+  ctx->functions[ctx->fn_count].type = fn_type;
+  ctx->fn_count++;
+
+  if (llvm->jit && cg_jit_has(llvm->jit, name, len)) return fn;  // compiled by an earlier module
+  if (llvm->npending == llvm->cappending) {
+    llvm->cappending = llvm->cappending ? llvm->cappending * 2 : 8;
+    llvm->pending = realloc(llvm->pending, sizeof(*llvm->pending) * llvm->cappending);
   }
+  llvm->pending[llvm->npending].name = name;
+  llvm->pending[llvm->npending].len = len;
+  llvm->pending[llvm->npending].fn_node = fn_node;
+  llvm->pending[llvm->npending].fn = fn;
+  llvm->npending++;
+  return fn;
 }
 
 static LLVMValueRef cg_expr_llvm(CgContext *ctx, LLVMCg *llvm, Node *node);
@@ -857,56 +1159,152 @@ static LLVMValueRef cg_bool_llvm(LLVMCg *llvm, Node *node) {
   return LLVMConstInt(LLVMInt1TypeInContext(llvm->ctx), node->as.bval ? 1 : 0, 0);
 }
 
-static LLVMValueRef cg_binop_llvm(CgContext *ctx, LLVMCg *llvm, const char *op,
-                                   Node *left, Node *right, Type *ty) {
-  LLVMValueRef l = cg_expr_llvm(ctx, llvm, left);
-  LLVMValueRef r = cg_expr_llvm(ctx, llvm, right);
-  if (!l || !r) return NULL;
+static LLVMValueRef cg_string_llvm(LLVMCg *llvm, Node *node) {
+  char *s = (char*)malloc(node->as.str.len + 1);
+  memcpy(s, node->as.str.ptr, node->as.str.len);
+  s[node->as.str.len] = '\0';
+  LLVMValueRef v = LLVMBuildGlobalStringPtr(llvm->builder, s, ".str");
+  free(s);
+  return v;
+}
 
-  if (strcmp(op, "+") == 0) {
-    if (ty && ty->kind == TY_FLOAT)
-      return LLVMBuildFAdd(llvm->builder, l, r, "addtmp");
-    return LLVMBuildAdd(llvm->builder, l, r, "addtmp");
+// Define name as a local holding val: an SSA value, or, when body assigns it
+// with set!, an alloca at the top of the entry block for mem2reg to promote
+static void cg_local_llvm(CgContext *ctx, LLVMCg *llvm, Node *body, Node *name, LLVMValueRef val, Type *ty) {
+  if (!val || !assigns_local(body, name->as.sym.ptr, name->as.sym.len)) {
+    cg_scope_define(ctx, name->as.sym.ptr, name->as.sym.len, val, ty);
+    return;
   }
-  if (strcmp(op, "-") == 0) {
-    if (ty && ty->kind == TY_FLOAT)
-      return LLVMBuildFSub(llvm->builder, l, r, "subtmp");
-    return LLVMBuildSub(llvm->builder, l, r, "subtmp");
-  }
-  if (strcmp(op, "*") == 0) {
-    if (ty && ty->kind == TY_FLOAT)
-      return LLVMBuildFMul(llvm->builder, l, r, "multmp");
-    return LLVMBuildMul(llvm->builder, l, r, "multmp");
-  }
-  if (strcmp(op, "/") == 0) {
-    if (ty && ty->kind == TY_FLOAT)
-      return LLVMBuildFDiv(llvm->builder, l, r, "divtmp");
-    return LLVMBuildSDiv(llvm->builder, l, r, "divtmp");
+  LLVMBasicBlockRef entry = LLVMGetEntryBasicBlock(llvm->current_fn);
+  LLVMBuilderRef b = LLVMCreateBuilderInContext(llvm->ctx);
+  LLVMValueRef first = LLVMGetFirstInstruction(entry);
+  if (first) LLVMPositionBuilderBefore(b, first);
+  else LLVMPositionBuilderAtEnd(b, entry);
+  char slot_name[128];
+  snprintf(slot_name, sizeof(slot_name), "%.*s.slot", (int)name->as.sym.len, name->as.sym.ptr);
+  LLVMValueRef slot = LLVMBuildAlloca(b, type_to_llvm_type(llvm->ctx, ty), slot_name);
+  LLVMDisposeBuilder(b);
+  LLVMBuildStore(llvm->builder, val, slot);
+  cg_scope_define(ctx, name->as.sym.ptr, name->as.sym.len, slot, ty);
+  ctx->scope->symbols->is_slot = 1;
+}
+
+static LLVMValueRef cg_symbol_llvm(CgContext *ctx, LLVMCg *llvm, Node *node) {
+  CgSymbol *sym = cg_scope_lookup(ctx, node->as.sym.ptr, node->as.sym.len);
+  if (sym && sym->is_slot) {
+    char name[128];
+    snprintf(name, sizeof(name), "%.*s", (int)node->as.sym.len, node->as.sym.ptr);
+    return LLVMBuildLoad2(llvm->builder, type_to_llvm_type(llvm->ctx, sym->type), (LLVMValueRef)sym->value, name);
   }
-  if (strcmp(op, "<") == 0) {
-    if (ty && ty->kind == TY_FLOAT)
-      return LLVMBuildFCmp(llvm->builder, LLVMRealOLT, l, r, "cmptmp");
-    return LLVMBuildICmp(llvm->builder, LLVMIntSLT, l, r, "cmptmp");
+  if (sym) return (LLVMValueRef)sym->value;
+  if (find_fn_def(llvm->program, node->as.sym.ptr, node->as.sym.len))
+    return cg_fail(llvm, node, "function values (%.*s)", (int)node->as.sym.len, node->as.sym.ptr);
+  return cg_fail(llvm, node, "global %.*s", (int)node->as.sym.len, node->as.sym.ptr);
+}
+
+static int operand_kind(Node *left, Node *right) {
+  if (!left->ty || !right->ty || left->ty->kind != right->ty->kind) return -1;
+  return (int)left->ty->kind;
+}
+
+// Integer / and mod, guarded as in cg_idiv_text
+static LLVMValueRef cg_idiv_llvm(LLVMCg *llvm, LLVMValueRef l, LLVMValueRef r, int rem) {
+  LLVMBuilderRef b = llvm->builder;
+  LLVMTypeRef i64 = LLVMInt64TypeInContext(llvm->ctx);
+  LLVMValueRef zero = LLVMConstInt(i64, 0, 0);
+  LLVMValueRef is0 = LLVMBuildICmp(b, LLVMIntEQ, r, zero, "is0");
+  LLVMValueRef neg1 = LLVMBuildICmp(b, LLVMIntEQ, r, LLVMConstAllOnes(i64), "isneg1");
+  LLVMValueRef d = LLVMBuildSelect(b, LLVMBuildOr(b, is0, neg1, "odd"), LLVMConstInt(i64, 1, 0), r, "divisor");
+  if (rem) return LLVMBuildSRem(b, l, d, "modtmp");
+  LLVMValueRef q = LLVMBuildSDiv(b, l, d, "divtmp");
+  q = LLVMBuildSelect(b, neg1, LLVMBuildSub(b, zero, l, "negtmp"), q, "divtmp");
+  return LLVMBuildSelect(b, is0, zero, q, "divtmp");
+}
+
+static LLVMValueRef cg_binop_llvm(CgContext *ctx, LLVMCg *llvm, const char *op, Node *list) {
+  Node *left = list->as.list.items[1];
+  Node *right = list->as.list.items[2];
+  int kind = operand_kind(left, right);
+  LLVMValueRef l = cg_expr_llvm(ctx, llvm, left);
+  LLVMValueRef r = cg_expr_llvm(ctx, llvm, right);
+  if (llvm->error[0]) return NULL;
+  LLVMBuilderRef b = llvm->builder;
+
+  if (kind == TY_INT || kind == TY_FLOAT) {
+    int fl = kind == TY_FLOAT;
+    if (strcmp(op, "+") == 0) return fl ? LLVMBuildFAdd(b, l, r, "addtmp") : LLVMBuildAdd(b, l, r, "addtmp");
+    if (strcmp(op, "-") == 0) return fl ? LLVMBuildFSub(b, l, r, "subtmp") : LLVMBuildSub(b, l, r, "subtmp");
+    if (strcmp(op, "*") == 0) return fl ? LLVMBuildFMul(b, l, r, "multmp") : LLVMBuildMul(b, l, r, "multmp");
+    if (strcmp(op, "/") == 0) return fl ? LLVMBuildFDiv(b, l, r, "divtmp") : cg_idiv_llvm(llvm, l, r, 0);
+    if (strcmp(op, "<") == 0) return fl ? LLVMBuildFCmp(b, LLVMRealOLT, l, r, "cmptmp") : LLVMBuildICmp(b, LLVMIntSLT, l, r, "cmptmp");
+    if (strcmp(op, ">") == 0) return fl ? LLVMBuildFCmp(b, LLVMRealOGT, l, r, "cmptmp") : LLVMBuildICmp(b, LLVMIntSGT, l, r, "cmptmp");
+    if (strcmp(op, "<=") == 0) return fl ? LLVMBuildFCmp(b, LLVMRealOLE, l, r, "cmptmp") : LLVMBuildICmp(b, LLVMIntSLE, l, r, "cmptmp");
+    if (strcmp(op, ">=") == 0) return fl ? LLVMBuildFCmp(b, LLVMRealOGE, l, r, "cmptmp") : LLVMBuildICmp(b, LLVMIntSGE, l, r, "cmptmp");
+    if (!fl && (strcmp(op, "%") == 0 || strcmp(op, "mod") == 0)) return cg_idiv_llvm(llvm, l, r, 1);
   }
-  if (strcmp(op, ">") == 0) {
-    if (ty && ty->kind == TY_FLOAT)
-      return LLVMBuildFCmp(llvm->builder, LLVMRealOGT, l, r, "cmptmp");
-    return LLVMBuildICmp(llvm->builder, LLVMIntSGT, l, r, "cmptmp");
+  if (strcmp(op, "=") == 0 || strcmp(op, "!=") == 0) {
+    int eq = op[0] == '=';
+    if (kind == TY_FLOAT) return LLVMBuildFCmp(b, eq ? LLVMRealOEQ : LLVMRealUNE, l, r, "cmptmp");
+    if (kind == TY_INT || kind == TY_BOOL) return LLVMBuildICmp(b, eq ? LLVMIntEQ : LLVMIntNE, l, r, "cmptmp");
+    if (kind == TY_STR) {
+      LLVMTypeRef str_ty = LLVMPointerType(LLVMInt8TypeInContext(llvm->ctx), 0);
+      LLVMTypeRef params[] = { str_ty, str_ty };
+      LLVMValueRef args[] = { l, r };
+      LLVMTypeRef i32 = LLVMInt32TypeInContext(llvm->ctx);
+      LLVMValueRef res = cg_shim_call(llvm, "sq_string_eq", i32, params, args, 2);
+      return LLVMBuildICmp(b, eq ? LLVMIntNE : LLVMIntEQ, res, LLVMConstInt(i32, 0, 0), "cmptmp");
+    }
   }
-  if (strcmp(op, "=") == 0) {
-    if (left->ty && left->ty->kind == TY_FLOAT)
-      return LLVMBuildFCmp(llvm->builder, LLVMRealOEQ, l, r, "cmptmp");
-    return LLVMBuildICmp(llvm->builder, LLVMIntEQ, l, r, "cmptmp");
+  if (kind == TY_BOOL) {
+    if (strcmp(op, "and") == 0) return LLVMBuildAnd(b, l, r, "andtmp");
+    if (strcmp(op, "or") == 0) return LLVMBuildOr(b, l, r, "ortmp");
   }
+  return cg_fail(llvm, list, "%s on %s", op, left->ty ? ty_kind_name(left->ty->kind) : "untyped values");
+}
 
+static LLVMValueRef cg_unop_llvm(CgContext *ctx, LLVMCg *llvm, const char *op, Node *list) {
+  Node *arg = list->as.list.items[1];
+  LLVMValueRef a = cg_expr_llvm(ctx, llvm, arg);
+  if (llvm->error[0]) return NULL;
+  int kind = arg->ty ? (int)arg->ty->kind : -1;
+  if (strcmp(op, "not") == 0 && kind == TY_BOOL) return LLVMBuildNot(llvm->builder, a, "nottmp");
+  if (strcmp(op, "neg") == 0 && kind == TY_INT) return LLVMBuildNeg(llvm->builder, a, "negtmp");
+  if (strcmp(op, "neg") == 0 && kind == TY_FLOAT) return LLVMBuildFNeg(llvm->builder, a, "negtmp");
+  return cg_fail(llvm, list, "%s on %s", op, kind >= 0 ? ty_kind_name(arg->ty->kind) : "untyped values");
+}
+
+// [print a b ...]: like rt_print, arguments separated by spaces, then a newline
+static LLVMValueRef cg_print_llvm(CgContext *ctx, LLVMCg *llvm, Node *list) {
+  LLVMTypeRef void_ty = LLVMVoidTypeInContext(llvm->ctx);
+  for (size_t i = 1; i < list->as.list.count; i++) {
+    Node *arg = list->as.list.items[i];
+    LLVMValueRef v = cg_expr_llvm(ctx, llvm, arg);
+    if (llvm->error[0]) return NULL;
+    LLVMTypeRef ty = v ? LLVMTypeOf(v) : NULL;
+    switch (arg->ty->kind) {
+      case TY_INT: cg_shim_call(llvm, "sq_print_i64", void_ty, &ty, &v, 1); break;
+      case TY_FLOAT: cg_shim_call(llvm, "sq_print_f64", void_ty, &ty, &v, 1); break;
+      case TY_BOOL: {
+        LLVMTypeRef i32 = LLVMInt32TypeInContext(llvm->ctx);
+        LLVMValueRef w = LLVMBuildZExt(llvm->builder, v, i32, "booltmp");
+        cg_shim_call(llvm, "sq_print_bool", void_ty, &i32, &w, 1);
+        break;
+      }
+      case TY_STR: cg_shim_call(llvm, "sq_print_cstr", void_ty, &ty, &v, 1); break;
+      case TY_UNIT: cg_print_cstr_llvm(llvm, "()"); break;
+      default: return cg_fail(llvm, arg, "printing %s", ty_kind_name(arg->ty->kind));
+    }
+    if (i + 1 < list->as.list.count) cg_print_cstr_llvm(llvm, " ");
+  }
+  cg_shim_call(llvm, "sq_print_newline", void_ty, NULL, NULL, 0);
   return NULL;
 }
 
 static LLVMValueRef cg_if_llvm(CgContext *ctx, LLVMCg *llvm, Node *list) {
-  if (list->as.list.count != 4) return NULL;
+  if (list->as.list.count != 4) return cg_fail(llvm, list, "if requires 3 arguments");
 
   LLVMValueRef cond = cg_expr_llvm(ctx, llvm, list->as.list.items[1]);
-  if (!cond) return NULL;
+  if (llvm->error[0]) return NULL;
 
   LLVMBasicBlockRef then_bb = LLVMAppendBasicBlockInContext(llvm->ctx, llvm->current_fn, "then");
   LLVMBasicBlockRef else_bb = LLVMAppendBasicBlockInContext(llvm->ctx, llvm->current_fn, "else");
@@ -917,17 +1315,20 @@ static LLVMValueRef cg_if_llvm(CgContext *ctx, LLVMCg *llvm, Node *list) {
   // Then block
   LLVMPositionBuilderAtEnd(llvm->builder, then_bb);
   LLVMValueRef then_val = cg_expr_llvm(ctx, llvm, list->as.list.items[2]);
+  if (llvm->error[0]) return NULL;
   LLVMBuildBr(llvm->builder, merge_bb);
   then_bb = LLVMGetInsertBlock(llvm->builder);
 
   // Else block
   LLVMPositionBuilderAtEnd(llvm->builder, else_bb);
   LLVMValueRef else_val = cg_expr_llvm(ctx, llvm, list->as.list.items[3]);
+  if (llvm->error[0]) return NULL;
   LLVMBuildBr(llvm->builder, merge_bb);
   else_bb = LLVMGetInsertBlock(llvm->builder);
 
-  // Merge with PHI
+  // Merge with PHI, unless the branches are Unit
   LLVMPositionBuilderAtEnd(llvm->builder, merge_bb);
+  if (list->ty->kind == TY_UNIT) return NULL;
   LLVMTypeRef phi_ty = type_to_llvm_type(llvm->ctx, list->ty);
   LLVMValueRef phi = LLVMBuildPhi(llvm->builder, phi_ty, "iftmp");
 
@@ -938,98 +1339,650 @@ static LLVMValueRef cg_if_llvm(CgContext *ctx, LLVMCg *llvm, Node *list) {
   return phi;
 }
 
+// [let [[name : T expr] [name expr] ...] body...]; as in the evaluator, a
+// [name : T] binding may also take its expression from the next item
+static LLVMValueRef cg_let_llvm(CgContext *ctx, LLVMCg *llvm, Node *list) {
+  if (list->as.list.count < 3) return cg_fail(llvm, list, "let requires bindings and body");
+
+  Node *bindings = list->as.list.items[1];
+  if (bindings->kind != N_LIST) return cg_fail(llvm, bindings, "let bindings must be a list");
+  cg_scope_push(ctx);
+
+  for (size_t i = 0; i < bindings->as.list.count && !llvm->error[0]; i++) {
+    Node *binding = bindings->as.list.items[i];
+    if (binding->kind != N_LIST || binding->as.list.count < 2) continue;
+
+    Node *name_node = binding->as.list.items[0];
+    Node *expr_node = NULL;
+    if (binding->as.list.count >= 4 && is_sym(binding->as.list.items[1], ":")) {
+      expr_node = binding->as.list.items[3];
+    } else if (binding->as.list.count == 3 && is_sym(binding->as.list.items[1], ":")) {
+      if (i + 1 < bindings->as.list.count) expr_node = bindings->as.list.items[++i];
+    } else {
+      expr_node = binding->as.list.items[1];
+    }
+    if (!expr_node || name_node->kind != N_SYMBOL) {
+      cg_fail(llvm, binding, "malformed let binding");
+      break;
+    }
+
+    LLVMValueRef val = cg_expr_llvm(ctx, llvm, expr_node);
+    if (llvm->error[0]) break;
+    if (val && !LLVMIsConstant(val)) LLVMSetValueName2(val, name_node->as.sym.ptr, name_node->as.sym.len);
+    cg_local_llvm(ctx, llvm, list, name_node, val, expr_node->ty);
+  }
+
+  LLVMValueRef result = NULL;
+  for (size_t i = 2; i < list->as.list.count && !llvm->error[0]; i++) {
+    result = cg_expr_llvm(ctx, llvm, list->as.list.items[i]);
+  }
+
+  cg_scope_pop(ctx);
+  return result;
+}
+
+// [while cond body...]: the condition block, the body looping back to it,
+// and the block after; Unit
+static LLVMValueRef cg_while_llvm(CgContext *ctx, LLVMCg *llvm, Node *list) {
+  if (list->as.list.count < 2) return cg_fail(llvm, list, "while requires a condition");
+
+  LLVMBasicBlockRef cond_bb = LLVMAppendBasicBlockInContext(llvm->ctx, llvm->current_fn, "while.cond");
+  LLVMBasicBlockRef body_bb = LLVMAppendBasicBlockInContext(llvm->ctx, llvm->current_fn, "while.body");
+  LLVMBasicBlockRef end_bb = LLVMAppendBasicBlockInContext(llvm->ctx, llvm->current_fn, "while.end");
+  LLVMBuildBr(llvm->builder, cond_bb);
+
+  LLVMPositionBuilderAtEnd(llvm->builder, cond_bb);
+  LLVMValueRef cond = cg_expr_llvm(ctx, llvm, list->as.list.items[1]);
+  if (llvm->error[0]) return NULL;
+  LLVMBuildCondBr(llvm->builder, cond, body_bb, end_bb);
+
+  LLVMPositionBuilderAtEnd(llvm->builder, body_bb);
+  for (size_t i = 2; i < list->as.list.count && !llvm->error[0]; i++) {
+    cg_expr_llvm(ctx, llvm, list->as.list.items[i]);
+  }
+  if (llvm->error[0]) return NULL;
+  LLVMBuildBr(llvm->builder, cond_bb);
+
+  LLVMPositionBuilderAtEnd(llvm->builder, end_bb);
+  return NULL;
+}
+
+// [set! name expr] on a local given a slot by cg_local_llvm; Unit
+static LLVMValueRef cg_set_llvm(CgContext *ctx, LLVMCg *llvm, Node *list) {
+  Node *target = list->as.list.items[1];
+  CgSymbol *sym = target->kind == N_SYMBOL ? cg_scope_lookup(ctx, target->as.sym.ptr, target->as.sym.len) : NULL;
+  if (!sym || !sym->is_slot) return cg_fail(llvm, list, "set! of globals");
+  LLVMValueRef val = cg_expr_llvm(ctx, llvm, list->as.list.items[2]);
+  if (llvm->error[0]) return NULL;
+  if (!val) return cg_fail(llvm, list, "set! of Unit values");
+  LLVMBuildStore(llvm->builder, val, (LLVMValueRef)sym->value);
+  return NULL;
+}
+
+static LLVMValueRef cg_do_llvm(CgContext *ctx, LLVMCg *llvm, Node *list) {
+  LLVMValueRef result = NULL;
+  for (size_t i = 1; i < list->as.list.count && !llvm->error[0]; i++) {
+    result = cg_expr_llvm(ctx, llvm, list->as.list.items[i]);
+  }
+  return result;
+}
+
+static LLVMValueRef cg_call_llvm(CgContext *ctx, LLVMCg *llvm, Node *list) {
+  Node *head = list->as.list.items[0];
+  if (head->kind != N_SYMBOL || cg_scope_lookup(ctx, head->as.sym.ptr, head->as.sym.len))
+    return cg_fail(llvm, list, "calls through function values");
+
+  char fname[256];
+  snprintf(fname, sizeof(fname), "%.*s", (int)head->as.sym.len, head->as.sym.ptr);
+  size_t argc = list->as.list.count - 1;
+
+  if (argc == 2 && (strcmp(fname, "+") == 0 || strcmp(fname, "-") == 0 ||
+                    strcmp(fname, "*") == 0 || strcmp(fname, "/") == 0 ||
+                    strcmp(fname, "%") == 0 || strcmp(fname, "mod") == 0 ||
+                    strcmp(fname, "=") == 0 || strcmp(fname, "!=") == 0 ||
+                    strcmp(fname, "<") == 0 || strcmp(fname, ">") == 0 ||
+                    strcmp(fname, "<=") == 0 || strcmp(fname, ">=") == 0 ||
+                    strcmp(fname, "and") == 0 || strcmp(fname, "or") == 0)) {
+    return cg_binop_llvm(ctx, llvm, fname, list);
+  }
+  if (argc == 1 && (strcmp(fname, "not") == 0 || strcmp(fname, "neg") == 0)) {
+    return cg_unop_llvm(ctx, llvm, fname, list);
+  }
+  if (strcmp(fname, "print") == 0) return cg_print_llvm(ctx, llvm, list);
+
+  LLVMTypeRef str_ty = LLVMPointerType(LLVMInt8TypeInContext(llvm->ctx), 0);
+  if (strcmp(fname, "str-concat") == 0 && argc == 2) {
+    LLVMValueRef args[] = { cg_expr_llvm(ctx, llvm, list->as.list.items[1]),
+                            cg_expr_llvm(ctx, llvm, list->as.list.items[2]) };
+    if (llvm->error[0]) return NULL;
+    LLVMTypeRef params[] = { str_ty, str_ty };
+    return cg_shim_call(llvm, "sq_string_concat", str_ty, params, args, 2);
+  }
+  if (strcmp(fname, "str-len") == 0 && argc == 1) {
+    LLVMValueRef arg = cg_expr_llvm(ctx, llvm, list->as.list.items[1]);
+    if (llvm->error[0]) return NULL;
+    return cg_shim_call(llvm, "sq_string_len", LLVMInt64TypeInContext(llvm->ctx), &str_ty, &arg, 1);
+  }
+
+  // User-defined function call
+  LLVMValueRef fn = cg_fn_ref_llvm(ctx, llvm, list, head->as.sym.ptr, head->as.sym.len);
+  if (llvm->error[0]) return NULL;
+  if (!fn) return cg_fail(llvm, list, "%s is not supported", fname);
+  if (LLVMCountParams(fn) != argc) return cg_fail(llvm, list, "%s takes %u arguments", fname, LLVMCountParams(fn));
+
+  LLVMValueRef *args = (LLVMValueRef*)malloc(sizeof(LLVMValueRef) * (argc ? argc : 1));
+  for (size_t i = 0; i < argc && !llvm->error[0]; i++) {
+    args[i] = cg_expr_llvm(ctx, llvm, list->as.list.items[i + 1]);
+  }
+  LLVMValueRef result = NULL;
+  if (!llvm->error[0]) {
+    LLVMTypeRef fn_ty = LLVMGlobalGetValueType(fn);
+    int is_void = LLVMGetTypeKind(LLVMGetReturnType(fn_ty)) == LLVMVoidTypeKind;
+    result = LLVMBuildCall2(llvm->builder, fn_ty, fn, args, (unsigned)argc, is_void ? "" : "calltmp");
+    if (is_void) result = NULL;
+  }
+  free(args);
+  return result;
+}
+
 static LLVMValueRef cg_list_llvm(CgContext *ctx, LLVMCg *llvm, Node *list) {
-  if (list->as.list.count == 0) return NULL;
+  if (list->as.list.count == 0) return cg_fail(llvm, list, "empty list");
 
   Node *head = list->as.list.items[0];
   if (head->kind == N_SYMBOL) {
-    // Check for special forms
+    // Special forms
     if (is_sym(head, "if")) return cg_if_llvm(ctx, llvm, list);
-
-    // Check for binary operators
-    char op[32];
-    snprintf(op, sizeof(op), "%.*s", (int)head->as.sym.len, head->as.sym.ptr);
-
-    if ((strcmp(op, "+") == 0 || strcmp(op, "-") == 0 ||
-         strcmp(op, "*") == 0 || strcmp(op, "/") == 0 ||
-         strcmp(op, "<") == 0 || strcmp(op, ">") == 0 ||
-         strcmp(op, "=") == 0) && list->as.list.count == 3) {
-      return cg_binop_llvm(ctx, llvm, op, list->as.list.items[1],
-                           list->as.list.items[2], list->ty);
+    if (is_sym(head, "let")) return cg_let_llvm(ctx, llvm, list);
+    if (is_sym(head, "do")) return cg_do_llvm(ctx, llvm, list);
+    if (is_sym(head, "while")) return cg_while_llvm(ctx, llvm, list);
+    if (is_sym(head, "set!") && list->as.list.count == 3) return cg_set_llvm(ctx, llvm, list);
+    if (list->as.list.form != FORM_CALL && list->as.list.form != FORM_VEC &&
+        list->as.list.form != FORM_STRUCT_NEW) {
+      return cg_fail(llvm, list, "%.*s is not supported", (int)head->as.sym.len, head->as.sym.ptr);
     }
   }
 
-  return NULL;
+  return cg_call_llvm(ctx, llvm, list);
 }
 
 static LLVMValueRef cg_expr_llvm(CgContext *ctx, LLVMCg *llvm, Node *node) {
+  if (llvm->error[0]) return NULL;
+  if (!type_to_llvm_type(llvm->ctx, node->ty)) {
+    return cg_fail(llvm, node, "values of type %s", node->ty ? ty_kind_name(node->ty->kind) : "unknown");
+  }
   switch (node->kind) {
     case N_INT: return cg_int_llvm(llvm, node);
     case N_FLOAT: return cg_float_llvm(llvm, node);
     case N_BOOL: return cg_bool_llvm(llvm, node);
+    case N_STRING: return cg_string_llvm(llvm, node);
+    case N_SYMBOL: return cg_symbol_llvm(ctx, llvm, node);
     case N_LIST: return cg_list_llvm(ctx, llvm, node);
-    default: return NULL;
+    default: return cg_fail(llvm, node, "unknown node");
   }
 }
 
-static char *codegen_emit_ir_llvm(Node *program, const CodegenOpts *opts, size_t *out_len) {
-  LLVMContextRef ctx = LLVMContextCreate();
-  LLVMModuleRef module = LLVMModuleCreateWithNameInContext(
-    opts && opts->module_name ? opts->module_name : "sqale", ctx);
-  LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
-
-  LLVMCg llvm = { .ctx = ctx, .module = module, .builder = builder };
+static void cg_function_llvm(CgContext *ctx, LLVMCg *llvm, Node *fn_node, LLVMValueRef fn) {
+  Node *params = fn_node->as.list.items[1];
+  Type *ret_type = fn_node->ty->as.fn.ret;
+  if (params->kind != N_LIST || params->as.list.count != LLVMCountParams(fn)) {
+    cg_fail(llvm, fn_node, "malformed parameter list");
+    return;
+  }
 
-  // Create main function
-  LLVMTypeRef main_ty = LLVMFunctionType(LLVMInt32TypeInContext(ctx), NULL, 0, 0);
-  LLVMValueRef main_fn = LLVMAddFunction(module, "main", main_ty);
-  llvm.current_fn = main_fn;
+  llvm->current_fn = fn;
+  LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(llvm->ctx, fn, "entry");
+  LLVMPositionBuilderAtEnd(llvm->builder, entry);
 
-  LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, main_fn, "entry");
-  LLVMPositionBuilderAtEnd(builder, entry);
+  cg_scope_push(ctx);
+  for (size_t i = 0; i < params->as.list.count; i++) {
+    Node *param = params->as.list.items[i];
+    if (param->kind != N_LIST || param->as.list.count < 3 || param->as.list.items[0]->kind != N_SYMBOL) {
+      cg_fail(llvm, param, "malformed parameter");
+      break;
+    }
+    Node *pname = param->as.list.items[0];
+    LLVMValueRef p = LLVMGetParam(fn, (unsigned)i);
+    LLVMSetValueName2(p, pname->as.sym.ptr, pname->as.sym.len);
+    cg_local_llvm(ctx, llvm, fn_node, pname, p, fn_node->ty->as.fn.params[i]);
+  }
 
-  // Generate code for program
-  CgContext *cgctx = cg_context_new(opts);
+  size_t body_start = 2;
+  if (fn_node->as.list.count > body_start && is_sym(fn_node->as.list.items[body_start], ":")) {
+    body_start += 2;  // Skip : RetType
+  }
+  LLVMValueRef last = NULL;
+  for (size_t i = body_start; i < fn_node->as.list.count && !llvm->error[0]; i++) {
+    last = cg_expr_llvm(ctx, llvm, fn_node->as.list.items[i]);
+  }
+  cg_scope_pop(ctx);
+  if (llvm->error[0]) return;
 
-  int mi = find_main_fn(program);
-  LLVMValueRef ret_val = NULL;
+  if (ret_type->kind == TY_UNIT) LLVMBuildRetVoid(llvm->builder);
+  else if (last) LLVMBuildRet(llvm->builder, last);
+  else cg_fail(llvm, fn_node, "function body has no value");
+}
 
-  if (mi >= 0) {
-    Node *main_def = program->as.list.items[mi];
-    Node *fn_node = main_def->as.list.items[4];
+static void cg_begin_llvm(LLVMCg *llvm, LLVMContextRef ctx, Node *program, const char *module_name) {
+  memset(llvm, 0, sizeof(*llvm));
+  llvm->ctx = ctx;
+  llvm->module = LLVMModuleCreateWithNameInContext(module_name, ctx);
+  llvm->builder = LLVMCreateBuilderInContext(ctx);
+  llvm->program = program;
+  char *triple = LLVMGetDefaultTargetTriple();
+  LLVMSetTarget(llvm->module, triple);
+  LLVMDisposeMessage(triple);
+}
 
-    // Generate body
-    size_t body_start = 2;
-    if (fn_node->as.list.count > body_start && is_sym(fn_node->as.list.items[body_start], ":")) {
-      body_start += 2;
-    }
+// Emit the bodies of the functions declared so far, and of those they declare
+static void cg_drain_llvm(CgContext *ctx, LLVMCg *llvm) {
+  for (size_t i = 0; i < llvm->npending && !llvm->error[0]; i++) {
+    cg_function_llvm(ctx, llvm, llvm->pending[i].fn_node, llvm->pending[i].fn);
+  }
+}
 
-    for (size_t i = body_start; i < fn_node->as.list.count; i++) {
-      ret_val = cg_expr_llvm(cgctx, &llvm, fn_node->as.list.items[i]);
-    }
+// Verify the module; returns it, or NULL with the reason in error
+static LLVMModuleRef cg_finish_llvm(LLVMCg *llvm, char *error, size_t error_len) {
+  if (!llvm->error[0]) {
+    char *msg = NULL;
+    if (LLVMVerifyModule(llvm->module, LLVMReturnStatusAction, &msg)) cg_fail(llvm, NULL, "invalid IR: %s", msg);
+    LLVMDisposeMessage(msg);
   }
+  free(llvm->pending);
+  LLVMDisposeBuilder(llvm->builder);
+  if (llvm->error[0]) {
+    snprintf(error, error_len, "%s", llvm->error);
+    LLVMDisposeModule(llvm->module);
+    return NULL;
+  }
+  return llvm->module;
+}
 
-  // Return
-  if (ret_val && LLVMTypeOf(ret_val) == LLVMInt64TypeInContext(ctx)) {
-    LLVMValueRef ret32 = LLVMBuildTrunc(builder, ret_val, LLVMInt32TypeInContext(ctx), "ret32");
-    LLVMBuildRet(builder, ret32);
+// Target machine for the host at opt level 0-3; NULL with the reason in error
+static LLVMTargetMachineRef cg_host_machine_llvm(int level, char *error, size_t error_len) {
+  LLVMInitializeNativeTarget();
+  LLVMInitializeNativeAsmPrinter();
+  char *triple = LLVMGetDefaultTargetTriple();
+  char *msg = NULL;
+  LLVMTargetRef target;
+  LLVMTargetMachineRef tm = NULL;
+  if (LLVMGetTargetFromTriple(triple, &target, &msg)) {
+    snprintf(error, error_len, "%s: %s", triple, msg);
+    LLVMDisposeMessage(msg);
   } else {
-    LLVMBuildRet(builder, LLVMConstInt(LLVMInt32TypeInContext(ctx), 0, 0));
+    LLVMCodeGenOptLevel cg_level = level <= 0 ? LLVMCodeGenLevelNone :
+                                   level == 1 ? LLVMCodeGenLevelLess :
+                                   level == 2 ? LLVMCodeGenLevelDefault : LLVMCodeGenLevelAggressive;
+    char *cpu = LLVMGetHostCPUName(), *features = LLVMGetHostCPUFeatures();
+    // PIC, so the system linker's default (often PIE) accepts the object
+    tm = LLVMCreateTargetMachine(target, triple, cpu, features, cg_level, LLVMRelocPIC, LLVMCodeModelDefault);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(features);
+  }
+  LLVMDisposeMessage(triple);
+  return tm;
+}
+
+// Run the new pass manager's default<On> pipeline over module, tuned for tm
+// (or the host when NULL). Level 0 leaves the module as lowered.
+static int cg_optimize_llvm(LLVMModuleRef module, LLVMTargetMachineRef tm, int level,
+                            char *error, size_t error_len) {
+  if (level <= 0) return 0;
+  if (level > 3) level = 3;
+  LLVMTargetMachineRef own = NULL;
+  if (!tm) {
+    own = tm = cg_host_machine_llvm(level, error, error_len);
+    if (!tm) return 1;
+  }
+  LLVMTargetDataRef layout = LLVMCreateTargetDataLayout(tm);
+  LLVMSetModuleDataLayout(module, layout);
+  LLVMDisposeTargetData(layout);
+  char pipeline[16];
+  snprintf(pipeline, sizeof(pipeline), "default<O%d>", level);
+  LLVMPassBuilderOptionsRef pbo = LLVMCreatePassBuilderOptions();
+  LLVMErrorRef err = LLVMRunPasses(module, pipeline, tm, pbo);
+  LLVMDisposePassBuilderOptions(pbo);
+  if (own) LLVMDisposeTargetMachine(own);
+  if (err) {
+    char *msg = LLVMGetErrorMessage(err);
+    snprintf(error, error_len, "%s: %s", pipeline, msg);
+    LLVMDisposeErrorMessage(msg);
+    return 1;
+  }
+  return 0;
+}
+
+// Lower main and every function it reaches into a new module in ctx,
+// optimized at opts->opt_level. On failure returns NULL with the reason in
+// error.
+static LLVMModuleRef cg_module_llvm(LLVMContextRef ctx, Node *program, const CodegenOpts *opts,
+                                    char *error, size_t error_len) {
+  LLVMCg llvm;
+  cg_begin_llvm(&llvm, ctx, program, opts && opts->module_name ? opts->module_name : "sqale");
+  CgContext *cgctx = cg_context_new(opts);
+
+  LLVMValueRef sqale_main = cg_fn_ref_llvm(cgctx, &llvm, NULL, "main", 4);
+  cg_drain_llvm(cgctx, &llvm);
+
+  // C entry point: main's Int result is the exit status, as with sqale run
+  if (!llvm.error[0] && (!opts || opts->for_exe)) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMValueRef main_fn = LLVMAddFunction(llvm.module, "main", LLVMFunctionType(i32, NULL, 0, 0));
+    LLVMPositionBuilderAtEnd(llvm.builder, LLVMAppendBasicBlockInContext(ctx, main_fn, "entry"));
+    LLVMValueRef status = LLVMConstInt(i32, 0, 0);
+    if (sqale_main) {
+      LLVMTypeRef fn_ty = LLVMGlobalGetValueType(sqale_main);
+      LLVMTypeRef ret_ty = LLVMGetReturnType(fn_ty);
+      int is_void = LLVMGetTypeKind(ret_ty) == LLVMVoidTypeKind;
+      LLVMValueRef r = LLVMBuildCall2(llvm.builder, fn_ty, sqale_main, NULL, 0, is_void ? "" : "ret");
+      if (ret_ty == LLVMInt64TypeInContext(ctx)) status = LLVMBuildTrunc(llvm.builder, r, i32, "ret32");
+    }
+    LLVMBuildRet(llvm.builder, status);
   }
 
   cg_context_free(cgctx);
+  LLVMModuleRef module = cg_finish_llvm(&llvm, error, error_len);
+  if (module && cg_optimize_llvm(module, NULL, opts ? opts->opt_level : 0, error, error_len)) {
+    LLVMDisposeModule(module);
+    return NULL;
+  }
+  return module;
+}
+
+static char *codegen_emit_ir_llvm(Node *program, const CodegenOpts *opts, size_t *out_len) {
+  LLVMContextRef ctx = LLVMContextCreate();
+  char error[256];
+  LLVMModuleRef module = cg_module_llvm(ctx, program, opts, error, sizeof(error));
+  if (!module) {
+    fprintf(stderr, "codegen: %s\n", error);
+    LLVMContextDispose(ctx);
+    return NULL;
+  }
 
   // Get IR string
-  char *ir = LLVMPrintModuleToString(module);
+  char *msg = LLVMPrintModuleToString(module);
+  char *ir = strdup(msg);
   if (out_len) *out_len = strlen(ir);
 
-  LLVMDisposeBuilder(builder);
+  LLVMDisposeMessage(msg);
   LLVMDisposeModule(module);
   LLVMContextDispose(ctx);
 
   return ir;
 }
 
+// Lower the program and write a native object file for the host through a
+// target machine; the object defines C main when opts->for_exe is set
+static int codegen_emit_object_llvm(Node *program, const CodegenOpts *opts, const char *out_path) {
+  char error[256];
+  LLVMTargetMachineRef tm = cg_host_machine_llvm(opts ? opts->opt_level : 0, error, sizeof(error));
+  if (!tm) {
+    fprintf(stderr, "codegen: %s\n", error);
+    return 1;
+  }
+  LLVMContextRef ctx = LLVMContextCreate();
+  LLVMModuleRef module = cg_module_llvm(ctx, program, opts, error, sizeof(error));
+  int rc = 1;
+  if (!module) {
+    fprintf(stderr, "codegen: %s\n", error);
+  } else {
+    LLVMTargetDataRef layout = LLVMCreateTargetDataLayout(tm);
+    LLVMSetModuleDataLayout(module, layout);
+    LLVMDisposeTargetData(layout);
+    char *msg = NULL;
+    if (LLVMTargetMachineEmitToFile(tm, module, (char*)out_path, LLVMObjectFile, &msg)) {
+      fprintf(stderr, "codegen: %s: %s\n", out_path, msg);
+      LLVMDisposeMessage(msg);
+    } else {
+      rc = 0;
+    }
+    LLVMDisposeModule(module);
+  }
+  LLVMDisposeTargetMachine(tm);
+  LLVMContextDispose(ctx);
+  return rc;
+}
+
+static int jit_error(LLVMErrorRef err) {
+  char *msg = LLVMGetErrorMessage(err);
+  fprintf(stderr, "jit: %s\n", msg);
+  LLVMDisposeErrorMessage(msg);
+  return 1;
+}
+
+// An LLJIT whose main JITDylib resolves the runtime shims to this binary's
+// copies, and anything else the code needs (libc, compiler helpers) in the
+// process
+static LLVMOrcLLJITRef cg_lljit_new(void) {
+  LLVMInitializeNativeTarget();
+  LLVMInitializeNativeAsmPrinter();
+
+  LLVMOrcLLJITRef jit;
+  LLVMErrorRef err = LLVMOrcCreateLLJIT(&jit, NULL);
+  if (err) {
+    jit_error(err);
+    return NULL;
+  }
+  LLVMOrcJITDylibRef jd = LLVMOrcLLJITGetMainJITDylib(jit);
+
+  size_t nshims = sizeof(cg_shims) / sizeof(cg_shims[0]);
+  LLVMJITCSymbolMapPair syms[sizeof(cg_shims) / sizeof(cg_shims[0])];
+  for (size_t i = 0; i < nshims; i++) {
+    syms[i].Name = LLVMOrcLLJITMangleAndIntern(jit, cg_shims[i].name);
+    syms[i].Sym.Address = (LLVMOrcExecutorAddress)(uintptr_t)cg_shims[i].addr;
+    syms[i].Sym.Flags.GenericFlags = LLVMJITSymbolGenericFlagsExported | LLVMJITSymbolGenericFlagsCallable;
+    syms[i].Sym.Flags.TargetFlags = 0;
+  }
+  LLVMOrcMaterializationUnitRef mu = LLVMOrcAbsoluteSymbols(syms, nshims);
+  err = LLVMOrcJITDylibDefine(jd, mu);
+  if (err) LLVMOrcDisposeMaterializationUnit(mu);
+  LLVMOrcDefinitionGeneratorRef gen;
+  if (!err) err = LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(&gen, LLVMOrcLLJITGetGlobalPrefix(jit), NULL, NULL);
+  if (!err) LLVMOrcJITDylibAddGenerator(jd, gen);
+  if (err) {
+    jit_error(err);
+    LLVMOrcDisposeLLJIT(jit);
+    return NULL;
+  }
+  return jit;
+}
+
+// Add module, built in tsctx, to jit's main JITDylib and look up name in it
+static LLVMOrcExecutorAddress cg_lljit_add(LLVMOrcLLJITRef jit, LLVMOrcThreadSafeContextRef tsctx,
+                                           LLVMModuleRef module, const char *name) {
+  LLVMSetDataLayout(module, LLVMOrcLLJITGetDataLayoutStr(jit));
+  LLVMOrcThreadSafeModuleRef tsm = LLVMOrcCreateNewThreadSafeModule(module, tsctx);
+  LLVMErrorRef err = LLVMOrcLLJITAddLLVMIRModule(jit, LLVMOrcLLJITGetMainJITDylib(jit), tsm);
+  LLVMOrcExecutorAddress addr = 0;
+  if (!err) err = LLVMOrcLLJITLookup(jit, &addr, name);
+  if (err) {
+    jit_error(err);
+    return 0;
+  }
+  return addr;
+}
+
+static int codegen_jit_run_llvm(Node *program, const CodegenOpts *opts, int *exit_code) {
+  LLVMOrcThreadSafeContextRef tsctx = LLVMOrcCreateNewThreadSafeContext();
+  char error[256];
+  LLVMModuleRef module = cg_module_llvm(LLVMOrcThreadSafeContextGetContext(tsctx), program, opts,
+                                        error, sizeof(error));
+  if (!module) {
+    fprintf(stderr, "jit: %s\n", error);
+    LLVMOrcDisposeThreadSafeContext(tsctx);
+    return 1;
+  }
+  LLVMOrcLLJITRef jit = cg_lljit_new();
+  if (!jit) {
+    LLVMDisposeModule(module);
+    LLVMOrcDisposeThreadSafeContext(tsctx);
+    return 1;
+  }
+
+  LLVMOrcExecutorAddress entry = cg_lljit_add(jit, tsctx, module, "main");
+  LLVMOrcDisposeThreadSafeContext(tsctx);  // the module keeps it alive
+  if (!entry) {
+    LLVMOrcDisposeLLJIT(jit);
+    return 1;
+  }
+
+  int (*main_fn)(void) = (int (*)(void))(uintptr_t)entry;
+  *exit_code = main_fn();
+  fflush(stdout);
+
+  LLVMErrorRef err = LLVMOrcDisposeLLJIT(jit);
+  if (err) jit_error(err);
+  return 0;
+}
+
+// ============================================================================
+// Tiered execution
+// ============================================================================
+
+struct CgJit {
+  LLVMOrcLLJITRef lljit;
+  Node *program;
+  int opt_level;
+  struct { const char *name; size_t len; } *compiled; // functions with code in lljit
+  size_t ncompiled, capcompiled;
+};
+
+static bool cg_jit_has(const CgJit *jit, const char *name, size_t len) {
+  for (size_t i = 0; i < jit->ncompiled; i++) {
+    if (sym_eq(jit->compiled[i].name, jit->compiled[i].len, name, len)) return true;
+  }
+  return false;
+}
+
+// Name of the toplevel def whose value is fn_node
+static Node *def_name_of(Node *program, Node *fn_node) {
+  for (size_t i = 0; i < program->as.list.count; i++) {
+    Node *form = program->as.list.items[i];
+    if (form->kind != N_LIST || form->as.list.count < 5) continue;
+    if (is_sym(form->as.list.items[0], "def") && form->as.list.items[4] == fn_node &&
+        form->as.list.items[1]->kind == N_SYMBOL)
+      return form->as.list.items[1];
+  }
+  return NULL;
+}
+
+// i64 name.entry(i64 *args): calls fn with its arguments unpacked from
+// 64-bit slots and returns the result packed into one
+static void cg_entry_llvm(LLVMCg *llvm, LLVMValueRef fn, const char *entry_name) {
+  LLVMContextRef c = llvm->ctx;
+  LLVMBuilderRef b = llvm->builder;
+  LLVMTypeRef i64 = LLVMInt64TypeInContext(c);
+  LLVMTypeRef slots_ty = LLVMPointerType(i64, 0);
+  LLVMValueRef entry = LLVMAddFunction(llvm->module, entry_name, LLVMFunctionType(i64, &slots_ty, 1, 0));
+  LLVMPositionBuilderAtEnd(b, LLVMAppendBasicBlockInContext(c, entry, "entry"));
+
+  LLVMTypeRef fn_ty = LLVMGlobalGetValueType(fn);
+  unsigned n = LLVMCountParamTypes(fn_ty);
+  LLVMTypeRef *params = (LLVMTypeRef*)malloc(sizeof(LLVMTypeRef) * (n ? n : 1));
+  LLVMValueRef *args = (LLVMValueRef*)malloc(sizeof(LLVMValueRef) * (n ? n : 1));
+  LLVMGetParamTypes(fn_ty, params);
+  for (unsigned i = 0; i < n; i++) {
+    LLVMValueRef idx = LLVMConstInt(i64, i, 0);
+    LLVMValueRef slot = LLVMBuildGEP2(b, i64, LLVMGetParam(entry, 0), &idx, 1, "slot");
+    LLVMValueRef v = LLVMBuildLoad2(b, i64, slot, "arg");
+    switch (LLVMGetTypeKind(params[i])) {
+      case LLVMDoubleTypeKind: v = LLVMBuildBitCast(b, v, params[i], "arg"); break;
+      case LLVMPointerTypeKind: v = LLVMBuildIntToPtr(b, v, params[i], "arg"); break;
+      case LLVMIntegerTypeKind: if (params[i] != i64) v = LLVMBuildTrunc(b, v, params[i], "arg"); break;
+      default: break;
+    }
+    args[i] = v;
+  }
+
+  LLVMTypeRef ret_ty = LLVMGetReturnType(fn_ty);
+  int is_void = LLVMGetTypeKind(ret_ty) == LLVMVoidTypeKind;
+  LLVMValueRef r = LLVMBuildCall2(b, fn_ty, fn, args, n, is_void ? "" : "ret");
+  switch (LLVMGetTypeKind(ret_ty)) {
+    case LLVMVoidTypeKind: r = LLVMConstInt(i64, 0, 0); break;
+    case LLVMDoubleTypeKind: r = LLVMBuildBitCast(b, r, i64, "ret"); break;
+    case LLVMPointerTypeKind: r = LLVMBuildPtrToInt(b, r, i64, "ret"); break;
+    default: if (ret_ty != i64) r = LLVMBuildZExt(b, r, i64, "ret"); break;
+  }
+  LLVMBuildRet(b, r);
+  free(params);
+  free(args);
+}
+
+static CgJit *codegen_jit_new_llvm(Node *program, int opt_level) {
+  LLVMOrcLLJITRef lljit = cg_lljit_new();
+  if (!lljit) return NULL;
+  CgJit *jit = (CgJit*)calloc(1, sizeof(CgJit));
+  jit->lljit = lljit;
+  jit->program = program;
+  jit->opt_level = opt_level;
+  return jit;
+}
+
+static void codegen_jit_free_llvm(CgJit *jit) {
+  LLVMErrorRef err = LLVMOrcDisposeLLJIT(jit->lljit);
+  if (err) jit_error(err);
+  free(jit->compiled);
+  free(jit);
+}
+
+static CgEntry codegen_jit_compile_llvm(CgJit *jit, Node *fn_node, char *error, size_t error_len) {
+  Node *name = def_name_of(jit->program, fn_node);
+  if (!name) {
+    snprintf(error, error_len, "not a toplevel function");
+    return NULL;
+  }
+  if (find_fn_def(jit->program, name->as.sym.ptr, name->as.sym.len) != fn_node) {
+    snprintf(error, error_len, "%s is redefined later", name->as.sym.ptr);
+    return NULL;
+  }
+
+  LLVMOrcThreadSafeContextRef tsctx = LLVMOrcCreateNewThreadSafeContext();
+  LLVMCg llvm;
+  cg_begin_llvm(&llvm, LLVMOrcThreadSafeContextGetContext(tsctx), jit->program, name->as.sym.ptr);
+  llvm.jit = jit;
+  CgContext *cgctx = cg_context_new(NULL);
+
+  LLVMValueRef fn = cg_fn_ref_llvm(cgctx, &llvm, fn_node, name->as.sym.ptr, name->as.sym.len);
+  cg_drain_llvm(cgctx, &llvm);
+  char entry_name[300];
+  snprintf(entry_name, sizeof(entry_name), "%.*s.entry", (int)name->as.sym.len, name->as.sym.ptr);
+  if (fn && !llvm.error[0]) cg_entry_llvm(&llvm, fn, entry_name);
+  cg_context_free(cgctx);
+
+  // Remember what this module defines before cg_finish_llvm frees the list
+  size_t ndefined = llvm.npending;
+  struct { const char *name; size_t len; } *defined = malloc(sizeof(*defined) * (ndefined ? ndefined : 1));
+  for (size_t i = 0; i < ndefined; i++) {
+    defined[i].name = llvm.pending[i].name;
+    defined[i].len = llvm.pending[i].len;
+  }
+
+  LLVMModuleRef module = cg_finish_llvm(&llvm, error, error_len);
+  if (module && cg_optimize_llvm(module, NULL, jit->opt_level, error, error_len)) {
+    LLVMDisposeModule(module);
+    module = NULL;
+  }
+  LLVMOrcExecutorAddress entry = 0;
+  if (module) {
+    entry = cg_lljit_add(jit->lljit, tsctx, module, entry_name);
+    if (!entry) snprintf(error, error_len, "LLJIT could not materialize %s", entry_name);
+  }
+  LLVMOrcDisposeThreadSafeContext(tsctx);
+
+  if (entry) {
+    if (jit->ncompiled + ndefined > jit->capcompiled) {
+      jit->capcompiled = (jit->ncompiled + ndefined) * 2;
+      jit->compiled = realloc(jit->compiled, sizeof(*jit->compiled) * jit->capcompiled);
+    }
+    for (size_t i = 0; i < ndefined; i++) {
+      jit->compiled[jit->ncompiled].name = defined[i].name;
+      jit->compiled[jit->ncompiled].len = defined[i].len;
+      jit->ncompiled++;
+    }
+  }
+  free(defined);
+  return (CgEntry)(uintptr_t)entry;
+}
+
 #endif // USE_LLVM
 
 // ============================================================================
@@ -1075,16 +2028,54 @@ char *codegen_emit_ir(Node *program, const CodegenOpts *opts, size_t *out_len) {
 
 int codegen_emit_object(Node *program, const CodegenOpts *opts, const char *out_path) {
 #if USE_LLVM
+  return codegen_emit_object_llvm(program, opts, out_path);
+#else
   (void)program;
   (void)opts;
   (void)out_path;
-  // TODO: Implement object file emission using LLVM target machine
+  fprintf(stderr, "Object file emission requires LLVM (compile with USE_LLVM=1)\n");
   return 1;
+#endif
+}
+
+int codegen_jit_run(Node *program, const CodegenOpts *opts, int *exit_code) {
+#if USE_LLVM
+  return codegen_jit_run_llvm(program, opts, exit_code);
 #else
   (void)program;
   (void)opts;
-  (void)out_path;
-  fprintf(stderr, "Object file emission requires LLVM (compile with USE_LLVM=1)\n");
+  (void)exit_code;
+  fprintf(stderr, "jit: requires LLVM (compile with USE_LLVM=1)\n");
   return 1;
 #endif
 }
+
+CgJit *codegen_jit_new(Node *program, int opt_level) {
+#if USE_LLVM
+  return codegen_jit_new_llvm(program, opt_level);
+#else
+  (void)program;
+  (void)opt_level;
+  fprintf(stderr, "jit: requires LLVM (compile with USE_LLVM=1)\n");
+  return NULL;
+#endif
+}
+
+void codegen_jit_free(CgJit *jit) {
+#if USE_LLVM
+  if (jit) codegen_jit_free_llvm(jit);
+#else
+  (void)jit;
+#endif
+}
+
+CgEntry codegen_jit_compile(CgJit *jit, Node *fn_node, char *error, size_t error_len) {
+#if USE_LLVM
+  return codegen_jit_compile_llvm(jit, fn_node, error, error_len);
+#else
+  (void)jit;
+  (void)fn_node;
+  snprintf(error, error_len, "requires LLVM");
+  return NULL;
+#endif
+}
@@ -1,15 +1,28 @@
 #include "env.h"
+#include "value.h"
 #include <stdlib.h>
 #include <string.h>
 
 Env *env_new(Env *parent) {
   Env *e = (Env*)malloc(sizeof(Env));
-  e->head = NULL; e->parent = parent; e->aux = parent ? parent->aux : NULL; return e;
+  e->head = NULL; e->parent = parent; e->aux = parent ? parent->aux : NULL;
+  e->slots = NULL; e->nslots = 0; e->heap = false; return e;
 }
 
-void env_free(Env *e) {
+void env_init_frame(Env *e, Env *parent, Value *slots, int32_t nslots) {
+  e->head = NULL; e->parent = parent; e->aux = parent ? parent->aux : NULL;
+  e->slots = slots; e->nslots = nslots; e->heap = false;
+  for (int32_t i=0;i<nslots;i++) e->slots[i] = v_unit();
+}
+
+void env_free_entries(Env *e) {
   EnvEntry *cur = e->head;
   while (cur) { EnvEntry *n = cur->next; free(cur); cur = n; }
+  e->head = NULL;
+}
+
+void env_free(Env *e) {
+  env_free_entries(e);
   free(e);
 }
 
@@ -1,6 +1,10 @@
 #include "eval.h"
 #include "parser.h"
+#include "resolve.h"
+#include "bytecode.h"
 #include "str.h"
+#include "thread.h"
+#include "tier.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,9 +25,16 @@ static Type *parse_type_node(Node *n);
 static int vm_import_file_impl(VM *vm, const char *path);
 static int vm_import_resolve_and_load(VM *vm, const char *name);
 
+// Roots owned by the VM itself; frames and temporaries are on the shadow stack
+static void vm_mark_roots(void *user) {
+  VM *vm = (VM*)user;
+  for (EnvEntry *en=vm->global_env->head; en; en=en->next) if (en->value) gc_mark_value(&vm->gc, (Value*)en->value);
+}
+
 VM *vm_new(void) {
   VM *vm = (VM*)calloc(1, sizeof(VM));
   gc_init(&vm->gc);
+  gc_set_root_callback(&vm->gc, vm_mark_roots, vm);
   vm->global_env = env_new(NULL);
   vm->global_env->aux = vm;
 
@@ -31,107 +42,143 @@ VM *vm_new(void) {
   Type *t_i = ty_int(NULL), *t_u = ty_unit(NULL), *t_any = ty_any(NULL);
   Value *vb;
   vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_print, ty_func(NULL, (Type*[]){ t_any }, 1, t_u));
-  env_set(vm->global_env, "print", vb->as.native.type, vb);
+  env_set(vm->global_env, "print", v_native_type(*vb), vb);
   vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_add, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i));
-  env_set(vm->global_env, "+", vb->as.native.type, vb);
+  env_set(vm->global_env, "+", v_native_type(*vb), vb);
   vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_sub, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i));
-  env_set(vm->global_env, "-", vb->as.native.type, vb);
+  env_set(vm->global_env, "-", v_native_type(*vb), vb);
   vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_mul, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i));
-  env_set(vm->global_env, "*", vb->as.native.type, vb);
+  env_set(vm->global_env, "*", v_native_type(*vb), vb);
   vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_div, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i));
-  env_set(vm->global_env, "/", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_eq, ty_func(NULL, (Type*[]){ty_any(NULL),ty_any(NULL)},2,ty_bool(NULL))); env_set(vm->global_env, "=", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_lt, ty_func(NULL, (Type*[]){t_i,t_i},2,ty_bool(NULL))); env_set(vm->global_env, "<", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_gt, ty_func(NULL, (Type*[]){t_i,t_i},2,ty_bool(NULL))); env_set(vm->global_env, ">", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_le, ty_func(NULL, (Type*[]){t_i,t_i},2,ty_bool(NULL))); env_set(vm->global_env, "<=", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_ge, ty_func(NULL, (Type*[]){t_i,t_i},2,ty_bool(NULL))); env_set(vm->global_env, ">=", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_ne, ty_func(NULL, (Type*[]){ty_any(NULL),ty_any(NULL)},2,ty_bool(NULL))); env_set(vm->global_env, "!=", vb->as.native.type, vb);
+  env_set(vm->global_env, "/", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_eq, ty_func(NULL, (Type*[]){ty_any(NULL),ty_any(NULL)},2,ty_bool(NULL))); env_set(vm->global_env, "=", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_lt, ty_func(NULL, (Type*[]){t_i,t_i},2,ty_bool(NULL))); env_set(vm->global_env, "<", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_gt, ty_func(NULL, (Type*[]){t_i,t_i},2,ty_bool(NULL))); env_set(vm->global_env, ">", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_le, ty_func(NULL, (Type*[]){t_i,t_i},2,ty_bool(NULL))); env_set(vm->global_env, "<=", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_ge, ty_func(NULL, (Type*[]){t_i,t_i},2,ty_bool(NULL))); env_set(vm->global_env, ">=", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_ne, ty_func(NULL, (Type*[]){ty_any(NULL),ty_any(NULL)},2,ty_bool(NULL))); env_set(vm->global_env, "!=", v_native_type(*vb), vb);
   // Logical operators
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_not, ty_func(NULL, (Type*[]){ty_bool(NULL)},1,ty_bool(NULL))); env_set(vm->global_env, "not", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_and, ty_func(NULL, (Type*[]){ty_bool(NULL),ty_bool(NULL)},2,ty_bool(NULL))); env_set(vm->global_env, "and", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_or, ty_func(NULL, (Type*[]){ty_bool(NULL),ty_bool(NULL)},2,ty_bool(NULL))); env_set(vm->global_env, "or", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_not, ty_func(NULL, (Type*[]){ty_bool(NULL)},1,ty_bool(NULL))); env_set(vm->global_env, "not", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_and, ty_func(NULL, (Type*[]){ty_bool(NULL),ty_bool(NULL)},2,ty_bool(NULL))); env_set(vm->global_env, "and", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_or, ty_func(NULL, (Type*[]){ty_bool(NULL),ty_bool(NULL)},2,ty_bool(NULL))); env_set(vm->global_env, "or", v_native_type(*vb), vb);
   // Modulo and negation
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_mod, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "mod", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_mod, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "%", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_neg, ty_func(NULL, (Type*[]){t_i},1,t_i)); env_set(vm->global_env, "neg", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_mod, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "mod", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_mod, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "%", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_neg, ty_func(NULL, (Type*[]){t_i},1,t_i)); env_set(vm->global_env, "neg", v_native_type(*vb), vb);
   // String operations
   Type *t_s = ty_str(NULL);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_concat, ty_func(NULL, (Type*[]){t_s,t_s},2,t_s)); env_set(vm->global_env, "str-concat", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_len, ty_func(NULL, (Type*[]){t_s},1,t_i)); env_set(vm->global_env, "str-len", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_slice, ty_func(NULL, (Type*[]){t_s,t_i,t_i},3,t_s)); env_set(vm->global_env, "str-slice", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_index, ty_func(NULL, (Type*[]){t_s,t_s},2,t_i)); env_set(vm->global_env, "str-index", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_concat, ty_func(NULL, (Type*[]){t_s,t_s},2,t_s)); env_set(vm->global_env, "str-concat", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_len, ty_func(NULL, (Type*[]){t_s},1,t_i)); env_set(vm->global_env, "str-len", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_slice, ty_func(NULL, (Type*[]){t_s,t_i,t_i},3,t_s)); env_set(vm->global_env, "str-slice", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_index, ty_func(NULL, (Type*[]){t_s,t_s},2,t_i)); env_set(vm->global_env, "str-index", v_native_type(*vb), vb);
   // Bitwise operations
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_bit_and, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "bit-and", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_bit_or, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "bit-or", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_bit_xor, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "bit-xor", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_bit_not, ty_func(NULL, (Type*[]){t_i},1,t_i)); env_set(vm->global_env, "bit-not", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_shl, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "shl", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_shr, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "shr", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_bit_and, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "bit-and", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_bit_or, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "bit-or", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_bit_xor, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "bit-xor", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_bit_not, ty_func(NULL, (Type*[]){t_i},1,t_i)); env_set(vm->global_env, "bit-not", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_shl, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "shl", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_shr, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "shr", v_native_type(*vb), vb);
   // Extended math
   Type *t_f = ty_float(NULL);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_abs, ty_func(NULL, (Type*[]){t_i},1,t_i)); env_set(vm->global_env, "abs", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_min, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "min", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_max, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "max", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_pow, ty_func(NULL, (Type*[]){t_f,t_f},2,t_f)); env_set(vm->global_env, "pow", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_sqrt, ty_func(NULL, (Type*[]){t_f},1,t_f)); env_set(vm->global_env, "sqrt", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_floor, ty_func(NULL, (Type*[]){t_f},1,t_f)); env_set(vm->global_env, "floor", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_ceil, ty_func(NULL, (Type*[]){t_f},1,t_f)); env_set(vm->global_env, "ceil", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_round, ty_func(NULL, (Type*[]){t_f},1,t_f)); env_set(vm->global_env, "round", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_abs, ty_func(NULL, (Type*[]){t_i},1,t_i)); env_set(vm->global_env, "abs", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_min, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "min", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_max, ty_func(NULL, (Type*[]){t_i,t_i},2,t_i)); env_set(vm->global_env, "max", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_pow, ty_func(NULL, (Type*[]){t_f,t_f},2,t_f)); env_set(vm->global_env, "pow", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_sqrt, ty_func(NULL, (Type*[]){t_f},1,t_f)); env_set(vm->global_env, "sqrt", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_floor, ty_func(NULL, (Type*[]){t_f},1,t_f)); env_set(vm->global_env, "floor", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_ceil, ty_func(NULL, (Type*[]){t_f},1,t_f)); env_set(vm->global_env, "ceil", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_round, ty_func(NULL, (Type*[]){t_f},1,t_f)); env_set(vm->global_env, "round", v_native_type(*vb), vb);
   // String conversions
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_to_int, ty_func(NULL, (Type*[]){t_s},1,t_i)); env_set(vm->global_env, "str-to-int", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_int_to_str, ty_func(NULL, (Type*[]){t_i},1,t_s)); env_set(vm->global_env, "int-to-str", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_to_float, ty_func(NULL, (Type*[]){t_s},1,t_f)); env_set(vm->global_env, "str-to-float", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_float_to_str, ty_func(NULL, (Type*[]){t_f},1,t_s)); env_set(vm->global_env, "float-to-str", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_chan, ty_func(NULL, (Type*[]){},0, ty_chan(NULL, t_i)));
-  env_set(vm->global_env, "chan", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_send, ty_func(NULL, (Type*[]){ ty_chan(NULL, t_i), t_i }, 2, ty_bool(NULL)));
-  env_set(vm->global_env, "send", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_recv, ty_func(NULL, (Type*[]){ ty_chan(NULL, t_i) }, 1, t_i));
-  env_set(vm->global_env, "recv", vb->as.native.type, vb);
-  Type *fn_u_u = ty_func(NULL, (Type*[]){}, 0, t_u); // Unit->Unit
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_spawn, ty_func(NULL, (Type*[]){ fn_u_u }, 1, t_u));
-  env_set(vm->global_env, "spawn", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_to_int, ty_func(NULL, (Type*[]){t_s},1,t_i)); env_set(vm->global_env, "str-to-int", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_int_to_str, ty_func(NULL, (Type*[]){t_i},1,t_s)); env_set(vm->global_env, "int-to-str", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_to_float, ty_func(NULL, (Type*[]){t_s},1,t_f)); env_set(vm->global_env, "str-to-float", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_float_to_str, ty_func(NULL, (Type*[]){t_f},1,t_s)); env_set(vm->global_env, "float-to-str", v_native_type(*vb), vb);
+  // Channels carry any element type; send and recv check it against the channel's
+  Type *t_e = ty_var(NULL, 0), *t_chan = ty_chan(NULL, t_e);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_chan, ty_func(NULL, (Type*[]){},0, t_chan));
+  env_set(vm->global_env, "chan", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_chan_with_cap, ty_func(NULL, (Type*[]){ t_i },1, t_chan));
+  env_set(vm->global_env, "chan-with-cap", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_send, ty_func(NULL, (Type*[]){ t_chan, t_e }, 2, ty_bool(NULL)));
+  env_set(vm->global_env, "send", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_recv, ty_func(NULL, (Type*[]){ t_chan }, 1, t_e));
+  env_set(vm->global_env, "recv", v_native_type(*vb), vb);
+  Type *t_evec = ty_vec(NULL, t_e);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_send_many, ty_func(NULL, (Type*[]){ t_chan, t_evec }, 2, ty_bool(NULL)));
+  env_set(vm->global_env, "send-many", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_recv_many, ty_func(NULL, (Type*[]){ t_chan, t_i }, 2, t_evec));
+  env_set(vm->global_env, "recv-many", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_chan_drain, ty_func(NULL, (Type*[]){ t_chan }, 1, t_evec));
+  env_set(vm->global_env, "chan-drain", v_native_type(*vb), vb);
+  // A task returns whatever its closure does; join hands it back
+  Type *t_thunk = ty_func(NULL, (Type*[]){}, 0, t_e), *t_task = ty_task(NULL, t_e);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_spawn, ty_func(NULL, (Type*[]){ t_thunk }, 1, t_task));
+  env_set(vm->global_env, "spawn", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_join, ty_func(NULL, (Type*[]){ t_task }, 1, t_e));
+  env_set(vm->global_env, "join", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_join_timeout, ty_func(NULL, (Type*[]){ t_task, t_i }, 2, ty_option(NULL, t_e)));
+  env_set(vm->global_env, "join-timeout", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_task_done, ty_func(NULL, (Type*[]){ t_task }, 1, ty_bool(NULL)));
+  env_set(vm->global_env, "task-done?", v_native_type(*vb), vb);
 
   // Collections builtins (untyped/Any for simplicity)
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_vec_new, ty_func(NULL, (Type*[]){}, 0, ty_vec(NULL, ty_any(NULL)))); env_set(vm->global_env, "vec", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_vec_push, ty_func(NULL, (Type*[]){ty_vec(NULL,ty_any(NULL)),ty_any(NULL)},2, t_u)); env_set(vm->global_env, "vec-push", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_vec_get, ty_func(NULL, (Type*[]){ty_vec(NULL,ty_any(NULL)), t_i},2, ty_any(NULL))); env_set(vm->global_env, "vec-get", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_vec_len, ty_func(NULL, (Type*[]){ty_vec(NULL,ty_any(NULL))},1, t_i)); env_set(vm->global_env, "vec-len", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_vec_new, ty_func(NULL, (Type*[]){}, 0, ty_vec(NULL, ty_any(NULL)))); env_set(vm->global_env, "vec", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_vec_push, ty_func(NULL, (Type*[]){ty_vec(NULL,ty_any(NULL)),ty_any(NULL)},2, t_u)); env_set(vm->global_env, "vec-push", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_vec_get, ty_func(NULL, (Type*[]){ty_vec(NULL,ty_any(NULL)), t_i},2, ty_any(NULL))); env_set(vm->global_env, "vec-get", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_vec_len, ty_func(NULL, (Type*[]){ty_vec(NULL,ty_any(NULL))},1, t_i)); env_set(vm->global_env, "vec-len", v_native_type(*vb), vb);
+  // Parallel ops: 'a is the element type, 'b what pmap's function returns
+  Type *t_a = ty_var(NULL, 0), *t_b = ty_var(NULL, 1), *t_avec = ty_vec(NULL, t_a);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_pmap, ty_func(NULL, (Type*[]){ t_avec, ty_func(NULL, (Type*[]){ t_a }, 1, t_b) }, 2, ty_vec(NULL, t_b)));
+  env_set(vm->global_env, "pmap", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_pfilter, ty_func(NULL, (Type*[]){ t_avec, ty_func(NULL, (Type*[]){ t_a }, 1, ty_bool(NULL)) }, 2, t_avec));
+  env_set(vm->global_env, "pfilter", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_preduce, ty_func(NULL, (Type*[]){ t_avec, t_a, ty_func(NULL, (Type*[]){ t_a, t_a }, 2, t_a) }, 3, t_a));
+  env_set(vm->global_env, "preduce", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_pfor, ty_func(NULL, (Type*[]){ t_avec, ty_func(NULL, (Type*[]){ t_a }, 1, t_b) }, 2, t_u));
+  env_set(vm->global_env, "pfor", v_native_type(*vb), vb);
   // Macro list/symbol helpers
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_list, ty_func(NULL, (Type*[]){t_any},1, ty_bool(NULL))); env_set(vm->global_env, "list?", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_symbol, ty_func(NULL, (Type*[]){t_any},1, ty_bool(NULL))); env_set(vm->global_env, "symbol?", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_symbol_eq, ty_func(NULL, (Type*[]){t_any,t_any},2, ty_bool(NULL))); env_set(vm->global_env, "symbol=", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_list_len, ty_func(NULL, (Type*[]){t_any},1, t_i)); env_set(vm->global_env, "list-len", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_list_head, ty_func(NULL, (Type*[]){t_any},1, t_any)); env_set(vm->global_env, "list-head", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_list_tail, ty_func(NULL, (Type*[]){t_any},1, t_any)); env_set(vm->global_env, "list-tail", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_list_cons, ty_func(NULL, (Type*[]){t_any,t_any},2, t_any)); env_set(vm->global_env, "list-cons", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_list_append, ty_func(NULL, (Type*[]){t_any,t_any},2, t_any)); env_set(vm->global_env, "list-append", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_list, ty_func(NULL, (Type*[]){t_any},1, ty_bool(NULL))); env_set(vm->global_env, "list?", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_symbol, ty_func(NULL, (Type*[]){t_any},1, ty_bool(NULL))); env_set(vm->global_env, "symbol?", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_symbol_eq, ty_func(NULL, (Type*[]){t_any,t_any},2, ty_bool(NULL))); env_set(vm->global_env, "symbol=", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_list_len, ty_func(NULL, (Type*[]){t_any},1, t_i)); env_set(vm->global_env, "list-len", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_list_head, ty_func(NULL, (Type*[]){t_any},1, t_any)); env_set(vm->global_env, "list-head", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_list_tail, ty_func(NULL, (Type*[]){t_any},1, t_any)); env_set(vm->global_env, "list-tail", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_list_cons, ty_func(NULL, (Type*[]){t_any,t_any},2, t_any)); env_set(vm->global_env, "list-cons", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_list_append, ty_func(NULL, (Type*[]){t_any,t_any},2, t_any)); env_set(vm->global_env, "list-append", v_native_type(*vb), vb);
   // Strings
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_split_ws, ty_func(NULL, (Type*[]){t_any},1, ty_vec(NULL, ty_str(NULL)))); env_set(vm->global_env, "str-split-ws", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_read_file, ty_func(NULL, (Type*[]){t_s},1, t_s)); env_set(vm->global_env, "read-file", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_write_file, ty_func(NULL, (Type*[]){t_s,t_s},2, ty_bool(NULL))); env_set(vm->global_env, "write-file", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_str_split_ws, ty_func(NULL, (Type*[]){t_any},1, ty_vec(NULL, ty_str(NULL)))); env_set(vm->global_env, "str-split-ws", v_native_type(*vb), vb);
   // Maps
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_new, ty_func(NULL, (Type*[]){},0, ty_map(NULL, ty_str(NULL), t_i))); env_set(vm->global_env, "map", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_set, ty_func(NULL, (Type*[]){ty_map(NULL,ty_str(NULL),t_i), ty_str(NULL), t_i},3, t_u)); env_set(vm->global_env, "map-set", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_get, ty_func(NULL, (Type*[]){ty_map(NULL,ty_str(NULL),t_i), ty_str(NULL)},2, t_i)); env_set(vm->global_env, "map-get", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_len, ty_func(NULL, (Type*[]){ty_map(NULL,ty_str(NULL),t_i)},1, t_i)); env_set(vm->global_env, "map-len", vb->as.native.type, vb);
+  Type *t_k = ty_var(NULL, 0), *t_v = ty_var(NULL, 1), *t_map = ty_map(NULL, t_k, t_v);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_new, ty_func(NULL, (Type*[]){},0, t_map)); env_set(vm->global_env, "map", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_set, ty_func(NULL, (Type*[]){t_map, t_k, t_v},3, t_u)); env_set(vm->global_env, "map-set", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_get, ty_func(NULL, (Type*[]){t_map, t_k},2, t_v)); env_set(vm->global_env, "map-get", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_get_or, ty_func(NULL, (Type*[]){t_map, t_k, t_v},3, t_v)); env_set(vm->global_env, "map-get-or", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_has, ty_func(NULL, (Type*[]){t_map, t_k},2, ty_bool(NULL))); env_set(vm->global_env, "map-has?", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_del, ty_func(NULL, (Type*[]){t_map, t_k},2, ty_bool(NULL))); env_set(vm->global_env, "map-del", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_len, ty_func(NULL, (Type*[]){t_map},1, t_i)); env_set(vm->global_env, "map-len", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_keys, ty_func(NULL, (Type*[]){t_map},1, ty_vec(NULL, t_k))); env_set(vm->global_env, "map-keys", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_map_vals, ty_func(NULL, (Type*[]){t_map},1, ty_vec(NULL, t_v))); env_set(vm->global_env, "map-vals", v_native_type(*vb), vb);
   // Option type operations
   Type *t_opt = ty_option(NULL, t_any);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_some, ty_func(NULL, (Type*[]){t_any},1, t_opt)); env_set(vm->global_env, "some", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_none_val, ty_func(NULL, (Type*[]){},0, t_opt)); env_set(vm->global_env, "none", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_some, ty_func(NULL, (Type*[]){t_opt},1, ty_bool(NULL))); env_set(vm->global_env, "some?", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_none, ty_func(NULL, (Type*[]){t_opt},1, ty_bool(NULL))); env_set(vm->global_env, "none?", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_unwrap, ty_func(NULL, (Type*[]){t_any},1, t_any)); env_set(vm->global_env, "unwrap", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_unwrap_or, ty_func(NULL, (Type*[]){t_any,t_any},2, t_any)); env_set(vm->global_env, "unwrap-or", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_some, ty_func(NULL, (Type*[]){t_any},1, t_opt)); env_set(vm->global_env, "some", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_none_val, ty_func(NULL, (Type*[]){},0, t_opt)); env_set(vm->global_env, "none", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_some, ty_func(NULL, (Type*[]){t_opt},1, ty_bool(NULL))); env_set(vm->global_env, "some?", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_none, ty_func(NULL, (Type*[]){t_opt},1, ty_bool(NULL))); env_set(vm->global_env, "none?", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_unwrap, ty_func(NULL, (Type*[]){t_any},1, t_any)); env_set(vm->global_env, "unwrap", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_unwrap_or, ty_func(NULL, (Type*[]){t_any,t_any},2, t_any)); env_set(vm->global_env, "unwrap-or", v_native_type(*vb), vb);
   // Result type operations
   Type *t_res = ty_result(NULL, t_any, t_any);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_ok_val, ty_func(NULL, (Type*[]){t_any},1, t_res)); env_set(vm->global_env, "ok", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_err_val, ty_func(NULL, (Type*[]){t_any},1, t_res)); env_set(vm->global_env, "err", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_ok, ty_func(NULL, (Type*[]){t_res},1, ty_bool(NULL))); env_set(vm->global_env, "ok?", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_err, ty_func(NULL, (Type*[]){t_res},1, ty_bool(NULL))); env_set(vm->global_env, "err?", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_unwrap_err, ty_func(NULL, (Type*[]){t_res},1, t_any)); env_set(vm->global_env, "unwrap-err", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_ok_val, ty_func(NULL, (Type*[]){t_any},1, t_res)); env_set(vm->global_env, "ok", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_err_val, ty_func(NULL, (Type*[]){t_any},1, t_res)); env_set(vm->global_env, "err", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_ok, ty_func(NULL, (Type*[]){t_res},1, ty_bool(NULL))); env_set(vm->global_env, "ok?", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_is_err, ty_func(NULL, (Type*[]){t_res},1, ty_bool(NULL))); env_set(vm->global_env, "err?", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_unwrap_err, ty_func(NULL, (Type*[]){t_res},1, t_any)); env_set(vm->global_env, "unwrap-err", v_native_type(*vb), vb);
   // Struct operations (struct-new is variadic, first arg is name string)
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_struct_new, ty_func(NULL, (Type*[]){t_any},1, t_any)); env_set(vm->global_env, "struct-new", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_struct_get, ty_func(NULL, (Type*[]){t_any,t_i},2, t_any)); env_set(vm->global_env, "struct-get", vb->as.native.type, vb);
-  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_struct_set, ty_func(NULL, (Type*[]){t_any,t_i,t_any},3, t_u)); env_set(vm->global_env, "struct-set", vb->as.native.type, vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_struct_new, ty_func(NULL, (Type*[]){t_any},1, t_any)); env_set(vm->global_env, "struct-new", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_struct_get, ty_func(NULL, (Type*[]){t_any,t_i},2, t_any)); env_set(vm->global_env, "struct-get", v_native_type(*vb), vb);
+  vb = (Value*)malloc(sizeof(Value)); *vb = v_native(rt_struct_set, ty_func(NULL, (Type*[]){t_any,t_i,t_any},3, t_u)); env_set(vm->global_env, "struct-set", v_native_type(*vb), vb);
   return vm;
 }
 
@@ -140,6 +187,7 @@ void vm_free(VM *vm) {
   ModArena *ma = vm->mod_arenas; while (ma) { ModArena *nx = ma->next; if (ma->arena) { arena_free(ma->arena); free(ma->arena); } free(ma); ma = nx; }
   // Free import cache
   ModNode *mn = vm->imported; while (mn) { ModNode *nx = mn->next; free(mn->path); free(mn); mn = nx; }
+  tier_free(vm->tier);
   gc_free_all(&vm->gc); env_free(vm->global_env); free(vm);
 }
 
@@ -147,13 +195,51 @@ static int is_sym(Node *n, const char *s) {
   return n && n->kind==N_SYMBOL && strlen(s)==n->as.sym.len && strncmp(n->as.sym.ptr, s, n->as.sym.len)==0;
 }
 
-// Helper for quasiquote: push value to ValList
-static void qq_vl_push(ValList *vl, Value v) {
-  if (vl->len == vl->cap) {
-    vl->cap = vl->cap ? vl->cap * 2 : 4;
-    vl->items = (Value*)realloc(vl->items, sizeof(Value) * vl->cap);
+// Type-annotation marker; checked on every call, so avoid strlen/strncmp
+static int is_colon(Node *n) {
+  return n->kind==N_SYMBOL && n->as.sym.len==1 && n->as.sym.ptr[0]==':';
+}
+
+// Storage of a resolved symbol: a slot in the frame chain or a global cell
+static Value *sym_location(Env *env, Node *sym) {
+  if (sym->as.sym.cell) return sym->as.sym.cell;
+  if (sym->as.sym.slot < 0) return NULL;
+  Env *e = env;
+  for (int32_t d=sym->as.sym.depth; d>0; d--) e = e->parent;
+  return &e->slots[sym->as.sym.slot];
+}
+
+// Store into a binding occurrence (def/let/param/enum variant) or set! target
+// annotated by the resolver. Stack frames and globals are roots; captured
+// frames are old objects and need the write barrier.
+static void bind_sym(VM *vm, Env *env, Node *sym, Value v) {
+  if (sym->as.sym.cell) { *sym->as.sym.cell = v; return; }
+  if (sym->as.sym.slot < 0) return;
+  Env *e = env;
+  for (int32_t d=sym->as.sym.depth; d>0; d--) e = e->parent;
+  e->slots[sym->as.sym.slot] = v;
+  if (e->heap) gc_write_barrier(&vm->gc, &env_heap_frame(e)->hdr, v_obj(v));
+}
+
+// Heap-allocated frame for a scope the resolver marked as captured
+static Env *heap_frame(VM *vm, Env *parent, int32_t nslots) {
+  HeapFrame *f = (HeapFrame*)gc_alloc(&vm->gc, sizeof(HeapFrame) + sizeof(Value)*(size_t)nslots, OBJ_FRAME);
+  env_init_frame(&f->env, parent, (Value*)(f+1), nslots);
+  f->env.heap = true;
+  return &f->env;
+}
+
+// Quasiquote collects items in a rooted malloc'd buffer, since splicing means
+// the final length is unknown until the whole template has been evaluated
+typedef struct QqBuf { Value *items; int32_t len, cap; GcRoot root; } QqBuf;
+
+static void qq_push(QqBuf *b, Value v) {
+  if (b->len == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 8;
+    b->items = (Value*)realloc(b->items, sizeof(Value) * (size_t)b->cap);
+    b->root.vals = b->items;
   }
-  vl->items[vl->len++] = v;
+  b->items[b->len++] = v; b->root.n = b->len;
 }
 
 // Forward decl for qq_eval
@@ -167,24 +253,25 @@ static Value qq_eval(VM *vm, Env *env, Node *node) {
         is_sym(node->as.list.items[0], "unquote")) {
       return eval_node(vm, env, node->as.list.items[1]);
     }
-    ValList *vl = (ValList*)gc_alloc(&vm->gc, sizeof(ValList), 7);
-    vl->len = 0; vl->cap = 0; vl->items = NULL;
+    QqBuf b = {0}; gc_push_root(&b.root, NULL, 0, NULL);
     for (size_t i = 0; i < node->as.list.count; i++) {
       Node *el = node->as.list.items[i];
       if (el->kind == N_LIST && el->as.list.count >= 2 &&
           el->as.list.items[0]->kind == N_SYMBOL &&
           is_sym(el->as.list.items[0], "unquote-splicing")) {
         Value sp = eval_node(vm, env, el->as.list.items[1]);
-        if (sp.kind == VAL_LIST && sp.as.list) {
-          for (int k = 0; k < sp.as.list->len; k++)
-            qq_vl_push(vl, sp.as.list->items[k]);
+        if (v_kind(sp) == VAL_LIST && v_as_list(sp)) {
+          for (int k = 0; k < v_as_list(sp)->len; k++) qq_push(&b, v_as_list(sp)->items[k]);
         } else {
-          qq_vl_push(vl, sp);
+          qq_push(&b, sp);
         }
       } else {
-        qq_vl_push(vl, qq_eval(vm, env, el));
+        qq_push(&b, qq_eval(vm, env, el));
       }
     }
+    ValList *vl = rt_list_new(vm, b.len);
+    if (b.len) memcpy(vl->items, b.items, sizeof(Value) * (size_t)b.len);
+    gc_pop_root(&b.root); free(b.items);
     return v_list(vl);
   }
   switch (node->kind) {
@@ -197,6 +284,58 @@ static Value qq_eval(VM *vm, Env *env, Node *node) {
   }
 }
 
+// [select arm...]: evaluate each arm's channel and value to send in order,
+// wait for the first case that can proceed, then run that arm's body
+static Value eval_select(VM *vm, Env *env, Node *list) {
+  size_t n = list->as.list.count;
+  RtSelectCase *cs = (RtSelectCase*)alloca(sizeof(RtSelectCase)*n);
+  Node **arms = (Node**)alloca(sizeof(Node*)*n);
+  // Values to send and received values, then the channels, rooted across
+  // evaluating the rest and the wait
+  Value *vals = (Value*)alloca(sizeof(Value)*2*n), *chans = vals + n;
+  for (size_t i=0;i<2*n;i++) vals[i] = v_unit();
+  GcRoot root; gc_push_root(&root, vals, (int32_t)(2*n), NULL);
+  int ncase = 0; int64_t timeout = -1; Node *fallback = NULL;
+  for (size_t i=1;i<n;i++) {
+    Node *arm = list->as.list.items[i];
+    SelectArm kind = select_arm(arm);
+    Node *op = arm->as.list.items[0];
+    if (kind==SELECT_DEFAULT) { timeout = 0; fallback = arm; continue; }
+    if (kind==SELECT_TIMEOUT) {
+      Value ms = eval_node(vm, env, op->as.list.items[1]);
+      timeout = v_kind(ms)==VAL_INT && v_as_int(ms)>0 ? v_as_int(ms) : 0; fallback = arm;
+      continue;
+    }
+    Value ch = chans[ncase] = eval_node(vm, env, op->as.list.items[1]);
+    if (v_kind(ch)!=VAL_CHAN) { fprintf(stderr, "select: not a channel\n"); gc_pop_root(&root); return v_unit(); }
+    if (kind==SELECT_SEND) {
+      vals[ncase] = eval_node(vm, env, op->as.list.items[2]);
+      rt_chan_barrier(vm, chans[ncase], vals[ncase]);
+    }
+    cs[ncase] = (RtSelectCase){ v_as_chan(chans[ncase]), &vals[ncase], kind==SELECT_SEND };
+    arms[ncase++] = arm;
+  }
+  int k = rt_channel_select(cs, ncase, timeout);
+  if (k>=0 && cs[k].send) rt_chan_barrier(vm, chans[k], vals[k]);
+  Node *arm = k>=0 ? arms[k] : fallback;
+  Value result = v_unit();
+  if (!arm) { gc_pop_root(&root); return result; }
+  if (k>=0 && !cs[k].send) {
+    Env frame, *child;
+    if (arm->as.list.captured) child = heap_frame(vm, env, arm->as.list.nslots);
+    else { child = &frame; env_init_frame(child, env, (Value*)alloca(sizeof(Value)*(arm->as.list.nslots+1)), arm->as.list.nslots); }
+    GcRoot froot; gc_push_root(&froot, NULL, 0, child);
+    bind_sym(vm, child, arm->as.list.items[1], vals[k]);
+    for (size_t i=2;i<arm->as.list.count;i++) result = eval_node(vm, child, arm->as.list.items[i]);
+    gc_pop_root(&froot);
+    if (child==&frame) env_free_entries(child);
+  } else {
+    for (size_t i=1;i<arm->as.list.count;i++) result = eval_node(vm, env, arm->as.list.items[i]);
+  }
+  gc_pop_root(&root);
+  return result;
+}
+
 // no-op now; direct native fns are stored
 
 // Closure call
@@ -209,12 +348,12 @@ static Value eval_list(VM *vm, Env *env, Node *list) {
   size_t n = list->as.list.count;
   if (n==0) return v_unit();
   Node *head = list->as.list.items[0];
-  if (head->kind==N_SYMBOL) {
-    if (is_sym(head, "defmacro")) {
+  switch (list->as.list.form) {
+    case FORM_DEFMACRO: {
       // handled in macro collection; during eval treat as no-op
       list->ty = ty_unit(NULL); return v_unit();
     }
-    if (is_sym(head, "def")) {
+    case FORM_DEF: {
       // [def name expr] or [def name : Type expr]
       if (n<3) return v_unit();
       Node *name = list->as.list.items[1];
@@ -224,11 +363,10 @@ static Value eval_list(VM *vm, Env *env, Node *list) {
       }
       if (idx<n) expr = list->as.list.items[idx];
       Value v = eval_node(vm, env, expr);
-      Value *box = (Value*)malloc(sizeof(Value)); *box = v;
-      env_set(env, name->as.sym.ptr, expr?expr->ty:NULL, box);
+      bind_sym(vm, env, name, v);
       return v_unit();
     }
-    if (is_sym(head, "quote")) {
+    case FORM_QUOTE: {
       if (n<2) return v_unit();
       Node *q = list->as.list.items[1];
       // Turn AST node into Value (symbol/string/int/bool, and list)
@@ -239,15 +377,26 @@ static Value eval_list(VM *vm, Env *env, Node *list) {
         case N_STRING: return v_str(rt_string_new(vm, q->as.str.ptr, q->as.str.len));
         case N_SYMBOL: return v_symbol(q->as.sym.ptr, (int32_t)q->as.sym.len);
         case N_LIST: {
-          ValList *vl = (ValList*)gc_alloc(&vm->gc, sizeof(ValList), 3);
-          vl->len = (int32_t)q->as.list.count; vl->cap = vl->len;
-          vl->items = (Value*)malloc(sizeof(Value)*vl->len);
-          for (int i=0;i<vl->len;i++) vl->items[i] = eval_node(vm, env, (Node*)q->as.list.items[i]);
-          return v_list(vl);
+          int32_t len = (int32_t)q->as.list.count;
+          ValList *vl = rt_list_new(vm, len);
+          for (int32_t i=0;i<len;i++) vl->items[i] = v_unit();
+          Value lv = v_list(vl);
+          GcRoot root; gc_push_root(&root, &lv, 1, NULL);
+          // the list may be promoted while elements are evaluated, so it is
+          // re-read from the root; collections run meanwhile, so each store
+          // goes through the barrier
+          for (int32_t i=0;i<len;i++) {
+            Value item = eval_node(vm, env, (Node*)q->as.list.items[i]);
+            v_as_list(lv)->items[i] = item;
+            gc_write_barrier(&vm->gc, &v_as_list(lv)->hdr, v_obj(item));
+          }
+          gc_pop_root(&root);
+          return lv;
         }
       }
+      return v_unit();
     }
-    if (is_sym(head, "quasiquote")) {
+    case FORM_QUASIQUOTE: {
       // quasiquote with unquote and unquote-splicing
       if (n<2) { list->ty = ty_any(NULL); return v_unit(); }
       Node *q = list->as.list.items[1];
@@ -255,11 +404,14 @@ static Value eval_list(VM *vm, Env *env, Node *list) {
       list->ty = ty_any(NULL);
       return out;
     }
-    if (is_sym(head, "let")) {
+    case FORM_LET: {
       // [let [[name expr] ...] body...]
       if (n<3) return v_unit();
       Node *binds = list->as.list.items[1];
-      Env *child = env_new(env);
+      Env frame, *child;
+      if (list->as.list.captured) child = heap_frame(vm, env, list->as.list.nslots);
+      else { child = &frame; env_init_frame(child, env, (Value*)alloca(sizeof(Value)*(list->as.list.nslots+1)), list->as.list.nslots); }
+      GcRoot root; gc_push_root(&root, NULL, 0, child);
       for (size_t i=0;i<binds->as.list.count;i++) {
         Node *pair = binds->as.list.items[i];
         if (pair->kind!=N_LIST || pair->as.list.count<2) continue;
@@ -274,53 +426,48 @@ static Value eval_list(VM *vm, Env *env, Node *list) {
           ex = pair->as.list.items[1];
         }
         Value v = eval_node(vm, child, ex);  // Use child env so previous bindings are visible
-        Value *box = (Value*)malloc(sizeof(Value)); *box=v;
-        env_set(child, nm->as.sym.ptr, ex->ty, box);
+        bind_sym(vm, child, nm, v);
       }
       Value result = v_unit();
       for (size_t i=2;i<n;i++) result = eval_node(vm, child, list->as.list.items[i]);
-      // NOTE: Don't free child - closures may have captured it (GC should handle this)
-      // env_free(child);
+      gc_pop_root(&root);
+      // Captured frames stay alive for their closures
+      if (child==&frame) env_free_entries(child);
       return result;
     }
-    if (is_sym(head, "if")) {
+    case FORM_IF: {
       if (n!=4) return v_unit();
       Value cond = eval_node(vm, env, list->as.list.items[1]);
-      if (cond.kind==VAL_BOOL && cond.as.b) return eval_node(vm, env, list->as.list.items[2]);
+      if (v_kind(cond)==VAL_BOOL && v_as_bool(cond)) return eval_node(vm, env, list->as.list.items[2]);
       return eval_node(vm, env, list->as.list.items[3]);
     }
-    if (is_sym(head, "do")) {
+    case FORM_DO: {
       Value v=v_unit();
       for (size_t i=1;i<n;i++) v = eval_node(vm, env, list->as.list.items[i]);
       return v;
     }
-    // while loop: [while condition body...]
-    if (is_sym(head, "while")) {
+    // while loop: [while condition body...]; Unit, as typechecked
+    case FORM_WHILE: {
       if (n < 2) return v_unit();
-      Value result = v_unit();
       for (;;) {
         Value cond = eval_node(vm, env, list->as.list.items[1]);
-        if (cond.kind != VAL_BOOL || !cond.as.b) break;
-        for (size_t i = 2; i < n; i++) {
-          result = eval_node(vm, env, list->as.list.items[i]);
-        }
+        if (v_kind(cond) != VAL_BOOL || !v_as_bool(cond)) break;
+        for (size_t i = 2; i < n; i++) (void)eval_node(vm, env, list->as.list.items[i]);
+        tier_backedge();
+        gc_safepoint(&vm->gc);
       }
-      return result;
+      return v_unit();
     }
     // set! mutation: [set! name value]
-    if (is_sym(head, "set!")) {
+    case FORM_SET: {
       if (n != 3 || list->as.list.items[1]->kind != N_SYMBOL) return v_unit();
-      const char *name = list->as.list.items[1]->as.sym.ptr;
-      size_t namelen = list->as.list.items[1]->as.sym.len;
-      char tmp[256]; if (namelen >= sizeof(tmp)) namelen = sizeof(tmp)-1;
-      memcpy(tmp, name, namelen); tmp[namelen] = '\0';
-      EnvEntry *e = env_lookup(env, tmp);
-      if (!e || !e->value) { fprintf(stderr, "set!: undefined variable: %s\n", tmp); return v_unit(); }
+      Node *target = list->as.list.items[1];
+      if (!sym_location(env, target)) { fprintf(stderr, "set!: undefined variable: %s\n", target->as.sym.ptr); return v_unit(); }
       Value newval = eval_node(vm, env, list->as.list.items[2]);
-      *(Value*)e->value = newval;
+      bind_sym(vm, env, target, newval);
       return v_unit();
     }
-    if (is_sym(head, "import")) {
+    case FORM_IMPORT: {
       if (n!=2 || list->as.list.items[1]->kind!=N_STRING) return v_unit();
       char tmp[1024]; size_t len = list->as.list.items[1]->as.str.len;
       if (len >= sizeof(tmp)) len = sizeof(tmp)-1;
@@ -329,7 +476,7 @@ static Value eval_list(VM *vm, Env *env, Node *list) {
       return v_unit();
     }
     // defstruct: [defstruct Name [[field1 : Type1] [field2 : Type2] ...]]
-    if (is_sym(head, "defstruct")) {
+    case FORM_DEFSTRUCT: {
       if (n < 3 || list->as.list.items[1]->kind != N_SYMBOL) return v_unit();
       const char *name = list->as.list.items[1]->as.sym.ptr;
       Node *fields_node = list->as.list.items[2];
@@ -351,7 +498,7 @@ static Value eval_list(VM *vm, Env *env, Node *list) {
       return v_unit();
     }
     // defenum: [defenum Name [Variant1 Variant2 ...]]
-    if (is_sym(head, "defenum")) {
+    case FORM_DEFENUM: {
       if (n < 3 || list->as.list.items[1]->kind != N_SYMBOL) return v_unit();
       const char *name = list->as.list.items[1]->as.sym.ptr;
       Node *variants_node = list->as.list.items[2];
@@ -366,30 +513,46 @@ static Value eval_list(VM *vm, Env *env, Node *list) {
       // Register enum type and variant constructors
       env_set(env, name, enum_ty, NULL);
 
-      // Register each variant as a value
+      // Register each variant as a value (an integer tag)
       for (size_t i = 0; i < nvariants; i++) {
-        Value *vb = (Value*)malloc(sizeof(Value));
-        *vb = v_int((int64_t)i); // Each variant is an integer tag
-        env_set(env, variants[i], ty_int(NULL), vb);
+        bind_sym(vm, env, variants_node->as.list.items[i], v_int((int64_t)i));
       }
       return v_unit();
     }
-    if (is_sym(head, "fn")) {
+    case FORM_SELECT: return eval_select(vm, env, list);
+    // [with-tasks body...]: like do, then wait for every task spawned inside
+    case FORM_WITH_TASKS: {
+      RtGroup g; rt_group_init(&g);
+      RtGroup *prev = rt_group_enter(&g);
+      Value v = v_unit();
+      GcRoot root; gc_push_root(&root, &v, 1, NULL);
+      for (size_t i=1;i<n;i++) v = eval_node(vm, env, list->as.list.items[i]);
+      rt_group_leave(&g, prev);
+      gc_pop_root(&root);
+      return v;
+    }
+    case FORM_FN: {
       // Build closure
-      Closure *c = (Closure*)gc_alloc(&vm->gc, sizeof(Closure), 2);
+      Closure *c = (Closure*)gc_alloc(&vm->gc, sizeof(Closure), OBJ_CLOSURE);
       c->fn_node = list; c->env = env; c->type = list->ty; // static type annotated
       return v_closure(c);
     }
+    default:
+      break;
   }
-  // Function call
-  // Evaluate head
-  Value fval = eval_node(vm, env, head);
+  // Function call: callee in callv[0], arguments after it; rooted while the
+  // remaining arguments are evaluated
   int argc = (int)(n-1);
-  Value *argv = (Value*)alloca(sizeof(Value)*argc);
-  for (int i=0;i<argc;i++) argv[i] = eval_node(vm, env, list->as.list.items[i+1]);
-  if (fval.kind==VAL_FUNC) return fval.as.native.fn(env, argv, argc);
-  if (fval.kind==VAL_CLOSURE) return vm_call_closure(vm, fval.as.clos, argv, argc);
-  return v_unit();
+  Value *callv = (Value*)alloca(sizeof(Value)*n);
+  for (size_t i=0;i<n;i++) callv[i] = v_unit();
+  GcRoot root; gc_push_root(&root, callv, (int32_t)n, NULL);
+  callv[0] = eval_node(vm, env, head);
+  for (int i=0;i<argc;i++) callv[i+1] = eval_node(vm, env, list->as.list.items[i+1]);
+  Value fval = callv[0], result = v_unit();
+  if (v_kind(fval)==VAL_FUNC) result = v_as_native(fval)(env, callv+1, argc);
+  else if (v_kind(fval)==VAL_CLOSURE) result = vm_call_closure(vm, v_as_clos(fval), callv+1, argc);
+  gc_pop_root(&root);
+  return result;
 }
 
 static Value eval_node(VM *vm, Env *env, Node *n) {
@@ -399,37 +562,63 @@ static Value eval_node(VM *vm, Env *env, Node *n) {
     case N_BOOL: return v_bool(n->as.bval);
     case N_STRING: return v_str(rt_string_new(vm, n->as.str.ptr, n->as.str.len));
     case N_SYMBOL: {
-      EnvEntry *e = env_lookup(env, n->as.sym.ptr);
-      if (!e) return v_unit();
-      if (!e->value) return v_unit();
-      return *(Value*)e->value;
+      if (n->as.sym.cell) return *n->as.sym.cell;
+      if (n->as.sym.slot < 0) return v_unit();
+      Env *e = env;
+      for (int32_t d=n->as.sym.depth; d>0; d--) e = e->parent;
+      return e->slots[n->as.sym.slot];
     }
     case N_LIST: return eval_list(vm, env, n);
   }
   return v_unit();
 }
 
-Value vm_call_closure(VM *vm, Closure *c, Value *args, int nargs) {
+static Value run_closure(VM *vm, Closure *c, Value *args, int nargs) {
   // fn form: [fn [[name : Type] ...] : Ret body...]
+  if (vm->engine==ENGINE_BC) {
+    Value out;
+    if (bc_call(vm, c, args, nargs, &out)) return out;
+  }
   Node *fn = (Node*)c->fn_node; Node *params = fn->as.list.items[1];
-  Env *callenv = env_new(c->env);
+  Env frame, *callenv;
+  if (fn->as.list.captured) callenv = heap_frame(vm, c->env, fn->as.list.nslots);
+  else { callenv = &frame; env_init_frame(callenv, c->env, (Value*)alloca(sizeof(Value)*(fn->as.list.nslots+1)), fn->as.list.nslots); }
   Value result = v_unit();
   int provided = nargs;
   int expected = (int)params->as.list.count;
   int nbind = provided<expected?provided:expected;
   for (int i=0;i<nbind;i++) {
     Node *p = params->as.list.items[i];
-    const char *nm = p->as.list.items[0]->as.sym.ptr;
-    Value *box = (Value*)malloc(sizeof(Value)); *box = args[i];
-    env_set(callenv, nm, NULL, box);
+    bind_sym(vm, callenv, p->as.list.items[0], args[i]);
   }
+  GcRoot root; gc_push_root(&root, NULL, 0, callenv);
+  gc_safepoint(&vm->gc);
   // Execute body
   size_t i0 = 2; // skip 'fn' and params
   // optional ':' ret-type
-  if (fn->as.list.count>i0 && is_sym(fn->as.list.items[i0], ":")) i0+=2;
+  if (fn->as.list.count>i0 && is_colon(fn->as.list.items[i0])) i0+=2;
   for (size_t i=i0;i<fn->as.list.count;i++) result = eval_node(vm, callenv, fn->as.list.items[i]);
-  // NOTE: Don't free callenv - closures may have captured it (GC should handle this)
-  // env_free(callenv);
+  gc_pop_root(&root);
+  // Captured frames stay alive for their closures
+  if (callenv==&frame) env_free_entries(callenv);
+  return result;
+}
+
+static Value call_closure(VM *vm, Closure *c, Value *args, int nargs) {
+  if (!vm->tier) return run_closure(vm, c, args, nargs);
+  Value out;
+  if (tier_call(vm, c, args, nargs, &out)) return out;
+  TierFn *outer = tier_enter((Node*)c->fn_node);
+  out = run_closure(vm, c, args, nargs);
+  tier_leave(outer);
+  return out;
+}
+
+Value vm_call_closure(VM *vm, Closure *c, Value *args, int nargs) {
+  v_set_heap(&vm->gc); // entry point for main, spawned threads and macros
+  gc_enter(&vm->gc);
+  Value result = call_closure(vm, c, args, nargs);
+  gc_exit();
   return result;
 }
 
@@ -453,6 +642,10 @@ static Type *parse_type_node(Node *n) {
     if (n->as.list.count==2 && n->as.list.items[0]->kind==N_SYMBOL && is_sym(n->as.list.items[0], "Vec")) {
       return ty_vec(NULL, parse_type_node(n->as.list.items[1]));
     }
+    // Task
+    if (n->as.list.count==2 && n->as.list.items[0]->kind==N_SYMBOL && is_sym(n->as.list.items[0], "Task")) {
+      return ty_task(NULL, parse_type_node(n->as.list.items[1]));
+    }
     // Map
     if (n->as.list.count==3 && n->as.list.items[0]->kind==N_SYMBOL && is_sym(n->as.list.items[0], "Map")) {
       return ty_map(NULL, parse_type_node(n->as.list.items[1]), parse_type_node(n->as.list.items[2]));
@@ -489,9 +682,9 @@ static int typecheck_node(Env *tenv, Node *n) {
 static int typecheck_list(Env *tenv, Node *list) {
   if (list->as.list.count==0) { list->ty=ty_unit(NULL); return 1; }
   Node *head = list->as.list.items[0];
-  if (head->kind==N_SYMBOL) {
-    if (is_sym(head, "defmacro")) { list->ty = ty_unit(NULL); return 1; }
-    if (is_sym(head, "def")) {
+  switch (list->as.list.form) {
+    case FORM_DEFMACRO: { list->ty = ty_unit(NULL); return 1; }
+    case FORM_DEF: {
       // [def name : Type expr]
       if (list->as.list.count<5) { fprintf(stderr, "def: too few items (%zu)\n", list->as.list.count); return 0; }
       const char *name = list->as.list.items[1]->as.sym.ptr;
@@ -505,7 +698,7 @@ static int typecheck_list(Env *tenv, Node *list) {
       if (!ty_eq(expr->ty, decl)) { fprintf(stderr, "def: type mismatch\n"); return 0; }
       list->ty = ty_unit(NULL); return 1;
     }
-    if (is_sym(head, "fn")) {
+    case FORM_FN: {
       // [fn [[name : T] ...] : R body...]
       Node *params = list->as.list.items[1];
       size_t i = 2; Type *ret = ty_unit(NULL);
@@ -527,9 +720,41 @@ static int typecheck_list(Env *tenv, Node *list) {
       if (!ty_eq(list->as.list.items[list->as.list.count-1]->ty, ret)) return 0;
       list->ty = ty_func(NULL, pt, arity, ret); env_free(child); return 1;
     }
-    if (is_sym(head, "quote")) { list->ty = ty_any(NULL); return 1; }
-    if (is_sym(head, "quasiquote")) { list->ty = ty_any(NULL); return 1; }
-    if (is_sym(head, "do")) {
+    case FORM_QUOTE: { list->ty = ty_any(NULL); return 1; }
+    case FORM_QUASIQUOTE: { list->ty = ty_any(NULL); return 1; }
+    // select: channels and sent values must agree; every arm has the same type
+    case FORM_SELECT: {
+      Type *t = NULL; int fallbacks = 0;
+      for (size_t i=1;i<list->as.list.count;i++) {
+        Node *arm = list->as.list.items[i];
+        SelectArm kind = select_arm(arm);
+        if (kind==SELECT_BAD) { fprintf(stderr, "select: bad arm\n"); return 0; }
+        Node *op = arm->as.list.items[0];
+        Env *scope = tenv; size_t body = 1;
+        if (kind==SELECT_DEFAULT || kind==SELECT_TIMEOUT) {
+          if (++fallbacks>1) { fprintf(stderr, "select: more than one timeout/default arm\n"); return 0; }
+          if (kind==SELECT_TIMEOUT && (!typecheck_node(tenv, op->as.list.items[1]) || !ty_eq(op->as.list.items[1]->ty, ty_int(NULL)))) return 0;
+        } else {
+          Node *ch = op->as.list.items[1];
+          if (!typecheck_node(tenv, ch)) return 0;
+          if (ch->ty->kind!=TY_CHAN) { fprintf(stderr, "select: not a channel\n"); return 0; }
+          Type *elem = ch->ty->as.chan.elem;
+          if (kind==SELECT_SEND) {
+            if (!typecheck_node(tenv, op->as.list.items[2]) || !ty_eq(op->as.list.items[2]->ty, elem)) return 0;
+          } else {
+            scope = env_new(tenv); env_set(scope, arm->as.list.items[1]->as.sym.ptr, elem, NULL); body = 2;
+          }
+        }
+        Type *at = ty_unit(NULL); int ok = 1;
+        for (size_t k=body;k<arm->as.list.count && ok;k++) { ok = typecheck_node(scope, arm->as.list.items[k]); at = arm->as.list.items[k]->ty; }
+        if (scope!=tenv) env_free(scope);
+        if (!ok) return 0;
+        if (!t) t = at;
+        else if (!ty_eq(t, at)) { fprintf(stderr, "select: arms differ in type\n"); return 0; }
+      }
+      list->ty = t ? t : ty_unit(NULL); return 1;
+    }
+    case FORM_DO: case FORM_WITH_TASKS: {
       // Sequence; type is last item's type or Unit
       Type *t = ty_unit(NULL);
       for (size_t i=1;i<list->as.list.count;i++) {
@@ -538,13 +763,13 @@ static int typecheck_list(Env *tenv, Node *list) {
       }
       list->ty = t; return 1;
     }
-    if (is_sym(head, "import")) {
+    case FORM_IMPORT: {
       // [import "module"]
       if (list->as.list.count!=2) return 0;
       if (list->as.list.items[1]->kind!=N_STRING) return 0;
       list->ty = ty_unit(NULL); return 1;
     }
-    if (is_sym(head, "let")) {
+    case FORM_LET: {
       Node *bindings = list->as.list.items[1];
       Env *child = env_new(tenv);
       for (size_t i2=0;i2<bindings->as.list.count;i2++) {
@@ -570,7 +795,7 @@ static int typecheck_list(Env *tenv, Node *list) {
       list->ty = list->as.list.count>2 ? list->as.list.items[list->as.list.count-1]->ty : ty_unit(NULL);
       env_free(child); return ok;
     }
-    if (is_sym(head, "if")) {
+    case FORM_IF: {
       if (!typecheck_node(tenv, list->as.list.items[1])) return 0;
       if (!typecheck_node(tenv, list->as.list.items[2])) return 0;
       if (!typecheck_node(tenv, list->as.list.items[3])) return 0;
@@ -578,7 +803,7 @@ static int typecheck_list(Env *tenv, Node *list) {
       list->ty = list->as.list.items[2]->ty; return 1;
     }
     // while: condition must be Bool, body returns Unit
-    if (is_sym(head, "while")) {
+    case FORM_WHILE: {
       if (list->as.list.count < 2) return 0;
       if (!typecheck_node(tenv, list->as.list.items[1])) return 0;
       if (!list->as.list.items[1]->ty || list->as.list.items[1]->ty->kind != TY_BOOL) return 0;
@@ -588,7 +813,7 @@ static int typecheck_list(Env *tenv, Node *list) {
       list->ty = ty_unit(NULL); return 1;
     }
     // set!: lookup variable and check type matches
-    if (is_sym(head, "set!")) {
+    case FORM_SET: {
       if (list->as.list.count != 3 || list->as.list.items[1]->kind != N_SYMBOL) return 0;
       char tmp[256]; size_t len = list->as.list.items[1]->as.sym.len;
       if (len >= sizeof(tmp)) len = sizeof(tmp)-1;
@@ -600,18 +825,18 @@ static int typecheck_list(Env *tenv, Node *list) {
       if (e->type && !ty_eq(e->type, list->as.list.items[2]->ty)) return 0;
       list->ty = ty_unit(NULL); return 1;
     }
-    if (is_sym(head, "vec")) {
+    case FORM_VEC: {
       // variadic; element types may differ; return Vec Any
       for (size_t i=1;i<list->as.list.count;i++) if (!typecheck_node(tenv, list->as.list.items[i])) return 0;
       list->ty = ty_vec(NULL, ty_any(NULL)); return 1;
     }
     // struct-new: variadic, first arg is type name string, rest are field values
-    if (is_sym(head, "struct-new")) {
+    case FORM_STRUCT_NEW: {
       for (size_t i=1;i<list->as.list.count;i++) if (!typecheck_node(tenv, list->as.list.items[i])) return 0;
       list->ty = ty_any(NULL); return 1;
     }
     // defstruct: [defstruct Name [[field1 : Type1] ...]]
-    if (is_sym(head, "defstruct")) {
+    case FORM_DEFSTRUCT: {
       if (list->as.list.count < 3 || list->as.list.items[1]->kind != N_SYMBOL) return 0;
       const char *name = list->as.list.items[1]->as.sym.ptr;
       Node *fields_node = list->as.list.items[2];
@@ -628,7 +853,7 @@ static int typecheck_list(Env *tenv, Node *list) {
       list->ty = ty_unit(NULL); return 1;
     }
     // defenum: [defenum Name [Variant1 Variant2 ...]]
-    if (is_sym(head, "defenum")) {
+    case FORM_DEFENUM: {
       if (list->as.list.count < 3 || list->as.list.items[1]->kind != N_SYMBOL) return 0;
       const char *name = list->as.list.items[1]->as.sym.ptr;
       Node *variants_node = list->as.list.items[2];
@@ -645,25 +870,27 @@ static int typecheck_list(Env *tenv, Node *list) {
       }
       list->ty = ty_unit(NULL); return 1;
     }
+    default:
+      break;
   }
   // Call typechecking: head must have function type in env
   if (!typecheck_node(tenv, head)) return 0;
   if (!head->ty || head->ty->kind!=TY_FUNC) return 0;
   Type *fty = head->ty;
   if (fty->as.fn.arity != list->as.list.count-1) return 0;
+  Type *bind[TY_MAX_VARS] = {0};
   for (size_t i=0;i<fty->as.fn.arity;i++) {
     if (!typecheck_node(tenv, list->as.list.items[i+1])) return 0;
-    if (!ty_eq(fty->as.fn.params[i], list->as.list.items[i+1]->ty)) return 0;
+    if (!ty_match(fty->as.fn.params[i], list->as.list.items[i+1]->ty, bind)) return 0;
   }
-  list->ty = fty->as.fn.ret; return 1;
+  list->ty = ty_subst(fty->as.fn.ret, bind); return 1;
 }
 
-int eval_program(VM *vm, Node *program) {
-  // Typecheck each toplevel form, then evaluate
+static int typecheck_forms(VM *vm, Node *program) {
   for (size_t i=0;i<program->as.list.count;i++) {
     Node *form = program->as.list.items[i];
     // Handle import eagerly to populate env
-    if (form->kind==N_LIST && form->as.list.count==2 && form->as.list.items[0]->kind==N_SYMBOL && is_sym(form->as.list.items[0], "import") && form->as.list.items[1]->kind==N_STRING) {
+    if (form->kind==N_LIST && form->as.list.count==2 && form->as.list.form==FORM_IMPORT && form->as.list.items[1]->kind==N_STRING) {
       char tmp[1024]; size_t len=form->as.list.items[1]->as.str.len; if (len>=sizeof(tmp)) len=sizeof(tmp)-1; memcpy(tmp, form->as.list.items[1]->as.str.ptr, len); tmp[len]='\0';
       (void)vm_import_resolve_and_load(vm, tmp);
       continue;
@@ -677,22 +904,41 @@ int eval_program(VM *vm, Node *program) {
       }
       return 1;
     }
+    resolve_form(vm, form);
   }
+  return 0;
+}
+
+int typecheck_program(VM *vm, Node *program) {
+  v_set_heap(&vm->gc);
+  gc_enter(&vm->gc);
+  int rc = typecheck_forms(vm, program);
+  gc_exit();
+  return rc;
+}
+
+int eval_program(VM *vm, Node *program) {
+  v_set_heap(&vm->gc);
+  gc_enter(&vm->gc);
+  // Typecheck each toplevel form, then evaluate
+  if (typecheck_forms(vm, program)) { gc_exit(); return 1; }
   for (size_t i=0;i<program->as.list.count;i++) {
     (void)eval_node(vm, vm->global_env, program->as.list.items[i]);
   }
+  gc_exit();
   return 0;
 }
 
 int eval_form(VM *vm, Node *form, Value *out) {
+  v_set_heap(&vm->gc);
   if (!typecheck_node(vm->global_env, form)) return 1;
+  resolve_form(vm, form);
+  gc_enter(&vm->gc);
   *out = eval_node(vm, vm->global_env, form);
+  gc_exit();
   return 0;
 }
 
-// Called from runtime spawn
-void vm_call_closure_noargs(struct VM *vm, struct Closure *c) { (void)vm_call_closure(vm, c, NULL, 0); }
-
 // File import helper
 static char *read_file_all2(const char *path, size_t *out_len) {
   FILE *f = fopen(path, "rb"); if (!f) return NULL;
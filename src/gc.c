@@ -1,58 +1,862 @@
 #include "gc.h"
+#include "value.h"
+#include "env.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define GC_MIN_THRESHOLD (1024*1024) // 1MB
+#define GC_NURSERY_SIZE (512*1024)
+#define GC_NURSERY_MAX_OBJECT (GC_NURSERY_SIZE/16) // larger objects go straight to the old space
+#define GC_TLAB_SIZE (16*1024)
+#define GC_MARK_SHARE (4*1024*1024) // old space bytes per extra marking thread
+#define GC_MARK_QUANTUM (256*1024)   // incremental marking: old space growth that requests a mark step,
+                                     // and the least a step marks
+#define GC_MARK_RATE 4               // bytes a step marks per byte the old space grew since the last one
+#define GC_MARK_SLICE_US 500         // longest a step marks for
+#define GC_MARK_CHUNK 4096           // elements of a long vector or list a step traces at a time
+
+_Thread_local GcRoot *gc_roots = NULL;
+_Thread_local GcMutator *gc_self = NULL;
+
+// A thread's slice of the nursery while tasks run. Epochs are unique across
+// heaps, so one left over from a freed heap never matches.
+typedef struct Tlab { GC *gc; size_t epoch; char *cur, *end; } Tlab;
+static _Thread_local Tlab tlab;
+static size_t next_epoch;
+
+// ---- Per-type hooks ----
+
+// Object bytes, copied when a young object is promoted
+static size_t size_string(Obj *o) { return sizeof(String) + (size_t)((String*)o)->len + 1; }
+static size_t size_closure(Obj *o) { (void)o; return sizeof(Closure); }
+static size_t size_list(Obj *o) { return sizeof(ValList) + sizeof(Value)*(size_t)((ValList*)o)->len; }
+static size_t size_vector(Obj *o) { return sizeof(Vector) + sizeof(Value)*(size_t)((Vector*)o)->ninline; }
+static size_t size_map(Obj *o) { (void)o; return sizeof(Map); }
+static size_t size_option(Obj *o) { (void)o; return sizeof(OptionVal); }
+static size_t size_result(Obj *o) { (void)o; return sizeof(ResultVal); }
+static size_t size_struct(Obj *o) {
+  StructVal *s = (StructVal*)o;
+  return sizeof(StructVal) + sizeof(Value)*(size_t)s->nfields + strlen(s->type_name) + 1;
+}
+static size_t size_int(Obj *o) { (void)o; return sizeof(IntBox); }
+static size_t size_task(Obj *o) { (void)o; return sizeof(TaskVal); }
+static size_t size_chan(Obj *o) { (void)o; return sizeof(ChanVal); }
+static size_t size_frame(Obj *o) { return sizeof(HeapFrame) + sizeof(Value)*(size_t)((HeapFrame*)o)->env.nslots; }
+
+// Out-of-line payload bytes, for bytes_allocated
+static size_t payload_vector(Obj *o) { Vector *v = (Vector*)o; return v->items==v->inline_items ? 0 : sizeof(Value)*(size_t)v->cap; }
+static size_t payload_map(Obj *o) { return sizeof(MapEntry)*(size_t)((Map*)o)->cap; }
+static size_t payload_chan(Obj *o) { return sizeof(Value)*rt_channel_slots(((ChanVal*)o)->chan); }
+
+static void trace_closure(GC *gc, Obj *o) { gc_mark_env(gc, ((Closure*)o)->env); }
+static void trace_list(GC *gc, Obj *o) { ValList *l = (ValList*)o; gc_mark_values(gc, l->items, l->len); }
+static void trace_vector(GC *gc, Obj *o) { Vector *v = (Vector*)o; gc_mark_values(gc, v->items, v->len); }
+static void trace_map(GC *gc, Obj *o) {
+  Map *m = (Map*)o;
+  for (int32_t i=0;i<m->cap;i++) {
+    if (!m->slots[i].hash) continue;
+    gc_mark_value(gc, &m->slots[i].key);
+    gc_mark_value(gc, &m->slots[i].val);
+  }
+}
+static void trace_option(GC *gc, Obj *o) { gc_mark_value(gc, &((OptionVal*)o)->value); }
+static void trace_result(GC *gc, Obj *o) { gc_mark_value(gc, &((ResultVal*)o)->value); }
+static void trace_struct(GC *gc, Obj *o) { StructVal *s = (StructVal*)o; gc_mark_values(gc, s->fields, s->nfields); }
+static void trace_task(GC *gc, Obj *o) { gc_mark_value(gc, &((TaskVal*)o)->result); }
+static void mark_chan_msg(void *msg, void *gc) { gc_mark_value((GC*)gc, (Value*)msg); }
+static void trace_chan(GC *gc, Obj *o) { rt_channel_each(((ChanVal*)o)->chan, mark_chan_msg, gc); }
+static void trace_frame(GC *gc, Obj *o) {
+  Env *e = &((HeapFrame*)o)->env;
+  gc_mark_values(gc, e->slots, e->nslots);
+  gc_mark_env(gc, e->parent);
+}
+
+static void release_vector(Obj *o) { Vector *v = (Vector*)o; if (v->items!=v->inline_items) free(v->items); }
+static void release_map(Obj *o) { free(((Map*)o)->slots); }
+static void release_frame(Obj *o) { env_free_entries(&((HeapFrame*)o)->env); }
+static void release_chan(Obj *o) { rt_channel_free(((ChanVal*)o)->chan); }
+
+typedef struct ObjClass {
+  size_t (*size)(Obj *o);             // object bytes, header included
+  size_t (*payload)(Obj *o);          // malloc'd payload bytes; NULL if none
+  void (*trace)(GC *gc, Obj *o);      // visit referenced objects; NULL for leaves
+  void (*release)(Obj *o);            // free out-of-line payload; NULL if none
+  bool young;                         // allocated in the nursery
+} ObjClass;
+
+// Short-lived values start in the nursery. Containers that are mutated in
+// place and captured frames are allocated old, so write barriers only fire
+// when a young value is stored into them. Nothing young has an interior
+// pointer, so a promotion is a plain copy.
+static const ObjClass classes[OBJ_NTYPES] = {
+  [OBJ_STRING]  = { size_string,  NULL,           NULL,          NULL,           true },
+  [OBJ_CLOSURE] = { size_closure, NULL,           trace_closure, NULL,           true },
+  [OBJ_LIST]    = { size_list,    NULL,           trace_list,    NULL,           true },
+  [OBJ_VECTOR]  = { size_vector,  payload_vector, trace_vector,  release_vector, false },
+  [OBJ_MAP]     = { size_map,     payload_map,    trace_map,     release_map,    false },
+  [OBJ_OPTION]  = { size_option,  NULL,           trace_option,  NULL,           true },
+  [OBJ_RESULT]  = { size_result,  NULL,           trace_result,  NULL,           true },
+  [OBJ_STRUCT]  = { size_struct,  NULL,           trace_struct,  NULL,           false },
+  [OBJ_FRAME]   = { size_frame,   NULL,           trace_frame,   release_frame,  false },
+  [OBJ_INT]     = { size_int,     NULL,           NULL,          NULL,           true },
+  [OBJ_TASK]    = { size_task,    NULL,           trace_task,    NULL,           false },
+  [OBJ_CHANNEL] = { size_chan,    payload_chan,   trace_chan,    release_chan,   false },
+};
+
+// The word after the header: next link of a free slab slot, forwarding
+// address of a copied young object. gc_alloc makes every object at least two
+// words.
+static inline void **second_word(void *o) { return (void**)((char*)o + sizeof(void*)); }
+
+static void obj_push(Obj ***arr, size_t *n, size_t *cap, Obj *o) {
+  if (*n==*cap) {
+    *cap = *cap ? *cap*2 : 256;
+    *arr = (Obj**)realloc(*arr, sizeof(Obj*)*(*cap));
+  }
+  (*arr)[(*n)++] = o;
+}
+
+// ---- Old space: size-class slab pages and large objects ----
+
+static const uint32_t class_sizes[GC_NCLASSES] = {
+  16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+  320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+
+#define GC_PAGE_WORDS (GC_PAGE_SIZE/16/64) // bitmap words for the smallest class
+
+typedef struct GcPage {
+  struct GcPage *next;     // pages of the same class
+  uint32_t objsize, nobjs;
+  uint32_t nlive;          // slots in use after the last sweep, or handed to the free list since
+  uint32_t recip;          // ceil(2^32/objsize): slot index by multiply and shift
+  uint64_t alloc[GC_PAGE_WORDS];
+  uint64_t mark[GC_PAGE_WORDS];
+} GcPage;
+
+#define GC_PAGE_HEADER ((sizeof(GcPage) + 15) & ~(size_t)15)
+
+typedef struct GcLarge {
+  struct GcLarge *next;
+  size_t size;
+  bool marked;
+} GcLarge; // the object follows
+
+static inline GcPage *page_of(Obj *o) { return (GcPage*)((uintptr_t)o & ~(uintptr_t)(GC_PAGE_SIZE-1)); }
+static inline char *page_base(GcPage *pg) { return (char*)pg + GC_PAGE_HEADER; }
+static inline uint32_t page_words(GcPage *pg) { return (pg->nobjs + 63) / 64; }
+// Offsets are exact multiples of objsize below 2^16, so the rounding in recip never shows
+static inline uint32_t slot_index(GcPage *pg, Obj *o) {
+  return (uint32_t)(((uint64_t)((char*)o - page_base(pg)) * pg->recip) >> 32);
+}
+static inline GcLarge *large_of(Obj *o) { return (GcLarge*)o - 1; }
+
+static int size_class(size_t sz) {
+  if (sz <= 256) return sz ? (int)((sz - 1) / 16) : 0;
+  int c = 16;
+  while (class_sizes[c] < sz) c++;
+  return c;
+}
+
+static GcPage *page_new(uint32_t objsize) {
+#ifdef _WIN32
+  GcPage *pg = (GcPage*)_aligned_malloc(GC_PAGE_SIZE, GC_PAGE_SIZE);
+#else
+  GcPage *pg = (GcPage*)aligned_alloc(GC_PAGE_SIZE, GC_PAGE_SIZE);
+#endif
+  memset(pg, 0, sizeof(GcPage));
+  pg->objsize = objsize;
+  pg->nobjs = (uint32_t)((GC_PAGE_SIZE - GC_PAGE_HEADER) / objsize);
+  pg->recip = (uint32_t)(((1ull << 32) + objsize - 1) / objsize);
+  return pg;
+}
+
+static void page_free(GcPage *pg) {
+#ifdef _WIN32
+  _aligned_free(pg);
+#else
+  free(pg);
+#endif
+}
+
+// Claim every free slot of pg and thread them, in address order, onto the free list
+static void page_fill(GcSizeClass *c, GcPage *pg) {
+  void *head = NULL, **tail = &head;
+  char *base = page_base(pg);
+  for (uint32_t w=0; w<page_words(pg); w++) {
+    uint64_t valid = (w+1)*64 <= pg->nobjs ? ~0ull : (1ull << (pg->nobjs % 64)) - 1;
+    uint64_t fr = ~pg->alloc[w] & valid;
+    pg->alloc[w] |= fr;
+    for (; fr; fr &= fr - 1) {
+      Obj *slot = (Obj*)(base + (size_t)(w*64 + (uint32_t)__builtin_ctzll(fr)) * pg->objsize);
+      *slot = (Obj){0};
+      *tail = slot; tail = second_word(slot);
+    }
+  }
+  *tail = c->free;
+  c->free = head;
+  pg->nlive = pg->nobjs;
+}
+
+// Release the unmarked objects of pg and turn its mark bitmap into the
+// allocation bitmap; returns the live slots. Only dead objects are touched.
+static uint32_t sweep_page(GcPage *pg) {
+  char *base = page_base(pg);
+  uint32_t live = 0;
+  for (uint32_t w=0; w<page_words(pg); w++) {
+    for (uint64_t dead = pg->alloc[w] & ~pg->mark[w]; dead; dead &= dead - 1) {
+      Obj *o = (Obj*)(base + (size_t)(w*64 + (uint32_t)__builtin_ctzll(dead)) * pg->objsize);
+      if (classes[o->type].release) classes[o->type].release(o); // free slots have type 0
+    }
+    pg->alloc[w] = pg->mark[w]; pg->mark[w] = 0;
+    live += (uint32_t)__builtin_popcountll(pg->alloc[w]);
+  }
+  return pg->nlive = live;
+}
+
+// Sweep is lazy: a class that needs room sweeps its unswept pages until one
+// has some, so the cost lands on allocation rather than in the pause
+static void class_refill(GcSizeClass *c, int ci) {
+  GcPage *pg;
+  while ((pg = c->unswept)) {
+    c->unswept = pg->next;
+    pg->next = c->pages; c->pages = pg;
+    if (sweep_page(pg) < pg->nobjs) { page_fill(c, pg); return; }
+  }
+  pg = page_new(class_sizes[ci]);
+  pg->next = c->pages; c->pages = pg;
+  page_fill(c, pg);
+}
+
+// Set o's mark bit; false if it was already set
+static bool mark_bit(Obj *o) {
+  // Marking threads race for the bit; a plain load first skips the atomic on the common repeat visit
+  if (o->large) {
+    GcLarge *l = large_of(o);
+    return !__atomic_load_n(&l->marked, __ATOMIC_RELAXED) && !__atomic_exchange_n(&l->marked, true, __ATOMIC_RELAXED);
+  }
+  GcPage *pg = page_of(o);
+  uint32_t i = slot_index(pg, o);
+  uint64_t bit = 1ull << (i % 64);
+  if (__atomic_load_n(&pg->mark[i/64], __ATOMIC_RELAXED) & bit) return false;
+  return !(__atomic_fetch_or(&pg->mark[i/64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+static Obj *old_alloc(GC *gc, size_t sz, unsigned type_tag) {
+  bool shared = __atomic_load_n(&gc->threads, __ATOMIC_ACQUIRE)>0;
+  if (shared) rt_spin_lock(&gc->heap_lock);
+  Obj *o;
+  if (sz <= GC_MAX_SMALL) {
+    int ci = size_class(sz);
+    GcSizeClass *c = &gc->size_classes[ci];
+    if (!c->free) class_refill(c, ci);
+    o = (Obj*)c->free;
+    c->free = *second_word(o);
+    *o = (Obj){ .type = type_tag };
+  } else {
+    GcLarge *l = (GcLarge*)malloc(sizeof(GcLarge) + sz);
+    l->size = sz; l->marked = false;
+    l->next = gc->large; gc->large = l;
+    o = (Obj*)(l + 1);
+    *o = (Obj){ .type = type_tag, .large = 1 };
+  }
+  // Allocated gray while marking: the caller fills it in before the next
+  // safepoint, where a mark step may trace it
+  if (gc->marking) { mark_bit(o); obj_push(&gc->greyed, &gc->ngreyed, &gc->capgreyed, o); }
+  if (shared) rt_spin_unlock(&gc->heap_lock);
+  return o;
+}
+
+// Sweep the pages a class has not got round to; empty ones are returned
+static void sweep_class(GcSizeClass *c) {
+  GcPage *pg;
+  while ((pg = c->unswept)) {
+    c->unswept = pg->next;
+    if (sweep_page(pg)) { pg->next = c->pages; c->pages = pg; }
+    else page_free(pg);
+  }
+}
+
+static void sweep_large(GC *gc) {
+  GcLarge **lp = &gc->large;
+  while (*lp) {
+    GcLarge *l = *lp;
+    if (!l->marked) {
+      *lp = l->next;
+      Obj *o = (Obj*)(l + 1);
+      if (classes[o->type].release) classes[o->type].release(o);
+      free(l);
+    } else {
+      l->marked = false;
+      lp = &l->next;
+    }
+  }
+}
+
+// After marking: large objects are swept now, pages as allocation reaches them
+static void sweep(GC *gc) {
+  for (int ci=0; ci<GC_NCLASSES; ci++) {
+    GcSizeClass *c = &gc->size_classes[ci];
+    c->free = NULL; // rebuilt from the bitmaps as pages are swept
+    c->unswept = c->pages; c->pages = NULL;
+  }
+  sweep_large(gc);
+}
+
+// ---- Allocation ----
+
+static int mark_threads_want;
+void gc_set_threads(int n) { mark_threads_want = n; }
+static int incremental_want = -1;
+void gc_set_incremental(int on) { incremental_want = on; }
 
 void gc_init(GC *gc) {
-  gc->objects = NULL;
+  memset(gc->size_classes, 0, sizeof(gc->size_classes));
+  gc->large = NULL;
   gc->bytes_allocated = 0;
-  gc->next_threshold = 1024*1024; // 1MB default
+  gc->next_threshold = GC_MIN_THRESHOLD;
+  gc->marked_bytes = 0;
+  gc->heap_lock = false;
+  arena_init(&gc->nursery, GC_NURSERY_SIZE);
+  gc->epoch = __atomic_add_fetch(&next_epoch, 1, __ATOMIC_RELAXED);
+  gc->remembered = NULL; gc->nremembered = 0; gc->capremembered = 0;
+  gc->minor = false;
   gc->mark_root_cb = NULL;
   gc->user = NULL;
+  gc->gray = NULL; gc->ngray = 0; gc->capgray = 0;
+  gc->markers = NULL; gc->nmarkers = 0;
+  gc->mark_threads = mark_threads_want;
+  if (gc->mark_threads<=0) { const char *env = getenv("SQALE_GC_THREADS"); if (env) gc->mark_threads = atoi(env); }
+  if (gc->mark_threads<=0) gc->mark_threads = rt_cpu_count();
+  gc->incremental = incremental_want > 0;
+  if (incremental_want < 0) { const char *mode = getenv("SQALE_GC_MODE"); gc->incremental = mode && strcmp(mode, "incremental")==0; }
+  gc->marking = false;
+  gc->mark_limit = gc->step_base = 0;
+  gc->greyed = NULL; gc->ngreyed = 0; gc->capgreyed = 0;
+  gc->minor_pauses = gc->step_pauses = gc->major_pauses = (GcPauses){0};
+  const char *stats = getenv("SQALE_GC_STATS");
+  gc->stats = stats && *stats && *stats!='0';
+  gc->collect_requested = false;
+  const char *stress = getenv("SQALE_GC_STRESS");
+  gc->stress = stress && *stress && *stress!='0';
+  gc->paused = 0;
+  gc->threads = 0;
+  gc->mutators = NULL; gc->mutators_lock = false; gc->stopping = 0;
+  gc_mutator_add(gc, &gc->main, NULL);
+  gc->collections = 0;
+  gc->minor_collections = 0;
 }
 
 void gc_set_root_callback(GC *gc, void (*cb)(void *), void *user) {
   gc->mark_root_cb = cb; gc->user = user;
 }
 
+static void request_collection(GC *gc) { __atomic_store_n(&gc->collect_requested, true, __ATOMIC_RELAXED); }
+
+void gc_account(GC *gc, ptrdiff_t bytes) {
+  size_t total = __atomic_add_fetch(&gc->bytes_allocated, (size_t)bytes, __ATOMIC_RELAXED);
+  if (gc->stress || total > gc->next_threshold) request_collection(gc);
+}
+
+// Nursery bytes for the calling thread while tasks run. Refills and objects
+// too big to be worth a TLAB take the lock; the rest is a bump.
+static Obj *tlab_alloc(GC *gc, size_t sz) {
+  sz = (sz + sizeof(double)-1) & ~(sizeof(double)-1);
+  Tlab *t = &tlab;
+  if (t->gc!=gc || t->epoch!=gc->epoch || (size_t)(t->end - t->cur) < sz) {
+    bool whole = sz > GC_TLAB_SIZE/4;
+    rt_spin_lock(&gc->heap_lock);
+    char *p = (char*)arena_alloc(&gc->nursery, whole ? sz : GC_TLAB_SIZE, sizeof(double));
+    bool full = gc->nursery.head->next!=NULL;
+    rt_spin_unlock(&gc->heap_lock);
+    if (full) request_collection(gc);
+    if (whole) return (Obj*)p;
+    t->gc = gc; t->epoch = gc->epoch; t->cur = p; t->end = p + GC_TLAB_SIZE;
+  }
+  Obj *o = (Obj*)t->cur; t->cur += sz;
+  return o;
+}
+
 void *gc_alloc(GC *gc, size_t sz, unsigned type_tag) {
-  Obj *o = (Obj*)malloc(sz);
-  o->marked = 0; o->type = type_tag;
-  o->next = gc->objects; gc->objects = o;
-  gc->bytes_allocated += sz;
-  if (gc->bytes_allocated > gc->next_threshold) {
-    gc_collect(gc);
-    gc->next_threshold *= 2;
+  const ObjClass *k = &classes[type_tag];
+  Obj *o;
+  if (sz < 2*sizeof(void*)) sz = 2*sizeof(void*);
+  if (k->young && sz<=GC_NURSERY_MAX_OBJECT) {
+    // With no tasks about, the toplevel owns the nursery outright
+    if (__atomic_load_n(&gc->threads, __ATOMIC_ACQUIRE)==0) {
+      o = (Obj*)arena_alloc(&gc->nursery, sz, sizeof(double));
+      // Spilling into a second chunk means the nursery is full
+      if (gc->nursery.head->next) request_collection(gc);
+    } else o = tlab_alloc(gc, sz);
+    *o = (Obj){ .type = type_tag, .young = 1 };
+    if (gc->stress) request_collection(gc);
+    return o;
   }
+  o = old_alloc(gc, sz, type_tag);
+  gc_account(gc, (ptrdiff_t)sz);
   return o;
 }
 
-void gc_mark(Obj *o) {
-  if (!o || o->marked) return;
-  o->marked = 1;
-  // Minimal GC: Objects are leaf nodes for now (Strings, Channels, Closures not traversed here)
+void gc_remember(GC *gc, Obj *o) {
+  bool shared = __atomic_load_n(&gc->threads, __ATOMIC_ACQUIRE)>0;
+  if (shared) rt_spin_lock(&gc->heap_lock);
+  // Two threads may have passed the barrier's check at once
+  if (!o->remembered) {
+    o->remembered = 1;
+    obj_push(&gc->remembered, &gc->nremembered, &gc->capremembered, o);
+  }
+  if (shared) rt_spin_unlock(&gc->heap_lock);
 }
 
-static void sweep(GC *gc) {
-  Obj **cur = &gc->objects;
-  while (*cur) {
-    if (!(*cur)->marked) {
-      Obj *unreached = *cur;
-      *cur = unreached->next;
-      free(unreached);
-    } else {
-      (*cur)->marked = 0; // unmark for next cycle
-      cur = &(*cur)->next;
-    }
+void gc_shade(GC *gc, Obj *o) {
+  if (!mark_bit(o)) return;
+  bool shared = __atomic_load_n(&gc->threads, __ATOMIC_ACQUIRE)>0;
+  if (shared) rt_spin_lock(&gc->heap_lock);
+  obj_push(&gc->greyed, &gc->ngreyed, &gc->capgreyed, o);
+  if (shared) rt_spin_unlock(&gc->heap_lock);
+}
+
+// ---- Marking ----
+
+// A marking thread's gray objects. The owner works on its private stack and,
+// while another marker is idle, moves half of it to its shared stack, which
+// idle markers steal from.
+typedef struct GcMarker {
+  Obj **stack; size_t n, cap;
+  RtSpin lock;
+  Obj **shared; size_t nshared, capshared;
+  size_t bytes;           // marked_bytes found by this marker
+  Obj *part;              // a long vector or list that incremental steps are tracing piecemeal
+  int32_t part_pos;       // and the next element
+} GcMarker;
+
+typedef struct MarkJob { GC *gc; int n; int idle; int next_class; } MarkJob;
+
+static _Thread_local GcMarker *marker; // this thread's, during a major collection
+
+// Major collections only: old objects are not traced by a minor collection
+// unless remembered or just promoted. Young objects are skipped: while an
+// incremental collection marks, the minor ones promote them gray.
+void gc_mark(GC *gc, Obj *o) {
+  if (!o || gc->minor || o->young || !mark_bit(o)) return;
+  const ObjClass *k = &classes[o->type];
+  GcMarker *m = marker;
+  m->bytes += k->size(o) + (k->payload ? k->payload(o) : 0);
+  if (k->trace) obj_push(&m->stack, &m->n, &m->cap, o);
+}
+
+// Copy a young object into the old space, leaving a forwarding address
+static Obj *evacuate(GC *gc, Obj *o) {
+  if (o->forwarded) return (Obj*)*second_word(o);
+  const ObjClass *k = &classes[o->type];
+  size_t sz = k->size(o);
+  Obj *n = old_alloc(gc, sz, o->type);
+  memcpy((char*)n + sizeof(Obj), (char*)o + sizeof(Obj), sz - sizeof(Obj));
+  gc->bytes_allocated += sz + (k->payload ? k->payload(n) : 0);
+  o->forwarded = 1; *second_word(o) = n;
+  if (k->trace) obj_push(&gc->gray, &gc->ngray, &gc->capgray, n); // its fields may still be young
+  return n;
+}
+
+static Obj *visit(GC *gc, Obj *o) {
+  if (!o) return o;
+  if (gc->minor) return o->young ? evacuate(gc, o) : o;
+  gc_mark(gc, o);
+  return o;
+}
+
+void gc_mark_value(GC *gc, Value *v) {
+  Obj *o = v_obj(*v);
+  if (o) v_set_obj(v, visit(gc, o));
+}
+
+void gc_mark_values(GC *gc, Value *vals, int32_t n) {
+  for (int32_t i=0;i<n;i++) gc_mark_value(gc, &vals[i]);
+}
+
+// Stack frames are traced in place. The walk stops at the first heap frame,
+// which is traced as an object, or at the global env (parent NULL), which the
+// root callback covers once.
+void gc_mark_env(GC *gc, Env *e) {
+  for (; e && e->parent; e = e->parent) {
+    if (e->heap) { gc_mark(gc, &env_heap_frame(e)->hdr); return; }
+    gc_mark_values(gc, e->slots, e->nslots);
   }
 }
 
-void gc_collect(GC *gc) {
+// ---- Collection ----
+
+static void visit_stack(GC *gc, GcRoot *r) {
+  for (; r; r=r->prev) {
+    gc_mark_values(gc, r->vals, r->n);
+    gc_mark_env(gc, r->env);
+  }
+}
+
+// The collector's own stack is live in gc_roots; the stopped mutators left theirs behind
+static void visit_roots(GC *gc) {
   if (gc->mark_root_cb) gc->mark_root_cb(gc->user);
+  bool own = gc_self && gc_self->gc==gc;
+  if (own) visit_stack(gc, gc_roots);
+  for (GcMutator *m=gc->mutators; m; m=m->next) if (!own || m!=gc_self) visit_stack(gc, m->roots);
+}
+
+static void drain_gray(GC *gc) {
+  while (gc->ngray>0) {
+    Obj *o = gc->gray[--gc->ngray];
+    classes[o->type].trace(gc, o);
+  }
+}
+
+// Copy the survivors reachable from the roots and the remembered set, then
+// empty the nursery. Work is proportional to the survivors, not to the
+// number of objects allocated.
+static void collect_minor(GC *gc) {
+  gc->minor = true;
+  visit_roots(gc);
+  for (size_t i=0;i<gc->nremembered;i++) {
+    Obj *o = gc->remembered[i];
+    o->remembered = 0;
+    classes[o->type].trace(gc, o);
+  }
+  gc->nremembered = 0;
+  drain_gray(gc);
+  arena_reset(&gc->nursery);
+  gc->epoch = __atomic_add_fetch(&next_epoch, 1, __ATOMIC_RELAXED);
+  // Under stress, scribble over the nursery so a missed root or barrier fails fast
+  if (gc->stress) memset(gc->nursery.head->data, 0xdb, gc->nursery.head->cap);
+  gc->minor = false;
+  gc->minor_collections++;
+}
+
+// Take half of v's shared stack, or all of it when v is m itself
+static bool mark_steal(GcMarker *m, GcMarker *v) {
+  if (!__atomic_load_n(&v->nshared, __ATOMIC_RELAXED)) return false;
+  rt_spin_lock(&v->lock);
+  size_t take = v==m ? v->nshared : (v->nshared + 1) / 2;
+  for (size_t i=0;i<take;i++) obj_push(&m->stack, &m->n, &m->cap, v->shared[v->nshared - take + i]);
+  __atomic_store_n(&v->nshared, v->nshared - take, __ATOMIC_RELAXED);
+  rt_spin_unlock(&v->lock);
+  return take>0;
+}
+
+static Obj *mark_pop(MarkJob *j, GcMarker *m) {
+  if (m->n) return m->stack[--m->n];
+  GcMarker *all = j->gc->markers;
+  int self = (int)(m - all);
+  for (int i=0;i<j->n;i++) if (mark_steal(m, &all[(self + i) % j->n])) return m->stack[--m->n];
+  return NULL;
+}
+
+// Hand the bottom half of the private stack, the oldest and likely widest
+// subgraphs, to idle markers
+static void mark_share(MarkJob *j, GcMarker *m) {
+  if (m->n < 2 || !__atomic_load_n(&j->idle, __ATOMIC_RELAXED)) return;
+  size_t give = m->n / 2;
+  rt_spin_lock(&m->lock);
+  size_t ns = m->nshared;
+  if (ns + give > m->capshared) {
+    while (ns + give > m->capshared) m->capshared = m->capshared ? m->capshared*2 : 256;
+    m->shared = (Obj**)realloc(m->shared, sizeof(Obj*)*m->capshared);
+  }
+  memcpy(m->shared + ns, m->stack, sizeof(Obj*)*give);
+  __atomic_store_n(&m->nshared, ns + give, __ATOMIC_RELAXED);
+  rt_spin_unlock(&m->lock);
+  memmove(m->stack, m->stack + give, sizeof(Obj*)*(m->n - give));
+  m->n -= give;
+}
+
+static bool any_shared(MarkJob *j) {
+  for (int i=0;i<j->n;i++) if (__atomic_load_n(&j->gc->markers[i].nshared, __ATOMIC_RELAXED)) return true;
+  return false;
+}
+
+// Trace until every marker is idle. A marker only goes idle with its own
+// shared stack empty, and only its owner fills it, so once all are idle no
+// work is left anywhere.
+static void mark_loop(MarkJob *j, GcMarker *m) {
+  for (;;) {
+    Obj *o;
+    while ((o = mark_pop(j, m))) {
+      classes[o->type].trace(j->gc, o);
+      if (j->n>1) mark_share(j, m);
+    }
+    if (j->n==1) return;
+    __atomic_add_fetch(&j->idle, 1, __ATOMIC_ACQ_REL);
+    for (;;) {
+      if (__atomic_load_n(&j->idle, __ATOMIC_ACQUIRE)==j->n) return;
+      if (any_shared(j)) break;
+      rt_thread_yield();
+    }
+    __atomic_sub_fetch(&j->idle, 1, __ATOMIC_ACQ_REL);
+  }
+}
+
+static void mark_worker(void *arg, int id) {
+  MarkJob *j = (MarkJob*)arg;
+  marker = &j->gc->markers[id];
+  mark_loop(j, marker);
+  marker = NULL;
+}
+
+// Pages left unswept since the last major collection still carry its mark
+// bits; finish them, a size class at a time per thread
+static void sweep_worker(void *arg, int id) {
+  MarkJob *j = (MarkJob*)arg;
+  (void)id;
+  for (int ci; (ci = __atomic_fetch_add(&j->next_class, 1, __ATOMIC_RELAXED)) < GC_NCLASSES; )
+    sweep_class(&j->gc->size_classes[ci]);
+}
+
+// One thread per GC_MARK_SHARE of old space, so small heaps do not pay for
+// waking helpers; stress runs use them all
+static int mark_job(GC *gc, MarkJob *j) {
+  size_t share = 1 + gc->bytes_allocated / GC_MARK_SHARE;
+  int n = gc->stress || share > (size_t)gc->mark_threads ? gc->mark_threads : (int)share;
+  if (gc->nmarkers < n) {
+    gc->markers = (GcMarker*)realloc(gc->markers, sizeof(GcMarker)*(size_t)n);
+    memset(gc->markers + gc->nmarkers, 0, sizeof(GcMarker)*(size_t)(n - gc->nmarkers));
+    gc->nmarkers = n;
+  }
+  *j = (MarkJob){ gc, n, 0, 0 };
+  return n;
+}
+
+// Count the greyed objects as marked by m and queue those with references
+static void take_greyed(GC *gc, GcMarker *m) {
+  for (size_t i=0;i<gc->ngreyed;i++) {
+    Obj *o = gc->greyed[i];
+    const ObjClass *k = &classes[o->type];
+    m->bytes += k->size(o) + (k->payload ? k->payload(o) : 0);
+    if (k->trace) obj_push(&m->stack, &m->n, &m->cap, o);
+  }
+  gc->ngreyed = 0;
+}
+
+// The last major collection's mark bits go with the pages it left unswept.
+// Incrementally, marking then starts from the roots, and from here on the
+// barrier shades stores and allocation is gray.
+static void begin_major(GC *gc) {
+  MarkJob job;
+  int n = mark_job(gc, &job);
+  rt_parallel(n, sweep_worker, &job);
+  for (int i=0;i<gc->nmarkers;i++) gc->markers[i].bytes = 0;
+  if (!gc->incremental) return;
+  gc->marking = true;
+  marker = &gc->markers[0];
+  visit_roots(gc);
+  marker = NULL;
+  // Should allocation outrun the marker, finish once the old space is half as big again
+  gc->mark_limit = gc->bytes_allocated + gc->bytes_allocated/2;
+  gc->step_base = gc->bytes_allocated;
+  gc->next_threshold = gc->bytes_allocated + GC_MARK_QUANTUM;
+}
+
+// Elements of a vector or list, which may be long enough to trace in pieces
+static Value *obj_elems(Obj *o, int32_t *n) {
+  if (o->type==OBJ_VECTOR) { *n = ((Vector*)o)->len; return ((Vector*)o)->items; }
+  if (o->type==OBJ_LIST) { *n = ((ValList*)o)->len; return ((ValList*)o)->items; }
+  return NULL;
+}
+
+// Trace the next chunk of m->part. Elements stay put: vectors only grow or
+// are set in place behind the barrier, and lists never change once built.
+static void trace_part(GC *gc, GcMarker *m, int32_t chunk) {
+  int32_t n = 0; Value *items = obj_elems(m->part, &n);
+  int32_t end = n - m->part_pos > chunk ? m->part_pos + chunk : n;
+  gc_mark_values(gc, items + m->part_pos, end - m->part_pos);
+  m->part_pos = end;
+  if (end==n) m->part = NULL;
+}
+
+// Trace gray objects in the collector's thread until the step has marked
+// GC_MARK_RATE times what the old space grew by since the last one, or its
+// slice is up; true once none are left
+static bool mark_step(GC *gc) {
+  GcMarker *m = marker = &gc->markers[0];
+  take_greyed(gc, m);
+  size_t grown = gc->bytes_allocated > gc->step_base ? gc->bytes_allocated - gc->step_base : 0;
+  size_t budget = gc->stress ? GC_MARK_QUANTUM/64 : grown*GC_MARK_RATE > GC_MARK_QUANTUM ? grown*GC_MARK_RATE : GC_MARK_QUANTUM;
+  size_t until = m->bytes + budget;
+  int64_t deadline = rt_now_us() + GC_MARK_SLICE_US;
+  int since = 0; // objects traced since the clock was last read
+  while ((m->part || m->n) && m->bytes < until) {
+    if (m->part) { trace_part(gc, m, GC_MARK_CHUNK); since = 64; }
+    else {
+      Obj *o = m->stack[--m->n];
+      int32_t n;
+      if (obj_elems(o, &n) && n > GC_MARK_CHUNK) { m->part = o; m->part_pos = 0; continue; }
+      classes[o->type].trace(gc, o);
+      since++;
+    }
+    if (since>=64) { since = 0; if (rt_now_us() >= deadline) break; }
+  }
+  marker = NULL;
+  gc->step_base = gc->bytes_allocated;
+  gc->next_threshold = gc->bytes_allocated + GC_MARK_QUANTUM;
+  return !m->n && !m->part;
+}
+
+// Mark from the roots in parallel, then sweep. Incrementally, this is the
+// remark: the roots are scanned again, since stores to them are not behind
+// the barrier, and the gray objects left are drained.
+static void finish_major(GC *gc) {
+  MarkJob job;
+  int n = mark_job(gc, &job);
+  marker = &gc->markers[0];
+  if (marker->part) trace_part(gc, marker, INT32_MAX);
+  visit_roots(gc);
+  take_greyed(gc, marker);
+  rt_parallel(n, mark_worker, &job);
+  marker = NULL;
+  gc->marking = false;
+  gc->marked_bytes = 0;
+  for (int i=0;i<gc->nmarkers;i++) gc->marked_bytes += gc->markers[i].bytes;
   sweep(gc);
+  gc->bytes_allocated = gc->marked_bytes;
+  gc->next_threshold = gc->bytes_allocated*2 > GC_MIN_THRESHOLD ? gc->bytes_allocated*2 : GC_MIN_THRESHOLD;
+  gc->collections++;
 }
 
-void gc_free_all(GC *gc) {
-  Obj *o = gc->objects;
-  while (o) { Obj *n = o->next; free(o); o = n; }
-  gc->objects = NULL; gc->bytes_allocated = 0; gc->next_threshold = 1024*1024;
+// ---- Mutators ----
+
+void gc_mutator_add(GC *gc, GcMutator *m, GcRoot *roots) {
+  m->gc = gc; m->roots = roots; m->running = 0;
+  m->depth = m!=&gc->main; m->saved = NULL;
+  rt_spin_lock(&gc->mutators_lock);
+  m->prev = NULL; m->next = gc->mutators;
+  if (m->next) m->next->prev = m;
+  gc->mutators = m;
+  rt_spin_unlock(&gc->mutators_lock);
+}
+
+void gc_mutator_remove(GcMutator *m) {
+  GC *gc = m->gc;
+  rt_spin_lock(&gc->mutators_lock);
+  if (m->prev) m->prev->next = m->next; else gc->mutators = m->next;
+  if (m->next) m->next->prev = m->prev;
+  rt_spin_unlock(&gc->mutators_lock);
+  if (gc_self==m) gc_self = NULL;
+}
+
+// Sequentially consistent on both sides, so either the collector sees m
+// running or m sees it stopping
+void gc_resume(GcMutator *m) {
+  gc_self = m;
+  for (;;) {
+    __atomic_store_n(&m->running, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&m->gc->stopping, __ATOMIC_SEQ_CST)) return;
+    __atomic_store_n(&m->running, 0, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&m->gc->stopping, __ATOMIC_ACQUIRE)) rt_thread_yield();
+  }
 }
 
+// Outside every entry point the shadow stack holds nothing of m's
+void gc_park(GcMutator *m) {
+  m->roots = m->depth ? gc_roots : NULL;
+  __atomic_store_n(&m->running, 0, __ATOMIC_RELEASE);
+}
+
+void gc_enter_slow(GC *gc) {
+  GcMutator *prev = gc_self;
+  if (prev) gc_park(prev);
+  gc_resume(&gc->main);
+  gc->main.depth++; gc->main.saved = prev;
+}
+
+void gc_exit_slow(GcMutator *m) {
+  GcMutator *prev = m->saved;
+  m->saved = NULL;
+  // An idle mutator is not worth handing back to
+  if (!prev->depth) return;
+  gc_park(m); gc_self = NULL;
+  gc_resume(prev);
+}
+
+void gc_leave(GC *gc) {
+  if (gc_self!=&gc->main) return;
+  gc_park(gc_self); gc_self = NULL;
+}
+
+static bool others_running(GC *gc) {
+  bool any = false;
+  rt_spin_lock(&gc->mutators_lock);
+  for (GcMutator *m=gc->mutators; m && !any; m=m->next)
+    any = m!=gc_self && __atomic_load_n(&m->running, __ATOMIC_SEQ_CST);
+  rt_spin_unlock(&gc->mutators_lock);
+  return any;
+}
+
+static void pause_add(GcPauses *p, int64_t us) {
+  p->count++; p->total_us += us;
+  if (us > p->max_us) p->max_us = us;
+}
+
+void gc_collect(GC *gc) {
+  if (gc->paused) return;
+  int64_t start = gc->stats ? rt_now_us() : 0;
+  int idle = 0;
+  if (!__atomic_compare_exchange_n(&gc->stopping, &idle, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    // Someone else is collecting: stop here until it is done
+    GcMutator *self = gc_self && gc_self->gc==gc ? gc_self : NULL;
+    if (self) { gc_park(self); gc_resume(self); }
+    return;
+  }
+  // Only running mutators add or remove mutators, so once every other one
+  // has stopped the list stays put
+  while (others_running(gc)) rt_thread_yield();
+  // The collection that stopped us may have been the one requested
+  if (__atomic_load_n(&gc->collect_requested, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&gc->collect_requested, false, __ATOMIC_RELAXED);
+    collect_minor(gc);
+    GcPauses *kind = &gc->minor_pauses;
+    if (gc->marking) {
+      kind = &gc->step_pauses;
+      if (mark_step(gc) || gc->bytes_allocated > gc->mark_limit) { finish_major(gc); kind = &gc->major_pauses; }
+    } else if (gc->stress || gc->bytes_allocated > gc->next_threshold) {
+      begin_major(gc);
+      if (gc->marking) kind = &gc->step_pauses;
+      else { finish_major(gc); kind = &gc->major_pauses; }
+    }
+    if (gc->stats) pause_add(kind, rt_now_us() - start);
+  }
+  __atomic_store_n(&gc->stopping, 0, __ATOMIC_RELEASE);
+}
+
+// Drop the marks of an incremental collection cut short
+static void unmark_all(GC *gc) {
+  for (int ci=0; ci<GC_NCLASSES; ci++)
+    for (GcPage *pg=gc->size_classes[ci].pages; pg; pg=pg->next) memset(pg->mark, 0, sizeof(pg->mark));
+  for (GcLarge *l=gc->large; l; l=l->next) l->marked = false;
+}
+
+static void print_pauses(const char *kind, GcPauses *p) {
+  if (!p->count) return;
+  fprintf(stderr, "gc: %zu %s, pause total %.3fms, mean %.3fms, max %.3fms\n", p->count, kind,
+    (double)p->total_us/1000, (double)p->total_us/1000/(double)p->count, (double)p->max_us/1000);
+}
+
+void gc_free_all(GC *gc) {
+  if (gc_self && gc_self->gc==gc) gc_self = NULL;
+  if (gc->stats) {
+    print_pauses("minor", &gc->minor_pauses);
+    print_pauses("mark steps", &gc->step_pauses);
+    print_pauses("major", &gc->major_pauses);
+    if (gc->major_pauses.count) fprintf(stderr, "gc: marking threads: up to %d\n", gc->mark_threads);
+  }
+  // Release every old object and page: finish the lazy sweep, then sweep again with nothing marked
+  for (int ci=0; ci<GC_NCLASSES; ci++) sweep_class(&gc->size_classes[ci]);
+  if (gc->marking) unmark_all(gc);
+  if (gc->nmarkers) gc->markers[0].part = NULL;
+  sweep(gc);
+  for (int ci=0; ci<GC_NCLASSES; ci++) sweep_class(&gc->size_classes[ci]);
+  arena_free(&gc->nursery);
+  free(gc->remembered); gc->remembered = NULL; gc->nremembered = gc->capremembered = 0;
+  free(gc->gray); gc->gray = NULL; gc->ngray = gc->capgray = 0;
+  free(gc->greyed); gc->greyed = NULL; gc->ngreyed = gc->capgreyed = 0;
+  gc->marking = false;
+  for (int i=0;i<gc->nmarkers;i++) { free(gc->markers[i].stack); free(gc->markers[i].shared); }
+  free(gc->markers); gc->markers = NULL; gc->nmarkers = 0;
+  gc->bytes_allocated = 0; gc->next_threshold = GC_MIN_THRESHOLD;
+}
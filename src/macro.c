@@ -48,12 +48,6 @@ static Node *expand_list(Arena *a, MacroEnv *env, Node *lst) {
     } else {
       // Convert args to AST values and invoke closure
       extern Value vm_call_closure(struct VM*, struct Closure*, Value*, int);
-      extern Value v_symbol(const char*, int32_t);
-      extern Value v_list(ValList*);
-      extern Value v_int(int64_t);
-      extern Value v_float(double);
-      extern Value v_bool(bool);
-      extern Value v_str(String*);
       extern String *rt_string_new(struct VM*, const char*, size_t);
 
       // node->value (AST) converter
@@ -65,8 +59,7 @@ static Node *expand_list(Arena *a, MacroEnv *env, Node *lst) {
           case N_BOOL: return v_bool(n->as.bval);
           case N_STRING: return v_str(rt_string_new(me->clos.vm, n->as.str.ptr, n->as.str.len));
           case N_LIST: {
-            ValList *vl = (ValList*)gc_alloc(&me->clos.vm->gc, sizeof(ValList), 6);
-            vl->len = (int32_t)n->as.list.count; vl->cap = vl->len; vl->items = (Value*)malloc(sizeof(Value)*vl->len);
+            ValList *vl = rt_list_new(me->clos.vm, (int32_t)n->as.list.count);
             for (int i=0;i<vl->len;i++) vl->items[i] = node_to_val(n->as.list.items[i]);
             return v_list(vl);
           }
@@ -75,15 +68,15 @@ static Node *expand_list(Arena *a, MacroEnv *env, Node *lst) {
       }
       // value->node converter
       Node *val_to_node(Value v) {
-        switch (v.kind) {
-          case VAL_INT: return node_new_int(a, v.as.i, 0,0);
-          case VAL_FLOAT: return node_new_float(a, v.as.f, 0,0);
-          case VAL_BOOL: return node_new_bool(a, v.as.b, 0,0);
-          case VAL_STR: return node_new_string(a, v.as.str->data, (size_t)v.as.str->len, 0,0);
-          case VAL_SYMBOL: return node_new_symbol(a, v.as.sym.name, (size_t)v.as.sym.len, 0,0);
+        switch (v_kind(v)) {
+          case VAL_INT: return node_new_int(a, v_as_int(v), 0,0);
+          case VAL_FLOAT: return node_new_float(a, v_as_float(v), 0,0);
+          case VAL_BOOL: return node_new_bool(a, v_as_bool(v), 0,0);
+          case VAL_STR: return node_new_string(a, v_as_str(v)->data, (size_t)v_as_str(v)->len, 0,0);
+          case VAL_SYMBOL: return node_new_symbol(a, v_sym_name(v), (size_t)v_sym_len(v), 0,0);
           case VAL_LIST: {
-            Node *nl = node_new_list(a, (size_t)v.as.list->len);
-            for (int i=0;i<v.as.list->len;i++) node_list_push(a, nl, val_to_node(v.as.list->items[i]));
+            Node *nl = node_new_list(a, (size_t)v_as_list(v)->len);
+            for (int i=0;i<v_as_list(v)->len;i++) node_list_push(a, nl, val_to_node(v_as_list(v)->items[i]));
             return nl;
           }
           default: return node_new_symbol(a, "_",1,0,0);
@@ -205,6 +198,9 @@ static int is_sym(Node *n, const char *s) {
 
 void macros_collect_user(Arena *a, MacroEnv **env, struct VM *vm, Node *program) {
   (void)a;
+  // Macro closures are held by the MacroEnv, outside the VM's roots, so the
+  // macro-time VM never collects.
+  vm->gc.paused++;
   for (size_t i=0;i<program->as.list.count;i++) {
     Node *f = program->as.list.items[i];
     if (f->kind!=N_LIST || f->as.list.count<3) continue;
@@ -231,8 +227,8 @@ void macros_collect_user(Arena *a, MacroEnv **env, struct VM *vm, Node *program)
     node_list_push(a, fn, body);
     // Evaluate fn to closure in macro-time VM and register
     extern int eval_form(struct VM*, Node*, Value*);
-    Value closv; if (eval_form(vm, fn, &closv)==0 && closv.kind==VAL_CLOSURE) {
-      macro_env_add_closure(env, name->as.sym.ptr, vm, closv.as.clos);
+    Value closv; if (eval_form(vm, fn, &closv)==0 && v_kind(closv)==VAL_CLOSURE) {
+      macro_env_add_closure(env, name->as.sym.ptr, vm, v_as_clos(closv));
     }
   }
 }
@@ -1,12 +1,22 @@
+#define _DEFAULT_SOURCE // posix_spawnp
 #include "sqale.h"
 #include "parser.h"
 #include "eval.h"
 #include "codegen.h"
+#include "tier.h"
 #include "arena.h"
 #include "macro.h"
+#include "thread.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <spawn.h>
+#include <sys/wait.h>
+extern char **environ;
+#endif
 
 static char *read_file_all(const char *path, size_t *out_len) {
   FILE *f = fopen(path, "rb"); if (!f) return NULL;
@@ -22,6 +32,7 @@ static int cmd_repl(void) {
   printf("SQALE REPL. Ctrl-D to exit.\n");
   while (1) {
     printf("> "); fflush(stdout);
+    gc_leave(&vm->gc); // tasks may collect while we wait for input
     if (!fgets(line, sizeof(line), stdin)) break;
     Parser p; parser_init(&p, &arena, line, strlen(line));
     Node *n_raw = parse_toplevel(&p);
@@ -31,12 +42,12 @@ static int cmd_repl(void) {
     for (size_t i=0;i<n->as.list.count;i++) {
       Value out; if (eval_form(vm, n->as.list.items[i], &out)==0) {
         // print result unless it's Unit
-        if (out.kind==VAL_UNIT) continue;
-        switch (out.kind) {
-          case VAL_INT: printf("%lld\n", (long long)out.as.i); break;
-          case VAL_FLOAT: printf("%g\n", out.as.f); break;
-          case VAL_BOOL: printf(out.as.b?"true\n":"false\n"); break;
-          case VAL_STR: printf("\"%.*s\"\n", (int)out.as.str->len, out.as.str->data); break;
+        if (v_kind(out)==VAL_UNIT) continue;
+        switch (v_kind(out)) {
+          case VAL_INT: printf("%lld\n", (long long)v_as_int(out)); break;
+          case VAL_FLOAT: printf("%g\n", v_as_float(out)); break;
+          case VAL_BOOL: printf(v_as_bool(out)?"true\n":"false\n"); break;
+          case VAL_STR: printf("\"%.*s\"\n", (int)v_as_str(out)->len, v_as_str(out)->data); break;
           default: printf("<val>\n"); break;
         }
       }
@@ -47,7 +58,7 @@ static int cmd_repl(void) {
   return 0;
 }
 
-static int cmd_run(const char *path) {
+static int cmd_run(const char *path, Engine engine, bool jit, uint32_t tier, bool tier_stats, int opt_level) {
   size_t n=0; char *buf = read_file_all(path, &n);
   if (!buf) { fprintf(stderr, "failed to read %s\n", path); return 1; }
   Arena arena; arena_init(&arena, 1<<20);
@@ -57,21 +68,67 @@ static int cmd_run(const char *path) {
   VM *mvm = vm_new(); macros_collect_user(&arena, &menv, mvm, prog_raw);
   Node *prog = macro_expand_all(&arena, menv, prog_raw);
   VM *vm = vm_new();
+  vm->engine = engine;
+  if (tier && !(vm->tier = tier_new(prog, tier, opt_level, tier_stats))) fprintf(stderr, "run: --tier ignored\n");
   int rc = eval_program(vm, prog);
-  if (rc==0) {
+  bool ran = false;
+  if (rc==0 && jit) {
+    // eval_program has typechecked the program; if the backend cannot lower
+    // something main reaches, the interpreter runs it instead
+    CodegenOpts opts = { .module_name = path, .use_llvm = USE_LLVM, .for_exe = 1, .opt_level = opt_level };
+    ran = codegen_jit_run(prog, &opts, &rc)==0;
+    if (!ran) fprintf(stderr, "run: falling back to the interpreter\n");
+  }
+  if (rc==0 && !ran) {
     EnvEntry *e = env_lookup(vm->global_env, "main");
     if (e && e->value) {
       Value v = *(Value*)e->value;
-      if (v.kind==VAL_CLOSURE) {
-        Value r = vm_call_closure0(vm, v.as.clos);
-        if (r.kind==VAL_INT) rc = (int)r.as.i;
+      if (v_kind(v)==VAL_CLOSURE) {
+        Value r = vm_call_closure0(vm, v_as_clos(v));
+        if (v_kind(r)==VAL_INT) rc = (int)v_as_int(r);
       }
     }
   }
+  // Let spawned tasks finish, short of those blocked for good
+  rt_sched_quiesce();
   vm_free(vm); vm_free(mvm); arena_free(&arena); free(buf); return rc;
 }
 
-static int cmd_emit_ir(const char *path, const char *out_path) {
+// Compiled programs are their functions: any other toplevel form would run
+// at build time, or not at all, instead of in the executable. Say which one
+// is in the way, before anything is evaluated.
+static int check_compilable(const char *cmd, const char *path, Node *prog) {
+  for (size_t i=0;i<prog->as.list.count;i++) {
+    Node *form = prog->as.list.items[i];
+    Node *at = form->kind==N_LIST && form->as.list.count ? form->as.list.items[0] : form; // lists carry no position
+    char loc[64]; // macro expansions have none either
+    if (at->line) snprintf(loc, sizeof loc, "%zu:%zu", at->line, at->col);
+    else snprintf(loc, sizeof loc, "toplevel form %zu", i);
+    const char *why = "toplevel expressions would run at compile time, not in the executable";
+    if (form->kind==N_LIST) {
+      size_t n = form->as.list.count;
+      Node **it = form->as.list.items;
+      switch (form->as.list.form) {
+        case FORM_DEFMACRO: case FORM_DEFSTRUCT: case FORM_DEFENUM: continue;
+        case FORM_DEF:
+          if (n>=5 && it[4]->kind==N_LIST && it[4]->as.list.form==FORM_FN) continue;
+          if (n>=2 && it[1]->kind==N_SYMBOL) {
+            fprintf(stderr, "%s: %s:%s: %.*s is not a typed function; compiled programs have no globals\n",
+                    cmd, path, loc, (int)it[1]->as.sym.len, it[1]->as.sym.ptr);
+            return 1;
+          }
+          break;
+        case FORM_IMPORT: why = "imports are not compiled"; break;
+        default: break;
+      }
+    }
+    fprintf(stderr, "%s: %s:%s: %s\n", cmd, path, loc, why);
+    return 1;
+  }
+  return 0;
+}
+
+static int cmd_emit_ir(const char *path, const char *out_path, int opt_level) {
   size_t n=0; char *buf = read_file_all(path, &n);
   if (!buf) { fprintf(stderr, "failed to read %s\n", path); return 1; }
   Arena arena; arena_init(&arena, 1<<20);
@@ -83,45 +140,141 @@ static int cmd_emit_ir(const char *path, const char *out_path) {
 
   // Run type checking to populate type annotations on AST nodes
   VM *vm = vm_new();
-  int rc = eval_program(vm, prog);
+  int rc = check_compilable("emit-ir", path, prog);
+  if (rc == 0 && (rc = typecheck_program(vm, prog)) != 0) fprintf(stderr, "Type checking failed\n");
   if (rc != 0) {
-    fprintf(stderr, "Type checking failed\n");
     vm_free(vm); vm_free(mvm); arena_free(&arena); free(buf);
     return 1;
   }
 
-  CodegenOpts opts = { .module_name = path, .use_llvm = USE_LLVM, .for_exe = 1 };
+  CodegenOpts opts = { .module_name = path, .use_llvm = USE_LLVM, .for_exe = 1, .opt_level = opt_level };
   size_t out_len=0; char *ir = codegen_emit_ir(prog, &opts, &out_len);
+  if (!ir) { vm_free(vm); vm_free(mvm); arena_free(&arena); free(buf); return 1; }
   FILE *f = fopen(out_path?out_path:"out.ll", "wb"); if (!f) { free(buf); arena_free(&arena); free(ir); vm_free(vm); return 1; }
   fwrite(ir,1,out_len,f); fclose(f);
   free(ir); vm_free(vm); vm_free(mvm); arena_free(&arena); free(buf); return 0;
 }
 
-static int cmd_build(const char *path, const char *out_path) {
-  // Emits IR; user can compile with clang if available
-  int rc = cmd_emit_ir(path, out_path?out_path:"out.ll");
+#if USE_LLVM
+// Run argv[0] from PATH and wait for it; its exit status, or -1
+static int run_tool(char *const argv[]) {
+#if defined(_WIN32)
+  return (int)_spawnvp(_P_WAIT, argv[0], (const char *const *)argv);
+#else
+  pid_t pid; int status;
+  if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ)!=0) return -1;
+  if (waitpid(pid, &status, 0)<0 || !WIFEXITED(status)) return -1;
+  return WEXITSTATUS(status);
+#endif
+}
+
+// libsqale_rt.a: $SQALE_RT, else next to this binary (make puts both in build/)
+static void runtime_lib_path(const char *argv0, char *buf, size_t len) {
+  const char *env = getenv("SQALE_RT");
+  if (env && *env) { snprintf(buf, len, "%s", env); return; }
+  const char *slash = strrchr(argv0, '/');
+#if defined(_WIN32)
+  const char *bslash = strrchr(argv0, '\\');
+  if (bslash && (!slash || bslash>slash)) slash = bslash;
+#endif
+  if (slash) snprintf(buf, len, "%.*s/libsqale_rt.a", (int)(slash-argv0), argv0);
+  else snprintf(buf, len, "libsqale_rt.a");
+}
+#endif
+
+static int cmd_build(const char *argv0, const char *path, const char *out_path, int opt_level) {
+#if USE_LLVM
+  // Native executable: object file from the LLVM backend, linked by $CC
+  // (default cc) against the runtime shims in libsqale_rt.a
+  size_t n=0; char *buf = read_file_all(path, &n);
+  if (!buf) { fprintf(stderr, "failed to read %s\n", path); return 1; }
+  Arena arena; arena_init(&arena, 1<<20);
+  Parser p; parser_init(&p, &arena, buf, n);
+  Node *prog_raw = parse_toplevel(&p);
+  MacroEnv *menv = NULL; macros_register_core(&menv);
+  VM *mvm = vm_new(); macros_collect_user(&arena, &menv, mvm, prog_raw);
+  Node *prog = macro_expand_all(&arena, menv, prog_raw);
+  VM *vm = vm_new();
+  int rc = check_compilable("build", path, prog);
+  if (rc==0 && (rc = typecheck_program(vm, prog))!=0) fprintf(stderr, "Type checking failed\n");
+  const char *exe = out_path?out_path:"a.out";
+  char obj[4096]; snprintf(obj, sizeof obj, "%s.o", exe);
+  if (rc==0) {
+    CodegenOpts opts = { .module_name = path, .use_llvm = 1, .for_exe = 1, .opt_level = opt_level };
+    rc = codegen_emit_object(prog, &opts, obj);
+  }
   if (rc==0) {
-    fprintf(stdout, "IR emitted to %s. Compile with: clang %s -O2 -o a.out\n", out_path?out_path:"out.ll", out_path?out_path:"out.ll");
+    char rt[4096]; runtime_lib_path(argv0, rt, sizeof rt);
+    const char *cc = getenv("CC");
+    char *ld[] = { (char*)(cc && *cc ? cc : "cc"), obj, rt, "-o", (char*)exe, NULL };
+    int st = run_tool(ld);
+    if (st!=0) { fprintf(stderr, "build: %s failed linking %s with %s\n", ld[0], obj, rt); rc = 1; }
+    remove(obj);
   }
+  vm_free(vm); vm_free(mvm); arena_free(&arena); free(buf);
   return rc;
+#else
+  // Without LLVM: emit IR; compile it with clang and libsqale_rt.a
+  (void)argv0;
+  int rc = cmd_emit_ir(path, out_path?out_path:"out.ll", opt_level);
+  if (rc==0) {
+    fprintf(stdout, "IR emitted to %s. Compile with: clang %s build/libsqale_rt.a -O2 -o a.out\n", out_path?out_path:"out.ll", out_path?out_path:"out.ll");
+  }
+  return rc;
+#endif
+}
+
+// -O0..-O3: LLVM optimization level; -1 if arg is not one
+static int parse_opt_level(const char *arg) {
+  if (arg[0]=='-' && arg[1]=='O' && arg[2]>='0' && arg[2]<='3' && !arg[3]) return arg[2]-'0';
+  return -1;
 }
 
 int main(int argc, char **argv) {
   if (argc<2) {
-    fprintf(stderr, "Usage: %s [repl | run <file.sq> | emit-ir <file.sq> -o <out.ll>]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [repl | run [--engine=tree|bc] [--jit] [-O0..3] [--tier[=N]] [--tier-stats] [--workers=N] [--task-stack=MB] [--gc-threads=N] [--gc=stw|incremental] <file.sq> | emit-ir <file.sq> [-O0..3] -o <out.ll> | build <file.sq> [-O0..3] -o <exe>]\n", argv[0]);
     return 1;
   }
   if (strcmp(argv[1], "repl")==0) return cmd_repl();
-  if (strcmp(argv[1], "run")==0 && argc>=3) return cmd_run(argv[2]);
+  if (strcmp(argv[1], "run")==0 && argc>=3) {
+    const char *path=NULL; Engine engine=ENGINE_TREE; bool jit=false, tier_stats=false;
+    uint32_t tier=0; // call + back-edge threshold; 0 leaves it off
+    int opt_level=2;
+    for (int i=2;i<argc;i++) {
+      if (strcmp(argv[i], "--jit")==0) jit=true;
+      else if (parse_opt_level(argv[i])>=0) opt_level=parse_opt_level(argv[i]);
+      else if (strcmp(argv[i], "--tier")==0) tier=1000;
+      else if (strncmp(argv[i], "--tier=", 7)==0) { int t=atoi(argv[i]+7); tier = t>0 ? (uint32_t)t : 1; }
+      else if (strcmp(argv[i], "--tier-stats")==0) { tier_stats=true; if (!tier) tier=1000; }
+      else if (strcmp(argv[i], "--engine=tree")==0) engine=ENGINE_TREE;
+      else if (strcmp(argv[i], "--engine=bc")==0) engine=ENGINE_BC;
+      else if (strncmp(argv[i], "--engine=", 9)==0) { fprintf(stderr, "unknown engine: %s\n", argv[i]+9); return 1; }
+      else if (strncmp(argv[i], "--workers=", 10)==0) rt_sched_set_workers(atoi(argv[i]+10));
+      else if (strncmp(argv[i], "--task-stack=", 13)==0) rt_sched_set_task_stack(atoi(argv[i]+13));
+      else if (strncmp(argv[i], "--gc-threads=", 13)==0) gc_set_threads(atoi(argv[i]+13));
+      else if (strcmp(argv[i], "--gc=incremental")==0) gc_set_incremental(1);
+      else if (strcmp(argv[i], "--gc=stw")==0) gc_set_incremental(0);
+      else if (strncmp(argv[i], "--gc=", 5)==0) { fprintf(stderr, "unknown gc mode: %s\n", argv[i]+5); return 1; }
+      else if (!path) path=argv[i];
+    }
+    if (!path) { fprintf(stderr, "run: missing file\n"); return 1; }
+    return cmd_run(path, engine, jit, tier, tier_stats, opt_level);
+  }
   if (strcmp(argv[1], "emit-ir")==0 && argc>=3) {
-    const char *out="out.ll";
-    for (int i=3;i<argc-1;i++) if (strcmp(argv[i], "-o")==0) out=argv[i+1];
-    return cmd_emit_ir(argv[2], out);
+    const char *out="out.ll"; int opt_level=0; // readable IR unless asked
+    for (int i=3;i<argc;i++) {
+      if (strcmp(argv[i], "-o")==0 && i+1<argc) out=argv[++i];
+      else if (parse_opt_level(argv[i])>=0) opt_level=parse_opt_level(argv[i]);
+    }
+    return cmd_emit_ir(argv[2], out, opt_level);
   }
   if (strcmp(argv[1], "build")==0 && argc>=3) {
-    const char *out="out.ll";
-    for (int i=3;i<argc-1;i++) if (strcmp(argv[i], "-o")==0) out=argv[i+1];
-    return cmd_build(argv[2], out);
+    const char *out=NULL; int opt_level=2;
+    for (int i=3;i<argc;i++) {
+      if (strcmp(argv[i], "-o")==0 && i+1<argc) out=argv[++i];
+      else if (parse_opt_level(argv[i])>=0) opt_level=parse_opt_level(argv[i]);
+    }
+    return cmd_build(argv[0], argv[2], out, opt_level);
   }
   fprintf(stderr, "Invalid command.\n");
   return 1;
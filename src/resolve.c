@@ -0,0 +1,211 @@
+#include "resolve.h"
+#include "runtime.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Static mirror of the runtime frame chain: one RScope per [fn ...] call
+// frame or [let ...] frame. The global env is represented by scope == NULL.
+typedef struct RScope {
+  const char **names;
+  int32_t count, cap;
+  bool captured; // a [fn ...] literal appears inside this scope
+  struct RScope *parent;
+} RScope;
+
+typedef struct Resolver {
+  VM *vm;
+  RScope *scope;
+} Resolver;
+
+static void resolve_node(Resolver *r, Node *n);
+
+static int is_sym(Node *n, const char *s) {
+  return n && n->kind==N_SYMBOL && strlen(s)==n->as.sym.len && strncmp(n->as.sym.ptr, s, n->as.sym.len)==0;
+}
+
+static void scope_push(Resolver *r, RScope *s) {
+  s->names = NULL; s->count = 0; s->cap = 0; s->captured = false; s->parent = r->scope; r->scope = s;
+}
+
+static int32_t scope_pop(Resolver *r) {
+  RScope *s = r->scope; int32_t n = s->count;
+  r->scope = s->parent; free(s->names); return n;
+}
+
+// Rebinding a name in the same frame reuses its slot, which matches the
+// shadowing behaviour of the old per-frame entry lists. Names are interned,
+// so they compare by pointer.
+static int32_t scope_declare(RScope *s, const char *name) {
+  for (int32_t i=0;i<s->count;i++) if (s->names[i]==name) return i;
+  if (s->count==s->cap) {
+    s->cap = s->cap ? s->cap*2 : 8;
+    s->names = (const char**)realloc(s->names, sizeof(const char*)*s->cap);
+  }
+  s->names[s->count] = name;
+  return s->count++;
+}
+
+// Value cell of a global. The typechecker registers globals with a NULL value
+// before they are evaluated; we give such entries a cell here so references can
+// point at it directly. A redefinition keeps the older entry's cell.
+static Value *global_cell(VM *vm, const char *name) {
+  EnvEntry *e = env_lookup(vm->global_env, name);
+  if (!e) return NULL;
+  if (!e->value) {
+    for (EnvEntry *o=e->next; o; o=o->next) {
+      if (o->value && strcmp(o->name, name)==0) { e->value = o->value; return (Value*)e->value; }
+    }
+    Value *box = (Value*)malloc(sizeof(Value)); *box = v_unit();
+    e->value = box;
+  }
+  return (Value*)e->value;
+}
+
+static void resolve_ref(Resolver *r, Node *sym) {
+  int32_t depth = 0;
+  for (RScope *s=r->scope; s; s=s->parent, depth++) {
+    for (int32_t i=0;i<s->count;i++) {
+      if (s->names[i]==sym->as.sym.ptr) {
+        sym->as.sym.depth = depth; sym->as.sym.slot = i; sym->as.sym.cell = NULL;
+        return;
+      }
+    }
+  }
+  sym->as.sym.depth = -1; sym->as.sym.slot = -1;
+  sym->as.sym.cell = global_cell(r->vm, sym->as.sym.ptr);
+}
+
+// Binding occurrence: a slot in the innermost frame, or the global cell at toplevel
+static void resolve_binding(Resolver *r, Node *sym) {
+  if (!sym || sym->kind!=N_SYMBOL) return;
+  if (r->scope) {
+    sym->as.sym.depth = 0; sym->as.sym.slot = scope_declare(r->scope, sym->as.sym.ptr); sym->as.sym.cell = NULL;
+  } else {
+    sym->as.sym.depth = -1; sym->as.sym.slot = -1; sym->as.sym.cell = global_cell(r->vm, sym->as.sym.ptr);
+  }
+}
+
+// Only unquoted parts of a quasiquote template are evaluated
+static void resolve_qq(Resolver *r, Node *n) {
+  if (n->kind!=N_LIST) return;
+  if (n->as.list.count>=2 && (is_sym(n->as.list.items[0], "unquote") || is_sym(n->as.list.items[0], "unquote-splicing"))) {
+    resolve_node(r, n->as.list.items[1]);
+    return;
+  }
+  for (size_t i=0;i<n->as.list.count;i++) resolve_qq(r, n->as.list.items[i]);
+}
+
+static void resolve_let(Resolver *r, Node *list) {
+  size_t n = list->as.list.count;
+  if (n<3) return;
+  Node *binds = list->as.list.items[1];
+  RScope s; scope_push(r, &s);
+  // Mirrors the binding shapes accepted by eval_list: each initialiser sees the
+  // bindings before it, but not its own name.
+  for (size_t i=0;i<binds->as.list.count;i++) {
+    Node *pair = binds->as.list.items[i];
+    if (pair->kind!=N_LIST || pair->as.list.count<2) continue;
+    Node *nm = pair->as.list.items[0];
+    Node *ex = NULL;
+    if (pair->as.list.count>=4 && is_sym(pair->as.list.items[1], ":")) {
+      ex = pair->as.list.items[3];
+    } else if (pair->as.list.count==3 && is_sym(pair->as.list.items[1], ":")) {
+      if (i+1<binds->as.list.count) ex = binds->as.list.items[++i];
+    } else {
+      ex = pair->as.list.items[1];
+    }
+    if (ex) resolve_node(r, ex);
+    resolve_binding(r, nm);
+  }
+  for (size_t i=2;i<n;i++) resolve_node(r, list->as.list.items[i]);
+  list->as.list.captured = s.captured;
+  list->as.list.nslots = scope_pop(r);
+}
+
+static void resolve_fn(Resolver *r, Node *list) {
+  if (list->as.list.count<2) return;
+  Node *params = list->as.list.items[1];
+  // The closure keeps the whole enclosing frame chain alive. Enclosing scopes
+  // are marked together, so an already captured scope ends the walk.
+  for (RScope *o=r->scope; o && !o->captured; o=o->parent) o->captured = true;
+  RScope s; scope_push(r, &s);
+  for (size_t k=0;k<params->as.list.count;k++) {
+    Node *p = params->as.list.items[k];
+    if (p->kind==N_LIST && p->as.list.count>0) resolve_binding(r, p->as.list.items[0]);
+  }
+  size_t i0 = 2;
+  if (list->as.list.count>i0 && is_sym(list->as.list.items[i0], ":")) i0 += 2;
+  for (size_t i=i0;i<list->as.list.count;i++) resolve_node(r, list->as.list.items[i]);
+  list->as.list.captured = s.captured;
+  list->as.list.nslots = scope_pop(r);
+}
+
+// A recv arm binds the received value in a frame of its own, like a let
+static void resolve_select(Resolver *r, Node *list) {
+  for (size_t i=1;i<list->as.list.count;i++) {
+    Node *arm = list->as.list.items[i];
+    if (select_arm(arm)!=SELECT_RECV) { resolve_node(r, arm); continue; }
+    resolve_node(r, arm->as.list.items[0]->as.list.items[1]);
+    RScope s; scope_push(r, &s);
+    resolve_binding(r, arm->as.list.items[1]);
+    for (size_t k=2;k<arm->as.list.count;k++) resolve_node(r, arm->as.list.items[k]);
+    arm->as.list.captured = s.captured;
+    arm->as.list.nslots = scope_pop(r);
+  }
+}
+
+static void resolve_list(Resolver *r, Node *list) {
+  size_t n = list->as.list.count;
+  if (n==0) return;
+  switch (list->as.list.form) {
+    case FORM_DEFMACRO:
+    case FORM_IMPORT:
+    case FORM_DEFSTRUCT:
+      return;
+    case FORM_DEF: {
+      if (n<3) return;
+      // Bound before its initialiser so recursive definitions resolve to themselves
+      resolve_binding(r, list->as.list.items[1]);
+      size_t idx = 2;
+      if (is_sym(list->as.list.items[idx], ":")) idx += 2;
+      if (idx<n) resolve_node(r, list->as.list.items[idx]);
+      return;
+    }
+    case FORM_QUOTE:
+      // eval_list evaluates the elements of a quoted list
+      if (n>=2 && list->as.list.items[1]->kind==N_LIST) {
+        Node *q = list->as.list.items[1];
+        for (size_t i=0;i<q->as.list.count;i++) resolve_node(r, q->as.list.items[i]);
+      }
+      return;
+    case FORM_QUASIQUOTE:
+      if (n>=2) resolve_qq(r, list->as.list.items[1]);
+      return;
+    case FORM_LET: resolve_let(r, list); return;
+    case FORM_FN: resolve_fn(r, list); return;
+    case FORM_SELECT: resolve_select(r, list); return;
+    case FORM_DEFENUM: {
+      if (n<3) return;
+      Node *variants = list->as.list.items[2];
+      for (size_t i=0;i<variants->as.list.count;i++) resolve_binding(r, variants->as.list.items[i]);
+      return;
+    }
+    default:
+      break;
+  }
+  // Calls and the remaining special forms (if, do, while, set!) only reference names
+  for (size_t i=0;i<n;i++) resolve_node(r, list->as.list.items[i]);
+}
+
+static void resolve_node(Resolver *r, Node *n) {
+  switch (n->kind) {
+    case N_SYMBOL: resolve_ref(r, n); return;
+    case N_LIST: resolve_list(r, n); return;
+    default: return;
+  }
+}
+
+void resolve_form(VM *vm, Node *form) {
+  Resolver r = { vm, NULL };
+  resolve_node(&r, form);
+}
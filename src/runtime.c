@@ -7,13 +7,12 @@
 
 // Forward from eval.c
 struct VM; struct Closure; 
-void vm_call_closure_noargs(struct VM *vm, struct Closure *c);
+Value vm_call_closure0(VM *vm, struct Closure *c);
+Value vm_call_closure(VM *vm, struct Closure *c, Value *args, int nargs);
 
 String *rt_string_new(VM *vm, const char *bytes, size_t len) {
-  (void)vm; // GC embedded in obj header; simple malloc for char data
-  String *s = (String*)gc_alloc(&vm->gc, sizeof(String), 1);
+  String *s = (String*)gc_alloc(&vm->gc, sizeof(String)+len+1, OBJ_STRING);
   s->len = (int64_t)len;
-  s->data = (char*)malloc(len+1);
   memcpy(s->data, bytes, len); s->data[len]='\0';
   return s;
 }
@@ -34,20 +33,20 @@ Value rt_print(Env *env, Value *args, int nargs) {
   (void)env;
   for (int i=0;i<nargs;i++) {
     Value v = args[i];
-    switch (v.kind) {
-      case VAL_INT: printf("%lld", (long long)v.as.i); break;
-      case VAL_FLOAT: printf("%g", v.as.f); break;
-      case VAL_BOOL: printf(v.as.b?"true":"false"); break;
-      case VAL_STR: printf("%.*s", (int)v.as.str->len, v.as.str->data); break;
+    switch (v_kind(v)) {
+      case VAL_INT: printf("%lld", (long long)v_as_int(v)); break;
+      case VAL_FLOAT: printf("%g", v_as_float(v)); break;
+      case VAL_BOOL: printf(v_as_bool(v)?"true":"false"); break;
+      case VAL_STR: printf("%.*s", (int)v_as_str(v)->len, v_as_str(v)->data); break;
       case VAL_VEC: {
         printf("[");
-        for (int j=0;j<v.as.vec->len;j++) {
-          Value e = v.as.vec->items[j];
-          if (e.kind==VAL_INT) printf("%lld", (long long)e.as.i);
-          else if (e.kind==VAL_STR) printf("\"%.*s\"", (int)e.as.str->len, e.as.str->data);
-          else if (e.kind==VAL_BOOL) printf(e.as.b?"true":"false");
+        for (int j=0;j<v_as_vec(v)->len;j++) {
+          Value e = v_as_vec(v)->items[j];
+          if (v_kind(e)==VAL_INT) printf("%lld", (long long)v_as_int(e));
+          else if (v_kind(e)==VAL_STR) printf("\"%.*s\"", (int)v_as_str(e)->len, v_as_str(e)->data);
+          else if (v_kind(e)==VAL_BOOL) printf(v_as_bool(e)?"true":"false");
           else printf("_");
-          if (j+1<v.as.vec->len) printf(" ");
+          if (j+1<v_as_vec(v)->len) printf(" ");
         }
         printf("]");
         break;
@@ -61,47 +60,6 @@ Value rt_print(Env *env, Value *args, int nargs) {
   return v_unit();
 }
 
-// ============================================================================
-// LLVM/run-time shims for codegen
-// These functions are called from LLVM-generated code
-// ============================================================================
-
-void sq_print_i64(long long v) { printf("%lld", v); }
-void sq_print_f64(double v) { printf("%g", v); }
-void sq_print_bool(int v) { printf(v ? "true" : "false"); }
-void sq_print_cstr(const char *s) { if (s) printf("%s", s); }
-void sq_print_newline(void) { printf("\n"); }
-
-// Runtime memory allocation for LLVM codegen
-void *sq_alloc(size_t size) {
-  return calloc(1, size);
-}
-
-// Closure allocation: stores function pointer, environment, and arity
-typedef struct {
-  void *fn;
-  void *env;
-  int arity;
-} SqClosure;
-
-void *sq_alloc_closure(void *fn, void *env, int arity) {
-  SqClosure *c = (SqClosure*)calloc(1, sizeof(SqClosure));
-  c->fn = fn;
-  c->env = env;
-  c->arity = arity;
-  return c;
-}
-
-void *sq_closure_get_fn(void *closure) {
-  if (!closure) return NULL;
-  return ((SqClosure*)closure)->fn;
-}
-
-void *sq_closure_get_env(void *closure) {
-  if (!closure) return NULL;
-  return ((SqClosure*)closure)->env;
-}
-
 static char *read_file_all(const char *path, size_t *out_len) {
   FILE *f = fopen(path, "rb"); if (!f) return NULL;
   fseek(f, 0, SEEK_END); long n = ftell(f); fseek(f, 0, SEEK_SET);
@@ -112,8 +70,8 @@ static char *read_file_all(const char *path, size_t *out_len) {
 Value rt_read_file(Env *env, Value *args, int nargs) {
   (void)env; if (!expect_nargs(nargs,1,"read-file")) return v_unit();
   VM *vm = (VM*)env->aux;
-  if (args[0].kind!=VAL_STR) return v_unit();
-  size_t len=0; char *buf = read_file_all(args[0].as.str->data, &len);
+  if (v_kind(args[0])!=VAL_STR) return v_unit();
+  size_t len=0; char *buf = read_file_all(v_as_str(args[0])->data, &len);
   if (!buf) return v_unit();
   String *s = rt_string_new(vm, buf, len); free(buf);
   return v_str(s);
@@ -121,61 +79,66 @@ Value rt_read_file(Env *env, Value *args, int nargs) {
 
 Value rt_write_file(Env *env, Value *args, int nargs) {
   (void)env; if (!expect_nargs(nargs,2,"write-file")) return v_unit();
-  if (args[0].kind!=VAL_STR || args[1].kind!=VAL_STR) return v_unit();
-  FILE *f = fopen(args[0].as.str->data, "wb"); if (!f) return v_bool(false);
-  fwrite(args[1].as.str->data,1,(size_t)args[1].as.str->len,f); fclose(f);
+  if (v_kind(args[0])!=VAL_STR || v_kind(args[1])!=VAL_STR) return v_unit();
+  FILE *f = fopen(v_as_str(args[0])->data, "wb"); if (!f) return v_bool(false);
+  fwrite(v_as_str(args[1])->data,1,(size_t)v_as_str(args[1])->len,f); fclose(f);
   return v_bool(true);
 }
 
 Value rt_str_split_ws(Env *env, Value *args, int nargs) {
-  VM *vm = (VM*)env->aux; if (nargs!=1 || args[0].kind!=VAL_STR) return v_vec(NULL);
-  const char *s = args[0].as.str->data; size_t n = (size_t)args[0].as.str->len;
-  Vector *v = (Vector*)gc_alloc(&vm->gc, sizeof(Vector), 4); v->len=0; v->cap=8; v->items=(Value*)malloc(sizeof(Value)*v->cap);
+  VM *vm = (VM*)env->aux; if (nargs!=1 || v_kind(args[0])!=VAL_STR) return v_unit();
+  const char *s = v_as_str(args[0])->data; size_t n = (size_t)v_as_str(args[0])->len;
+  Vector *v = rt_vec_alloc(vm, 8);
   size_t i=0; while (i<n) {
     while (i<n && (s[i]==' '||s[i]=='\n' || s[i]=='\t' || s[i]=='\r')) i++;
     size_t start=i; while (i<n && !(s[i]==' '||s[i]=='\n'||s[i]=='\t'||s[i]=='\r')) i++;
-    if (i>start) { String *str = rt_string_new(vm, s+start, i-start); if (v->len==v->cap){v->cap*=2; v->items=(Value*)realloc(v->items,sizeof(Value)*v->cap);} v->items[v->len++] = v_str(str); }
+    if (i>start) { String *str = rt_string_new(vm, s+start, i-start); if (v->len==v->cap) rt_vec_grow(vm, v); v->items[v->len++] = v_str(str); gc_write_barrier(&vm->gc, &v->hdr, &str->hdr); }
   }
   return v_vec(v);
 }
 
-static int both_int(Value a, Value b) { return a.kind==VAL_INT && b.kind==VAL_INT; }
-static int both_float(Value a, Value b) { return a.kind==VAL_FLOAT && b.kind==VAL_FLOAT; }
+static int both_int(Value a, Value b) { return v_kind(a)==VAL_INT && v_kind(b)==VAL_INT; }
+static int both_float(Value a, Value b) { return v_kind(a)==VAL_FLOAT && v_kind(b)==VAL_FLOAT; }
 
 Value rt_add(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_unit();
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i + args[1].as.i);
-  if (both_float(args[0],args[1])) return v_float(args[0].as.f + args[1].as.f);
+  if (both_int(args[0],args[1])) return v_int(v_as_int(args[0]) + v_as_int(args[1]));
+  if (both_float(args[0],args[1])) return v_float(v_as_float(args[0]) + v_as_float(args[1]));
   return v_unit();
 }
 Value rt_sub(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_unit();
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i - args[1].as.i);
-  if (both_float(args[0],args[1])) return v_float(args[0].as.f - args[1].as.f);
+  if (both_int(args[0],args[1])) return v_int(v_as_int(args[0]) - v_as_int(args[1]));
+  if (both_float(args[0],args[1])) return v_float(v_as_float(args[0]) - v_as_float(args[1]));
   return v_unit();
 }
 Value rt_mul(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_unit();
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i * args[1].as.i);
-  if (both_float(args[0],args[1])) return v_float(args[0].as.f * args[1].as.f);
+  if (both_int(args[0],args[1])) return v_int(v_as_int(args[0]) * v_as_int(args[1]));
+  if (both_float(args[0],args[1])) return v_float(v_as_float(args[0]) * v_as_float(args[1]));
   return v_unit();
 }
 Value rt_div(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_unit();
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i / args[1].as.i);
-  if (both_float(args[0],args[1])) return v_float(args[0].as.f / args[1].as.f);
+  if (both_int(args[0],args[1])) {
+    int64_t a = v_as_int(args[0]), b = v_as_int(args[1]);
+    if (b == 0) return v_int(0); // avoid division by zero, as rt_mod does
+    if (b == -1) return v_int((int64_t)(0 - (uint64_t)a)); // INT64_MIN / -1 wraps
+    return v_int(a / b);
+  }
+  if (both_float(args[0],args[1])) return v_float(v_as_float(args[0]) / v_as_float(args[1]));
   return v_unit();
 }
 
 Value rt_eq(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_bool(false);
   Value a=args[0], b=args[1];
-  if (a.kind!=b.kind) return v_bool(false);
-  switch (a.kind) {
-    case VAL_INT: return v_bool(a.as.i==b.as.i);
-    case VAL_FLOAT: return v_bool(a.as.f==b.as.f);
-    case VAL_BOOL: return v_bool(a.as.b==b.as.b);
-    case VAL_STR: return v_bool(a.as.str->len==b.as.str->len && memcmp(a.as.str->data,b.as.str->data,a.as.str->len)==0);
+  if (v_kind(a)!=v_kind(b)) return v_bool(false);
+  switch (v_kind(a)) {
+    case VAL_INT: return v_bool(v_as_int(a)==v_as_int(b));
+    case VAL_FLOAT: return v_bool(v_as_float(a)==v_as_float(b));
+    case VAL_BOOL: return v_bool(v_as_bool(a)==v_as_bool(b));
+    case VAL_STR: return v_bool(v_as_str(a)->len==v_as_str(b)->len && memcmp(v_as_str(a)->data,v_as_str(b)->data,v_as_str(a)->len)==0);
     case VAL_UNIT: return v_bool(true);
     default: return v_bool(false);
   }
@@ -183,15 +146,15 @@ Value rt_eq(Env *env, Value *args, int nargs) {
 Value rt_lt(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_bool(false);
   Value a=args[0], b=args[1];
-  if (a.kind==VAL_INT && b.kind==VAL_INT) return v_bool(a.as.i<b.as.i);
-  if (a.kind==VAL_FLOAT && b.kind==VAL_FLOAT) return v_bool(a.as.f<b.as.f);
+  if (v_kind(a)==VAL_INT && v_kind(b)==VAL_INT) return v_bool(v_as_int(a)<v_as_int(b));
+  if (v_kind(a)==VAL_FLOAT && v_kind(b)==VAL_FLOAT) return v_bool(v_as_float(a)<v_as_float(b));
   return v_bool(false);
 }
 Value rt_gt(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_bool(false);
   Value a=args[0], b=args[1];
-  if (a.kind==VAL_INT && b.kind==VAL_INT) return v_bool(a.as.i>b.as.i);
-  if (a.kind==VAL_FLOAT && b.kind==VAL_FLOAT) return v_bool(a.as.f>b.as.f);
+  if (v_kind(a)==VAL_INT && v_kind(b)==VAL_INT) return v_bool(v_as_int(a)>v_as_int(b));
+  if (v_kind(a)==VAL_FLOAT && v_kind(b)==VAL_FLOAT) return v_bool(v_as_float(a)>v_as_float(b));
   return v_bool(false);
 }
 
@@ -202,28 +165,28 @@ Value rt_gt(Env *env, Value *args, int nargs) {
 Value rt_le(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_bool(false);
   Value a=args[0], b=args[1];
-  if (a.kind==VAL_INT && b.kind==VAL_INT) return v_bool(a.as.i<=b.as.i);
-  if (a.kind==VAL_FLOAT && b.kind==VAL_FLOAT) return v_bool(a.as.f<=b.as.f);
+  if (v_kind(a)==VAL_INT && v_kind(b)==VAL_INT) return v_bool(v_as_int(a)<=v_as_int(b));
+  if (v_kind(a)==VAL_FLOAT && v_kind(b)==VAL_FLOAT) return v_bool(v_as_float(a)<=v_as_float(b));
   return v_bool(false);
 }
 
 Value rt_ge(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_bool(false);
   Value a=args[0], b=args[1];
-  if (a.kind==VAL_INT && b.kind==VAL_INT) return v_bool(a.as.i>=b.as.i);
-  if (a.kind==VAL_FLOAT && b.kind==VAL_FLOAT) return v_bool(a.as.f>=b.as.f);
+  if (v_kind(a)==VAL_INT && v_kind(b)==VAL_INT) return v_bool(v_as_int(a)>=v_as_int(b));
+  if (v_kind(a)==VAL_FLOAT && v_kind(b)==VAL_FLOAT) return v_bool(v_as_float(a)>=v_as_float(b));
   return v_bool(false);
 }
 
 Value rt_ne(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_bool(true);
   Value a=args[0], b=args[1];
-  if (a.kind!=b.kind) return v_bool(true);
-  switch (a.kind) {
-    case VAL_INT: return v_bool(a.as.i!=b.as.i);
-    case VAL_FLOAT: return v_bool(a.as.f!=b.as.f);
-    case VAL_BOOL: return v_bool(a.as.b!=b.as.b);
-    case VAL_STR: return v_bool(a.as.str->len!=b.as.str->len || memcmp(a.as.str->data,b.as.str->data,a.as.str->len)!=0);
+  if (v_kind(a)!=v_kind(b)) return v_bool(true);
+  switch (v_kind(a)) {
+    case VAL_INT: return v_bool(v_as_int(a)!=v_as_int(b));
+    case VAL_FLOAT: return v_bool(v_as_float(a)!=v_as_float(b));
+    case VAL_BOOL: return v_bool(v_as_bool(a)!=v_as_bool(b));
+    case VAL_STR: return v_bool(v_as_str(a)->len!=v_as_str(b)->len || memcmp(v_as_str(a)->data,v_as_str(b)->data,v_as_str(a)->len)!=0);
     case VAL_UNIT: return v_bool(false);
     default: return v_bool(true);
   }
@@ -235,21 +198,21 @@ Value rt_ne(Env *env, Value *args, int nargs) {
 
 Value rt_not(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=1) return v_bool(false);
-  if (args[0].kind==VAL_BOOL) return v_bool(!args[0].as.b);
+  if (v_kind(args[0])==VAL_BOOL) return v_bool(!v_as_bool(args[0]));
   return v_bool(false);
 }
 
 Value rt_and(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_bool(false);
-  if (args[0].kind==VAL_BOOL && args[1].kind==VAL_BOOL)
-    return v_bool(args[0].as.b && args[1].as.b);
+  if (v_kind(args[0])==VAL_BOOL && v_kind(args[1])==VAL_BOOL)
+    return v_bool(v_as_bool(args[0]) && v_as_bool(args[1]));
   return v_bool(false);
 }
 
 Value rt_or(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_bool(false);
-  if (args[0].kind==VAL_BOOL && args[1].kind==VAL_BOOL)
-    return v_bool(args[0].as.b || args[1].as.b);
+  if (v_kind(args[0])==VAL_BOOL && v_kind(args[1])==VAL_BOOL)
+    return v_bool(v_as_bool(args[0]) || v_as_bool(args[1]));
   return v_bool(false);
 }
 
@@ -260,16 +223,17 @@ Value rt_or(Env *env, Value *args, int nargs) {
 Value rt_mod(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_int(0);
   if (both_int(args[0],args[1])) {
-    if (args[1].as.i == 0) return v_int(0); // avoid division by zero
-    return v_int(args[0].as.i % args[1].as.i);
+    if (v_as_int(args[1]) == 0) return v_int(0); // avoid division by zero
+    if (v_as_int(args[1]) == -1) return v_int(0); // INT64_MIN % -1 traps
+    return v_int(v_as_int(args[0]) % v_as_int(args[1]));
   }
   return v_int(0);
 }
 
 Value rt_neg(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=1) return v_int(0);
-  if (args[0].kind==VAL_INT) return v_int(-args[0].as.i);
-  if (args[0].kind==VAL_FLOAT) return v_float(-args[0].as.f);
+  if (v_kind(args[0])==VAL_INT) return v_int(-v_as_int(args[0]));
+  if (v_kind(args[0])==VAL_FLOAT) return v_float(-v_as_float(args[0]));
   return v_int(0);
 }
 
@@ -279,9 +243,9 @@ Value rt_neg(Env *env, Value *args, int nargs) {
 
 Value rt_str_concat(Env *env, Value *args, int nargs) {
   VM *vm = (VM*)env->aux;
-  if (nargs!=2 || args[0].kind!=VAL_STR || args[1].kind!=VAL_STR) return v_str(NULL);
-  String *a = args[0].as.str;
-  String *b = args[1].as.str;
+  if (nargs!=2 || v_kind(args[0])!=VAL_STR || v_kind(args[1])!=VAL_STR) return v_unit();
+  String *a = v_as_str(args[0]);
+  String *b = v_as_str(args[1]);
   size_t total = (size_t)(a->len + b->len);
   char *buf = (char*)malloc(total+1);
   memcpy(buf, a->data, a->len);
@@ -294,8 +258,8 @@ Value rt_str_concat(Env *env, Value *args, int nargs) {
 
 Value rt_str_len(Env *env, Value *args, int nargs) {
   (void)env;
-  if (nargs!=1 || args[0].kind!=VAL_STR) return v_int(0);
-  return v_int(args[0].as.str->len);
+  if (nargs!=1 || v_kind(args[0])!=VAL_STR) return v_int(0);
+  return v_int(v_as_str(args[0])->len);
 }
 
 // ============================================================================
@@ -304,37 +268,37 @@ Value rt_str_len(Env *env, Value *args, int nargs) {
 
 Value rt_bit_and(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_int(0);
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i & args[1].as.i);
+  if (both_int(args[0],args[1])) return v_int(v_as_int(args[0]) & v_as_int(args[1]));
   return v_int(0);
 }
 
 Value rt_bit_or(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_int(0);
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i | args[1].as.i);
+  if (both_int(args[0],args[1])) return v_int(v_as_int(args[0]) | v_as_int(args[1]));
   return v_int(0);
 }
 
 Value rt_bit_xor(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_int(0);
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i ^ args[1].as.i);
+  if (both_int(args[0],args[1])) return v_int(v_as_int(args[0]) ^ v_as_int(args[1]));
   return v_int(0);
 }
 
 Value rt_bit_not(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=1) return v_int(0);
-  if (args[0].kind==VAL_INT) return v_int(~args[0].as.i);
+  if (v_kind(args[0])==VAL_INT) return v_int(~v_as_int(args[0]));
   return v_int(0);
 }
 
 Value rt_shl(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_int(0);
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i << args[1].as.i);
+  if (both_int(args[0],args[1])) return v_int(v_as_int(args[0]) << v_as_int(args[1]));
   return v_int(0);
 }
 
 Value rt_shr(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_int(0);
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i >> args[1].as.i);
+  if (both_int(args[0],args[1])) return v_int(v_as_int(args[0]) >> v_as_int(args[1]));
   return v_int(0);
 }
 
@@ -346,56 +310,56 @@ Value rt_shr(Env *env, Value *args, int nargs) {
 
 Value rt_abs(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=1) return v_int(0);
-  if (args[0].kind==VAL_INT) return v_int(args[0].as.i < 0 ? -args[0].as.i : args[0].as.i);
-  if (args[0].kind==VAL_FLOAT) return v_float(fabs(args[0].as.f));
+  if (v_kind(args[0])==VAL_INT) return v_int(v_as_int(args[0]) < 0 ? -v_as_int(args[0]) : v_as_int(args[0]));
+  if (v_kind(args[0])==VAL_FLOAT) return v_float(fabs(v_as_float(args[0])));
   return v_int(0);
 }
 
 Value rt_min(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_int(0);
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i < args[1].as.i ? args[0].as.i : args[1].as.i);
-  if (both_float(args[0],args[1])) return v_float(args[0].as.f < args[1].as.f ? args[0].as.f : args[1].as.f);
+  if (both_int(args[0],args[1])) return v_int(v_as_int(args[0]) < v_as_int(args[1]) ? v_as_int(args[0]) : v_as_int(args[1]));
+  if (both_float(args[0],args[1])) return v_float(v_as_float(args[0]) < v_as_float(args[1]) ? v_as_float(args[0]) : v_as_float(args[1]));
   return v_int(0);
 }
 
 Value rt_max(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_int(0);
-  if (both_int(args[0],args[1])) return v_int(args[0].as.i > args[1].as.i ? args[0].as.i : args[1].as.i);
-  if (both_float(args[0],args[1])) return v_float(args[0].as.f > args[1].as.f ? args[0].as.f : args[1].as.f);
+  if (both_int(args[0],args[1])) return v_int(v_as_int(args[0]) > v_as_int(args[1]) ? v_as_int(args[0]) : v_as_int(args[1]));
+  if (both_float(args[0],args[1])) return v_float(v_as_float(args[0]) > v_as_float(args[1]) ? v_as_float(args[0]) : v_as_float(args[1]));
   return v_int(0);
 }
 
 Value rt_pow(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=2) return v_float(0);
-  double a = args[0].kind==VAL_INT ? (double)args[0].as.i : (args[0].kind==VAL_FLOAT ? args[0].as.f : 0);
-  double b = args[1].kind==VAL_INT ? (double)args[1].as.i : (args[1].kind==VAL_FLOAT ? args[1].as.f : 0);
+  double a = v_kind(args[0])==VAL_INT ? (double)v_as_int(args[0]) : (v_kind(args[0])==VAL_FLOAT ? v_as_float(args[0]) : 0);
+  double b = v_kind(args[1])==VAL_INT ? (double)v_as_int(args[1]) : (v_kind(args[1])==VAL_FLOAT ? v_as_float(args[1]) : 0);
   return v_float(pow(a, b));
 }
 
 Value rt_sqrt(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=1) return v_float(0);
-  double x = args[0].kind==VAL_INT ? (double)args[0].as.i : (args[0].kind==VAL_FLOAT ? args[0].as.f : 0);
+  double x = v_kind(args[0])==VAL_INT ? (double)v_as_int(args[0]) : (v_kind(args[0])==VAL_FLOAT ? v_as_float(args[0]) : 0);
   return v_float(sqrt(x));
 }
 
 Value rt_floor(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=1) return v_float(0);
-  if (args[0].kind==VAL_FLOAT) return v_float(floor(args[0].as.f));
-  if (args[0].kind==VAL_INT) return v_float((double)args[0].as.i);
+  if (v_kind(args[0])==VAL_FLOAT) return v_float(floor(v_as_float(args[0])));
+  if (v_kind(args[0])==VAL_INT) return v_float((double)v_as_int(args[0]));
   return v_float(0);
 }
 
 Value rt_ceil(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=1) return v_float(0);
-  if (args[0].kind==VAL_FLOAT) return v_float(ceil(args[0].as.f));
-  if (args[0].kind==VAL_INT) return v_float((double)args[0].as.i);
+  if (v_kind(args[0])==VAL_FLOAT) return v_float(ceil(v_as_float(args[0])));
+  if (v_kind(args[0])==VAL_INT) return v_float((double)v_as_int(args[0]));
   return v_float(0);
 }
 
 Value rt_round(Env *env, Value *args, int nargs) {
   (void)env; if (nargs!=1) return v_float(0);
-  if (args[0].kind==VAL_FLOAT) return v_float(round(args[0].as.f));
-  if (args[0].kind==VAL_INT) return v_float((double)args[0].as.i);
+  if (v_kind(args[0])==VAL_FLOAT) return v_float(round(v_as_float(args[0])));
+  if (v_kind(args[0])==VAL_INT) return v_float((double)v_as_int(args[0]));
   return v_float(0);
 }
 
@@ -404,37 +368,37 @@ Value rt_round(Env *env, Value *args, int nargs) {
 // ============================================================================
 
 Value rt_str_to_int(Env *env, Value *args, int nargs) {
-  (void)env; if (nargs!=1 || args[0].kind!=VAL_STR) return v_int(0);
+  (void)env; if (nargs!=1 || v_kind(args[0])!=VAL_STR) return v_int(0);
   char tmp[64];
-  size_t len = (size_t)args[0].as.str->len;
+  size_t len = (size_t)v_as_str(args[0])->len;
   if (len >= sizeof(tmp)) len = sizeof(tmp)-1;
-  memcpy(tmp, args[0].as.str->data, len); tmp[len] = '\0';
+  memcpy(tmp, v_as_str(args[0])->data, len); tmp[len] = '\0';
   return v_int(atoll(tmp));
 }
 
 Value rt_int_to_str(Env *env, Value *args, int nargs) {
   VM *vm = (VM*)env->aux;
-  if (nargs!=1 || args[0].kind!=VAL_INT) return v_str(NULL);
+  if (nargs!=1 || v_kind(args[0])!=VAL_INT) return v_unit();
   char buf[32];
-  int n = snprintf(buf, sizeof(buf), "%lld", (long long)args[0].as.i);
+  int n = snprintf(buf, sizeof(buf), "%lld", (long long)v_as_int(args[0]));
   String *s = rt_string_new(vm, buf, (size_t)n);
   return v_str(s);
 }
 
 Value rt_str_to_float(Env *env, Value *args, int nargs) {
-  (void)env; if (nargs!=1 || args[0].kind!=VAL_STR) return v_float(0);
+  (void)env; if (nargs!=1 || v_kind(args[0])!=VAL_STR) return v_float(0);
   char tmp[64];
-  size_t len = (size_t)args[0].as.str->len;
+  size_t len = (size_t)v_as_str(args[0])->len;
   if (len >= sizeof(tmp)) len = sizeof(tmp)-1;
-  memcpy(tmp, args[0].as.str->data, len); tmp[len] = '\0';
+  memcpy(tmp, v_as_str(args[0])->data, len); tmp[len] = '\0';
   return v_float(atof(tmp));
 }
 
 Value rt_float_to_str(Env *env, Value *args, int nargs) {
   VM *vm = (VM*)env->aux;
-  if (nargs!=1 || args[0].kind!=VAL_FLOAT) return v_str(NULL);
+  if (nargs!=1 || v_kind(args[0])!=VAL_FLOAT) return v_unit();
   char buf[64];
-  int n = snprintf(buf, sizeof(buf), "%g", args[0].as.f);
+  int n = snprintf(buf, sizeof(buf), "%g", v_as_float(args[0]));
   String *s = rt_string_new(vm, buf, (size_t)n);
   return v_str(s);
 }
@@ -445,11 +409,11 @@ Value rt_float_to_str(Env *env, Value *args, int nargs) {
 
 Value rt_str_slice(Env *env, Value *args, int nargs) {
   VM *vm = (VM*)env->aux;
-  if (nargs!=3 || args[0].kind!=VAL_STR || args[1].kind!=VAL_INT || args[2].kind!=VAL_INT)
-    return v_str(NULL);
-  String *s = args[0].as.str;
-  int64_t start = args[1].as.i;
-  int64_t end = args[2].as.i;
+  if (nargs!=3 || v_kind(args[0])!=VAL_STR || v_kind(args[1])!=VAL_INT || v_kind(args[2])!=VAL_INT)
+    return v_unit();
+  String *s = v_as_str(args[0]);
+  int64_t start = v_as_int(args[1]);
+  int64_t end = v_as_int(args[2]);
   if (start < 0) start = 0;
   if (end > s->len) end = s->len;
   if (start >= end) return v_str(rt_string_new(vm, "", 0));
@@ -459,9 +423,9 @@ Value rt_str_slice(Env *env, Value *args, int nargs) {
 
 Value rt_str_index(Env *env, Value *args, int nargs) {
   (void)env;
-  if (nargs!=2 || args[0].kind!=VAL_STR || args[1].kind!=VAL_STR) return v_int(-1);
-  String *haystack = args[0].as.str;
-  String *needle = args[1].as.str;
+  if (nargs!=2 || v_kind(args[0])!=VAL_STR || v_kind(args[1])!=VAL_STR) return v_int(-1);
+  String *haystack = v_as_str(args[0]);
+  String *needle = v_as_str(args[1]);
   if (needle->len == 0) return v_int(0);
   if (needle->len > haystack->len) return v_int(-1);
   for (int64_t i = 0; i <= haystack->len - needle->len; i++) {
@@ -471,85 +435,551 @@ Value rt_str_index(Env *env, Value *args, int nargs) {
   return v_int(-1);
 }
 
-Value rt_chan(Env *env, Value *args, int nargs) {
-  (void)env; (void)args; if (nargs!=0) { /* type info not used at runtime here */ }
-  Channel *c = rt_channel_new(16);
-  return v_chan(c);
+// The ring is freed with the ChanVal once nothing references it
+static Value chan_new(VM *vm, size_t cap) {
+  ChanVal *cv = (ChanVal*)gc_alloc(&vm->gc, sizeof(ChanVal), OBJ_CHANNEL);
+  cv->chan = rt_channel_new(cap, sizeof(Value));
+  gc_account(&vm->gc, (ptrdiff_t)(sizeof(Value)*rt_channel_slots(cv->chan)));
+  return v_chan(cv);
 }
 
-typedef struct { VM *vm; Closure *clos; } SpawnArg;
-static void *spawn_tramp(void *p) {
-  SpawnArg *sa=(SpawnArg*)p; vm_call_closure_noargs(sa->vm, sa->clos); free(sa); return NULL;
+// Barrier for a message sent on a channel, run before the send and again
+// after it: a sender may park with the message already in the ring (a
+// rendezvous) while a minor collection runs, and an incremental marker may
+// have traced the channel before the message went in
+void rt_chan_barrier(VM *vm, Value ch, Value msg) {
+  gc_write_barrier(&vm->gc, v_obj(ch), v_obj(msg));
 }
 
+Value rt_chan(Env *env, Value *args, int nargs) {
+  (void)args; if (!expect_nargs(nargs, 0, "chan")) return v_unit();
+  return chan_new((VM*)env->aux, 16);
+}
+
+// Capacity 0 makes a rendezvous channel: each send waits for its receiver
+Value rt_chan_with_cap(Env *env, Value *args, int nargs) {
+  if (!expect_nargs(nargs, 1, "chan-with-cap") || v_kind(args[0])!=VAL_INT) return v_unit();
+  if (v_as_int(args[0]) < 0) { fprintf(stderr, "chan-with-cap: negative capacity\n"); return v_unit(); }
+  return chan_new((VM*)env->aux, (size_t)v_as_int(args[0]));
+}
+
+// A joiner blocked on a task; lives on the joiner's stack
+typedef struct JoinNode { struct JoinNode *next; RtWaiter *w; } JoinNode;
+
+// vals holds the handle and the closure: the task's roots from spawn to exit
+typedef struct { VM *vm; Value vals[2]; GcRoot root; GcMutator mut; } SpawnArg;
+static void spawn_main(void *p) {
+  SpawnArg *sa=(SpawnArg*)p;
+  gc_roots = &sa->root; gc_resume(&sa->mut);
+  TaskVal *t = v_as_task(sa->vals[0]);
+  Value r = vm_call_closure0(sa->vm, v_as_clos(sa->vals[1]));
+  t->result = r; gc_write_barrier(&sa->vm->gc, &t->hdr, v_obj(r));
+  rt_spin_lock(&t->lock);
+  __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+  rt_spin_unlock(&t->lock);
+  // No joiner queues once done is set; wake the ones already there
+  for (;;) {
+    RtWake k; bool woke = false;
+    rt_spin_lock(&t->lock);
+    JoinNode *j = t->joiners;
+    if (j) { t->joiners = j->next; woke = rt_waiter_claim(j->w, &k); }
+    rt_spin_unlock(&t->lock);
+    if (!j) break;
+    if (woke) rt_waiter_notify(&k);
+  }
+  __atomic_sub_fetch(&sa->vm->gc.threads, 1, __ATOMIC_RELEASE);
+  gc_roots = NULL; gc_mutator_remove(&sa->mut);
+  free(sa);
+}
+
+// Wait for t to finish or the timeout (<0: none) to pass; true once done
+static bool task_wait(TaskVal *t, int64_t timeout_ms) {
+  if (__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) return true;
+  if (!timeout_ms) return false;
+  RtWaiter w; rt_waiter_init(&w);
+  JoinNode j = { NULL, &w };
+  rt_spin_lock(&t->lock);
+  if (t->done) { rt_spin_unlock(&t->lock); return true; }
+  j.next = t->joiners; t->joiners = &j;
+  rt_spin_unlock(&t->lock);
+  if (rt_waiter_block(&w, timeout_ms)) return true;
+  rt_spin_lock(&t->lock);
+  for (JoinNode **pp = &t->joiners; *pp; pp = &(*pp)->next) if (*pp==&j) { *pp = j.next; break; }
+  rt_spin_unlock(&t->lock);
+  return __atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+}
+
+// Runs clos as a task and returns its handle; join gives back what it returned
 Value rt_spawn(Env *env, Value *args, int nargs) {
-  if (nargs!=1 || args[0].kind!=VAL_CLOSURE) return v_unit();
+  if (nargs!=1 || v_kind(args[0])!=VAL_CLOSURE) return v_unit();
   VM *vm = (VM*)env->aux;
-  SpawnArg *sa = (SpawnArg*)malloc(sizeof(SpawnArg)); sa->vm=vm; sa->clos=args[0].as.clos;
-  RtThread *t = rt_thread_spawn(spawn_tramp, sa);
-  (void)t; // fire-and-forget; later we can add join/handle
-  return v_unit();
+  TaskVal *t = (TaskVal*)gc_alloc(&vm->gc, sizeof(TaskVal), OBJ_TASK);
+  t->done = 0; t->lock = false; t->joiners = NULL; t->result = v_unit();
+  SpawnArg *sa = (SpawnArg*)malloc(sizeof(SpawnArg)); sa->vm=vm; sa->vals[0]=v_task(t); sa->vals[1]=args[0];
+  sa->root = (GcRoot){ NULL, sa->vals, 2, NULL };
+  gc_mutator_add(&vm->gc, &sa->mut, &sa->root);
+  __atomic_add_fetch(&vm->gc.threads, 1, __ATOMIC_ACQ_REL);
+  rt_task_spawn(spawn_main, sa);
+  return v_task(t);
+}
+
+Value rt_join(Env *env, Value *args, int nargs) {
+  (void)env; if (nargs!=1 || v_kind(args[0])!=VAL_TASK) return v_unit();
+  TaskVal *t = v_as_task(args[0]);
+  task_wait(t, -1);
+  return t->result;
+}
+
+// Some result, or None if the task is still running after ms
+Value rt_join_timeout(Env *env, Value *args, int nargs) {
+  if (nargs!=2 || v_kind(args[0])!=VAL_TASK || v_kind(args[1])!=VAL_INT) return v_none();
+  TaskVal *t = v_as_task(args[0]);
+  int64_t ms = v_as_int(args[1]);
+  if (!task_wait(t, ms<0 ? 0 : ms)) return v_none();
+  return rt_some(env, &t->result, 1);
+}
+
+Value rt_task_done(Env *env, Value *args, int nargs) {
+  (void)env; if (nargs!=1 || v_kind(args[0])!=VAL_TASK) return v_bool(false);
+  return v_bool(__atomic_load_n(&v_as_task(args[0])->done, __ATOMIC_ACQUIRE));
 }
 
 Value rt_send(Env *env, Value *args, int nargs) {
-  (void)env; if (nargs!=2 || args[0].kind!=VAL_CHAN) return v_bool(false);
-  Value *box = (Value*)malloc(sizeof(Value)); *box = args[1];
-  bool ok = rt_channel_send(args[0].as.chan, box, -1);
-  return v_bool(ok);
+  if (nargs!=2 || v_kind(args[0])!=VAL_CHAN) return v_bool(false);
+  VM *vm = (VM*)env->aux;
+  rt_chan_barrier(vm, args[0], args[1]);
+  bool sent = rt_channel_send(v_as_chan(args[0]), &args[1], -1);
+  rt_chan_barrier(vm, args[0], args[1]);
+  return v_bool(sent);
 }
 Value rt_recv(Env *env, Value *args, int nargs) {
-  (void)env; if (nargs!=1 || args[0].kind!=VAL_CHAN) return v_unit();
-  Value *box = (Value*)rt_channel_recv(args[0].as.chan, -1);
-  if (!box) return v_unit();
-  Value v=*box; free(box); return v;
+  (void)env; if (nargs!=1 || v_kind(args[0])!=VAL_CHAN) return v_unit();
+  Value v;
+  if (!rt_channel_recv(v_as_chan(args[0]), &v, -1)) return v_unit();
+  return v;
+}
+
+// Batched channel ops move a run of messages per claim on the ring. Vectors
+// are allocated old and never move, so messages are copied straight in and out.
+Value rt_send_many(Env *env, Value *args, int nargs) {
+  if (nargs!=2 || v_kind(args[0])!=VAL_CHAN || v_kind(args[1])!=VAL_VEC) return v_bool(false);
+  Vector *v = v_as_vec(args[1]);
+  VM *vm = (VM*)env->aux;
+  for (int32_t i=0;i<v->len;i++) rt_chan_barrier(vm, args[0], v->items[i]);
+  size_t sent = rt_channel_send_many(v_as_chan(args[0]), v->items, (size_t)v->len, -1);
+  for (size_t i=0;i<sent;i++) rt_chan_barrier(vm, args[0], v->items[i]);
+  return v_bool(sent==(size_t)v->len);
+}
+// Wait for at least one message, then take up to n without waiting more
+Value rt_recv_many(Env *env, Value *args, int nargs) {
+  if (nargs!=2 || v_kind(args[0])!=VAL_CHAN || v_kind(args[1])!=VAL_INT) return v_unit();
+  VM *vm = (VM*)env->aux;
+  Channel *c = v_as_chan(args[0]);
+  // One claim never takes more than the ring holds
+  int64_t n = v_as_int(args[1]);
+  if (n<1) n = 1;
+  if ((size_t)n > rt_channel_slots(c)) n = (int64_t)rt_channel_slots(c);
+  Vector *v = rt_vec_alloc(vm, (int32_t)n);
+  // Rooted while it waits: a collection may run meanwhile
+  Value out = v_vec(v);
+  GcRoot root; gc_push_root(&root, &out, 1, NULL);
+  v->len = (int32_t)rt_channel_recv_many(c, v->items, (size_t)n, -1);
+  gc_pop_root(&root);
+  for (int32_t i=0;i<v->len;i++) gc_write_barrier(&vm->gc, &v->hdr, v_obj(v->items[i]));
+  return out;
+}
+// Everything buffered right now, without waiting
+Value rt_chan_drain(Env *env, Value *args, int nargs) {
+  if (nargs!=1 || v_kind(args[0])!=VAL_CHAN) return v_unit();
+  VM *vm = (VM*)env->aux; Channel *c = v_as_chan(args[0]);
+  size_t n = rt_channel_len(c);
+  Vector *v = rt_vec_alloc(vm, (int32_t)n);
+  v->len = n ? (int32_t)rt_channel_recv_many(c, v->items, n, 0) : 0;
+  for (int32_t i=0;i<v->len;i++) gc_write_barrier(&vm->gc, &v->hdr, v_obj(v->items[i]));
+  return v_vec(v);
 }
 
 // Collections
-static Vector *vec_new_gc(VM *vm, int cap) {
-  Vector *v = (Vector*)gc_alloc(&vm->gc, sizeof(Vector), 4); v->len=0; v->cap=cap>0?cap:4; v->items=(Value*)malloc(sizeof(Value)*v->cap); return v; }
+ValList *rt_list_new(VM *vm, int32_t len) {
+  ValList *l = (ValList*)gc_alloc(&vm->gc, sizeof(ValList)+sizeof(Value)*(size_t)len, OBJ_LIST);
+  // Too big for the nursery: remember it up front rather than barrier every item
+  if (!l->hdr.young) gc_remember(&vm->gc, &l->hdr);
+  l->len = len; return l;
+}
+Vector *rt_vec_alloc(VM *vm, int32_t cap) {
+  if (cap<4) cap=4;
+  Vector *v = (Vector*)gc_alloc(&vm->gc, sizeof(Vector)+sizeof(Value)*(size_t)cap, OBJ_VECTOR);
+  v->len=0; v->cap=v->ninline=cap; v->items=v->inline_items; return v;
+}
+void rt_vec_grow(VM *vm, Vector *v) {
+  size_t bytes = sizeof(Value)*(size_t)v->cap*2;
+  if (v->items==v->inline_items) { Value *out = (Value*)malloc(bytes); memcpy(out, v->items, sizeof(Value)*(size_t)v->len); v->items = out; }
+  else { v->items = (Value*)realloc(v->items, bytes); gc_account(&vm->gc, -(ptrdiff_t)(sizeof(Value)*(size_t)v->cap)); }
+  gc_account(&vm->gc, (ptrdiff_t)bytes);
+  v->cap *= 2;
+}
 Value rt_vec_new(Env *env, Value *args, int nargs) {
-  VM *vm=(VM*)env->aux; Vector *v = vec_new_gc(vm, nargs);
-  for (int i=0;i<nargs;i++) v->items[v->len++]=args[i];
+  VM *vm=(VM*)env->aux; Vector *v = rt_vec_alloc(vm, nargs);
+  for (int i=0;i<nargs;i++) { v->items[v->len++]=args[i]; gc_write_barrier(&vm->gc, &v->hdr, v_obj(args[i])); }
   return v_vec(v);
 }
 Value rt_vec_push(Env *env, Value *args, int nargs) {
-  (void)env; (void)nargs; if (nargs!=2 || args[0].kind!=VAL_VEC) return v_unit();
-  Vector *v=args[0].as.vec; if (v->len==v->cap){ v->cap*=2; v->items=(Value*)realloc(v->items,sizeof(Value)*v->cap);} v->items[v->len++]=args[1]; return v_unit();
+  if (nargs!=2 || v_kind(args[0])!=VAL_VEC) return v_unit();
+  VM *vm=(VM*)env->aux;
+  Vector *v=v_as_vec(args[0]); if (v->len==v->cap) rt_vec_grow(vm, v); v->items[v->len++]=args[1];
+  gc_write_barrier(&vm->gc, &v->hdr, v_obj(args[1])); return v_unit();
 }
 Value rt_vec_get(Env *env, Value *args, int nargs) {
-  (void)env; if (nargs!=2 || args[0].kind!=VAL_VEC || args[1].kind!=VAL_INT) return v_unit();
-  Vector *v=args[0].as.vec; int64_t i=args[1].as.i; if (i<0 || i>=v->len) return v_unit(); return v->items[i];
+  (void)env; if (nargs!=2 || v_kind(args[0])!=VAL_VEC || v_kind(args[1])!=VAL_INT) return v_unit();
+  Vector *v=v_as_vec(args[0]); int64_t i=v_as_int(args[1]); if (i<0 || i>=v->len) return v_unit(); return v->items[i];
+}
+Value rt_vec_len(Env *env, Value *args, int nargs) { (void)env; if (nargs!=1 || v_kind(args[0])!=VAL_VEC) return v_int(0); return v_int(v_as_vec(args[0])->len); }
+
+// ---- Parallel collection ops ----
+// pmap, pfilter, preduce and pfor split a vector's index space into chunks
+// that the caller and helper tasks on the worker pool claim in turn. Chunks
+// are guided: each takes a share of what is left, so they start large and
+// shrink towards the end, and a thread held up by slow elements claims fewer
+// while the others take the rest. Results are stored straight into the
+// output vector, which is old and never moves.
+typedef enum { PAR_MAP, PAR_FILTER, PAR_REDUCE, PAR_FOR } ParKind;
+
+typedef struct ParJob {
+  VM *vm;
+  ParKind kind;
+  Value vals[3];     // the function, the input vector, and pmap's output or preduce's init and result;
+                     // rooted by the caller
+  Value *parts;      // preduce: each chunk's reduction, in claim order, so in index order
+  uint8_t *keep;     // pfilter: whether each element passed
+  int32_t len, next; // elements, and the first not yet claimed
+  int32_t nparts;    // chunks claimed so far
+  int threads;       // the caller and its helpers
+  RtSpin lock;       // guards next and nparts
+} ParJob;
+
+static int32_t par_chunk(int32_t left, int threads) {
+  int32_t c = left / (2*threads);
+  return c>0 ? c : 1;
+}
+
+// Chunks of a job: their sizes depend only on what is left
+static int32_t par_nchunks(int32_t len, int threads) {
+  int32_t n = 0;
+  for (int32_t left=len; left>0; left-=par_chunk(left, threads)) n++;
+  return n;
+}
+
+static bool par_claim(ParJob *j, int32_t *start, int32_t *end, int32_t *part) {
+  rt_spin_lock(&j->lock);
+  bool ok = j->next < j->len;
+  if (ok) { *start = j->next; j->next += par_chunk(j->len - j->next, j->threads); *end = j->next; *part = j->nparts++; }
+  rt_spin_unlock(&j->lock);
+  return ok;
+}
+
+static Value par_call(VM *vm, Value f, Value *args, int nargs) {
+  if (v_kind(f)==VAL_FUNC) return v_as_native(f)(vm->global_env, args, nargs);
+  return vm_call_closure(vm, v_as_clos(f), args, nargs);
+}
+
+// Claim and run chunks until none are left. The function and both vectors are
+// read from the job's roots on every call: a young closure moves, and the
+// input vector's items move if it grows.
+static void par_run(ParJob *j) {
+  VM *vm = j->vm;
+  Value args[2] = { v_unit(), v_unit() }; // preduce's running reduction lives here across calls
+  GcRoot root; gc_push_root(&root, args, 2, NULL);
+  int32_t start, end, part;
+  while (par_claim(j, &start, &end, &part)) {
+    for (int32_t i=start;i<end;i++) {
+      Value x = v_as_vec(j->vals[1])->items[i];
+      if (j->kind==PAR_REDUCE) {
+        if (i==start) { args[0] = x; continue; }
+        args[1] = x; args[0] = par_call(vm, j->vals[0], args, 2);
+        continue;
+      }
+      args[0] = x;
+      Value r = par_call(vm, j->vals[0], args, 1);
+      if (j->kind==PAR_MAP) {
+        Vector *out = v_as_vec(j->vals[2]);
+        out->items[i] = r; gc_write_barrier(&vm->gc, &out->hdr, v_obj(r));
+      } else if (j->kind==PAR_FILTER) j->keep[i] = v_kind(r)==VAL_BOOL && v_as_bool(r);
+    }
+    if (j->kind==PAR_REDUCE) j->parts[part] = args[0];
+  }
+  gc_pop_root(&root);
+}
+
+// A helper task is a mutator of its own, like a spawned one
+typedef struct { ParJob *job; GcRoot root; GcMutator mut; } ParHelper;
+static void par_helper_main(void *p) {
+  ParHelper *h = (ParHelper*)p;
+  gc_roots = &h->root; gc_resume(&h->mut);
+  par_run(h->job);
+  __atomic_sub_fetch(&h->job->vm->gc.threads, 1, __ATOMIC_RELEASE);
+  gc_roots = NULL; gc_mutator_remove(&h->mut);
+  free(h);
+}
+
+// Run j on the caller and up to one helper per other worker, then wait for
+// the helpers. Like with-tasks, this also waits for tasks the function spawns.
+static void par_go(ParJob *j) {
+  VM *vm = j->vm;
+  j->threads = 1;
+  if (j->len > 1) {
+    // A caller that is a task already occupies a worker
+    int workers = rt_sched_workers() - (rt_task_current()!=NULL);
+    j->threads = workers>0 ? workers+1 : 1;
+  }
+  int32_t nchunks = par_nchunks(j->len, j->threads);
+  int helpers = nchunks-1 < j->threads-1 ? nchunks-1 : j->threads-1;
+  Value *parts = NULL;
+  GcRoot proot; gc_push_root(&proot, NULL, 0, NULL);
+  if (j->kind==PAR_REDUCE) {
+    parts = (Value*)malloc(sizeof(Value)*(size_t)(nchunks>0 ? nchunks : 1));
+    for (int32_t i=0;i<nchunks;i++) parts[i] = v_unit();
+    proot.vals = j->parts = parts; proot.n = nchunks;
+  }
+  RtGroup g; rt_group_init(&g);
+  RtGroup *prev = rt_group_enter(&g);
+  for (int i=0;i<helpers;i++) {
+    ParHelper *h = (ParHelper*)malloc(sizeof(ParHelper)); h->job = j;
+    h->root = (GcRoot){ NULL, NULL, 0, NULL };
+    gc_mutator_add(&vm->gc, &h->mut, &h->root);
+    __atomic_add_fetch(&vm->gc.threads, 1, __ATOMIC_ACQ_REL);
+    rt_task_spawn(par_helper_main, h);
+  }
+  par_run(j);
+  rt_group_leave(&g, prev);
+  // preduce: fold the chunks' reductions into init, left to right
+  if (j->kind==PAR_REDUCE) {
+    Value acc[2] = { j->vals[2], v_unit() };
+    GcRoot aroot; gc_push_root(&aroot, acc, 2, NULL);
+    for (int32_t p=0;p<j->nparts;p++) { acc[1] = parts[p]; acc[0] = par_call(vm, j->vals[0], acc, 2); }
+    j->vals[2] = acc[0];
+    gc_pop_root(&aroot);
+  }
+  gc_pop_root(&proot);
+  free(parts);
+}
+
+static bool par_fn(Value f) { return v_kind(f)==VAL_CLOSURE || v_kind(f)==VAL_FUNC; }
+
+// [pmap v f]: a new vector of f applied to each element
+Value rt_pmap(Env *env, Value *args, int nargs) {
+  if (nargs!=2 || v_kind(args[0])!=VAL_VEC || !par_fn(args[1])) return v_unit();
+  VM *vm = (VM*)env->aux;
+  ParJob j = { .vm = vm, .kind = PAR_MAP, .len = v_as_vec(args[0])->len };
+  Vector *out = rt_vec_alloc(vm, j.len);
+  for (int32_t i=0;i<j.len;i++) out->items[i] = v_unit();
+  out->len = j.len;
+  j.vals[0] = args[1]; j.vals[1] = args[0]; j.vals[2] = v_vec(out);
+  GcRoot root; gc_push_root(&root, j.vals, 3, NULL);
+  par_go(&j);
+  gc_pop_root(&root);
+  return j.vals[2];
+}
+
+// [pfilter v pred]: the elements pred holds for, in order
+Value rt_pfilter(Env *env, Value *args, int nargs) {
+  if (nargs!=2 || v_kind(args[0])!=VAL_VEC || !par_fn(args[1])) return v_unit();
+  VM *vm = (VM*)env->aux;
+  ParJob j = { .vm = vm, .kind = PAR_FILTER, .len = v_as_vec(args[0])->len };
+  j.vals[0] = args[1]; j.vals[1] = args[0]; j.vals[2] = v_unit();
+  j.keep = (uint8_t*)calloc((size_t)j.len + 1, 1);
+  GcRoot root; gc_push_root(&root, j.vals, 3, NULL);
+  par_go(&j);
+  int32_t n = 0;
+  for (int32_t i=0;i<j.len;i++) n += j.keep[i];
+  Vector *out = rt_vec_alloc(vm, n);
+  Vector *in = v_as_vec(j.vals[1]);
+  for (int32_t i=0;i<j.len;i++) {
+    if (!j.keep[i]) continue;
+    out->items[out->len++] = in->items[i]; gc_write_barrier(&vm->gc, &out->hdr, v_obj(in->items[i]));
+  }
+  gc_pop_root(&root);
+  free(j.keep);
+  return v_vec(out);
+}
+
+// [preduce v init f]: f must be associative. Each chunk is reduced on its
+// own, then the caller folds the chunks' results into init.
+Value rt_preduce(Env *env, Value *args, int nargs) {
+  if (nargs!=3 || v_kind(args[0])!=VAL_VEC || !par_fn(args[2])) return v_unit();
+  ParJob j = { .vm = (VM*)env->aux, .kind = PAR_REDUCE, .len = v_as_vec(args[0])->len };
+  j.vals[0] = args[2]; j.vals[1] = args[0]; j.vals[2] = args[1];
+  GcRoot root; gc_push_root(&root, j.vals, 3, NULL);
+  par_go(&j);
+  gc_pop_root(&root);
+  return j.vals[2];
+}
+
+// [pfor v f]: f on each element, for its effects
+Value rt_pfor(Env *env, Value *args, int nargs) {
+  if (nargs!=2 || v_kind(args[0])!=VAL_VEC || !par_fn(args[1])) return v_unit();
+  ParJob j = { .vm = (VM*)env->aux, .kind = PAR_FOR, .len = v_as_vec(args[0])->len };
+  j.vals[0] = args[1]; j.vals[1] = args[0]; j.vals[2] = v_unit();
+  GcRoot root; gc_push_root(&root, j.vals, 3, NULL);
+  par_go(&j);
+  gc_pop_root(&root);
+  return v_unit();
 }
-Value rt_vec_len(Env *env, Value *args, int nargs) { (void)env; if (nargs!=1 || args[0].kind!=VAL_VEC) return v_int(0); return v_int(args[0].as.vec->len); }
 
 // Code-as-data list/symbol helpers
-Value rt_is_list(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1) return v_bool(false); return v_bool(args[0].kind==VAL_LIST); }
-Value rt_is_symbol(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1) return v_bool(false); return v_bool(args[0].kind==VAL_SYMBOL); }
-Value rt_symbol_eq(Env *env, Value *args, int nargs){ (void)env; if (nargs!=2) return v_bool(false); if (args[0].kind!=VAL_SYMBOL || args[1].kind!=VAL_SYMBOL) return v_bool(false); if (args[0].as.sym.len!=args[1].as.sym.len) return v_bool(false); return v_bool(strncmp(args[0].as.sym.name,args[1].as.sym.name,args[0].as.sym.len)==0); }
-Value rt_list_len(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1 || args[0].kind!=VAL_LIST || !args[0].as.list) return v_int(0); return v_int(args[0].as.list->len); }
-Value rt_list_head(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1 || args[0].kind!=VAL_LIST || !args[0].as.list || args[0].as.list->len==0) return v_unit(); return args[0].as.list->items[0]; }
-Value rt_list_tail(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1 || args[0].kind!=VAL_LIST || !args[0].as.list) return v_list(NULL); VM *vm=(VM*)env->aux; ValList *l=args[0].as.list; if (l->len<=1){ ValList *nl=(ValList*)gc_alloc(&vm->gc,sizeof(ValList),8); nl->len=0; nl->cap=0; nl->items=NULL; return v_list(nl);} ValList *nl=(ValList*)gc_alloc(&vm->gc,sizeof(ValList),8); nl->len=l->len-1; nl->cap=nl->len; nl->items=(Value*)malloc(sizeof(Value)*nl->len); for (int i=0;i<nl->len;i++) nl->items[i]=l->items[i+1]; return v_list(nl); }
-Value rt_list_cons(Env *env, Value *args, int nargs){ if (nargs!=2 || args[1].kind!=VAL_LIST) return v_list(NULL); VM *vm=(VM*)env->aux; ValList *l=args[1].as.list; int n = l?l->len:0; ValList *nl=(ValList*)gc_alloc(&vm->gc,sizeof(ValList),8); nl->len=n+1; nl->cap=nl->len; nl->items=(Value*)malloc(sizeof(Value)*nl->len); nl->items[0]=args[0]; for (int i=0;i<n;i++) nl->items[i+1]=l->items[i]; return v_list(nl);} 
-Value rt_list_append(Env *env, Value *args, int nargs){ if (nargs!=2 || args[0].kind!=VAL_LIST || args[1].kind!=VAL_LIST) return v_list(NULL); VM *vm=(VM*)env->aux; ValList *a=args[0].as.list; ValList *b=args[1].as.list; int na=a?a->len:0, nb=b?b->len:0; ValList *nl=(ValList*)gc_alloc(&vm->gc,sizeof(ValList),8); nl->len=na+nb; nl->cap=nl->len; nl->items=(Value*)malloc(sizeof(Value)*nl->len); for (int i=0;i<na;i++) nl->items[i]=a->items[i]; for (int j=0;j<nb;j++) nl->items[na+j]=b->items[j]; return v_list(nl);} 
-// very simple map (Str->Int) with linear probing
+Value rt_is_list(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1) return v_bool(false); return v_bool(v_kind(args[0])==VAL_LIST); }
+Value rt_is_symbol(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1) return v_bool(false); return v_bool(v_kind(args[0])==VAL_SYMBOL); }
+Value rt_symbol_eq(Env *env, Value *args, int nargs){ (void)env; if (nargs!=2) return v_bool(false); if (v_kind(args[0])!=VAL_SYMBOL || v_kind(args[1])!=VAL_SYMBOL) return v_bool(false); if (v_sym_len(args[0])!=v_sym_len(args[1])) return v_bool(false); return v_bool(strncmp(v_sym_name(args[0]),v_sym_name(args[1]),v_sym_len(args[0]))==0); }
+Value rt_list_len(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1 || v_kind(args[0])!=VAL_LIST || !v_as_list(args[0])) return v_int(0); return v_int(v_as_list(args[0])->len); }
+Value rt_list_head(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1 || v_kind(args[0])!=VAL_LIST || !v_as_list(args[0]) || v_as_list(args[0])->len==0) return v_unit(); return v_as_list(args[0])->items[0]; }
+Value rt_list_tail(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1 || v_kind(args[0])!=VAL_LIST || !v_as_list(args[0])) return v_unit(); VM *vm=(VM*)env->aux; ValList *l=v_as_list(args[0]); ValList *nl=rt_list_new(vm, l->len<=1 ? 0 : l->len-1); for (int i=0;i<nl->len;i++) nl->items[i]=l->items[i+1]; return v_list(nl); }
+Value rt_list_cons(Env *env, Value *args, int nargs){ if (nargs!=2 || v_kind(args[1])!=VAL_LIST) return v_unit(); VM *vm=(VM*)env->aux; ValList *l=v_as_list(args[1]); int n = l?l->len:0; ValList *nl=rt_list_new(vm, n+1); nl->items[0]=args[0]; for (int i=0;i<n;i++) nl->items[i+1]=l->items[i]; return v_list(nl);} 
+Value rt_list_append(Env *env, Value *args, int nargs){ if (nargs!=2 || v_kind(args[0])!=VAL_LIST || v_kind(args[1])!=VAL_LIST) return v_unit(); VM *vm=(VM*)env->aux; ValList *a=v_as_list(args[0]); ValList *b=v_as_list(args[1]); int na=a?a->len:0, nb=b?b->len:0; ValList *nl=rt_list_new(vm, na+nb); for (int i=0;i<na;i++) nl->items[i]=a->items[i]; for (int j=0;j<nb;j++) nl->items[na+j]=b->items[j]; return v_list(nl);} 
+// ---- Maps ----
+// Keys compare by value for Int, Float, Bool, Unit, Str, symbols, lists and
+// option/result; other objects by identity. Young objects move, so a
+// closure's hash comes from its fn node rather than its address; vectors,
+// maps and structs are allocated old and never move.
 static uint64_t hash_str(const char *s, int64_t len){ uint64_t h=1469598103934665603ull; for (int64_t i=0;i<len;i++){ h^=(unsigned char)s[i]; h*=1099511628211ull; } return h; }
-static Map *map_new_gc(VM *vm, int cap){ Map *m=(Map*)gc_alloc(&vm->gc,sizeof(Map),5); m->cap=cap>8?cap:8; m->len=0; m->slots=(MapEntry*)calloc(m->cap,sizeof(MapEntry)); return m; }
-static void map_set_pair(Map *m, String *k, int64_t val){
-  uint64_t h = hash_str(k->data,k->len); int i = (int)(h % m->cap);
-  while (m->slots[i].used) {
-    Value *kv = m->slots[i].key; if (kv && kv->kind==VAL_STR) {
-      if (kv->as.str->len==k->len && memcmp(kv->as.str->data,k->data,k->len)==0) { m->slots[i].val->kind=VAL_INT; m->slots[i].val->as.i=val; return; }
+static uint64_t hash_mix(uint64_t x){ x^=x>>33; x*=0xff51afd7ed558ccdull; x^=x>>33; x*=0xc4ceb9fe1a85ec53ull; x^=x>>33; return x; }
+
+uint64_t rt_value_hash(Value v) {
+  switch (v_kind(v)) {
+    case VAL_INT: return hash_mix((uint64_t)v_as_int(v));
+    case VAL_FLOAT: { double f = v_as_float(v); uint64_t b; if (f==0) f=0; memcpy(&b, &f, 8); return hash_mix(b ^ 0x9e3779b97f4a7c15ull); }
+    case VAL_BOOL: return v_as_bool(v) ? 0x51 : 0x50;
+    case VAL_UNIT: return 0x52;
+    case VAL_STR: return hash_str(v_as_str(v)->data, v_as_str(v)->len);
+    case VAL_SYMBOL: return hash_str(v_sym_name(v), v_sym_len(v)) ^ 0x53;
+    case VAL_LIST: { ValList *l = v_as_list(v); uint64_t h = 0x54; for (int32_t i=0;i<l->len;i++) h = hash_mix(h ^ rt_value_hash(l->items[i])); return h; }
+    case VAL_OPTION: { OptionVal *o = v_as_opt(v); return o && o->has_value ? hash_mix(0x55 ^ rt_value_hash(o->value)) : 0x56; }
+    case VAL_RESULT: { ResultVal *r = v_as_res(v); return hash_mix((r->is_ok ? 0x57 : 0x58) ^ rt_value_hash(r->value)); }
+    case VAL_CLOSURE: return hash_mix((uint64_t)(uintptr_t)v_as_clos(v)->fn_node);
+    case VAL_FUNC: return hash_mix((uint64_t)(uintptr_t)v_as_native(v));
+    case VAL_CHAN: return hash_mix((uint64_t)(uintptr_t)v_as_chan(v));
+    default: return hash_mix((uint64_t)(uintptr_t)v_obj(v));
+  }
+}
+
+bool rt_value_equal(Value a, Value b) {
+  ValueKind k = v_kind(a);
+  if (k!=v_kind(b)) return false;
+  switch (k) {
+    case VAL_INT: return v_as_int(a)==v_as_int(b);
+    case VAL_FLOAT: return v_as_float(a)==v_as_float(b);
+    case VAL_BOOL: return v_as_bool(a)==v_as_bool(b);
+    case VAL_UNIT: return true;
+    case VAL_STR: { String *x = v_as_str(a), *y = v_as_str(b); return x->len==y->len && memcmp(x->data, y->data, (size_t)x->len)==0; }
+    case VAL_SYMBOL: return v_sym_len(a)==v_sym_len(b) && memcmp(v_sym_name(a), v_sym_name(b), (size_t)v_sym_len(a))==0;
+    case VAL_LIST: {
+      ValList *x = v_as_list(a), *y = v_as_list(b);
+      if (x->len!=y->len) return false;
+      for (int32_t i=0;i<x->len;i++) if (!rt_value_equal(x->items[i], y->items[i])) return false;
+      return true;
+    }
+    case VAL_OPTION: {
+      OptionVal *x = v_as_opt(a), *y = v_as_opt(b);
+      bool hx = x && x->has_value, hy = y && y->has_value;
+      return hx==hy && (!hx || rt_value_equal(x->value, y->value));
     }
-    i=(i+1)%m->cap;
+    case VAL_RESULT: return v_as_res(a)->is_ok==v_as_res(b)->is_ok && rt_value_equal(v_as_res(a)->value, v_as_res(b)->value);
+    case VAL_FUNC: return v_as_native(a)==v_as_native(b);
+    case VAL_CHAN: return v_as_chan(a)==v_as_chan(b);
+    default: return v_obj(a)==v_obj(b);
+  }
+}
+
+// Robin Hood open addressing: an entry's probe distance from its home slot
+// never exceeds that of the entry it is inserted past, so a lookup stops as
+// soon as it meets a closer entry. Deletion shifts the following run back
+// instead of leaving tombstones.
+#define MAP_MIN_CAP 8
+static inline uint64_t map_hash(Value k) { return rt_value_hash(k) | (1ull<<63); } // never 0
+static inline uint32_t map_dist(Map *m, uint64_t h, uint32_t i) { return (i - (uint32_t)h) & (uint32_t)(m->cap-1); }
+
+static Map *map_new_gc(VM *vm, int32_t cap) {
+  Map *m = (Map*)gc_alloc(&vm->gc, sizeof(Map), OBJ_MAP);
+  m->cap = MAP_MIN_CAP; while (m->cap < cap) m->cap *= 2;
+  m->len = 0; m->slots = (MapEntry*)calloc((size_t)m->cap, sizeof(MapEntry));
+  gc_account(&vm->gc, (ptrdiff_t)(sizeof(MapEntry)*(size_t)m->cap));
+  return m;
+}
+
+static int32_t map_find(Map *m, uint64_t h, Value k) {
+  uint32_t mask = (uint32_t)m->cap-1, i = (uint32_t)h & mask;
+  for (uint32_t d=0;;d++, i=(i+1)&mask) {
+    MapEntry *e = &m->slots[i];
+    if (!e->hash || map_dist(m, e->hash, i) < d) return -1;
+    if (e->hash==h && rt_value_equal(e->key, k)) return (int32_t)i;
+  }
+}
+
+static void map_insert_new(Map *m, MapEntry cur) {
+  uint32_t mask = (uint32_t)m->cap-1, i = (uint32_t)cur.hash & mask;
+  for (uint32_t d=0;;d++, i=(i+1)&mask) {
+    MapEntry *e = &m->slots[i];
+    if (!e->hash) { *e = cur; m->len++; return; }
+    uint32_t ed = map_dist(m, e->hash, i);
+    if (ed < d) { MapEntry t = *e; *e = cur; cur = t; d = ed; }
   }
-  m->slots[i].used=1; m->slots[i].key=(Value*)malloc(sizeof(Value)); *m->slots[i].key = v_str(k); m->slots[i].val=(Value*)malloc(sizeof(Value)); *m->slots[i].val = v_int(val); m->len++;
 }
-static int map_get_pair(Map *m, String *k, int64_t *out){ uint64_t h=hash_str(k->data,k->len); int i=(int)(h%m->cap); int start=i; while (m->slots[i].used){ Value *kv=m->slots[i].key; if (kv && kv->kind==VAL_STR && kv->as.str->len==k->len && memcmp(kv->as.str->data,k->data,k->len)==0){ *out = m->slots[i].val->as.i; return 1; } i=(i+1)%m->cap; if (i==start) break; } return 0; }
 
-Value rt_map_new(Env *env, Value *args, int nargs){ (void)args; (void)nargs; VM *vm=(VM*)env->aux; Map *m=map_new_gc(vm, 16); return v_map(m);} 
-Value rt_map_set(Env *env, Value *args, int nargs){ (void)env; if (nargs!=3 || args[0].kind!=VAL_MAP || args[1].kind!=VAL_STR || args[2].kind!=VAL_INT) return v_unit(); map_set_pair(args[0].as.map, args[1].as.str, args[2].as.i); return v_unit(); }
-Value rt_map_get(Env *env, Value *args, int nargs){ (void)env; if (nargs!=2 || args[0].kind!=VAL_MAP || args[1].kind!=VAL_STR) return v_int(0); int64_t out=0; if (map_get_pair(args[0].as.map,args[1].as.str,&out)) return v_int(out); return v_int(0);}
-Value rt_map_len(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1 || args[0].kind!=VAL_MAP) return v_int(0); return v_int(args[0].as.map->len);}
+static void map_grow(VM *vm, Map *m) {
+  MapEntry *old = m->slots; int32_t oldcap = m->cap;
+  m->cap *= 2; m->len = 0; m->slots = (MapEntry*)calloc((size_t)m->cap, sizeof(MapEntry));
+  for (int32_t i=0;i<oldcap;i++) if (old[i].hash) map_insert_new(m, old[i]);
+  free(old);
+  gc_account(&vm->gc, (ptrdiff_t)(sizeof(MapEntry)*(size_t)oldcap));
+}
+
+static void map_put(VM *vm, Map *m, Value k, Value v) {
+  uint64_t h = map_hash(k);
+  int32_t i = map_find(m, h, k);
+  if (i>=0) m->slots[i].val = v;
+  else {
+    if ((m->len+1)*8 > m->cap*7) map_grow(vm, m); // load factor 7/8
+    map_insert_new(m, (MapEntry){ h, k, v });
+  }
+  gc_write_barrier(&vm->gc, &m->hdr, v_obj(k));
+  gc_write_barrier(&vm->gc, &m->hdr, v_obj(v));
+}
+
+static bool map_remove(Map *m, Value k) {
+  int32_t found = map_find(m, map_hash(k), k);
+  if (found<0) return false;
+  uint32_t mask = (uint32_t)m->cap-1, i = (uint32_t)found;
+  for (;;) {
+    uint32_t j = (i+1)&mask;
+    MapEntry *e = &m->slots[j];
+    if (!e->hash || map_dist(m, e->hash, j)==0) break;
+    m->slots[i] = *e; i = j;
+  }
+  m->slots[i].hash = 0; m->slots[i].key = m->slots[i].val = v_unit();
+  m->len--;
+  return true;
+}
+
+Value rt_map_new(Env *env, Value *args, int nargs){ (void)args; (void)nargs; VM *vm=(VM*)env->aux; return v_map(map_new_gc(vm, MAP_MIN_CAP)); }
+Value rt_map_set(Env *env, Value *args, int nargs){ if (nargs!=3 || v_kind(args[0])!=VAL_MAP) return v_unit(); map_put((VM*)env->aux, v_as_map(args[0]), args[1], args[2]); return v_unit(); }
+// A missing key reads as Unit, like an out-of-range vec-get
+Value rt_map_get(Env *env, Value *args, int nargs){ (void)env; if (nargs!=2 || v_kind(args[0])!=VAL_MAP) return v_unit(); Map *m=v_as_map(args[0]); int32_t i=map_find(m, map_hash(args[1]), args[1]); return i>=0 ? m->slots[i].val : v_unit(); }
+Value rt_map_get_or(Env *env, Value *args, int nargs){ (void)env; if (nargs!=3 || v_kind(args[0])!=VAL_MAP) return v_unit(); Map *m=v_as_map(args[0]); int32_t i=map_find(m, map_hash(args[1]), args[1]); return i>=0 ? m->slots[i].val : args[2]; }
+Value rt_map_has(Env *env, Value *args, int nargs){ (void)env; if (nargs!=2 || v_kind(args[0])!=VAL_MAP) return v_bool(false); return v_bool(map_find(v_as_map(args[0]), map_hash(args[1]), args[1])>=0); }
+Value rt_map_del(Env *env, Value *args, int nargs){ (void)env; if (nargs!=2 || v_kind(args[0])!=VAL_MAP) return v_bool(false); return v_bool(map_remove(v_as_map(args[0]), args[1])); }
+Value rt_map_len(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1 || v_kind(args[0])!=VAL_MAP) return v_int(0); return v_int(v_as_map(args[0])->len);}
+// Snapshot of the keys or values in table order, which is unspecified
+static Value map_column(Env *env, Value *args, int nargs, bool keys) {
+  if (nargs!=1 || v_kind(args[0])!=VAL_MAP) return v_unit();
+  VM *vm=(VM*)env->aux; Map *m=v_as_map(args[0]);
+  Vector *v = rt_vec_alloc(vm, m->len);
+  for (int32_t i=0;i<m->cap;i++) {
+    if (!m->slots[i].hash) continue;
+    Value x = keys ? m->slots[i].key : m->slots[i].val;
+    v->items[v->len++] = x; gc_write_barrier(&vm->gc, &v->hdr, v_obj(x));
+  }
+  return v_vec(v);
+}
+Value rt_map_keys(Env *env, Value *args, int nargs){ return map_column(env, args, nargs, true); }
+Value rt_map_vals(Env *env, Value *args, int nargs){ return map_column(env, args, nargs, false); }
 
 // ============================================================================
 // Option Type Operations
@@ -558,9 +988,8 @@ Value rt_map_len(Env *env, Value *args, int nargs){ (void)env; if (nargs!=1 || a
 Value rt_some(Env *env, Value *args, int nargs) {
   VM *vm = (VM*)env->aux;
   if (nargs != 1) return v_none();
-  OptionVal *opt = (OptionVal*)gc_alloc(&vm->gc, sizeof(OptionVal), 10);
-  opt->value = (Value*)malloc(sizeof(Value));
-  *opt->value = args[0];
+  OptionVal *opt = (OptionVal*)gc_alloc(&vm->gc, sizeof(OptionVal), OBJ_OPTION);
+  opt->value = args[0];
   opt->has_value = true;
   return v_some(opt);
 }
@@ -572,28 +1001,28 @@ Value rt_none_val(Env *env, Value *args, int nargs) {
 
 Value rt_is_some(Env *env, Value *args, int nargs) {
   (void)env;
-  if (nargs != 1 || args[0].kind != VAL_OPTION) return v_bool(false);
-  return v_bool(args[0].as.opt != NULL && args[0].as.opt->has_value);
+  if (nargs != 1 || v_kind(args[0]) != VAL_OPTION) return v_bool(false);
+  return v_bool(v_as_opt(args[0]) != NULL && v_as_opt(args[0])->has_value);
 }
 
 Value rt_is_none(Env *env, Value *args, int nargs) {
   (void)env;
-  if (nargs != 1 || args[0].kind != VAL_OPTION) return v_bool(true);
-  return v_bool(args[0].as.opt == NULL || !args[0].as.opt->has_value);
+  if (nargs != 1 || v_kind(args[0]) != VAL_OPTION) return v_bool(true);
+  return v_bool(v_as_opt(args[0]) == NULL || !v_as_opt(args[0])->has_value);
 }
 
 Value rt_unwrap(Env *env, Value *args, int nargs) {
   (void)env;
   if (nargs != 1) return v_unit();
-  if (args[0].kind == VAL_OPTION) {
-    if (args[0].as.opt && args[0].as.opt->has_value)
-      return *args[0].as.opt->value;
+  if (v_kind(args[0]) == VAL_OPTION) {
+    if (v_as_opt(args[0]) && v_as_opt(args[0])->has_value)
+      return v_as_opt(args[0])->value;
     fprintf(stderr, "unwrap: called on None\n");
     return v_unit();
   }
-  if (args[0].kind == VAL_RESULT) {
-    if (args[0].as.res && args[0].as.res->is_ok)
-      return *args[0].as.res->value;
+  if (v_kind(args[0]) == VAL_RESULT) {
+    if (v_as_res(args[0]) && v_as_res(args[0])->is_ok)
+      return v_as_res(args[0])->value;
     fprintf(stderr, "unwrap: called on Err\n");
     return v_unit();
   }
@@ -603,14 +1032,14 @@ Value rt_unwrap(Env *env, Value *args, int nargs) {
 Value rt_unwrap_or(Env *env, Value *args, int nargs) {
   (void)env;
   if (nargs != 2) return v_unit();
-  if (args[0].kind == VAL_OPTION) {
-    if (args[0].as.opt && args[0].as.opt->has_value)
-      return *args[0].as.opt->value;
+  if (v_kind(args[0]) == VAL_OPTION) {
+    if (v_as_opt(args[0]) && v_as_opt(args[0])->has_value)
+      return v_as_opt(args[0])->value;
     return args[1]; // default value
   }
-  if (args[0].kind == VAL_RESULT) {
-    if (args[0].as.res && args[0].as.res->is_ok)
-      return *args[0].as.res->value;
+  if (v_kind(args[0]) == VAL_RESULT) {
+    if (v_as_res(args[0]) && v_as_res(args[0])->is_ok)
+      return v_as_res(args[0])->value;
     return args[1]; // default value
   }
   return args[1];
@@ -623,9 +1052,8 @@ Value rt_unwrap_or(Env *env, Value *args, int nargs) {
 Value rt_ok_val(Env *env, Value *args, int nargs) {
   VM *vm = (VM*)env->aux;
   if (nargs != 1) return v_unit();
-  ResultVal *res = (ResultVal*)gc_alloc(&vm->gc, sizeof(ResultVal), 11);
-  res->value = (Value*)malloc(sizeof(Value));
-  *res->value = args[0];
+  ResultVal *res = (ResultVal*)gc_alloc(&vm->gc, sizeof(ResultVal), OBJ_RESULT);
+  res->value = args[0];
   res->is_ok = true;
   return v_ok(res);
 }
@@ -633,30 +1061,29 @@ Value rt_ok_val(Env *env, Value *args, int nargs) {
 Value rt_err_val(Env *env, Value *args, int nargs) {
   VM *vm = (VM*)env->aux;
   if (nargs != 1) return v_unit();
-  ResultVal *res = (ResultVal*)gc_alloc(&vm->gc, sizeof(ResultVal), 11);
-  res->value = (Value*)malloc(sizeof(Value));
-  *res->value = args[0];
+  ResultVal *res = (ResultVal*)gc_alloc(&vm->gc, sizeof(ResultVal), OBJ_RESULT);
+  res->value = args[0];
   res->is_ok = false;
   return v_err(res);
 }
 
 Value rt_is_ok(Env *env, Value *args, int nargs) {
   (void)env;
-  if (nargs != 1 || args[0].kind != VAL_RESULT) return v_bool(false);
-  return v_bool(args[0].as.res && args[0].as.res->is_ok);
+  if (nargs != 1 || v_kind(args[0]) != VAL_RESULT) return v_bool(false);
+  return v_bool(v_as_res(args[0]) && v_as_res(args[0])->is_ok);
 }
 
 Value rt_is_err(Env *env, Value *args, int nargs) {
   (void)env;
-  if (nargs != 1 || args[0].kind != VAL_RESULT) return v_bool(true);
-  return v_bool(!args[0].as.res || !args[0].as.res->is_ok);
+  if (nargs != 1 || v_kind(args[0]) != VAL_RESULT) return v_bool(true);
+  return v_bool(!v_as_res(args[0]) || !v_as_res(args[0])->is_ok);
 }
 
 Value rt_unwrap_err(Env *env, Value *args, int nargs) {
   (void)env;
-  if (nargs != 1 || args[0].kind != VAL_RESULT) return v_unit();
-  if (args[0].as.res && !args[0].as.res->is_ok)
-    return *args[0].as.res->value;
+  if (nargs != 1 || v_kind(args[0]) != VAL_RESULT) return v_unit();
+  if (v_as_res(args[0]) && !v_as_res(args[0])->is_ok)
+    return v_as_res(args[0])->value;
   fprintf(stderr, "unwrap-err: called on Ok\n");
   return v_unit();
 }
@@ -667,39 +1094,41 @@ Value rt_unwrap_err(Env *env, Value *args, int nargs) {
 
 Value rt_struct_get(Env *env, Value *args, int nargs) {
   (void)env;
-  if (nargs != 2 || args[0].kind != VAL_STRUCT || args[1].kind != VAL_INT)
+  if (nargs != 2 || v_kind(args[0]) != VAL_STRUCT || v_kind(args[1]) != VAL_INT)
     return v_unit();
-  StructVal *s = args[0].as.struc;
-  int64_t idx = args[1].as.i;
+  StructVal *s = v_as_struct(args[0]);
+  int64_t idx = v_as_int(args[1]);
   if (idx < 0 || idx >= s->nfields) return v_unit();
   return s->fields[idx];
 }
 
 Value rt_struct_set(Env *env, Value *args, int nargs) {
-  (void)env;
-  if (nargs != 3 || args[0].kind != VAL_STRUCT || args[1].kind != VAL_INT)
+  if (nargs != 3 || v_kind(args[0]) != VAL_STRUCT || v_kind(args[1]) != VAL_INT)
     return v_unit();
-  StructVal *s = args[0].as.struc;
-  int64_t idx = args[1].as.i;
+  StructVal *s = v_as_struct(args[0]);
+  int64_t idx = v_as_int(args[1]);
   if (idx < 0 || idx >= s->nfields) return v_unit();
   s->fields[idx] = args[2];
+  gc_write_barrier(&((VM*)env->aux)->gc, &s->hdr, v_obj(args[2]));
   return v_unit();
 }
 
 // Create a new struct instance with given name and fields
 Value rt_struct_new(Env *env, Value *args, int nargs) {
-  if (nargs < 1 || args[0].kind != VAL_STR) return v_unit();
-  const char *name = args[0].as.str->data;
+  if (nargs < 1 || v_kind(args[0]) != VAL_STR) return v_unit();
+  String *name = v_as_str(args[0]);
   int32_t n = (int32_t)(nargs - 1);
 
   // Allocate struct through GC
   VM *vm = (VM*)env->aux;
-  StructVal *s = (StructVal*)gc_alloc(&vm->gc, sizeof(StructVal), 6);
-  s->type_name = name;
+  // The name is copied after the fields: the String it came from may move or die
+  StructVal *s = (StructVal*)gc_alloc(&vm->gc, sizeof(StructVal)+sizeof(Value)*(size_t)n+(size_t)name->len+1, OBJ_STRUCT);
+  memcpy(s->fields+n, name->data, (size_t)name->len+1);
+  s->type_name = (const char*)(s->fields+n);
   s->nfields = n;
-  s->fields = (Value*)malloc(sizeof(Value) * n);
   for (int32_t i = 0; i < n; i++) {
     s->fields[i] = args[i + 1];
+    gc_write_barrier(&vm->gc, &s->hdr, v_obj(args[i + 1]));
   }
   return v_struct(s);
 }
@@ -707,7 +1136,7 @@ Value rt_struct_new(Env *env, Value *args, int nargs) {
 // Get struct field by name
 Value rt_struct_get_field(Env *env, Value *args, int nargs) {
   (void)env;
-  if (nargs != 2 || args[0].kind != VAL_STRUCT || args[1].kind != VAL_STR)
+  if (nargs != 2 || v_kind(args[0]) != VAL_STRUCT || v_kind(args[1]) != VAL_STR)
     return v_unit();
   // For named access, we'd need to store field names in StructVal
   // For now, fall back to index-based access
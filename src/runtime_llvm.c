@@ -11,6 +11,12 @@
  *
  *   ar rcs libsqale_rt.a runtime_llvm.o
  *   clang program.ll -L. -lsqale_rt -o program
+ *
+ * `make` archives it as build/libsqale_rt.a, which `sqale build` links
+ * executables against.
+ *
+ * It is also linked into sqale itself: `sqale run --jit` binds the compiled
+ * code's calls to these copies.
  */
 
 #include <stdio.h>
@@ -18,6 +24,8 @@
 #include <string.h>
 #include <stdint.h>
 
+typedef struct SqStrings { char **items; size_t len, cap; } SqStrings;
+
 // ============================================================================
 // Print Functions
 // ============================================================================
@@ -98,9 +106,33 @@ int sq_closure_get_arity(void *closure) {
 // String Operations
 // ============================================================================
 
+// Strings made on a thread while sq_strings is set are also recorded there,
+// so that its owner can free them all at once. sqale sets it around tiered
+// calls (tier.c); compiled executables never do.
+_Thread_local SqStrings *sq_strings;
+
+static char *string_alloc(size_t size) {
+  char *s = (char*)malloc(size);
+  SqStrings *l = sq_strings;
+  if (l) {
+    if (l->len == l->cap) {
+      l->cap = l->cap ? l->cap * 2 : 16;
+      l->items = (char**)realloc(l->items, l->cap * sizeof(char*));
+    }
+    l->items[l->len++] = s;
+  }
+  return s;
+}
+
+void sq_strings_free(SqStrings *l) {
+  for (size_t i = 0; i < l->len; i++) free(l->items[i]);
+  free(l->items);
+  l->items = NULL; l->len = l->cap = 0;
+}
+
 // Allocate a new string (copies data)
 char *sq_string_new(const char *data, size_t len) {
-  char *s = (char*)malloc(len + 1);
+  char *s = string_alloc(len + 1);
   if (data) memcpy(s, data, len);
   s[len] = '\0';
   return s;
@@ -110,7 +142,7 @@ char *sq_string_new(const char *data, size_t len) {
 char *sq_string_concat(const char *a, const char *b) {
   size_t la = a ? strlen(a) : 0;
   size_t lb = b ? strlen(b) : 0;
-  char *s = (char*)malloc(la + lb + 1);
+  char *s = string_alloc(la + lb + 1);
   if (a) memcpy(s, a, la);
   if (b) memcpy(s + la, b, lb);
   s[la + lb] = '\0';
@@ -122,6 +154,11 @@ size_t sq_string_len(const char *s) {
   return s ? strlen(s) : 0;
 }
 
+// String equality
+int sq_string_eq(const char *a, const char *b) {
+  return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
 // ============================================================================
 // Vector Operations (dynamic arrays)
 // ============================================================================
@@ -0,0 +1,824 @@
+// Context switching backend: hand-written on x86-64 and AArch64, fibers on
+// Windows, ucontext elsewhere and under AddressSanitizer, which follows
+// swapcontext but not a bare stack pointer swap.
+#if defined(__SANITIZE_ADDRESS__)
+#define SQALE_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SQALE_ASAN 1
+#endif
+#endif
+#if defined(_WIN32)
+#define CTX_FIBER 1
+#elif (defined(__x86_64__) || defined(__aarch64__)) && !SQALE_ASAN
+#define CTX_ASM 1
+#else
+#define CTX_UCONTEXT 1
+#endif
+
+#if !defined(_WIN32)
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+#if defined(__APPLE__) && CTX_UCONTEXT
+#define _XOPEN_SOURCE 600
+#endif
+#endif
+
+#include "thread.h"
+#include "gc.h"
+#include "value.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TASK_STACK_MB 8     // default reserve per task, as for a thread; pages are committed as they are touched
+#define FIBER_POOL 64       // idle stacks a worker keeps for reuse
+
+static size_t task_stack;   // bytes reserved per task, fixed when the workers start
+
+// ---- Platform ----
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE Cond;
+static void mutex_init(Mutex *m) { InitializeSRWLock(m); }
+static void mutex_lock(Mutex *m) { AcquireSRWLockExclusive(m); }
+static void mutex_unlock(Mutex *m) { ReleaseSRWLockExclusive(m); }
+static void cond_init(Cond *c) { InitializeConditionVariable(c); }
+static void cond_signal(Cond *c) { WakeConditionVariable(c); }
+static void cond_broadcast(Cond *c) { WakeAllConditionVariable(c); }
+static int64_t now_ms(void) { return (int64_t)GetTickCount64(); }
+static int64_t now_us(void) {
+  LARGE_INTEGER f, t; QueryPerformanceFrequency(&f); QueryPerformanceCounter(&t);
+  return (int64_t)(t.QuadPart / f.QuadPart * 1000000 + t.QuadPart % f.QuadPart * 1000000 / f.QuadPart);
+}
+// Wait for a signal or until the now_ms() deadline (<0: none)
+static void cond_wait_until(Cond *c, Mutex *m, int64_t deadline) {
+  DWORD ms = INFINITE;
+  if (deadline>=0) { int64_t now = now_ms(); ms = deadline>now ? (DWORD)(deadline-now) : 0; }
+  SleepConditionVariableSRW(c, m, ms, 0);
+}
+static int cpu_count(void) { SYSTEM_INFO si; GetSystemInfo(&si); return (int)si.dwNumberOfProcessors; }
+
+#else
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if CTX_UCONTEXT
+#include <ucontext.h>
+#if defined(__clang__)
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#endif
+#endif
+
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+static void mutex_init(Mutex *m) { pthread_mutex_init(m, NULL); }
+static void mutex_lock(Mutex *m) { pthread_mutex_lock(m); }
+static void mutex_unlock(Mutex *m) { pthread_mutex_unlock(m); }
+static void cond_init(Cond *c) { pthread_cond_init(c, NULL); }
+static void cond_signal(Cond *c) { pthread_cond_signal(c); }
+static void cond_broadcast(Cond *c) { pthread_cond_broadcast(c); }
+static int64_t now_ms(void) {
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+static int64_t now_us(void) {
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+static void cond_wait_until(Cond *c, Mutex *m, int64_t deadline) {
+  if (deadline<0) { pthread_cond_wait(c, m); return; }
+  int64_t ms = deadline - now_ms(); if (ms<0) ms = 0;
+  struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms/1000; ts.tv_nsec += (ms%1000)*1000000;
+  if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+  pthread_cond_timedwait(c, m, &ts);
+}
+static int cpu_count(void) { return (int)sysconf(_SC_NPROCESSORS_ONLN); }
+
+static void *stack_alloc(void) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+  flags |= MAP_NORESERVE;
+#endif
+  void *p = mmap(NULL, task_stack, PROT_READ|PROT_WRITE, flags, -1, 0);
+  if (p==MAP_FAILED) return NULL;
+  mprotect(p, (size_t)sysconf(_SC_PAGESIZE), PROT_NONE); // guard page
+  return p;
+}
+static void stack_free(void *p) { munmap(p, task_stack); }
+
+#endif
+
+// ---- Contexts ----
+
+// A task stack with the context last saved on it. A fiber runs fiber_main,
+// which calls one task after another as the fiber is reused.
+static void fiber_main(void);
+
+#if CTX_ASM
+typedef struct Ctx { void *sp; } Ctx;
+
+// Push the callee-saved registers, store sp in *save, load sp from next and
+// pop the registers saved there.
+void sqale_ctx_switch(void **save, void *next);
+#if defined(__APPLE__)
+#define CTX_SYM "_sqale_ctx_switch"
+#else
+#define CTX_SYM "sqale_ctx_switch"
+#endif
+#if defined(__ELF__)
+#define CTX_TYPE ".type " CTX_SYM ", @function\n"
+#else
+#define CTX_TYPE
+#endif
+#if defined(__x86_64__)
+__asm__(
+  ".text\n.globl " CTX_SYM "\n" CTX_TYPE ".p2align 4\n" CTX_SYM ":\n"
+  "  pushq %rbp\n  pushq %rbx\n  pushq %r12\n  pushq %r13\n  pushq %r14\n  pushq %r15\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  popq %r15\n  popq %r14\n  popq %r13\n  popq %r12\n  popq %rbx\n  popq %rbp\n"
+  "  ret\n");
+#else
+__asm__(
+  ".text\n.globl " CTX_SYM "\n" CTX_TYPE ".p2align 4\n" CTX_SYM ":\n"
+  "  sub sp, sp, #160\n"
+  "  stp x19, x20, [sp, #0]\n  stp x21, x22, [sp, #16]\n  stp x23, x24, [sp, #32]\n"
+  "  stp x25, x26, [sp, #48]\n  stp x27, x28, [sp, #64]\n  stp x29, x30, [sp, #80]\n"
+  "  stp d8, d9, [sp, #96]\n  stp d10, d11, [sp, #112]\n  stp d12, d13, [sp, #128]\n  stp d14, d15, [sp, #144]\n"
+  "  mov x2, sp\n  str x2, [x0]\n"
+  "  mov sp, x1\n"
+  "  ldp x19, x20, [sp, #0]\n  ldp x21, x22, [sp, #16]\n  ldp x23, x24, [sp, #32]\n"
+  "  ldp x25, x26, [sp, #48]\n  ldp x27, x28, [sp, #64]\n  ldp x29, x30, [sp, #80]\n"
+  "  ldp d8, d9, [sp, #96]\n  ldp d10, d11, [sp, #112]\n  ldp d12, d13, [sp, #128]\n  ldp d14, d15, [sp, #144]\n"
+  "  add sp, sp, #160\n"
+  "  ret\n");
+#endif
+
+typedef struct Fiber { Ctx ctx; void *stack; struct Fiber *next; } Fiber;
+
+static bool ctx_make(Fiber *f) {
+  if (!(f->stack = stack_alloc())) return false;
+  void **sp = (void**)((char*)f->stack + task_stack);
+#if defined(__x86_64__)
+  *--sp = NULL;               // fiber_main's return address, never used
+  *--sp = (void*)fiber_main;  // taken by ret, leaving sp 16-byte aligned minus 8 as after a call
+  for (int i=0;i<6;i++) *--sp = NULL;
+#else
+  sp -= 20; memset(sp, 0, 20*sizeof(void*));
+  sp[11] = (void*)fiber_main; // x30
+#endif
+  f->ctx.sp = sp;
+  return true;
+}
+static void ctx_switch(Ctx *from, Ctx *to) { sqale_ctx_switch(&from->sp, to->sp); }
+static void ctx_thread_init(Ctx *c) { (void)c; }
+static void ctx_free(Fiber *f) { stack_free(f->stack); }
+
+#elif CTX_UCONTEXT
+typedef struct Ctx { ucontext_t uc; } Ctx;
+typedef struct Fiber { Ctx ctx; void *stack; struct Fiber *next; } Fiber;
+
+static bool ctx_make(Fiber *f) {
+  if (!(f->stack = stack_alloc())) return false;
+  getcontext(&f->ctx.uc);
+  f->ctx.uc.uc_stack.ss_sp = f->stack;
+  f->ctx.uc.uc_stack.ss_size = task_stack;
+  f->ctx.uc.uc_link = NULL;
+  makecontext(&f->ctx.uc, fiber_main, 0);
+  return true;
+}
+static void ctx_switch(Ctx *from, Ctx *to) { swapcontext(&from->uc, &to->uc); }
+static void ctx_thread_init(Ctx *c) { (void)c; }
+static void ctx_free(Fiber *f) { stack_free(f->stack); }
+
+#else
+typedef struct Ctx { void *fiber; } Ctx;
+typedef struct Fiber { Ctx ctx; struct Fiber *next; } Fiber;
+
+static VOID WINAPI fiber_proc(LPVOID p) { (void)p; fiber_main(); }
+static bool ctx_make(Fiber *f) {
+  f->ctx.fiber = CreateFiberEx(64*1024, task_stack, FIBER_FLAG_FLOAT_SWITCH, fiber_proc, NULL);
+  return f->ctx.fiber!=NULL;
+}
+static void ctx_switch(Ctx *from, Ctx *to) { (void)from; SwitchToFiber(to->fiber); }
+static void ctx_thread_init(Ctx *c) { c->fiber = ConvertThreadToFiber(NULL); }
+static void ctx_free(Fiber *f) { DeleteFiber(f->ctx.fiber); }
+#endif
+
+// ---- Scheduler state ----
+
+enum {
+  TASK_RUNNABLE, // queued or running
+  TASK_PARKING,  // blocking; its worker has not switched away from it yet
+  TASK_PARKED,
+  TASK_WOKEN,    // made runnable while parking, or before it got to park
+};
+
+struct RtTask {
+  RtTaskFn fn;             // cleared when the task returns
+  void *arg;
+  int state;               // TASK_*
+  struct Worker *home;     // the worker it first ran on
+  Fiber *fiber;
+  RtTask *next;            // ready or inject queue link
+  GcRoot *roots;           // gc_roots, gc_self and v_heap while switched out
+  GcMutator *mut;
+#if SQALE_NANBOX
+  GC *heap;
+#endif
+  RtWaiter *waiter;        // the wait a pending timer belongs to
+  int64_t deadline;
+  bool idle;               // parked with no deadline: only another task can wake it
+  RtGroup *group;          // where the tasks it spawns are counted
+  RtGroup *owner;          // the group it was spawned into
+  ptrdiff_t timer_idx;     // index in the timer heap, -1 if none
+};
+
+typedef struct TaskList { RtTask *head, *tail; } TaskList;
+
+typedef struct Worker {
+  Ctx ctx;                 // the scheduler loop, resumed when a task parks or returns
+  RtTask *cur;
+  RtSpin qlock;            // fresh tasks; the owner pushes and pops the tail, thieves take the head
+  RtTask **q;
+  size_t qcap, qhead, qlen;
+  RtSpin rlock;            // parked tasks of this worker that were made runnable again
+  TaskList ready;
+  Fiber *fibers;           // idle stacks
+  int nfibers;
+  Mutex mu;                // sleeping, cv: an idle worker waits here
+  Cond cv;
+  int sleeping;
+  uint32_t rng;
+} Worker;
+
+static struct {
+  Worker *workers;
+  int n, want;
+  int started;
+  RtSpin start_lock;
+  RtSpin ilock;            // tasks spawned outside the workers
+  TaskList inject;
+  RtSpin tlock;            // binary min-heap of parked tasks by wait deadline
+  RtTask **timers;
+  size_t ntimers, captimers;
+  int active;              // live tasks, less those parked idle
+  Mutex qmu;               // qcv: rt_sched_quiesce waits here for active to reach 0
+  Cond qcv;
+} sched;
+
+static _Thread_local Worker *self;
+static _Thread_local RtGroup *thread_group; // current group outside tasks
+
+static void list_push(TaskList *l, RtTask *t) {
+  t->next = NULL;
+  if (l->tail) l->tail->next = t; else l->head = t;
+  l->tail = t;
+}
+static RtTask *list_pop(TaskList *l) {
+  RtTask *t = l->head;
+  if (t) { l->head = t->next; if (!l->head) l->tail = NULL; }
+  return t;
+}
+
+static void deque_push(Worker *w, RtTask *t) {
+  rt_spin_lock(&w->qlock);
+  if (w->qlen==w->qcap) {
+    size_t cap = w->qcap ? w->qcap*2 : 64;
+    RtTask **q = (RtTask**)malloc(sizeof(RtTask*)*cap);
+    for (size_t i=0;i<w->qlen;i++) q[i] = w->q[(w->qhead+i) % w->qcap];
+    free(w->q); w->q = q; w->qcap = cap; w->qhead = 0;
+  }
+  w->q[(w->qhead + w->qlen++) % w->qcap] = t;
+  rt_spin_unlock(&w->qlock);
+}
+static RtTask *deque_pop(Worker *w) {
+  rt_spin_lock(&w->qlock);
+  RtTask *t = w->qlen ? w->q[(w->qhead + --w->qlen) % w->qcap] : NULL;
+  rt_spin_unlock(&w->qlock);
+  return t;
+}
+static RtTask *deque_steal(Worker *w) {
+  rt_spin_lock(&w->qlock);
+  RtTask *t = NULL;
+  if (w->qlen) { t = w->q[w->qhead]; w->qhead = (w->qhead+1) % w->qcap; w->qlen--; }
+  rt_spin_unlock(&w->qlock);
+  return t;
+}
+static bool deque_empty(Worker *w) {
+  rt_spin_lock(&w->qlock); bool e = w->qlen==0; rt_spin_unlock(&w->qlock); return e;
+}
+
+// Wake w if it is asleep. Pairs with the fence in worker_sleep: either the
+// sleeper sees the work just queued or this sees it sleeping.
+static void wake(Worker *w) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&w->sleeping, __ATOMIC_RELAXED)) return;
+  mutex_lock(&w->mu); cond_signal(&w->cv); mutex_unlock(&w->mu);
+}
+static void wake_one(void) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (int i=0;i<sched.n;i++) {
+    Worker *w = &sched.workers[i];
+    if (w!=self && __atomic_load_n(&w->sleeping, __ATOMIC_RELAXED)) {
+      mutex_lock(&w->mu); cond_signal(&w->cv); mutex_unlock(&w->mu);
+      return;
+    }
+  }
+}
+
+static void ready_push(Worker *w, RtTask *t) {
+  rt_spin_lock(&w->rlock); list_push(&w->ready, t); rt_spin_unlock(&w->rlock);
+  if (w!=self) wake(w);
+}
+
+// Make a task blocked in rt_waiter_block runnable on its worker. Its waiter
+// may have been completed before it blocked; then WOKEN tells it not to.
+static void task_ready(RtTask *t) {
+  int s = __atomic_load_n(&t->state, __ATOMIC_ACQUIRE);
+  for (;;) {
+    if (s==TASK_PARKED) {
+      if (__atomic_compare_exchange_n(&t->state, &s, TASK_RUNNABLE, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (t->idle) { t->idle = false; __atomic_add_fetch(&sched.active, 1, __ATOMIC_ACQ_REL); }
+        ready_push(t->home, t); return;
+      }
+    } else if (s==TASK_PARKING || s==TASK_RUNNABLE) {
+      if (__atomic_compare_exchange_n(&t->state, &s, TASK_WOKEN, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return;
+    } else return;
+  }
+}
+
+// ---- Timers ----
+
+static bool timer_less(size_t a, size_t b) { return sched.timers[a]->deadline < sched.timers[b]->deadline; }
+static void timer_swap(size_t a, size_t b) {
+  RtTask *t = sched.timers[a]; sched.timers[a] = sched.timers[b]; sched.timers[b] = t;
+  sched.timers[a]->timer_idx = (ptrdiff_t)a; sched.timers[b]->timer_idx = (ptrdiff_t)b;
+}
+static void timer_up(size_t i) {
+  while (i && timer_less(i, (i-1)/2)) { timer_swap(i, (i-1)/2); i = (i-1)/2; }
+}
+static void timer_down(size_t i) {
+  for (;;) {
+    size_t l = 2*i+1, m = i;
+    if (l < sched.ntimers && timer_less(l, m)) m = l;
+    if (l+1 < sched.ntimers && timer_less(l+1, m)) m = l+1;
+    if (m==i) return;
+    timer_swap(i, m); i = m;
+  }
+}
+static void timer_remove(RtTask *t) {
+  size_t i = (size_t)t->timer_idx, last = sched.ntimers-1;
+  __atomic_store_n(&sched.ntimers, last, __ATOMIC_RELAXED);
+  if (i!=last) {
+    sched.timers[i] = sched.timers[last]; sched.timers[i]->timer_idx = (ptrdiff_t)i;
+    timer_down(i); timer_up(i);
+  }
+  t->timer_idx = -1;
+}
+static void timer_add(RtTask *t, RtWaiter *w, int64_t deadline) {
+  rt_spin_lock(&sched.tlock);
+  if (sched.ntimers==sched.captimers) {
+    sched.captimers = sched.captimers ? sched.captimers*2 : 16;
+    sched.timers = (RtTask**)realloc(sched.timers, sizeof(RtTask*)*sched.captimers);
+  }
+  t->waiter = w; t->deadline = deadline;
+  t->timer_idx = (ptrdiff_t)sched.ntimers;
+  sched.timers[sched.ntimers] = t;
+  __atomic_store_n(&sched.ntimers, sched.ntimers+1, __ATOMIC_RELAXED);
+  timer_up((size_t)t->timer_idx);
+  rt_spin_unlock(&sched.tlock);
+}
+// Called by the task once it runs again: until then its waiter stays valid
+static void timer_cancel(RtTask *t) {
+  rt_spin_lock(&sched.tlock);
+  if (t->timer_idx>=0) timer_remove(t);
+  rt_spin_unlock(&sched.tlock);
+}
+static void timers_run(void) {
+  if (!__atomic_load_n(&sched.ntimers, __ATOMIC_RELAXED)) return;
+  int64_t now = now_ms();
+  rt_spin_lock(&sched.tlock);
+  while (sched.ntimers && sched.timers[0]->deadline <= now) {
+    RtTask *t = sched.timers[0];
+    timer_remove(t);
+    int pending = RT_WAIT_PENDING;
+    if (__atomic_compare_exchange_n(&t->waiter->state, &pending, RT_WAIT_TIMEOUT, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      task_ready(t);
+  }
+  rt_spin_unlock(&sched.tlock);
+}
+static int64_t timers_next(void) {
+  rt_spin_lock(&sched.tlock);
+  int64_t d = sched.ntimers ? sched.timers[0]->deadline : -1;
+  rt_spin_unlock(&sched.tlock);
+  return d;
+}
+
+// ---- Groups and quiescence ----
+
+// A task stops counting as active when it returns or parks with no deadline.
+// Only an active task (or a thread outside the scheduler) can wake an idle
+// one, so once none is left the remaining tasks can never run again.
+static void inactive(void) {
+  if (__atomic_sub_fetch(&sched.active, 1, __ATOMIC_ACQ_REL)) return;
+  mutex_lock(&sched.qmu); cond_signal(&sched.qcv); mutex_unlock(&sched.qmu);
+}
+
+static void group_done(RtGroup *g) {
+  RtWake k; bool woke = false;
+  rt_spin_lock(&g->lock);
+  if (!--g->live && g->waiter) woke = rt_waiter_claim(g->waiter, &k);
+  rt_spin_unlock(&g->lock);
+  if (woke) rt_waiter_notify(&k);
+}
+
+static RtGroup **group_slot(void) {
+  RtTask *t = self ? self->cur : NULL;
+  return t ? &t->group : &thread_group;
+}
+
+void rt_group_init(RtGroup *g) { g->live = 0; g->lock = false; g->waiter = NULL; }
+
+RtGroup *rt_group_enter(RtGroup *g) {
+  RtGroup **slot = group_slot(), *prev = *slot;
+  *slot = g;
+  return prev;
+}
+
+void rt_group_leave(RtGroup *g, RtGroup *prev) {
+  *group_slot() = prev;
+  RtWaiter w; rt_waiter_init(&w);
+  rt_spin_lock(&g->lock);
+  if (!g->live) { rt_spin_unlock(&g->lock); return; }
+  g->waiter = &w;
+  rt_spin_unlock(&g->lock);
+  rt_waiter_block(&w, -1);
+  // The last task may still hold the lock it claimed w under; g is about to go
+  rt_spin_lock(&g->lock); rt_spin_unlock(&g->lock);
+}
+
+void rt_sched_quiesce(void) {
+  if (!__atomic_load_n(&sched.started, __ATOMIC_ACQUIRE)) return;
+  GcMutator *m = gc_self;
+  if (m) gc_park(m);
+  mutex_lock(&sched.qmu);
+  while (__atomic_load_n(&sched.active, __ATOMIC_ACQUIRE)) cond_wait_until(&sched.qcv, &sched.qmu, -1);
+  mutex_unlock(&sched.qmu);
+  if (m) gc_resume(m);
+}
+
+// ---- Workers ----
+
+static Fiber *fiber_get(Worker *w) {
+  Fiber *f = w->fibers;
+  if (f) { w->fibers = f->next; w->nfibers--; return f; }
+  f = (Fiber*)calloc(1, sizeof(Fiber));
+  if (!ctx_make(f)) { fprintf(stderr, "spawn: cannot allocate a task stack\n"); abort(); }
+  return f;
+}
+static void fiber_put(Worker *w, Fiber *f) {
+  if (w->nfibers >= FIBER_POOL) { ctx_free(f); free(f); return; }
+  f->next = w->fibers; w->fibers = f; w->nfibers++;
+}
+
+static void fiber_main(void) {
+  for (;;) {
+    RtTask *t = self->cur;
+    t->fn(t->arg);
+    t->fn = NULL;
+    if (t->owner) group_done(t->owner);
+    ctx_switch(&t->fiber->ctx, &t->home->ctx);
+  }
+}
+
+static void run_task(Worker *w, RtTask *t) {
+  if (!t->fiber) { t->fiber = fiber_get(w); t->home = w; }
+  w->cur = t;
+  gc_roots = t->roots;
+  if (t->mut) gc_resume(t->mut); // a new task starts its mutator itself
+#if SQALE_NANBOX
+  v_heap = t->heap;
+#endif
+  ctx_switch(&w->ctx, &t->fiber->ctx);
+  // Stopped while switched out, so collections need not wait for it
+  t->mut = gc_self;
+  if (gc_self) { gc_park(gc_self); gc_self = NULL; }
+  t->roots = gc_roots; gc_roots = NULL;
+#if SQALE_NANBOX
+  t->heap = v_heap; v_heap = NULL;
+#endif
+  w->cur = NULL;
+  if (!t->fn) { fiber_put(w, t->fiber); free(t); inactive(); return; }
+  // Read idle first: once PARKED, a waker may clear it
+  bool idle = t->idle;
+  int s = TASK_PARKING;
+  if (!__atomic_compare_exchange_n(&t->state, &s, TASK_PARKED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    t->idle = false;
+    __atomic_store_n(&t->state, TASK_RUNNABLE, __ATOMIC_RELAXED); // woken while parking
+    ready_push(w, t);
+  } else if (idle) inactive();
+}
+
+static RtTask *inject_pop(void) {
+  rt_spin_lock(&sched.ilock); RtTask *t = list_pop(&sched.inject); rt_spin_unlock(&sched.ilock);
+  return t;
+}
+
+static RtTask *next_task(Worker *w) {
+  rt_spin_lock(&w->rlock); RtTask *t = list_pop(&w->ready); rt_spin_unlock(&w->rlock);
+  if (t || (t = deque_pop(w)) || (t = inject_pop())) return t;
+  w->rng ^= w->rng << 13; w->rng ^= w->rng >> 17; w->rng ^= w->rng << 5;
+  for (int i=0;i<sched.n;i++) {
+    Worker *v = &sched.workers[(w->rng + (uint32_t)i) % (uint32_t)sched.n];
+    if (v!=w && (t = deque_steal(v))) return t;
+  }
+  return NULL;
+}
+
+static bool has_work(Worker *w) {
+  rt_spin_lock(&w->rlock); bool r = w->ready.head!=NULL; rt_spin_unlock(&w->rlock);
+  if (r) return true;
+  rt_spin_lock(&sched.ilock); r = sched.inject.head!=NULL; rt_spin_unlock(&sched.ilock);
+  if (r) return true;
+  for (int i=0;i<sched.n;i++) if (!deque_empty(&sched.workers[i])) return true;
+  return false;
+}
+
+static void worker_sleep(Worker *w) {
+  mutex_lock(&w->mu);
+  __atomic_store_n(&w->sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!has_work(w)) cond_wait_until(&w->cv, &w->mu, timers_next());
+  __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+  mutex_unlock(&w->mu);
+}
+
+// A task that runs into the guard page below its stack is reported, rather
+// than dying of a bare SIGSEGV. The handler runs on a per-worker signal stack,
+// since the faulting one has no room left.
+#if !defined(_WIN32) && !SQALE_ASAN
+#include <signal.h>
+static char overflow_msg[160];
+static size_t overflow_len, page_size;
+
+static void overflow_handler(int sig, siginfo_t *si, void *uc) {
+  (void)uc;
+  char *a = (char*)si->si_addr;
+  if (self && self->cur && self->cur->fiber) {
+    char *lo = (char*)self->cur->fiber->stack;
+    if (a>=lo && a<lo+page_size) {
+      ssize_t r = write(2, overflow_msg, overflow_len); (void)r;
+      _exit(134);
+    }
+  }
+  signal(sig, SIG_DFL); // any other fault: crash as usual once it recurs
+}
+static void overflow_install(void) {
+  page_size = (size_t)sysconf(_SC_PAGESIZE);
+  int n = snprintf(overflow_msg, sizeof overflow_msg,
+    "task stack overflow (%zuMB; set --task-stack=MB or SQALE_TASK_STACK)\n", task_stack>>20);
+  overflow_len = n>0 ? (size_t)n : 0;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_sigaction = overflow_handler;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, NULL);
+  sigaction(SIGBUS, &sa, NULL); // what macOS raises for a PROT_NONE page
+}
+static void overflow_thread_init(void) {
+  stack_t ss = {0};
+  ss.ss_size = 64*1024;
+  if ((ss.ss_sp = malloc(ss.ss_size))) sigaltstack(&ss, NULL);
+}
+#else
+static void overflow_install(void) {}
+static void overflow_thread_init(void) {}
+#endif
+
+static void *worker_main(void *p) {
+  Worker *w = (Worker*)p;
+  self = w;
+  ctx_thread_init(&w->ctx);
+  overflow_thread_init();
+  for (;;) {
+    timers_run();
+    RtTask *t = next_task(w);
+    if (t) run_task(w, t); else worker_sleep(w);
+  }
+  return NULL;
+}
+
+static void sched_start(void) {
+  if (__atomic_load_n(&sched.started, __ATOMIC_ACQUIRE)) return;
+  rt_spin_lock(&sched.start_lock);
+  if (!sched.started) {
+    int n = sched.want;
+    const char *env = getenv("SQALE_WORKERS");
+    if (n<=0 && env) n = atoi(env);
+    if (n<=0) n = cpu_count();
+    if (n<=0) n = 1;
+    const char *st = getenv("SQALE_TASK_STACK");
+    if (!task_stack && st && atoi(st)>0) task_stack = (size_t)atoi(st) << 20;
+    if (!task_stack) task_stack = (size_t)TASK_STACK_MB << 20;
+    overflow_install();
+    sched.workers = (Worker*)calloc((size_t)n, sizeof(Worker));
+    mutex_init(&sched.qmu); cond_init(&sched.qcv);
+    for (int i=0;i<n;i++) {
+      Worker *w = &sched.workers[i];
+      mutex_init(&w->mu); cond_init(&w->cv);
+      w->rng = (uint32_t)i*2654435761u + 1;
+    }
+    sched.n = n;
+    // Workers run for the life of the process
+    for (int i=0;i<n;i++) rt_thread_spawn(worker_main, &sched.workers[i]);
+    __atomic_store_n(&sched.started, 1, __ATOMIC_RELEASE);
+  }
+  rt_spin_unlock(&sched.start_lock);
+}
+
+void rt_sched_set_workers(int n) { sched.want = n; }
+void rt_sched_set_task_stack(int mb) { if (mb>0) task_stack = (size_t)mb << 20; }
+int rt_sched_workers(void) { sched_start(); return sched.n; }
+
+void rt_task_spawn(RtTaskFn fn, void *arg) {
+  sched_start();
+  RtTask *t = (RtTask*)calloc(1, sizeof(RtTask));
+  t->fn = fn; t->arg = arg; t->timer_idx = -1;
+  t->group = t->owner = *group_slot();
+  if (t->owner) { rt_spin_lock(&t->owner->lock); t->owner->live++; rt_spin_unlock(&t->owner->lock); }
+  __atomic_add_fetch(&sched.active, 1, __ATOMIC_ACQ_REL);
+  if (self) deque_push(self, t);
+  else { rt_spin_lock(&sched.ilock); list_push(&sched.inject, t); rt_spin_unlock(&sched.ilock); }
+  wake_one();
+}
+
+RtTask *rt_task_current(void) { return self ? self->cur : NULL; }
+
+// ---- Helper threads ----
+
+// One job at a time: a helper takes the next id of the current generation,
+// at most one per generation, so a job never waits on a helper still busy
+// with the previous one.
+static struct {
+  RtSpin start_lock;
+  bool ready;
+  Mutex job;               // held by the thread running a job
+  Mutex mu;                // the rest; helpers wait on cv, the caller on done
+  Cond cv, done;
+  int nhelpers;
+  uint64_t gen;
+  void (*fn)(void *arg, int id);
+  void *arg;
+  int next, want, busy;
+} helpers;
+
+static void *helper_main(void *p) {
+  (void)p;
+  uint64_t seen = 0;
+  mutex_lock(&helpers.mu);
+  for (;;) {
+    while (helpers.gen==seen) cond_wait_until(&helpers.cv, &helpers.mu, -1);
+    seen = helpers.gen;
+    if (helpers.next>=helpers.want) continue;
+    int id = helpers.next++;
+    mutex_unlock(&helpers.mu);
+    helpers.fn(helpers.arg, id);
+    mutex_lock(&helpers.mu);
+    if (--helpers.busy==0) cond_signal(&helpers.done);
+  }
+  return NULL;
+}
+
+void rt_parallel(int n, void (*fn)(void *arg, int id), void *arg) {
+  if (n<=1) { fn(arg, 0); return; }
+  if (!__atomic_load_n(&helpers.ready, __ATOMIC_ACQUIRE)) {
+    rt_spin_lock(&helpers.start_lock);
+    if (!helpers.ready) {
+      mutex_init(&helpers.job); mutex_init(&helpers.mu);
+      cond_init(&helpers.cv); cond_init(&helpers.done);
+      __atomic_store_n(&helpers.ready, true, __ATOMIC_RELEASE);
+    }
+    rt_spin_unlock(&helpers.start_lock);
+  }
+  mutex_lock(&helpers.job);
+  mutex_lock(&helpers.mu);
+  // Helpers run for the life of the process, like workers
+  for (; helpers.nhelpers<n-1; helpers.nhelpers++) rt_thread_spawn(helper_main, NULL);
+  helpers.fn = fn; helpers.arg = arg;
+  helpers.next = 1; helpers.want = n; helpers.busy = n-1;
+  helpers.gen++;
+  cond_broadcast(&helpers.cv);
+  mutex_unlock(&helpers.mu);
+  fn(arg, 0);
+  mutex_lock(&helpers.mu);
+  while (helpers.busy) cond_wait_until(&helpers.done, &helpers.mu, -1);
+  mutex_unlock(&helpers.mu);
+  mutex_unlock(&helpers.job);
+}
+
+// ---- Waiting ----
+
+int64_t rt_now_ms(void) { return now_ms(); }
+int64_t rt_now_us(void) { return now_us(); }
+int rt_cpu_count(void) {
+  static int n;
+  int c = __atomic_load_n(&n, __ATOMIC_RELAXED);
+  if (!c) { c = cpu_count()>0 ? cpu_count() : 1; __atomic_store_n(&n, c, __ATOMIC_RELAXED); }
+  return c;
+}
+
+// A thread outside the scheduler sleeps on its waiter's state: with a futex
+// on Linux, elsewhere on a per-thread mutex and condition variable.
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+static void thread_wait(RtWaiter *w, int64_t deadline) {
+  struct timespec ts, *tp = NULL;
+  if (deadline>=0) {
+    int64_t ms = deadline - now_ms(); if (ms<0) ms = 0;
+    ts.tv_sec = ms/1000; ts.tv_nsec = (ms%1000)*1000000; tp = &ts;
+  }
+  syscall(SYS_futex, &w->state, FUTEX_WAIT_PRIVATE, RT_WAIT_PENDING, tp, NULL, 0);
+}
+// The waiter may already be gone; waking a stale address is harmless
+static void thread_wake(RtWake *k) { syscall(SYS_futex, k->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0); }
+static struct RtParker *thread_parker(void) { return NULL; }
+#else
+typedef struct RtParker { Mutex mu; Cond cv; } RtParker;
+static _Thread_local RtParker *parker; // never freed: a late wakeup may still signal it
+
+static void thread_wait(RtWaiter *w, int64_t deadline) {
+  mutex_lock(&w->parker->mu);
+  if (__atomic_load_n(&w->state, __ATOMIC_ACQUIRE)==RT_WAIT_PENDING) cond_wait_until(&w->parker->cv, &w->parker->mu, deadline);
+  mutex_unlock(&w->parker->mu);
+}
+static void thread_wake(RtWake *k) {
+  mutex_lock(&k->parker->mu); cond_signal(&k->parker->cv); mutex_unlock(&k->parker->mu);
+}
+static RtParker *thread_parker(void) {
+  if (!parker) {
+    parker = (RtParker*)malloc(sizeof(RtParker));
+    mutex_init(&parker->mu); cond_init(&parker->cv);
+  }
+  return parker;
+}
+#endif
+
+void rt_waiter_init(RtWaiter *w) {
+  w->state = RT_WAIT_PENDING;
+  w->task = rt_task_current();
+  w->parker = w->task ? NULL : thread_parker();
+}
+
+bool rt_waiter_block(RtWaiter *w, int64_t timeout_ms) {
+  int64_t deadline = timeout_ms<0 ? -1 : now_ms() + timeout_ms;
+  RtTask *t = w->task;
+  if (t) {
+    if (deadline>=0) timer_add(t, w, deadline);
+    t->idle = deadline<0;
+    // A wakeup from here on finds the task parking and leaves it to run_task
+    // to requeue; one that came earlier left it WOKEN, and it does not switch
+    int s = TASK_RUNNABLE;
+    if (__atomic_compare_exchange_n(&t->state, &s, TASK_PARKING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      ctx_switch(&t->fiber->ctx, &t->home->ctx);
+    else __atomic_store_n(&t->state, TASK_RUNNABLE, __ATOMIC_RELAXED);
+    if (deadline>=0) timer_cancel(t);
+  } else {
+    GcMutator *m = gc_self;
+    if (m) gc_park(m);
+    while (__atomic_load_n(&w->state, __ATOMIC_ACQUIRE)==RT_WAIT_PENDING) {
+      if (deadline>=0 && now_ms()>=deadline) {
+        int pending = RT_WAIT_PENDING;
+        __atomic_compare_exchange_n(&w->state, &pending, RT_WAIT_TIMEOUT, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        break;
+      }
+      thread_wait(w, deadline);
+    }
+    if (m) gc_resume(m);
+  }
+  return __atomic_load_n(&w->state, __ATOMIC_ACQUIRE)==RT_WAIT_DONE;
+}
+
+bool rt_waiter_claim(RtWaiter *w, RtWake *k) {
+  // Read before completing the wait: w may be gone as soon as it is
+  k->task = w->task; k->parker = w->parker; k->state = &w->state;
+  int pending = RT_WAIT_PENDING;
+  return __atomic_compare_exchange_n(&w->state, &pending, RT_WAIT_DONE, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// A claimed task cannot run until readied here, so k->task is still valid
+void rt_waiter_notify(RtWake *k) {
+  if (k->task) task_ready(k->task);
+  else thread_wake(k);
+}
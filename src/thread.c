@@ -23,10 +23,12 @@ RtThread *rt_thread_spawn(RtThreadFn fn, void *arg) {
   RtThread *t = (RtThread*)malloc(sizeof(RtThread)); t->h = h; return t;
 }
 void rt_thread_join(RtThread *t) { WaitForSingleObject(t->h, INFINITE); CloseHandle(t->h); free(t); }
+void rt_thread_yield(void) { SwitchToThread(); }
 
 #else
 
 #include <pthread.h>
+#include <sched.h>
 
 typedef struct RtThread { pthread_t th; } RtThread;
 
@@ -41,6 +43,7 @@ RtThread *rt_thread_spawn(RtThreadFn fn, void *arg) {
   return t;
 }
 void rt_thread_join(RtThread *t) { pthread_join(t->th, NULL); free(t); }
+void rt_thread_yield(void) { sched_yield(); }
 
 #endif
 
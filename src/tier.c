@@ -0,0 +1,171 @@
+#include "tier.h"
+#include "eval.h"
+#include "gc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Cross-platform alloca
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <alloca.h>
+#endif
+
+_Thread_local TierFn *tier_running;
+
+Tier *tier_new(Node *program, uint32_t threshold, int opt_level, bool stats) {
+  CgJit *jit = codegen_jit_new(program, opt_level);
+  if (!jit) return NULL;
+  Tier *t = (Tier*)calloc(1, sizeof(Tier));
+  t->jit = jit;
+  t->program = program;
+  t->threshold = threshold ? threshold : 1;
+  t->stats = stats;
+  return t;
+}
+
+// Name of the toplevel def f belongs to, for stats
+static void tier_name(Tier *t, TierFn *f, char *buf, size_t len) {
+  for (size_t i=0;i<t->program->as.list.count;i++) {
+    Node *form = t->program->as.list.items[i];
+    if (form->kind==N_LIST && form->as.list.count>=5 && form->as.list.form==FORM_DEF &&
+        form->as.list.items[4]==f->fn && form->as.list.items[1]->kind==N_SYMBOL) {
+      snprintf(buf, len, "%s", form->as.list.items[1]->as.sym.ptr);
+      return;
+    }
+  }
+  snprintf(buf, len, "fn at %zu:%zu", f->fn->line, f->fn->col);
+}
+
+void tier_free(Tier *t) {
+  if (!t) return;
+  if (t->stats) {
+    int64_t total_us = 0; size_t native = 0;
+    for (size_t i=0;i<t->ntried;i++) {
+      TierFn *f = t->tried[i];
+      char name[128]; tier_name(t, f, name, sizeof name);
+      if (f->state==TIER_NATIVE) {
+        native++; total_us += f->compile_us;
+        fprintf(stderr, "tier: %s native after %u calls, %u back-edges; compiled in %.2fms\n",
+                name, f->calls, f->backedges, f->compile_us/1000.0);
+      } else {
+        fprintf(stderr, "tier: %s interpreted (%s)\n", name, f->error);
+      }
+    }
+    fprintf(stderr, "tier: %zu of %zu hot functions compiled, %.2fms compiling\n", native, t->ntried, total_us/1000.0);
+  }
+  codegen_jit_free(t->jit);
+  TierFn *f = t->fns;
+  while (f) { TierFn *nx = f->next; free(f); f = nx; }
+  free(t->tried);
+  free(t);
+}
+
+static TierFn *tier_fn(Tier *t, Node *fn) {
+  TierFn *f = __atomic_load_n(&fn->as.list.tier, __ATOMIC_ACQUIRE);
+  if (f) return f;
+  // Spawned threads may race to create it; the loser frees its copy
+  TierFn *fresh = (TierFn*)calloc(1, sizeof(TierFn)), *expected = NULL;
+  fresh->fn = fn;
+  if (!__atomic_compare_exchange_n(&fn->as.list.tier, &expected, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(fresh);
+    return expected;
+  }
+  fresh->next = __atomic_load_n(&t->fns, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&t->fns, &fresh->next, fresh, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+  return fresh;
+}
+
+// Compile f under t->lock; the thread is parked meanwhile, so collections
+// need not wait for the compiler
+static void tier_up(Tier *t, TierFn *f) {
+  if (__atomic_test_and_set(&t->lock, __ATOMIC_ACQUIRE)) return; // another compile is running; try next call
+  if (__atomic_load_n(&f->state, __ATOMIC_RELAXED)!=TIER_COUNTING) { rt_spin_unlock(&t->lock); return; }
+  __atomic_store_n(&f->state, TIER_COMPILING, __ATOMIC_RELAXED);
+  if (t->ntried==t->captried) {
+    t->captried = t->captried ? t->captried*2 : 16;
+    t->tried = (TierFn**)realloc(t->tried, sizeof(TierFn*)*t->captried);
+  }
+  t->tried[t->ntried++] = f;
+  GcMutator *m = gc_self;
+  if (m) gc_park(m);
+  int64_t t0 = rt_now_us();
+  CgEntry entry = codegen_jit_compile(t->jit, f->fn, f->error, sizeof(f->error));
+  f->compile_us = rt_now_us() - t0;
+  if (m) gc_resume(m);
+  f->entry = entry;
+  __atomic_store_n(&f->state, entry ? TIER_NATIVE : TIER_FAILED, __ATOMIC_RELEASE);
+  rt_spin_unlock(&t->lock);
+}
+
+// Arguments into 64-bit slots, as CgEntry takes them; 0 if one does not have
+// the kind the function's type says, which leaves the call to the interpreter
+static int tier_run(VM *vm, TierFn *f, Value *args, int nargs, Value *out) {
+  Type *ft = f->fn->ty;
+  if ((size_t)nargs!=ft->as.fn.arity) return 0;
+  for (int i=0;i<nargs;i++) {
+    ValueKind k = v_kind(args[i]);
+    switch (ft->as.fn.params[i]->kind) {
+      case TY_INT: if (k!=VAL_INT) return 0; break;
+      case TY_FLOAT: if (k!=VAL_FLOAT) return 0; break;
+      case TY_BOOL: if (k!=VAL_BOOL) return 0; break;
+      case TY_STR: if (k!=VAL_STR) return 0; break;
+      default: return 0;
+    }
+  }
+  int64_t *slots = (int64_t*)alloca(sizeof(int64_t)*(size_t)(nargs ? nargs : 1));
+  char **copies = NULL; int ncopies = 0;
+  for (int i=0;i<nargs;i++) {
+    Value a = args[i];
+    switch (ft->as.fn.params[i]->kind) {
+      case TY_INT: slots[i] = v_as_int(a); break;
+      case TY_FLOAT: { double d = v_as_float(a); memcpy(&slots[i], &d, sizeof d); break; }
+      case TY_BOOL: slots[i] = v_as_bool(a); break;
+      default: {
+        // Young strings move once the thread is parked: pass copies
+        String *str = v_as_str(a);
+        char *cp = (char*)malloc((size_t)str->len+1);
+        memcpy(cp, str->data, (size_t)str->len); cp[str->len] = '\0';
+        if (!copies) copies = (char**)alloca(sizeof(char*)*(size_t)nargs);
+        copies[ncopies++] = cp;
+        slots[i] = (int64_t)(intptr_t)cp;
+        break;
+      }
+    }
+  }
+  // Compiled code has no safepoints: park so collections need not wait for it.
+  // The strings it makes are malloc'd; collect them to free after boxing.
+  SqStrings made = {0}, *outer = sq_strings;
+  sq_strings = &made;
+  GcMutator *m = gc_self;
+  if (m) gc_park(m);
+  int64_t r = f->entry(slots);
+  if (m) gc_resume(m);
+  sq_strings = outer;
+  switch (ft->as.fn.ret->kind) {
+    case TY_INT: *out = v_int(r); break;
+    case TY_FLOAT: { double d; memcpy(&d, &r, sizeof d); *out = v_float(d); break; }
+    case TY_BOOL: *out = v_bool(r!=0); break;
+    case TY_STR: *out = v_str(rt_string_from_cstr(vm, (const char*)(intptr_t)r)); break; // r may be a copy
+    default: *out = v_unit(); break;
+  }
+  sq_strings_free(&made);
+  for (int i=0;i<ncopies;i++) free(copies[i]);
+  return 1;
+}
+
+int tier_call(VM *vm, struct Closure *c, Value *args, int nargs, Value *out) {
+  Tier *t = vm->tier;
+  Node *fn = (Node*)c->fn_node;
+  TierFn *f = tier_fn(t, fn);
+  int state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+  if (state==TIER_COUNTING) {
+    uint32_t calls = __atomic_add_fetch(&f->calls, 1, __ATOMIC_RELAXED);
+    if (calls + __atomic_load_n(&f->backedges, __ATOMIC_RELAXED) < t->threshold) return 0;
+    tier_up(t, f);
+    state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+  }
+  if (state!=TIER_NATIVE) return 0;
+  return tier_run(vm, f, args, nargs, out);
+}
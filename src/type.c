@@ -62,12 +62,18 @@ Type *ty_enum(void *arena, const char *name, const char **variants, size_t nvari
   return t;
 }
 
+Type *ty_var(void *arena, int id) {
+  Type *t = mk(arena, TY_VAR); t->as.var.id = id; return t; }
+
+Type *ty_task(void *arena, Type *result) {
+  Type *t = mk(arena, TY_TASK); t->as.chan.elem=result; return t; }
+
 bool ty_eq(const Type *a, const Type *b) {
   if (a==b) return true;
   if (!a || !b) return false;
   if (a->kind != b->kind) {
-    // ANY is compatible with anything
-    if (a->kind==TY_ANY || b->kind==TY_ANY) return true;
+    // ANY is compatible with anything, and so is an unbound type variable
+    if (a->kind==TY_ANY || b->kind==TY_ANY || a->kind==TY_VAR || b->kind==TY_VAR) return true;
     return false;
   }
   switch (a->kind) {
@@ -82,7 +88,7 @@ bool ty_eq(const Type *a, const Type *b) {
       return ty_eq(a->as.chan.elem, b->as.chan.elem);
     case TY_MAP:
       return ty_eq(a->as.fn.params[0], b->as.fn.params[0]) && ty_eq(a->as.fn.params[1], b->as.fn.params[1]);
-    case TY_OPTION:
+    case TY_OPTION: case TY_TASK:
       return ty_eq(a->as.chan.elem, b->as.chan.elem);
     case TY_RESULT:
       return ty_eq(a->as.result.ok_type, b->as.result.ok_type) && ty_eq(a->as.result.err_type, b->as.result.err_type);
@@ -95,6 +101,59 @@ bool ty_eq(const Type *a, const Type *b) {
   }
 }
 
+bool ty_match(const Type *p, Type *a, Type **bind) {
+  if (!p || !a) return p==a;
+  if (p->kind==TY_VAR) {
+    Type **b = &bind[p->as.var.id];
+    if (!*b || (*b)->kind==TY_ANY) { *b = a; return true; }
+    return ty_eq(*b, a);
+  }
+  if (p->kind!=a->kind) return ty_eq(p, a);
+  switch (p->kind) {
+    case TY_CHAN: case TY_VEC: case TY_OPTION: case TY_TASK:
+      return ty_match(p->as.chan.elem, a->as.chan.elem, bind);
+    case TY_MAP:
+      return ty_match(p->as.fn.params[0], a->as.fn.params[0], bind) && ty_match(p->as.fn.params[1], a->as.fn.params[1], bind);
+    case TY_FUNC:
+      if (p->as.fn.arity!=a->as.fn.arity) return false;
+      for (size_t i=0;i<p->as.fn.arity;i++) if (!ty_match(p->as.fn.params[i], a->as.fn.params[i], bind)) return false;
+      return ty_match(p->as.fn.ret, a->as.fn.ret, bind);
+    default:
+      return ty_eq(p, a);
+  }
+}
+
+static bool has_var(const Type *t) {
+  if (!t) return false;
+  switch (t->kind) {
+    case TY_VAR: return true;
+    case TY_CHAN: case TY_VEC: case TY_OPTION: case TY_TASK: return has_var(t->as.chan.elem);
+    case TY_MAP: return has_var(t->as.fn.params[0]) || has_var(t->as.fn.params[1]);
+    case TY_FUNC:
+      for (size_t i=0;i<t->as.fn.arity;i++) if (has_var(t->as.fn.params[i])) return true;
+      return has_var(t->as.fn.ret);
+    default: return false;
+  }
+}
+
+Type *ty_subst(Type *t, Type **bind) {
+  if (!has_var(t)) return t;
+  switch (t->kind) {
+    case TY_VAR: return bind[t->as.var.id] ? bind[t->as.var.id] : ty_any(NULL);
+    case TY_CHAN: return ty_chan(NULL, ty_subst(t->as.chan.elem, bind));
+    case TY_VEC: return ty_vec(NULL, ty_subst(t->as.chan.elem, bind));
+    case TY_OPTION: return ty_option(NULL, ty_subst(t->as.chan.elem, bind));
+    case TY_TASK: return ty_task(NULL, ty_subst(t->as.chan.elem, bind));
+    case TY_MAP: return ty_map(NULL, ty_subst(t->as.fn.params[0], bind), ty_subst(t->as.fn.params[1], bind));
+    default: {
+      Type **ps = (Type**)malloc(sizeof(Type*)*(t->as.fn.arity ? t->as.fn.arity : 1));
+      for (size_t i=0;i<t->as.fn.arity;i++) ps[i] = ty_subst(t->as.fn.params[i], bind);
+      Type *f = ty_func(NULL, ps, t->as.fn.arity, ty_subst(t->as.fn.ret, bind));
+      free(ps); return f;
+    }
+  }
+}
+
 const char *ty_kind_name(TypeKind k) {
   switch (k) {
     case TY_INT: return "Int";
@@ -112,6 +171,8 @@ const char *ty_kind_name(TypeKind k) {
     case TY_RESULT: return "Result";
     case TY_STRUCT: return "Struct";
     case TY_ENUM: return "Enum";
+    case TY_VAR: return "Var";
+    case TY_TASK: return "Task";
   }
   return "?";
 }
@@ -144,5 +205,7 @@ void ty_to_string(const Type *t, char *buf, size_t bufsize) {
     case TY_RESULT: { char ok[32],err[32]; ty_to_string(t->as.result.ok_type,ok,sizeof(ok)); ty_to_string(t->as.result.err_type,err,sizeof(err)); snprintf(buf,bufsize,"(Result %s %s)",ok,err); break; }
     case TY_STRUCT: snprintf(buf, bufsize, "%s", t->as.struc.name ? t->as.struc.name : "<struct>"); break;
     case TY_ENUM: snprintf(buf, bufsize, "%s", t->as.enu.name ? t->as.enu.name : "<enum>"); break;
+    case TY_VAR: snprintf(buf, bufsize, "'%c", 'a'+t->as.var.id); break;
+    case TY_TASK: { char tmp[64]; ty_to_string(t->as.chan.elem,tmp,sizeof(tmp)); snprintf(buf,bufsize,"(Task %s)",tmp); break; }
   }
 }
@@ -1,19 +1,62 @@
 #include "value.h"
+#include <stdlib.h>
 
-Value v_int(int64_t x){ Value v; v.kind=VAL_INT; v.as.i=x; return v; }
-Value v_float(double x){ Value v; v.kind=VAL_FLOAT; v.as.f=x; return v; }
-Value v_bool(bool x){ Value v; v.kind=VAL_BOOL; v.as.b=x; return v; }
-Value v_unit(void){ Value v; v.kind=VAL_UNIT; return v; }
-Value v_str(String *s){ Value v; v.kind=VAL_STR; v.as.str=s; return v; }
-Value v_native(NativeFn f, Type *type){ Value v; v.kind=VAL_FUNC; v.as.native.fn=f; v.as.native.type=type; return v; }
-Value v_closure(Closure *c){ Value v; v.kind=VAL_CLOSURE; v.as.clos=c; return v; }
-Value v_chan(Channel *c){ Value v; v.kind=VAL_CHAN; v.as.chan=c; return v; }
-Value v_symbol(const char *name, int32_t len){ Value v; v.kind=VAL_SYMBOL; v.as.sym.name=name; v.as.sym.len=len; return v; }
-Value v_list(ValList *l){ Value v; v.kind=VAL_LIST; v.as.list=l; return v; }
-Value v_vec(Vector *vec){ Value v; v.kind=VAL_VEC; v.as.vec=vec; return v; }
-Value v_map(Map *m){ Value v; v.kind=VAL_MAP; v.as.map=m; return v; }
-Value v_some(OptionVal *o){ Value v; v.kind=VAL_OPTION; v.as.opt=o; return v; }
-Value v_none(void){ Value v; v.kind=VAL_OPTION; v.as.opt=NULL; return v; }
-Value v_ok(ResultVal *r){ Value v; v.kind=VAL_RESULT; v.as.res=r; return v; }
-Value v_err(ResultVal *r){ Value v; v.kind=VAL_RESULT; v.as.res=r; return v; }
-Value v_struct(StructVal *s){ Value v; v.kind=VAL_STRUCT; v.as.struc=s; return v; }
+#if SQALE_NANBOX
+
+_Thread_local GC *v_heap;
+
+const uint8_t v_obj_kinds[OBJ_NTYPES] = {
+  [OBJ_STRING]=VAL_STR, [OBJ_CLOSURE]=VAL_CLOSURE, [OBJ_LIST]=VAL_LIST, [OBJ_VECTOR]=VAL_VEC,
+  [OBJ_MAP]=VAL_MAP, [OBJ_OPTION]=VAL_OPTION, [OBJ_RESULT]=VAL_RESULT, [OBJ_STRUCT]=VAL_STRUCT,
+  [OBJ_INT]=VAL_INT, [OBJ_TASK]=VAL_TASK, [OBJ_CHANNEL]=VAL_CHAN,
+};
+
+Value v_int_boxed(int64_t x) {
+  IntBox *b = (IntBox*)gc_alloc(v_heap, sizeof(IntBox), OBJ_INT);
+  b->i = x; return vb_obj(b);
+}
+
+// Natives are created once per builtin when a VM starts, so their records
+// are simply never freed
+Value v_native(NativeFn f, Type *type) {
+  NativeBox *b = (NativeBox*)malloc(sizeof(NativeBox));
+  b->fn = f; b->type = type; return vb_make(VT_NATIVE, (uint64_t)(uintptr_t)b);
+}
+
+// Symbol names are interned, so a symbol Value stays valid after the source
+// text it was read from is freed. Symbols only come from program text, which
+// bounds the table.
+static struct { SymbolName **slots; size_t cap, len; bool lock; } symtab;
+
+static uint64_t sym_hash(const char *s, int32_t len) {
+  uint64_t h = 1469598103934665603ull;
+  for (int32_t i=0;i<len;i++) { h ^= (unsigned char)s[i]; h *= 1099511628211ull; }
+  return h;
+}
+
+static SymbolName **sym_slot(SymbolName **slots, size_t cap, const char *name, int32_t len) {
+  size_t i = (size_t)sym_hash(name, len) & (cap-1);
+  while (slots[i] && (slots[i]->len!=len || memcmp(slots[i]->name, name, (size_t)len)!=0)) i = (i+1) & (cap-1);
+  return &slots[i];
+}
+
+Value v_symbol(const char *name, int32_t len) {
+  while (__atomic_test_and_set(&symtab.lock, __ATOMIC_ACQUIRE)) {}
+  if (2*(symtab.len+1) > symtab.cap) {
+    size_t cap = symtab.cap ? symtab.cap*2 : 256;
+    SymbolName **slots = (SymbolName**)calloc(cap, sizeof(SymbolName*));
+    for (size_t i=0;i<symtab.cap;i++) if (symtab.slots[i]) *sym_slot(slots, cap, symtab.slots[i]->name, symtab.slots[i]->len) = symtab.slots[i];
+    free(symtab.slots); symtab.slots = slots; symtab.cap = cap;
+  }
+  SymbolName **slot = sym_slot(symtab.slots, symtab.cap, name, len);
+  if (!*slot) {
+    SymbolName *s = (SymbolName*)malloc(sizeof(SymbolName)+(size_t)len+1);
+    s->len = len; memcpy(s->name, name, (size_t)len); s->name[len] = 0;
+    *slot = s; symtab.len++;
+  }
+  SymbolName *s = *slot;
+  __atomic_clear(&symtab.lock, __ATOMIC_RELEASE);
+  return vb_make(VT_SYM, (uint64_t)(uintptr_t)s);
+}
+
+#endif